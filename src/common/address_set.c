@@ -6,8 +6,23 @@
  * \brief Implementation for a set of addresses.
  *
  * This module was first written on a semi-emergency basis to improve the
- * robustness of the anti-DoS module.  As such, it's written in a pretty
- * conservative way, and should be susceptible to improvement later on.
+ * robustness of the anti-DoS module, as a Bloom filter.  It is now a cuckoo
+ * filter (Fan, Andersen, Kaminsky and Mitzenmacher, "Cuckoo Filter:
+ * Practically Better Than Bloom", CoNEXT 2014), which has a lower false
+ * positive rate for the same amount of memory, and supports removing
+ * addresses so that the set can be kept up to date as nodes come and go.
+ *
+ * Every address has a 16-bit fingerprint and two candidate buckets of
+ * ADDRESS_SET_SLOTS fingerprints each, derived from one keyed hash.  The
+ * second bucket can be computed from the first and the fingerprint alone,
+ * so fingerprints can be moved ("kicked") to their other bucket to make
+ * room without knowing which address they came from.  A lookup reads at
+ * most two buckets.
+ *
+ * Each slot also has a count of how many times its fingerprint was added,
+ * so that an address shared by many nodes takes one slot rather than one
+ * per node.  Two addresses with the same fingerprint and the same pair of
+ * buckets share a slot too: the filter can't tell them apart anyway.
  **/
 
 #include "orconfig.h"
@@ -19,29 +34,48 @@
 #include "common/util.h"
 #include "siphash.h"
 
-/** How many 64-bit siphash values to extract per address */
-#define N_HASHES 2
-/** How many bloom-filter bits we set per address. This is twice the N_HASHES
- * value, since we split the siphash output into two 32-bit values. */
-#define N_BITS_PER_ITEM (N_HASHES * 2)
+/** How many fingerprints fit in one bucket. */
+#define ADDRESS_SET_SLOTS 4
+/** Fewest buckets that we allocate. */
+#define ADDRESS_SET_MIN_BUCKETS 16
+/** Load factor, in percent, that we size the table for.  Insertions start
+ * failing at around 95%. */
+#define ADDRESS_SET_TARGET_LOAD 90
+/** How many fingerprints we kick to their other bucket before giving up on
+ * an insertion. */
+#define ADDRESS_SET_MAX_KICKS 500
 
-/* XXXX This code is largely duplicated with digestset_t.  We should merge
- * them together into a common bloom-filter implementation.  I'm keeping
- * them separate for now, though, since this module needs to be backported
- * all the way to 0.2.9.
- *
- * The main difference between digestset_t and this code is that we use
- * independent siphashes rather than messing around with bit-shifts.  The
- * approach here is probably more sound, and we should prefer it if&when we
- * unify the implementations.
- */
+/** The fingerprint value that marks an empty slot. */
+#define EMPTY_FP 0
+/** Largest count that a slot can hold.  Past it, we add the fingerprint
+ * again in another slot. */
+#define MAX_SLOT_COUNT UINT8_MAX
 
 struct address_set_t {
-  /** siphash keys to make N_HASHES independent hashes for each address. */
-  struct sipkey key[N_HASHES];
-  int mask; /**< One less than the number of bits in <b>ba</b>; always one less
-             * than a power of two. */
-  bitarray_t *ba; /**< A bit array to implement the Bloom filter. */
+  /** siphash key used to hash every address. */
+  struct sipkey key;
+  /** One less than the number of buckets; always one less than a power of
+   * two. */
+  uint32_t mask;
+  /** Array of (mask+1) * ADDRESS_SET_SLOTS fingerprints. */
+  uint16_t *slots;
+  /** For each entry of <b>slots</b>, how many times its fingerprint is in
+   * the set. */
+  uint8_t *counts;
+  /** Number of fingerprints in <b>slots</b> and in the victim. */
+  int n_items;
+  /** State of the generator that picks which fingerprint to kick. */
+  uint32_t kick_rng;
+  /** True iff a fingerprint that could not be placed during the last
+   * insertion is waiting in <b>victim_fp</b>. Until that victim is placed,
+   * further insertions fail. */
+  unsigned int has_victim : 1;
+  /** The fingerprint that could not be placed, if any. */
+  uint16_t victim_fp;
+  /** The count of <b>victim_fp</b>. */
+  uint8_t victim_count;
+  /** One of the buckets of <b>victim_fp</b>. */
+  uint32_t victim_bucket;
 };
 
 /**
@@ -51,13 +85,25 @@ struct address_set_t {
 address_set_t *
 address_set_new(int max_addresses_guess)
 {
-  /* See digestset_new() for rationale on this equation. */
-  int n_bits = 1u << (tor_log2(max_addresses_guess)+5);
-
+  uint64_t n_wanted;
+  uint32_t n_buckets = ADDRESS_SET_MIN_BUCKETS;
   address_set_t *set = tor_malloc_zero(sizeof(address_set_t));
-  set->mask = n_bits - 1;
-  set->ba = bitarray_init_zero(n_bits);
-  crypto_rand((char*) set->key, sizeof(set->key));
+
+  if (max_addresses_guess < 0)
+    max_addresses_guess = 0;
+  n_wanted = ((uint64_t)max_addresses_guess * 100 /
+              ADDRESS_SET_TARGET_LOAD + ADDRESS_SET_SLOTS - 1) /
+    ADDRESS_SET_SLOTS;
+  while (n_buckets < n_wanted)
+    n_buckets <<= 1;
+
+  set->mask = n_buckets - 1;
+  set->slots = tor_calloc(n_buckets, ADDRESS_SET_SLOTS * sizeof(uint16_t));
+  set->counts = tor_calloc(n_buckets, ADDRESS_SET_SLOTS);
+  crypto_rand((char*) &set->key, sizeof(set->key));
+  crypto_rand((char*) &set->kick_rng, sizeof(set->kick_rng));
+  /* Zero is a fixed point of the generator. */
+  set->kick_rng |= 1;
 
   return set;
 }
@@ -71,39 +117,279 @@ address_set_free(address_set_t *set)
   if (! set)
     return;
 
-  bitarray_free(set->ba);
+  tor_free(set->slots);
+  tor_free(set->counts);
   tor_free(set);
 }
 
-/** Yield the bit index corresponding to 'val' for set. */
-#define BIT(set, val) ((val) & (set)->mask)
+/** Return the number of addresses in <b>set</b>, counting each time an
+ * address was added. */
+int
+address_set_get_n_items(const address_set_t *set)
+{
+  return set->n_items;
+}
+
+/** Return the number of bytes used by <b>set</b>. */
+size_t
+address_set_get_allocation(const address_set_t *set)
+{
+  return sizeof(address_set_t) +
+    ((size_t)set->mask + 1) * ADDRESS_SET_SLOTS *
+    (sizeof(uint16_t) + sizeof(uint8_t));
+}
+
+/** Compute the fingerprint of <b>addr</b> in <b>set</b>, and its first
+ * bucket. */
+static inline void
+address_set_hash(const address_set_t *set, const struct tor_addr_t *addr,
+                 uint16_t *fp_out, uint32_t *bucket_out)
+{
+  uint64_t h = tor_addr_keyed_hash(&set->key, addr);
+  uint16_t fp = (uint16_t)(h >> 48);
+  /* The empty marker can't be a fingerprint. */
+  *fp_out = fp == EMPTY_FP ? 1 : fp;
+  *bucket_out = (uint32_t)h & set->mask;
+}
+
+/** Return the other bucket of a fingerprint <b>fp</b> that can be stored
+ * in <b>bucket</b>.  Applying this twice gives back <b>bucket</b>. */
+static inline uint32_t
+address_set_alt_bucket(const address_set_t *set, uint32_t bucket,
+                       uint16_t fp)
+{
+  /* Multiplying by an odd constant spreads the fingerprint over all the
+   * bits of the mask. */
+  return (bucket ^ ((uint32_t)fp * 0x5bd1e995u)) & set->mask;
+}
+
+/** Return a pointer to the first slot of <b>bucket</b> in <b>set</b>. */
+static inline uint16_t *
+address_set_bucket(const address_set_t *set, uint32_t bucket)
+{
+  return set->slots + (size_t)bucket * ADDRESS_SET_SLOTS;
+}
+
+/** Return a pointer to the count of the first slot of <b>bucket</b> in
+ * <b>set</b>. */
+static inline uint8_t *
+address_set_bucket_counts(const address_set_t *set, uint32_t bucket)
+{
+  return set->counts + (size_t)bucket * ADDRESS_SET_SLOTS;
+}
+
+/** Store <b>fp</b> with <b>count</b> in an empty slot of <b>bucket</b>.
+ * Return true on success, or false if the bucket is full. */
+static int
+address_set_bucket_insert(address_set_t *set, uint32_t bucket, uint16_t fp,
+                          uint8_t count)
+{
+  uint16_t *slots = address_set_bucket(set, bucket);
+  int i;
+  for (i = 0; i < ADDRESS_SET_SLOTS; ++i) {
+    if (slots[i] == EMPTY_FP) {
+      slots[i] = fp;
+      address_set_bucket_counts(set, bucket)[i] = count;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Add one to the count of a slot of <b>bucket</b> that holds <b>fp</b>.
+ * Return true on success, or false if there is no such slot with room. */
+static int
+address_set_bucket_incr(address_set_t *set, uint32_t bucket, uint16_t fp)
+{
+  const uint16_t *slots = address_set_bucket(set, bucket);
+  uint8_t *counts = address_set_bucket_counts(set, bucket);
+  int i;
+  for (i = 0; i < ADDRESS_SET_SLOTS; ++i) {
+    if (slots[i] == fp && counts[i] < MAX_SLOT_COUNT) {
+      ++counts[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Remove one copy of <b>fp</b> from <b>bucket</b>, emptying its slot if
+ * that was the last one.  Return 2 if we emptied a slot, 1 if we removed a
+ * copy but the slot is still in use, or 0 if <b>fp</b> isn't there. */
+static int
+address_set_bucket_remove(address_set_t *set, uint32_t bucket, uint16_t fp)
+{
+  uint16_t *slots = address_set_bucket(set, bucket);
+  uint8_t *counts = address_set_bucket_counts(set, bucket);
+  int i;
+  for (i = 0; i < ADDRESS_SET_SLOTS; ++i) {
+    if (slots[i] == fp) {
+      if (--counts[i])
+        return 1;
+      slots[i] = EMPTY_FP;
+      return 2;
+    }
+  }
+  return 0;
+}
+
+/** Return true iff <b>bucket</b> holds <b>fp</b>. */
+static inline int
+address_set_bucket_contains(const address_set_t *set, uint32_t bucket,
+                            uint16_t fp)
+{
+  const uint16_t *slots = address_set_bucket(set, bucket);
+  int i, found = 0;
+  /* No early exit, so that the compiler can unroll this without branches. */
+  for (i = 0; i < ADDRESS_SET_SLOTS; ++i)
+    found |= (slots[i] == fp);
+  return found;
+}
+
+/** Store <b>fp</b> with <b>count</b> in <b>bucket</b> or its other
+ * bucket, kicking other fingerprints out of the way if needed.  Return 0 on
+ * success.  If we give up, the fingerprint left without a slot is kept as
+ * the victim, and we return -1. */
+static int
+address_set_place(address_set_t *set, uint32_t bucket, uint16_t fp,
+                  uint8_t count)
+{
+  int n;
+
+  if (address_set_bucket_insert(set, bucket, fp, count))
+    return 0;
+  bucket = address_set_alt_bucket(set, bucket, fp);
+  if (address_set_bucket_insert(set, bucket, fp, count))
+    return 0;
+
+  for (n = 0; n < ADDRESS_SET_MAX_KICKS; ++n) {
+    uint16_t *slots = address_set_bucket(set, bucket);
+    uint8_t *counts = address_set_bucket_counts(set, bucket);
+    uint16_t kicked;
+    uint8_t kicked_count;
+    int slot;
+
+    /* A xorshift generator is plenty to avoid kicking in cycles. */
+    set->kick_rng ^= set->kick_rng << 13;
+    set->kick_rng ^= set->kick_rng >> 17;
+    set->kick_rng ^= set->kick_rng << 5;
+    slot = set->kick_rng % ADDRESS_SET_SLOTS;
+
+    kicked = slots[slot];
+    kicked_count = counts[slot];
+    slots[slot] = fp;
+    counts[slot] = count;
+    fp = kicked;
+    count = kicked_count;
+    bucket = address_set_alt_bucket(set, bucket, fp);
+    if (address_set_bucket_insert(set, bucket, fp, count))
+      return 0;
+  }
+
+  set->has_victim = 1;
+  set->victim_fp = fp;
+  set->victim_count = count;
+  set->victim_bucket = bucket;
+  return -1;
+}
 
 /**
  * Add <b>addr</b> to <b>set</b>.
  *
- * All future queries for <b>addr</b> in set will return true. Removing
- * items is not possible.
+ * All future queries for <b>addr</b> in set will return true, until it is
+ * removed as many times as it was added.  Return 0 on success, or -1 if the
+ * set is too full to hold it; the caller should then build a bigger one.
  */
-void
+int
 address_set_add(address_set_t *set, const struct tor_addr_t *addr)
 {
-  int i;
-  for (i = 0; i < N_HASHES; ++i) {
-    uint64_t h = tor_addr_keyed_hash(&set->key[i], addr);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    bitarray_set(set->ba, BIT(set, high_bits));
-    bitarray_set(set->ba, BIT(set, low_bits));
+  uint16_t fp;
+  uint32_t bucket, alt;
+
+  address_set_hash(set, addr, &fp, &bucket);
+  alt = address_set_alt_bucket(set, bucket, fp);
+
+  /* If the fingerprint is already there, just count it again. */
+  if (address_set_bucket_incr(set, bucket, fp) ||
+      address_set_bucket_incr(set, alt, fp)) {
+    ++set->n_items;
+    return 0;
   }
+  if (set->has_victim && set->victim_fp == fp &&
+      (set->victim_bucket == bucket || set->victim_bucket == alt) &&
+      set->victim_count < MAX_SLOT_COUNT) {
+    ++set->victim_count;
+    ++set->n_items;
+    return 0;
+  }
+
+  /* Once something has been left without a slot, we can't kick anything
+   * else around without risking losing it. */
+  if (set->has_victim)
+    return -1;
+
+  /* Even if the address is left as the victim or kicks another fingerprint
+   * into the victim, it is still in the set. */
+  ++set->n_items;
+  (void) address_set_place(set, bucket, fp, 1);
+  return 0;
 }
 
 /** As address_set_add(), but take an ipv4 address in host order. */
-void
+int
 address_set_add_ipv4h(address_set_t *set, uint32_t addr)
 {
   tor_addr_t a;
   tor_addr_from_ipv4h(&a, addr);
-  address_set_add(set, &a);
+  return address_set_add(set, &a);
+}
+
+/**
+ * Remove <b>addr</b> from <b>set</b>.  It must have been added to the set
+ * before, and not removed since: removing an address that was never added
+ * could remove another address that happens to share its fingerprint.
+ * Return true on success, or false if <b>addr</b> wasn't found.
+ */
+int
+address_set_remove(address_set_t *set, const struct tor_addr_t *addr)
+{
+  uint16_t fp;
+  uint32_t bucket, alt;
+  int r;
+
+  address_set_hash(set, addr, &fp, &bucket);
+  alt = address_set_alt_bucket(set, bucket, fp);
+
+  if (set->has_victim && set->victim_fp == fp &&
+      (set->victim_bucket == bucket || set->victim_bucket == alt)) {
+    --set->n_items;
+    if (--set->victim_count == 0)
+      set->has_victim = 0;
+    return 1;
+  }
+  r = address_set_bucket_remove(set, bucket, fp);
+  if (!r)
+    r = address_set_bucket_remove(set, alt, fp);
+  if (!r)
+    return 0;
+  --set->n_items;
+
+  /* There is a free slot now, so try to find a place for the victim. */
+  if (r == 2 && set->has_victim) {
+    set->has_victim = 0;
+    (void) address_set_place(set, set->victim_bucket, set->victim_fp,
+                             set->victim_count);
+  }
+  return 1;
+}
+
+/** As address_set_remove(), but take an ipv4 address in host order. */
+int
+address_set_remove_ipv4h(address_set_t *set, uint32_t addr)
+{
+  tor_addr_t a;
+  tor_addr_from_ipv4h(&a, addr);
+  return address_set_remove(set, &a);
 }
 
 /**
@@ -111,19 +397,18 @@ address_set_add_ipv4h(address_set_t *set, uint32_t addr)
  * return false if <b>addr</b> is not a member of set.)
  */
 int
-address_set_probably_contains(address_set_t *set,
+address_set_probably_contains(const address_set_t *set,
                               const struct tor_addr_t *addr)
 {
-  int i, matches = 0;
-  for (i = 0; i < N_HASHES; ++i) {
-    uint64_t h = tor_addr_keyed_hash(&set->key[i], addr);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    // Note that !! is necessary here, since bitarray_is_set does not
-    // necessarily return 1 on true.
-    matches += !! bitarray_is_set(set->ba, BIT(set, high_bits));
-    matches += !! bitarray_is_set(set->ba, BIT(set, low_bits));
-  }
-  return matches == N_BITS_PER_ITEM;
-}
+  uint16_t fp;
+  uint32_t bucket;
 
+  address_set_hash(set, addr, &fp, &bucket);
+  if (address_set_bucket_contains(set, bucket, fp) ||
+      address_set_bucket_contains(set,
+                                  address_set_alt_bucket(set, bucket, fp), fp))
+    return 1;
+  return set->has_victim && set->victim_fp == fp &&
+    (set->victim_bucket == bucket ||
+     set->victim_bucket == address_set_alt_bucket(set, bucket, fp));
+}
@@ -6,8 +6,7 @@
  * \brief Types to handle sets of addresses.
  *
  * This module was first written on a semi-emergency basis to improve the
- * robustness of the anti-DoS module.  As such, it's written in a pretty
- * conservative way, and should be susceptible to improvement later on.
+ * robustness of the anti-DoS module.
  **/
 
 #ifndef TOR_ADDRESS_SET_H
@@ -17,19 +16,23 @@
 #include "lib/cc/torint.h"
 
 /**
- * An address_set_t represents a set of tor_addr_t values. The implementation
- * is probabilistic: false negatives cannot occur but false positives are
- * possible.
+ * An address_set_t represents a multiset of tor_addr_t values. The
+ * implementation is probabilistic: false negatives cannot occur but false
+ * positives are possible.
  */
 typedef struct address_set_t address_set_t;
 struct tor_addr_t;
 
 address_set_t *address_set_new(int max_addresses_guess);
 void address_set_free(address_set_t *set);
-void address_set_add(address_set_t *set, const struct tor_addr_t *addr);
-void address_set_add_ipv4h(address_set_t *set, uint32_t addr);
-int address_set_probably_contains(address_set_t *set,
+int address_set_add(address_set_t *set, const struct tor_addr_t *addr);
+int address_set_add_ipv4h(address_set_t *set, uint32_t addr);
+int address_set_remove(address_set_t *set, const struct tor_addr_t *addr);
+int address_set_remove_ipv4h(address_set_t *set, uint32_t addr);
+int address_set_probably_contains(const address_set_t *set,
                                   const struct tor_addr_t *addr);
+int address_set_get_n_items(const address_set_t *set);
+size_t address_set_get_allocation(const address_set_t *set);
 
 #endif
 
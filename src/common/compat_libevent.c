@@ -10,6 +10,7 @@
 #include "common/compat.h"
 #define COMPAT_LIBEVENT_PRIVATE
 #include "common/compat_libevent.h"
+#include "common/profiler.h"
 
 #include "lib/crypt_ops/crypto_rand.h"
 
@@ -311,8 +312,34 @@ struct mainloop_event_t {
   struct event *ev;
   void (*cb)(mainloop_event_t *, void *);
   void *userdata;
+  /** Where we account for the time that <b>cb</b> takes. */
+  profiler_entry_t *profile;
+  /** If <b>is_due</b> is set, when this event should run; we use it to
+   * measure how late the main loop runs it. */
+  monotime_t due;
+  unsigned int is_due : 1;
 };
 
+/**
+ * Internal: run the callback of <b>mev</b>, and account for its lag and
+ * for the time that it takes.
+ */
+static void
+mainloop_event_run_cb(mainloop_event_t *mev)
+{
+  /* The callback may free mev. */
+  profiler_entry_t *profile = mev->profile;
+  profiler_timer_t timer;
+
+  profiler_timer_start(&timer);
+  if (mev->is_due) {
+    profiler_note_lag(monotime_diff_usec(&mev->due, &timer.start));
+    mev->is_due = 0;
+  }
+  mev->cb(mev, mev->userdata);
+  profiler_timer_stop(&timer, profile);
+}
+
 /**
  * Internal: Implements mainloop event using a libevent event.
  */
@@ -321,8 +348,7 @@ mainloop_event_cb(evutil_socket_t fd, short what, void *arg)
 {
   (void)fd;
   (void)what;
-  mainloop_event_t *mev = arg;
-  mev->cb(mev, mev->userdata);
+  mainloop_event_run_cb(arg);
 }
 
 /**
@@ -346,8 +372,7 @@ mainloop_event_postloop_cb(evutil_socket_t fd, short what, void *arg)
    */
   event_active(rescan_mainloop_ev, EV_READ, 1);
 
-  mainloop_event_t *mev = arg;
-  mev->cb(mev, mev->userdata);
+  mainloop_event_run_cb(arg);
 }
 
 /**
@@ -356,9 +381,10 @@ mainloop_event_postloop_cb(evutil_socket_t fd, short what, void *arg)
 static mainloop_event_t *
 mainloop_event_new_impl(int postloop,
                         void (*cb)(mainloop_event_t *, void *),
-                        void *userdata)
+                        void *userdata, const char *name)
 {
   tor_assert(cb);
+  tor_assert(name);
 
   struct event_base *base = tor_libevent_get_base();
   mainloop_event_t *mev = tor_malloc_zero(sizeof(mainloop_event_t));
@@ -368,6 +394,7 @@ mainloop_event_new_impl(int postloop,
   tor_assert(mev->ev);
   mev->cb = cb;
   mev->userdata = userdata;
+  mev->profile = profiler_entry_get(PROFILER_KIND_EVENT, name);
   return mev;
 }
 
@@ -379,28 +406,42 @@ mainloop_event_new_impl(int postloop,
  * must remain valid for as long as the mainloop_event_t event exists:
  * it is your responsibility to free it.
  *
+ * The time that <b>cb</b> takes is profiled under <b>name</b>; the
+ * mainloop_event_new() macro uses the name of <b>cb</b>.
+ *
  * The event is not scheduled by default: Use mainloop_event_activate()
  * or mainloop_event_schedule() to make it run.
  */
 mainloop_event_t *
-mainloop_event_new(void (*cb)(mainloop_event_t *, void *),
-                   void *userdata)
+mainloop_event_new_named(void (*cb)(mainloop_event_t *, void *),
+                         void *userdata, const char *name)
 {
-  return mainloop_event_new_impl(0, cb, userdata);
+  return mainloop_event_new_impl(0, cb, userdata, name);
 }
 
 /**
- * As mainloop_event_new(), but create a post-loop event.
+ * As mainloop_event_new_named(), but create a post-loop event.
  *
  * A post-loop event behaves like any ordinary event, but any events
  * that _it_ activates cannot run until Libevent has checked for other
  * events at least once.
  */
 mainloop_event_t *
-mainloop_event_postloop_new(void (*cb)(mainloop_event_t *, void *),
-                            void *userdata)
+mainloop_event_postloop_new_named(void (*cb)(mainloop_event_t *, void *),
+                                  void *userdata, const char *name)
 {
-  return mainloop_event_new_impl(1, cb, userdata);
+  return mainloop_event_new_impl(1, cb, userdata, name);
+}
+
+/** Account for the time that the callback of <b>event</b> takes in
+ * <b>ent</b>, instead of in the entry named after the callback. */
+void
+mainloop_event_set_profiler_entry(mainloop_event_t *event,
+                                  profiler_entry_t *ent)
+{
+  tor_assert(event);
+  tor_assert(ent);
+  event->profile = ent;
 }
 
 /**
@@ -414,7 +455,13 @@ mainloop_event_postloop_new(void (*cb)(mainloop_event_t *, void *),
 void
 mainloop_event_activate(mainloop_event_t *event)
 {
+  monotime_t now;
   tor_assert(event);
+  monotime_get(&now);
+  if (!event->is_due || monotime_diff_usec(&now, &event->due) > 0) {
+    event->due = now;
+    event->is_due = 1;
+  }
   event_active(event->ev, EV_READ, 1);
 }
 
@@ -439,6 +486,17 @@ mainloop_event_schedule(mainloop_event_t *event, const struct timeval *tv)
     return 0;
     // LCOV_EXCL_STOP
   }
+  /* Don't bother measuring the lag of events that are more than a day
+   * away. */
+  if (tv->tv_sec < 86400) {
+    monotime_t now;
+    monotime_get(&now);
+    monotime_add_msec(&event->due, &now,
+                      (uint32_t)(tv->tv_sec * 1000 + tv->tv_usec / 1000));
+    event->is_due = 1;
+  } else {
+    event->is_due = 0;
+  }
   return event_add(event->ev, tv);
 }
 
@@ -450,6 +508,7 @@ mainloop_event_cancel(mainloop_event_t *event)
   if (!event)
     return;
   (void) event_del(event->ev);
+  event->is_due = 0;
 }
 
 /** Cancel <b>event</b> and release all storage associated with it. */
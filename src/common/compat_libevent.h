@@ -36,12 +36,22 @@ void periodic_timer_disable(periodic_timer_t *);
 #define periodic_timer_free(t) \
   FREE_AND_NULL(periodic_timer_t, periodic_timer_free_, (t))
 
+struct profiler_entry_t;
 typedef struct mainloop_event_t mainloop_event_t;
-mainloop_event_t *mainloop_event_new(void (*cb)(mainloop_event_t *, void *),
-                                     void *userdata);
-mainloop_event_t * mainloop_event_postloop_new(
+mainloop_event_t *mainloop_event_new_named(
                                      void (*cb)(mainloop_event_t *, void *),
-                                     void *userdata);
+                                     void *userdata, const char *name);
+mainloop_event_t *mainloop_event_postloop_new_named(
+                                     void (*cb)(mainloop_event_t *, void *),
+                                     void *userdata, const char *name);
+/** Create a mainloop_event_t whose time is profiled under the name of its
+ * callback. */
+#define mainloop_event_new(cb, userdata) \
+  mainloop_event_new_named((cb), (userdata), #cb)
+#define mainloop_event_postloop_new(cb, userdata) \
+  mainloop_event_postloop_new_named((cb), (userdata), #cb)
+void mainloop_event_set_profiler_entry(mainloop_event_t *event,
+                                       struct profiler_entry_t *ent);
 void mainloop_event_activate(mainloop_event_t *event);
 int mainloop_event_schedule(mainloop_event_t *event,
                             const struct timeval *delay);
@@ -375,6 +375,17 @@ atomic_counter_add(atomic_counter_t *counter, size_t add)
   counter->val += add;
   tor_mutex_release(&counter->mutex);
 }
+/** Add a value to an atomic counter; return the old value. */
+size_t
+atomic_counter_fetch_add(atomic_counter_t *counter, size_t add)
+{
+  size_t oldval;
+  tor_mutex_acquire(&counter->mutex);
+  oldval = counter->val;
+  counter->val += add;
+  tor_mutex_release(&counter->mutex);
+  return oldval;
+}
 /** Subtract a value from an atomic counter. */
 void
 atomic_counter_sub(atomic_counter_t *counter, size_t sub)
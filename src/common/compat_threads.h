@@ -172,6 +172,8 @@ typedef struct atomic_counter_t {
 ATOMIC_LINKAGE void atomic_counter_init(atomic_counter_t *counter);
 ATOMIC_LINKAGE void atomic_counter_destroy(atomic_counter_t *counter);
 ATOMIC_LINKAGE void atomic_counter_add(atomic_counter_t *counter, size_t add);
+ATOMIC_LINKAGE size_t atomic_counter_fetch_add(atomic_counter_t *counter,
+                                               size_t add);
 ATOMIC_LINKAGE void atomic_counter_sub(atomic_counter_t *counter, size_t sub);
 ATOMIC_LINKAGE size_t atomic_counter_get(atomic_counter_t *counter);
 ATOMIC_LINKAGE size_t atomic_counter_exchange(atomic_counter_t *counter,
@@ -197,6 +199,12 @@ atomic_counter_add(atomic_counter_t *counter, size_t add)
 {
   (void) atomic_fetch_add(&counter->val, add);
 }
+/** Add a value to an atomic counter; return the old value. */
+static inline size_t
+atomic_counter_fetch_add(atomic_counter_t *counter, size_t add)
+{
+  return atomic_fetch_add(&counter->val, add);
+}
 /** Subtract a value from an atomic counter. */
 static inline void
 atomic_counter_sub(atomic_counter_t *counter, size_t sub)
@@ -1090,12 +1090,11 @@ smartlist_uniq_digests256(smartlist_t *sl)
  * and types associated with the map get prefixed with <b>prefix</b> */
 #define DEFINE_MAP_STRUCTS(maptype, keydecl, prefix)      \
   typedef struct prefix ## entry_t {                      \
-    HT_ENTRY(prefix ## entry_t) node;                     \
     void *val;                                            \
     keydecl;                                              \
   } prefix ## entry_t;                                    \
   struct maptype {                                        \
-    HT_HEAD(prefix ## impl, prefix ## entry_t) head;      \
+    OAHT_HEAD(prefix ## impl, prefix ## entry_t) head;    \
   }
 
 DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
@@ -1145,45 +1144,42 @@ digest256map_entry_hash(const digest256map_entry_t *a)
   return (unsigned) siphash24g(a->key, DIGEST256_LEN);
 }
 
-HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-             strmap_entries_eq)
-HT_GENERATE2(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
-             strmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
-
-HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq)
-HT_GENERATE2(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq, 0.6, tor_reallocarray_, tor_free_)
-
-HT_PROTOTYPE(digest256map_impl, digest256map_entry_t, node,
-             digest256map_entry_hash,
-             digest256map_entries_eq)
-HT_GENERATE2(digest256map_impl, digest256map_entry_t, node,
-             digest256map_entry_hash,
-             digest256map_entries_eq, 0.6, tor_reallocarray_, tor_free_)
-
-#define strmap_entry_free(ent) \
-  FREE_AND_NULL(strmap_entry_t, strmap_entry_free_, (ent))
-#define digestmap_entry_free(ent) \
-  FREE_AND_NULL(digestmap_entry_t, digestmap_entry_free_, (ent))
-#define digest256map_entry_free(ent) \
-  FREE_AND_NULL(digest256map_entry_t, digest256map_entry_free_, (ent))
-
+/* The maps use open-addressing tables: the entries live in the table
+ * itself, so that a lookup doesn't chase a pointer per entry, and adding an
+ * entry doesn't allocate one. */
+OAHT_PROTOTYPE(strmap_impl, strmap_entry_t, strmap_entry_hash,
+               strmap_entries_eq)
+OAHT_GENERATE(strmap_impl, strmap_entry_t, strmap_entry_hash,
+              strmap_entries_eq, 0.75, tor_reallocarray_, tor_free_)
+
+OAHT_PROTOTYPE(digestmap_impl, digestmap_entry_t, digestmap_entry_hash,
+               digestmap_entries_eq)
+OAHT_GENERATE(digestmap_impl, digestmap_entry_t, digestmap_entry_hash,
+              digestmap_entries_eq, 0.75, tor_reallocarray_, tor_free_)
+
+OAHT_PROTOTYPE(digest256map_impl, digest256map_entry_t,
+               digest256map_entry_hash,
+               digest256map_entries_eq)
+OAHT_GENERATE(digest256map_impl, digest256map_entry_t,
+              digest256map_entry_hash,
+              digest256map_entries_eq, 0.75, tor_reallocarray_, tor_free_)
+
+/* Helpers: release the storage held by an entry that we are about to remove
+ * from its table. */
 static inline void
-strmap_entry_free_(strmap_entry_t *ent)
+strmap_entry_clear(strmap_entry_t *ent)
 {
   tor_free(ent->key);
-  tor_free(ent);
 }
 static inline void
-digestmap_entry_free_(digestmap_entry_t *ent)
+digestmap_entry_clear(digestmap_entry_t *ent)
 {
-  tor_free(ent);
+  (void) ent;
 }
 static inline void
-digest256map_entry_free_(digest256map_entry_t *ent)
+digest256map_entry_clear(digest256map_entry_t *ent)
 {
-  tor_free(ent);
+  (void) ent;
 }
 
 static inline void
@@ -1220,10 +1216,10 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
 /**
  * Macro: implement all the functions for a map that are declared in
  * container.h by the DECLARE_MAP_FNS() macro.  You must additionally define a
- * prefix_entry_free_() function to free entries (and their keys), a
- * prefix_assign_tmp_key() function to temporarily set a stack-allocated
- * entry to hold a key, and a prefix_assign_key() function to set a
- * heap-allocated entry to hold a key.
+ * prefix_entry_clear() function to free the storage held by an entry's key,
+ * a prefix_assign_tmp_key() function to temporarily set a stack-allocated
+ * entry to hold a key, and a prefix_assign_key() function to set an entry
+ * in the table to hold its own copy of a key.
  */
 #define IMPLEMENT_MAP_FNS(maptype, keytype, prefix)                     \
   /** Create and return a new empty map. */                             \
@@ -1232,7 +1228,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   {                                                                     \
     maptype *result;                                                    \
     result = tor_malloc(sizeof(maptype));                               \
-    HT_INIT(prefix##_impl, &result->head);                              \
+    OAHT_INIT(prefix##_impl, &result->head);                              \
     return result;                                                      \
   }                                                                     \
                                                                         \
@@ -1246,7 +1242,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
     prefix ##_assign_tmp_key(&search, key);                             \
-    resolve = HT_FIND(prefix ##_impl, &map->head, &search);             \
+    resolve = OAHT_FIND(prefix ##_impl, &map->head, &search);             \
     if (resolve) {                                                      \
       return resolve->val;                                              \
     } else {                                                            \
@@ -1259,36 +1255,27 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   void *                                                                \
   prefix##_set(maptype *map, const keytype key, void *val)              \
   {                                                                     \
-    prefix##_entry_t search;                                            \
+    prefix##_entry_t search, *ent;                                      \
     void *oldval;                                                       \
+    int inserted;                                                       \
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
     tor_assert(val);                                                    \
     prefix##_assign_tmp_key(&search, key);                              \
-    /* We a lot of our time in this function, so the code below is */   \
-    /* meant to optimize the check/alloc/set cycle by avoiding the two */\
-    /* trips to the hash table that we would do in the unoptimized */   \
-    /* version of this code. (Each of HT_INSERT and HT_FIND calls */     \
-    /* HT_SET_HASH and HT_FIND_P.) */                                   \
-    HT_FIND_OR_INSERT_(prefix##_impl, node, prefix##_entry_hash,        \
-                       &(map->head),                                    \
-                       prefix##_entry_t, &search, ptr,                  \
-                       {                                                \
-                         /* we found an entry. */                       \
-                         oldval = (*ptr)->val;                          \
-                         (*ptr)->val = val;                             \
-                         return oldval;                                 \
-                       },                                               \
-                       {                                                \
-                         /* We didn't find the entry. */                \
-                         prefix##_entry_t *newent =                     \
-                           tor_malloc_zero(sizeof(prefix##_entry_t));   \
-                         prefix##_assign_key(newent, key);              \
-                         newent->val = val;                             \
-                         HT_FOI_INSERT_(node, &(map->head),             \
-                            &search, newent, ptr);                      \
-                         return NULL;                                   \
-    });                                                                 \
+    search.val = val;                                                   \
+    /* We spend a lot of our time in this function, so we look for the */\
+    /* entry and insert it in a single trip to the hash table. */       \
+    ent = OAHT_FIND_OR_INSERT(prefix##_impl, &map->head, &search,       \
+                              &inserted);                               \
+    tor_assert(ent);                                                    \
+    if (inserted) {                                                     \
+      /* The table holds a copy of our temporary key; replace it. */    \
+      prefix##_assign_key(ent, key);                                    \
+      return NULL;                                                      \
+    }                                                                   \
+    oldval = ent->val;                                                  \
+    ent->val = val;                                                     \
+    return oldval;                                                      \
   }                                                                     \
                                                                         \
   /** Remove the value currently associated with <b>key</b> from the map. \
@@ -1306,10 +1293,11 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
     tor_assert(map);                                                    \
     tor_assert(key);                                                    \
     prefix##_assign_tmp_key(&search, key);                              \
-    resolve = HT_REMOVE(prefix##_impl, &map->head, &search);            \
+    resolve = OAHT_FIND(prefix##_impl, &map->head, &search);            \
     if (resolve) {                                                      \
       oldval = resolve->val;                                            \
-      prefix##_entry_free(resolve);                                     \
+      prefix##_entry_clear(resolve);                                    \
+      OAHT_REMOVE_AT(prefix##_impl, &map->head, resolve);               \
       return oldval;                                                    \
     } else {                                                            \
       return NULL;                                                      \
@@ -1320,21 +1308,21 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   int                                                                   \
   prefix##_size(const maptype *map)                                     \
   {                                                                     \
-    return HT_SIZE(&map->head);                                         \
+    return OAHT_SIZE(&map->head);                                         \
   }                                                                     \
                                                                         \
   /** Return true iff <b>map</b> has no entries. */                     \
   int                                                                   \
   prefix##_isempty(const maptype *map)                                  \
   {                                                                     \
-    return HT_EMPTY(&map->head);                                        \
+    return OAHT_EMPTY(&map->head);                                        \
   }                                                                     \
                                                                         \
   /** Assert that <b>map</b> is not corrupt. */                         \
   void                                                                  \
   prefix##_assert_ok(const maptype *map)                                \
   {                                                                     \
-    tor_assert(!prefix##_impl_HT_REP_IS_BAD_(&map->head));              \
+    tor_assert(!OAHT_REP_IS_BAD_(prefix##_impl, &map->head));           \
   }                                                                     \
                                                                         \
   /** Remove all entries from <b>map</b>, and deallocate storage for    \
@@ -1343,19 +1331,16 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   MOCK_IMPL(void,                                                       \
   prefix##_free_, (maptype *map, void (*free_val)(void*)))              \
   {                                                                     \
-    prefix##_entry_t **ent, **next, *this;                              \
+    prefix##_entry_t *ent;                                              \
     if (!map)                                                           \
       return;                                                           \
-    for (ent = HT_START(prefix##_impl, &map->head); ent != NULL;        \
-         ent = next) {                                                  \
-      this = *ent;                                                      \
-      next = HT_NEXT_RMV(prefix##_impl, &map->head, ent);               \
+    for (ent = OAHT_START(prefix##_impl, &map->head); ent != NULL;      \
+         ent = OAHT_NEXT(prefix##_impl, &map->head, ent)) {             \
       if (free_val)                                                     \
-        free_val(this->val);                                            \
-      prefix##_entry_free(this);                                        \
+        free_val(ent->val);                                             \
+      prefix##_entry_clear(ent);                                        \
     }                                                                   \
-    tor_assert(HT_EMPTY(&map->head));                                   \
-    HT_CLEAR(prefix##_impl, &map->head);                                \
+    OAHT_CLEAR(prefix##_impl, &map->head);                              \
     tor_free(map);                                                      \
   }                                                                     \
                                                                         \
@@ -1384,7 +1369,7 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   prefix##_iter_init(maptype *map)                                      \
   {                                                                     \
     tor_assert(map);                                                    \
-    return HT_START(prefix##_impl, &map->head);                         \
+    return OAHT_START(prefix##_impl, &map->head);                         \
   }                                                                     \
                                                                         \
   /** Advance <b>iter</b> a single step to the next entry, and return   \
@@ -1394,21 +1379,20 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
   {                                                                     \
     tor_assert(map);                                                    \
     tor_assert(iter);                                                   \
-    return HT_NEXT(prefix##_impl, &map->head, iter);                    \
+    return OAHT_NEXT(prefix##_impl, &map->head, iter);                  \
   }                                                                     \
   /** Advance <b>iter</b> a single step to the next entry, removing the \
    * current entry, and return its new value. */                        \
   prefix##_iter_t *                                                     \
   prefix##_iter_next_rmv(maptype *map, prefix##_iter_t *iter)           \
   {                                                                     \
-    prefix##_entry_t *rmv;                                              \
     tor_assert(map);                                                    \
     tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
-    rmv = *iter;                                                        \
-    iter = HT_NEXT_RMV(prefix##_impl, &map->head, iter);                \
-    prefix##_entry_free(rmv);                                           \
-    return iter;                                                        \
+    /* Removing an entry doesn't move the others, so we can still find */\
+    /* the next one from here. */                                       \
+    prefix##_entry_clear(iter);                                         \
+    OAHT_REMOVE_AT(prefix##_impl, &map->head, iter);                    \
+    return OAHT_NEXT(prefix##_impl, &map->head, iter);                  \
   }                                                                     \
   /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed    \
    * to by iter. */                                                     \
@@ -1417,11 +1401,10 @@ digest256map_assign_key(digest256map_entry_t *ent, const uint8_t *key)
                     void **valp)                                        \
   {                                                                     \
     tor_assert(iter);                                                   \
-    tor_assert(*iter);                                                  \
     tor_assert(keyp);                                                   \
     tor_assert(valp);                                                   \
-    *keyp = (*iter)->key;                                               \
-    *valp = (*iter)->val;                                               \
+    *keyp = iter->key;                                                  \
+    *valp = iter->val;                                                  \
   }                                                                     \
   /** Return true iff <b>iter</b> has advanced past the last entry of   \
    * <b>map</b>. */                                                     \
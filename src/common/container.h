@@ -347,7 +347,7 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
 
 #define DECLARE_MAP_FNS(maptype, keytype, prefix)                       \
   typedef struct maptype maptype;                                       \
-  typedef struct prefix##entry_t *prefix##iter_t;                       \
+  typedef struct prefix##entry_t prefix##iter_t;                        \
   MOCK_DECL(maptype*, prefix##new, (void));                             \
   void* prefix##set(maptype *map, keytype key, void *val);              \
   void* prefix##get(const maptype *map, keytype key);                   \
@@ -0,0 +1,147 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file hyperloglog.c
+ * \brief Implementation of HyperLogLog cardinality estimation.
+ *
+ * A HyperLogLog sketch with precision p has 2^p one-byte registers.  Each
+ * added hash selects a register with its top p bits, and that register keeps
+ * the largest "rank" (the position of the first set bit among the remaining
+ * bits) seen so far.  The harmonic mean of 2^-rank over all registers then
+ * estimates the number of distinct hashes, with a relative standard error
+ * of about 1.04/sqrt(2^p).  For small counts, where many registers are still
+ * empty, we fall back to linear counting, which is close to exact.
+ *
+ * See Flajolet, Fusy, Gandouet and Meunier, "HyperLogLog: the analysis of a
+ * near-optimal cardinality estimation algorithm", 2007.
+ **/
+
+#include "orconfig.h"
+#include "common/hyperloglog.h"
+#include "common/util.h"
+
+#include <math.h>
+
+struct hyperloglog_t {
+  /** Number of hash bits used to select a register. */
+  unsigned precision;
+  /** Array of 2^precision registers. */
+  uint8_t *registers;
+};
+
+/** Return the number of registers in a sketch with <b>precision</b>. */
+#define N_REGISTERS(precision) (1u << (precision))
+
+/**
+ * Allocate and return a new, empty hyperloglog_t with 2^<b>precision</b>
+ * registers.  <b>precision</b> must be between HYPERLOGLOG_MIN_PRECISION and
+ * HYPERLOGLOG_MAX_PRECISION.
+ */
+hyperloglog_t *
+hyperloglog_new(unsigned precision)
+{
+  hyperloglog_t *hll;
+  tor_assert(precision >= HYPERLOGLOG_MIN_PRECISION &&
+             precision <= HYPERLOGLOG_MAX_PRECISION);
+  hll = tor_malloc_zero(sizeof(hyperloglog_t));
+  hll->precision = precision;
+  hll->registers = tor_malloc_zero(N_REGISTERS(precision));
+  return hll;
+}
+
+/** Release all storage held by <b>hll</b>. */
+void
+hyperloglog_free_(hyperloglog_t *hll)
+{
+  if (!hll)
+    return;
+  tor_free(hll->registers);
+  tor_free(hll);
+}
+
+/** Add an item with the 64-bit hash <b>hash</b> to <b>hll</b>. */
+void
+hyperloglog_add_hash(hyperloglog_t *hll, uint64_t hash)
+{
+  const unsigned p = hll->precision;
+  const uint64_t idx = hash >> (64 - p);
+  const uint64_t rest = hash & ((UINT64_C(1) << (64 - p)) - 1);
+  uint8_t rank;
+
+  /* The rank is one more than the number of leading zeros in the remaining
+   * 64-p bits. */
+  if (rest)
+    rank = (uint8_t)(64 - p - tor_log2(rest));
+  else
+    rank = (uint8_t)(64 - p + 1);
+  if (rank > hll->registers[idx])
+    hll->registers[idx] = rank;
+}
+
+/** Add every item that was added to <b>src</b> to <b>dest</b>.  Both must
+ * have the same precision. */
+void
+hyperloglog_merge(hyperloglog_t *dest, const hyperloglog_t *src)
+{
+  unsigned i;
+  tor_assert(dest->precision == src->precision);
+  for (i = 0; i < N_REGISTERS(dest->precision); ++i) {
+    if (src->registers[i] > dest->registers[i])
+      dest->registers[i] = src->registers[i];
+  }
+}
+
+/** Forget every item that has been added to <b>hll</b>. */
+void
+hyperloglog_clear(hyperloglog_t *hll)
+{
+  memset(hll->registers, 0, N_REGISTERS(hll->precision));
+}
+
+/** Return an estimate of the number of distinct items that have been added
+ * to <b>hll</b>. */
+uint64_t
+hyperloglog_estimate(const hyperloglog_t *hll)
+{
+  const unsigned m = N_REGISTERS(hll->precision);
+  double alpha, sum = 0.0, estimate;
+  unsigned i, n_zero = 0;
+
+  switch (m) {
+    case 16: alpha = 0.673; break;
+    case 32: alpha = 0.697; break;
+    case 64: alpha = 0.709; break;
+    default: alpha = 0.7213 / (1.0 + 1.079 / m); break;
+  }
+
+  for (i = 0; i < m; ++i) {
+    sum += ldexp(1.0, -(int)hll->registers[i]);
+    if (hll->registers[i] == 0)
+      ++n_zero;
+  }
+  estimate = alpha * m * m / sum;
+
+  /* With 64-bit hashes we never need the large-range correction, but the
+   * raw estimate is biased for small counts. */
+  if (estimate <= 2.5 * m && n_zero > 0)
+    estimate = m * log((double)m / n_zero);
+
+  return (uint64_t)(estimate + 0.5);
+}
+
+/** Return the relative standard error of estimates from a hyperloglog_t
+ * with <b>precision</b>. */
+double
+hyperloglog_relative_error(unsigned precision)
+{
+  return 1.04 / sqrt((double)N_REGISTERS(precision));
+}
+
+/** Return the number of bytes used by a hyperloglog_t with
+ * <b>precision</b>. */
+size_t
+hyperloglog_size(unsigned precision)
+{
+  return sizeof(hyperloglog_t) + N_REGISTERS(precision);
+}
@@ -0,0 +1,39 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file hyperloglog.h
+ * \brief Header for hyperloglog.c
+ **/
+
+#ifndef TOR_HYPERLOGLOG_H
+#define TOR_HYPERLOGLOG_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+
+/** Smallest precision that a hyperloglog_t may have. */
+#define HYPERLOGLOG_MIN_PRECISION 4
+/** Largest precision that a hyperloglog_t may have. */
+#define HYPERLOGLOG_MAX_PRECISION 16
+
+/**
+ * A hyperloglog_t estimates the number of distinct items that have been
+ * added to it, using a fixed amount of memory no matter how many items there
+ * are.  Items are added as uniformly distributed 64-bit hashes; the caller is
+ * responsible for hashing them with a suitable keyed hash.
+ */
+typedef struct hyperloglog_t hyperloglog_t;
+
+hyperloglog_t *hyperloglog_new(unsigned precision);
+void hyperloglog_free_(hyperloglog_t *hll);
+#define hyperloglog_free(hll) \
+  FREE_AND_NULL(hyperloglog_t, hyperloglog_free_, (hll))
+void hyperloglog_add_hash(hyperloglog_t *hll, uint64_t hash);
+void hyperloglog_merge(hyperloglog_t *dest, const hyperloglog_t *src);
+void hyperloglog_clear(hyperloglog_t *hll);
+uint64_t hyperloglog_estimate(const hyperloglog_t *hll);
+double hyperloglog_relative_error(unsigned precision);
+size_t hyperloglog_size(unsigned precision);
+
+#endif /* !defined(TOR_HYPERLOGLOG_H) */
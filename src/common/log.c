@@ -13,6 +13,7 @@
 #include <stdarg.h>
 // #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
@@ -497,6 +498,38 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Send the message <b>msg_after_prefix</b> to the system log.  The full
+ * message, with time prefix and severity, is <b>msg_len</b> bytes long. */
+static void
+syslog_deliver(int severity, const char *msg_after_prefix, size_t msg_len)
+{
+#ifdef HAVE_SYSLOG_H
+#ifdef MAXLINE
+  /* Some syslog implementations have limits on the length of what you can
+   * pass them, and some very old ones do not detect overflow so well.
+   * Regrettably, they call their maximum line length MAXLINE. */
+#if MAXLINE < 64
+#warn "MAXLINE is a very low number; it might not be from syslog.h after all"
+#endif
+  char *m = msg_after_prefix;
+  if (msg_len >= MAXLINE)
+    m = tor_strndup(msg_after_prefix, MAXLINE-1);
+  syslog(severity, "%s", m);
+  if (m != msg_after_prefix) {
+    tor_free(m);
+  }
+#else /* !(defined(MAXLINE)) */
+  /* We have syslog but not MAXLINE.  That's promising! */
+  (void) msg_len;
+  syslog(severity, "%s", msg_after_prefix);
+#endif /* defined(MAXLINE) */
+#else /* !(defined(HAVE_SYSLOG_H)) */
+  (void) severity;
+  (void) msg_after_prefix;
+  (void) msg_len;
+#endif /* defined(HAVE_SYSLOG_H) */
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -510,26 +543,7 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
 {
 
   if (lf->is_syslog) {
-#ifdef HAVE_SYSLOG_H
-#ifdef MAXLINE
-    /* Some syslog implementations have limits on the length of what you can
-     * pass them, and some very old ones do not detect overflow so well.
-     * Regrettably, they call their maximum line length MAXLINE. */
-#if MAXLINE < 64
-#warn "MAXLINE is a very low number; it might not be from syslog.h after all"
-#endif
-    char *m = msg_after_prefix;
-    if (msg_len >= MAXLINE)
-      m = tor_strndup(msg_after_prefix, MAXLINE-1);
-    syslog(severity, "%s", m);
-    if (m != msg_after_prefix) {
-      tor_free(m);
-    }
-#else /* !(defined(MAXLINE)) */
-    /* We have syslog but not MAXLINE.  That's promising! */
-    syslog(severity, "%s", msg_after_prefix);
-#endif /* defined(MAXLINE) */
-#endif /* defined(HAVE_SYSLOG_H) */
+    syslog_deliver(severity, msg_after_prefix, msg_len);
   } else if (lf->is_android) {
 #ifdef HAVE_ANDROID_LOG_H
     int priority = severity_to_android_log_priority(severity);
@@ -557,6 +571,416 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
   }
 }
 
+/** Size in bytes of the ring of log messages that each thread writes to in
+ * asynchronous mode.  Must be a power of two. */
+#define LOG_RING_SIZE (1<<16)
+/** How often, in msec, the log writer thread writes out the messages that
+ * are waiting in the rings. */
+#define LOG_ASYNC_WRITE_INTERVAL_MSEC 100
+
+/** Header of a message in a log_ring_t.  The formatted message follows it,
+ * without a NUL. */
+typedef struct log_ring_msg_hdr_t {
+  /** Position of this message among all the messages sent to the rings, so
+   * that we can write messages from different threads in order. */
+  uint64_t seq;
+  int severity;
+  log_domain_mask_t domain;
+  /** Length of the message, and offset of the part after the prefix. */
+  uint32_t len;
+  uint32_t prefix_len;
+} log_ring_msg_hdr_t;
+
+/** A ring of log messages waiting to be written by the log writer thread.
+ * Only the thread that owns the ring adds to it, and only the thread that
+ * holds log_drain_mutex takes messages out, so neither needs a lock. */
+typedef struct log_ring_t {
+  /** Next ring in log_rings. */
+  struct log_ring_t *next;
+  /** Number of bytes ever added to this ring, and ever taken out of it.
+   * Both wrap around modulo SIZE_MAX+1, which is a multiple of
+   * LOG_RING_SIZE. */
+  atomic_counter_t head;
+  atomic_counter_t tail;
+  /** Number of messages that we dropped because the ring was full, since
+   * the writer last looked. */
+  atomic_counter_t n_dropped;
+  char buf[LOG_RING_SIZE];
+} log_ring_t;
+
+/** A message that the log writer thread took out of a ring. */
+typedef struct log_async_msg_t {
+  log_ring_msg_hdr_t hdr;
+  /** Number of syslog logs that want this message. */
+  int n_syslogs;
+  char body[FLEXIBLE_ARRAY_MEMBER];
+} log_async_msg_t;
+
+/** True iff messages for files and syslog go through the rings and the log
+ * writer thread, rather than being written by the thread that logs them. */
+static int log_async_enabled = 0;
+/** True iff we have initialized the locks and thread-local storage that
+ * asynchronous logging uses. */
+static int log_async_initialized = 0;
+/** The ring of each thread that has logged in asynchronous mode. */
+static tor_threadlocal_t log_ring_threadlocal;
+/** Every ring that we have allocated.  We never free them, since a thread
+ * might log at any time. Guarded by log_writer_mutex. */
+static log_ring_t *log_rings = NULL;
+/** Source of log_ring_msg_hdr_t.seq. */
+static atomic_counter_t log_async_seq;
+/** Total number of messages dropped because their ring was full. */
+static atomic_counter_t log_async_n_dropped;
+/** Guards log_rings and the state of the log writer thread, and goes with
+ * log_writer_cond. */
+static tor_mutex_t log_writer_mutex;
+/** Signaled to wake up the log writer thread, and by the log writer thread
+ * when it exits. */
+static tor_cond_t log_writer_cond;
+/** True iff the log writer thread is running, and iff it should exit. */
+static int log_writer_running = 0;
+static int log_writer_should_exit = 0;
+/** Held by whoever is taking messages out of the rings. */
+static tor_mutex_t log_drain_mutex;
+/** Held while writing to the fds of the logs without holding log_mutex.
+ * close_log() takes it, so that no fd gets closed while we write to it.
+ * Always acquired after log_mutex. */
+static tor_mutex_t log_write_mutex;
+
+/** Return true iff messages for <b>lf</b> should go to the log writer
+ * thread. */
+static inline int
+logfile_is_async(const logfile_t *lf)
+{
+  return log_async_enabled && (lf->is_syslog || !logfile_is_external(lf));
+}
+
+/** Copy <b>n</b> bytes from <b>src</b> into <b>ring</b> at position
+ * <b>pos</b>, wrapping around its end if needed. */
+static void
+log_ring_copy_in(log_ring_t *ring, size_t pos, const void *src, size_t n)
+{
+  size_t off = pos & (LOG_RING_SIZE - 1);
+  size_t n1 = MIN(n, LOG_RING_SIZE - off);
+  memcpy(ring->buf + off, src, n1);
+  memcpy(ring->buf, (const char *)src + n1, n - n1);
+}
+
+/** Copy <b>n</b> bytes out of <b>ring</b> at position <b>pos</b> into
+ * <b>dest</b>, wrapping around its end if needed. */
+static void
+log_ring_copy_out(const log_ring_t *ring, size_t pos, void *dest, size_t n)
+{
+  size_t off = pos & (LOG_RING_SIZE - 1);
+  size_t n1 = MIN(n, LOG_RING_SIZE - off);
+  memcpy(dest, ring->buf + off, n1);
+  memcpy((char *)dest + n1, ring->buf, n - n1);
+}
+
+/** Return the ring of the current thread, allocating it if needed. */
+static log_ring_t *
+log_ring_get(void)
+{
+  log_ring_t *ring = tor_threadlocal_get(&log_ring_threadlocal);
+  if (PREDICT_UNLIKELY(ring == NULL)) {
+    ring = tor_malloc_zero(sizeof(log_ring_t));
+    atomic_counter_init(&ring->head);
+    atomic_counter_init(&ring->tail);
+    atomic_counter_init(&ring->n_dropped);
+    tor_mutex_acquire(&log_writer_mutex);
+    ring->next = log_rings;
+    log_rings = ring;
+    tor_mutex_release(&log_writer_mutex);
+    tor_threadlocal_set(&log_ring_threadlocal, ring);
+  }
+  return ring;
+}
+
+/** Add a formatted message to the ring of the current thread, for the log
+ * writer thread to write.  The full message, with time prefix and severity,
+ * is the <b>msg_len</b> bytes at <b>buf</b>, and the message itself starts
+ * at <b>msg_after_prefix</b>. If the ring is full, count the message as
+ * dropped instead. */
+static void
+log_ring_push(int severity, log_domain_mask_t domain, const char *buf,
+              size_t msg_len, const char *msg_after_prefix)
+{
+  log_ring_t *ring = log_ring_get();
+  log_ring_msg_hdr_t hdr;
+  const size_t head = atomic_counter_get(&ring->head);
+  const size_t used = head - atomic_counter_get(&ring->tail);
+
+  if (LOG_RING_SIZE - used < sizeof(hdr) + msg_len) {
+    atomic_counter_add(&ring->n_dropped, 1);
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.seq = atomic_counter_fetch_add(&log_async_seq, 1);
+  hdr.severity = severity;
+  hdr.domain = domain;
+  hdr.len = (uint32_t)msg_len;
+  hdr.prefix_len = (uint32_t)(msg_after_prefix - buf);
+  log_ring_copy_in(ring, head, &hdr, sizeof(hdr));
+  log_ring_copy_in(ring, head + sizeof(hdr), buf, msg_len);
+  /* This publishes the message to the writer. */
+  atomic_counter_add(&ring->head, sizeof(hdr) + msg_len);
+
+  /* Don't wait for the writer's next round if the ring is getting full. */
+  if (used < LOG_RING_SIZE / 2 &&
+      used + sizeof(hdr) + msg_len >= LOG_RING_SIZE / 2) {
+    tor_mutex_acquire(&log_writer_mutex);
+    tor_cond_signal_one(&log_writer_cond);
+    tor_mutex_release(&log_writer_mutex);
+  }
+}
+
+/** Helper for sorting log_async_msg_t by sequence number. */
+static int
+log_async_msg_compare_(const void **a_, const void **b_)
+{
+  const log_async_msg_t *a = *a_, *b = *b_;
+  if (a->hdr.seq < b->hdr.seq)
+    return -1;
+  return a->hdr.seq > b->hdr.seq;
+}
+
+/** Take every message out of the rings, and return them in a new smartlist
+ * in the order that they were logged.  Add a message about any messages
+ * that we dropped.  Caller must hold log_drain_mutex. */
+static smartlist_t *
+log_rings_drain(void)
+{
+  smartlist_t *msgs = smartlist_new();
+  log_ring_t *ring;
+  size_t n_dropped = 0;
+
+  tor_mutex_acquire(&log_writer_mutex);
+  ring = log_rings;
+  tor_mutex_release(&log_writer_mutex);
+
+  /* Rings are only ever added at the front of the list, so we can walk it
+   * without the lock. */
+  for ( ; ring; ring = ring->next) {
+    const size_t head = atomic_counter_get(&ring->head);
+    const size_t tail = atomic_counter_get(&ring->tail);
+    size_t pos = tail;
+    while (pos != head) {
+      log_ring_msg_hdr_t hdr;
+      log_async_msg_t *msg;
+      log_ring_copy_out(ring, pos, &hdr, sizeof(hdr));
+      msg = tor_malloc(offsetof(log_async_msg_t, body) + hdr.len + 1);
+      memcpy(&msg->hdr, &hdr, sizeof(hdr));
+      msg->n_syslogs = 0;
+      log_ring_copy_out(ring, pos + sizeof(hdr), msg->body, hdr.len);
+      msg->body[hdr.len] = '\0';
+      smartlist_add(msgs, msg);
+      pos += sizeof(hdr) + hdr.len;
+    }
+    atomic_counter_add(&ring->tail, head - tail);
+    n_dropped += atomic_counter_exchange(&ring->n_dropped, 0);
+  }
+
+  smartlist_sort(msgs, log_async_msg_compare_);
+
+  if (n_dropped) {
+    char buf[256];
+    size_t n;
+    log_async_msg_t *msg;
+    atomic_counter_add(&log_async_n_dropped, n_dropped);
+    n = log_prefix_(buf, sizeof(buf), LOG_WARN);
+    tor_snprintf(buf+n, sizeof(buf)-n,
+                 "Dropped "U64_FORMAT" log messages because the log writer "
+                 "couldn't keep up.\n", U64_PRINTF_ARG(n_dropped));
+    msg = tor_malloc(offsetof(log_async_msg_t, body) + strlen(buf) + 1);
+    memset(&msg->hdr, 0, sizeof(msg->hdr));
+    msg->hdr.severity = LOG_WARN;
+    msg->hdr.domain = LD_GENERAL;
+    msg->hdr.len = (uint32_t)strlen(buf);
+    msg->hdr.prefix_len = (uint32_t)n;
+    msg->n_syslogs = 0;
+    strlcpy(msg->body, buf, strlen(buf) + 1);
+    smartlist_add(msgs, msg);
+  }
+
+  return msgs;
+}
+
+/** A batch of messages to write to one fd-based log. */
+typedef struct log_async_batch_t {
+  logfile_t *lf;
+  int fd;
+  char *data;
+  size_t len;
+} log_async_batch_t;
+
+/** Write every message waiting in the rings to the logs that want it,
+ * writing each log's share in a single call. */
+static void
+log_async_write_pending(void)
+{
+  smartlist_t *msgs, *batches;
+  logfile_t *lf;
+
+  tor_mutex_acquire(&log_drain_mutex);
+  msgs = log_rings_drain();
+  if (smartlist_len(msgs) == 0) {
+    smartlist_free(msgs);
+    tor_mutex_release(&log_drain_mutex);
+    return;
+  }
+
+  /* Decide where the messages go while we hold the lock, but write them
+   * after releasing it, so that we don't block other threads' logging. */
+  batches = smartlist_new();
+  LOCK_LOGS();
+  for (lf = logfiles; lf; lf = lf->next) {
+    log_async_batch_t *batch;
+    size_t len = 0;
+
+    if (lf->is_syslog) {
+      SMARTLIST_FOREACH(msgs, log_async_msg_t *, msg,
+        if (logfile_wants_message(lf, msg->hdr.severity, msg->hdr.domain))
+          ++msg->n_syslogs);
+      continue;
+    }
+    if (logfile_is_external(lf))
+      continue;
+
+    SMARTLIST_FOREACH(msgs, log_async_msg_t *, msg,
+      if (logfile_wants_message(lf, msg->hdr.severity, msg->hdr.domain))
+        len += msg->hdr.len);
+    if (!len)
+      continue;
+
+    batch = tor_malloc_zero(sizeof(log_async_batch_t));
+    batch->lf = lf;
+    batch->fd = lf->fd;
+    batch->data = tor_malloc(len);
+    SMARTLIST_FOREACH_BEGIN(msgs, log_async_msg_t *, msg) {
+      if (logfile_wants_message(lf, msg->hdr.severity, msg->hdr.domain)) {
+        memcpy(batch->data + batch->len, msg->body, msg->hdr.len);
+        batch->len += msg->hdr.len;
+      }
+    } SMARTLIST_FOREACH_END(msg);
+    smartlist_add(batches, batch);
+  }
+  tor_mutex_acquire(&log_write_mutex);
+  UNLOCK_LOGS();
+
+  SMARTLIST_FOREACH_BEGIN(msgs, log_async_msg_t *, msg) {
+    int i;
+    for (i = 0; i < msg->n_syslogs; ++i)
+      syslog_deliver(msg->hdr.severity, msg->body + msg->hdr.prefix_len,
+                     msg->hdr.len);
+    tor_free(msg);
+  } SMARTLIST_FOREACH_END(msg);
+  SMARTLIST_FOREACH_BEGIN(batches, log_async_batch_t *, batch) {
+    /* close_log() can't free the logfile_t while we hold log_write_mutex,
+     * so it's still safe to mark it dead. */
+    if (write_all(batch->fd, batch->data, batch->len, 0) < 0)
+      batch->lf->seems_dead = 1;
+    tor_free(batch->data);
+    tor_free(batch);
+  } SMARTLIST_FOREACH_END(batch);
+  tor_mutex_release(&log_write_mutex);
+  tor_mutex_release(&log_drain_mutex);
+
+  smartlist_free(batches);
+  smartlist_free(msgs);
+}
+
+/** Main function of the log writer thread. */
+static void
+log_writer_thread_main(void *arg)
+{
+  (void) arg;
+  tor_mutex_acquire(&log_writer_mutex);
+  while (!log_writer_should_exit) {
+    const struct timeval tv = { 0, LOG_ASYNC_WRITE_INTERVAL_MSEC * 1000 };
+    tor_cond_wait(&log_writer_cond, &log_writer_mutex, &tv);
+    tor_mutex_release(&log_writer_mutex);
+    log_async_write_pending();
+    tor_mutex_acquire(&log_writer_mutex);
+  }
+  log_writer_running = 0;
+  tor_cond_signal_all(&log_writer_cond);
+  tor_mutex_release(&log_writer_mutex);
+}
+
+/** Turn asynchronous logging on or off, according to <b>enabled</b>.
+ *
+ * In asynchronous mode, messages for files and for syslog go through a
+ * ring for each thread to a writer thread, which writes them out in
+ * batches; a thread that logs only formats its message and copies it into
+ * its ring.  Messages are written at most LOG_ASYNC_WRITE_INTERVAL_MSEC
+ * late, and are dropped if a ring is full.  Errors are still written right
+ * away, since we might be about to exit.
+ *
+ * Return 0 on success, or -1 if we couldn't start the writer thread. */
+int
+logs_set_async(int enabled)
+{
+  enabled = !!enabled;
+  if (enabled == log_async_enabled)
+    return 0;
+
+  if (!log_async_initialized) {
+    tor_threadlocal_init(&log_ring_threadlocal);
+    atomic_counter_init(&log_async_seq);
+    atomic_counter_init(&log_async_n_dropped);
+    tor_mutex_init(&log_writer_mutex);
+    tor_cond_init(&log_writer_cond);
+    tor_mutex_init(&log_drain_mutex);
+    tor_mutex_init(&log_write_mutex);
+    log_async_initialized = 1;
+  }
+
+  if (enabled) {
+    tor_mutex_acquire(&log_writer_mutex);
+    log_writer_should_exit = 0;
+    log_writer_running = 1;
+    tor_mutex_release(&log_writer_mutex);
+    if (spawn_func(log_writer_thread_main, NULL) < 0) {
+      log_writer_running = 0;
+      return -1;
+    }
+    log_async_enabled = 1;
+  } else {
+    tor_mutex_acquire(&log_writer_mutex);
+    log_writer_should_exit = 1;
+    tor_cond_signal_all(&log_writer_cond);
+    while (log_writer_running)
+      tor_cond_wait(&log_writer_cond, &log_writer_mutex, NULL);
+    tor_mutex_release(&log_writer_mutex);
+    /* Write out what is in the rings before anything can be logged
+     * directly, so that older messages come first.  Then write whatever
+     * threads pushed while we were turning async mode off. */
+    logs_flush_async();
+    log_async_enabled = 0;
+    logs_flush_async();
+  }
+  return 0;
+}
+
+/** Write out every message that is waiting for the log writer thread. */
+void
+logs_flush_async(void)
+{
+  if (log_async_initialized)
+    log_async_write_pending();
+}
+
+/** Return the number of log messages that we have dropped in asynchronous
+ * mode because the log writer thread couldn't keep up. */
+uint64_t
+logs_get_n_async_dropped(void)
+{
+  if (!log_async_initialized)
+    return 0;
+  return atomic_counter_get(&log_async_n_dropped);
+}
+
 /** Helper: sends a message to the appropriate logfiles, at loglevel
  * <b>severity</b>.  If provided, <b>funcname</b> is prepended to the
  * message.  The actual message is derived as from tor_snprintf(format,ap).
@@ -571,6 +995,7 @@ logv,(int severity, log_domain_mask_t domain, const char *funcname,
   logfile_t *lf;
   char *end_of_prefix=NULL;
   int callbacks_deferred = 0;
+  int async_wanted = 0;
 
   /* Call assert, not tor_assert, since tor_assert calls log on failure. */
   raw_assert(format);
@@ -608,10 +1033,18 @@ logv,(int severity, log_domain_mask_t domain, const char *funcname,
       formatted = 1;
     }
 
+    if (logfile_is_async(lf) && severity != LOG_ERR) {
+      async_wanted = 1;
+      continue;
+    }
+
     logfile_deliver(lf, buf, msg_len, end_of_prefix, domain, severity,
       &callbacks_deferred);
   }
   UNLOCK_LOGS();
+
+  if (async_wanted)
+    log_ring_push(severity, domain, buf, msg_len, end_of_prefix);
 }
 
 /** Output a message to the log.  It gets logged to all logfiles that
@@ -766,6 +1199,7 @@ logs_free_all(void)
 {
   logfile_t *victim, *next;
   smartlist_t *messages, *messages2;
+  logs_set_async(0);
   LOCK_LOGS();
   next = logfiles;
   logfiles = NULL;
@@ -829,6 +1263,9 @@ delete_log(logfile_t *victim)
 static void
 close_log(logfile_t *victim)
 {
+  /* Don't close anything while the log writer thread is writing to it. */
+  if (log_async_initialized)
+    tor_mutex_acquire(&log_write_mutex);
   if (victim->needs_close && victim->fd >= 0) {
     close(victim->fd);
     victim->fd = -1;
@@ -840,6 +1277,8 @@ close_log(logfile_t *victim)
     }
 #endif /* defined(HAVE_SYSLOG_H) */
   }
+  if (log_async_initialized)
+    tor_mutex_release(&log_write_mutex);
 }
 
 /** Adjust a log severity configuration in <b>severity_out</b> to contain
@@ -1080,6 +1519,8 @@ close_temp_logs(void)
 {
   logfile_t *lf, **p;
 
+  /* Write the messages that are waiting for these logs first. */
+  logs_flush_async();
   LOCK_LOGS();
   for (p = &logfiles; *p; ) {
     if ((*p)->is_temporary) {
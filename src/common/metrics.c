@@ -0,0 +1,371 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metrics.c
+ * \brief A registry of counters, gauges and histograms, and their
+ * exposition in the Prometheus text format.
+ *
+ * Modules keep their metrics in their own (usually static) storage, and
+ * update them with the inline functions in metrics.h: that is no more
+ * expensive than the ad hoc counters that they replace.  They then register
+ * that storage here, once, with a name, a help string and an optional set
+ * of labels.  Values that a module already tracks some other way can be
+ * registered with a getter function instead.
+ *
+ * Several registrations may share a name if they have different labels;
+ * together they make up one "metric family" in the output.
+ *
+ * Metrics are only read and updated from the main thread.
+ **/
+
+#include "orconfig.h"
+#include "common/metrics.h"
+#include "common/container.h"
+#include "common/util.h"
+
+/** The kinds of metric that we know how to format. */
+typedef enum {
+  METRICS_TYPE_COUNTER,
+  METRICS_TYPE_GAUGE,
+  METRICS_TYPE_HISTOGRAM,
+} metrics_type_t;
+
+/** A registered metric. */
+typedef struct metrics_entry_t {
+  metrics_type_t type;
+  /** Name of the metric family; help string for the family; labels for this
+   * member of the family, without braces, or NULL. */
+  char *name;
+  char *help;
+  char *labels;
+  /** Position in the registry, used to keep the output stable. */
+  int idx;
+  /** Where the value lives: exactly one of these is set. */
+  metrics_counter_t *counter;
+  metrics_gauge_t *gauge;
+  metrics_histogram_t *histogram;
+  metrics_getter_fn_t getter;
+  const void *getter_arg;
+} metrics_entry_t;
+
+/** Every registered metric_entry_t, in registration order. */
+static smartlist_t *metrics_registry = NULL;
+
+/** Record the value <b>v</b> in the histogram <b>h</b>. */
+void
+metrics_histogram_observe(metrics_histogram_t *h, double v)
+{
+  int i;
+  /* Histograms are short enough that a linear scan beats a binary search. */
+  for (i = 0; i < h->n_bounds; ++i) {
+    if (v <= h->bounds[i])
+      break;
+  }
+  ++h->counts[i];
+  h->sum += v;
+}
+
+/** Forget every observation in the histogram <b>h</b>. */
+void
+metrics_histogram_clear(metrics_histogram_t *h)
+{
+  memset(h->counts, 0, sizeof(h->counts));
+  h->sum = 0.0;
+}
+
+/** Return the number of observations in the histogram <b>h</b>. */
+uint64_t
+metrics_histogram_get_count(const metrics_histogram_t *h)
+{
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i <= h->n_bounds; ++i)
+    n += h->counts[i];
+  return n;
+}
+
+/**
+ * Return an estimate of the <b>q</b>-quantile (0 \<= q \<= 1) of the
+ * observations in the histogram <b>h</b>, interpolating linearly within the
+ * bucket that holds it, as Prometheus does.  Observations in the "+Inf"
+ * bucket are reported as the largest finite bound.  Return 0 if there are
+ * no observations.
+ */
+double
+metrics_histogram_quantile(const metrics_histogram_t *h, double q)
+{
+  const uint64_t total = metrics_histogram_get_count(h);
+  uint64_t cumulative = 0;
+  double rank, lower;
+  int i;
+
+  if (total == 0)
+    return 0.0;
+  if (q < 0.0)
+    q = 0.0;
+  if (q > 1.0)
+    q = 1.0;
+  rank = q * U64_TO_DBL(total);
+
+  for (i = 0; i < h->n_bounds; ++i) {
+    if (h->counts[i] && U64_TO_DBL(cumulative + h->counts[i]) >= rank)
+      break;
+    cumulative += h->counts[i];
+  }
+  if (i == h->n_bounds)
+    return h->n_bounds ? h->bounds[h->n_bounds - 1] : 0.0;
+
+  lower = i ? h->bounds[i - 1] : 0.0;
+  return lower + (h->bounds[i] - lower) *
+    ((rank - U64_TO_DBL(cumulative)) / U64_TO_DBL(h->counts[i]));
+}
+
+/** Create a new registry entry of type <b>type</b> and add it to the
+ * registry.  Return the new entry. */
+static metrics_entry_t *
+metrics_entry_add(metrics_type_t type, const char *name, const char *help,
+                  const char *labels)
+{
+  metrics_entry_t *ent = tor_malloc_zero(sizeof(metrics_entry_t));
+  tor_assert(name);
+  tor_assert(help);
+
+  if (!metrics_registry)
+    metrics_registry = smartlist_new();
+
+  ent->type = type;
+  ent->name = tor_strdup(name);
+  ent->help = tor_strdup(help);
+  ent->labels = labels ? tor_strdup(labels) : NULL;
+  ent->idx = smartlist_len(metrics_registry);
+  smartlist_add(metrics_registry, ent);
+  return ent;
+}
+
+/** Register the counter <b>c</b> as <b>name</b>, with the help string
+ * <b>help</b> and the labels <b>labels</b>.  <b>labels</b> is a
+ * comma-separated list of label="value" pairs, or NULL.  <b>c</b> must
+ * remain valid until metrics_free_all() is called. */
+void
+metrics_register_counter(metrics_counter_t *c, const char *name,
+                         const char *help, const char *labels)
+{
+  tor_assert(c);
+  metrics_entry_add(METRICS_TYPE_COUNTER, name, help, labels)->counter = c;
+}
+
+/** As metrics_register_counter(), but for the gauge <b>g</b>. */
+void
+metrics_register_gauge(metrics_gauge_t *g, const char *name,
+                       const char *help, const char *labels)
+{
+  tor_assert(g);
+  metrics_entry_add(METRICS_TYPE_GAUGE, name, help, labels)->gauge = g;
+}
+
+/** As metrics_register_counter(), but for the histogram <b>h</b>. */
+void
+metrics_register_histogram(metrics_histogram_t *h, const char *name,
+                           const char *help, const char *labels)
+{
+  tor_assert(h);
+  tor_assert(h->n_bounds <= METRICS_HISTOGRAM_MAX_BOUNDS);
+  metrics_entry_add(METRICS_TYPE_HISTOGRAM, name, help, labels)->histogram =
+    h;
+}
+
+/** Register a counter as in metrics_register_counter(), whose value is
+ * found by calling <b>fn</b>(<b>arg</b>). */
+void
+metrics_register_counter_fn(metrics_getter_fn_t fn, const void *arg,
+                            const char *name, const char *help,
+                            const char *labels)
+{
+  metrics_entry_t *ent;
+  tor_assert(fn);
+  ent = metrics_entry_add(METRICS_TYPE_COUNTER, name, help, labels);
+  ent->getter = fn;
+  ent->getter_arg = arg;
+}
+
+/** Register a gauge as in metrics_register_gauge(), whose value is found by
+ * calling <b>fn</b>(<b>arg</b>). */
+void
+metrics_register_gauge_fn(metrics_getter_fn_t fn, const void *arg,
+                          const char *name, const char *help,
+                          const char *labels)
+{
+  metrics_entry_t *ent;
+  tor_assert(fn);
+  ent = metrics_entry_add(METRICS_TYPE_GAUGE, name, help, labels);
+  ent->getter = fn;
+  ent->getter_arg = arg;
+}
+
+/** Getter for metrics_register_counter_fn() and
+ * metrics_register_gauge_fn(): return the uint64_t that <b>arg</b> points
+ * to. */
+uint64_t
+metrics_read_u64(const void *arg)
+{
+  return *(const uint64_t *)arg;
+}
+
+/** As metrics_read_u64(), but for a uint32_t. */
+uint64_t
+metrics_read_u32(const void *arg)
+{
+  return *(const uint32_t *)arg;
+}
+
+/** As metrics_read_u64(), but <b>arg</b> points to a smartlist_t pointer,
+ * and we return the length of the list, or 0 if it is NULL. */
+uint64_t
+metrics_read_smartlist_len(const void *arg)
+{
+  smartlist_t *const *lst = arg;
+  return *lst ? smartlist_len(*lst) : 0;
+}
+
+/** Return the number of registered metrics. */
+int
+metrics_get_n_registered(void)
+{
+  return metrics_registry ? smartlist_len(metrics_registry) : 0;
+}
+
+/** Helper for sorting: order metrics_entry_t by name, then by registration
+ * order, so that every family is contiguous. */
+static int
+compare_metrics_entries_(const void **a_, const void **b_)
+{
+  const metrics_entry_t *a = *a_, *b = *b_;
+  int r = strcmp(a->name, b->name);
+  if (r)
+    return r;
+  return a->idx - b->idx;
+}
+
+/** Return the name of the Prometheus type of <b>type</b>. */
+static const char *
+metrics_type_to_string(metrics_type_t type)
+{
+  switch (type) {
+    case METRICS_TYPE_COUNTER: return "counter";
+    case METRICS_TYPE_GAUGE: return "gauge";
+    case METRICS_TYPE_HISTOGRAM: return "histogram";
+  }
+  tor_assert_nonfatal_unreached();
+  return "untyped";
+}
+
+/** Append to <b>out</b> the samples of the histogram entry <b>ent</b>. */
+static void
+metrics_format_histogram(smartlist_t *out, const metrics_entry_t *ent)
+{
+  const metrics_histogram_t *h = ent->histogram;
+  const char *sep = ent->labels ? "," : "";
+  const char *labels = ent->labels ? ent->labels : "";
+  uint64_t cumulative = 0;
+  int i;
+
+  for (i = 0; i < h->n_bounds; ++i) {
+    cumulative += h->counts[i];
+    smartlist_add_asprintf(out, "%s_bucket{%s%sle=\"%g\"} "U64_FORMAT"\n",
+                           ent->name, labels, sep, h->bounds[i],
+                           U64_PRINTF_ARG(cumulative));
+  }
+  cumulative += h->counts[h->n_bounds];
+  smartlist_add_asprintf(out, "%s_bucket{%s%sle=\"+Inf\"} "U64_FORMAT"\n",
+                         ent->name, labels, sep, U64_PRINTF_ARG(cumulative));
+  if (ent->labels) {
+    smartlist_add_asprintf(out, "%s_sum{%s} %.17g\n%s_count{%s} "U64_FORMAT
+                           "\n", ent->name, labels, h->sum, ent->name, labels,
+                           U64_PRINTF_ARG(cumulative));
+  } else {
+    smartlist_add_asprintf(out, "%s_sum %.17g\n%s_count "U64_FORMAT"\n",
+                           ent->name, h->sum, ent->name,
+                           U64_PRINTF_ARG(cumulative));
+  }
+}
+
+/** Append to <b>out</b> the sample of the counter or gauge entry
+ * <b>ent</b>. */
+static void
+metrics_format_value(smartlist_t *out, const metrics_entry_t *ent)
+{
+  char value[32];
+
+  if (ent->getter) {
+    tor_snprintf(value, sizeof(value), U64_FORMAT,
+                 U64_PRINTF_ARG(ent->getter(ent->getter_arg)));
+  } else if (ent->counter) {
+    tor_snprintf(value, sizeof(value), U64_FORMAT,
+                 U64_PRINTF_ARG(ent->counter->value));
+  } else {
+    tor_snprintf(value, sizeof(value), I64_FORMAT,
+                 I64_PRINTF_ARG(ent->gauge->value));
+  }
+
+  if (ent->labels)
+    smartlist_add_asprintf(out, "%s{%s} %s\n", ent->name, ent->labels, value);
+  else
+    smartlist_add_asprintf(out, "%s %s\n", ent->name, value);
+}
+
+/**
+ * Return a newly allocated string holding the current value of every
+ * registered metric, in the Prometheus text exposition format (version
+ * 0.0.4).
+ */
+char *
+metrics_format_prometheus(void)
+{
+  smartlist_t *entries, *out;
+  const char *prev_name = NULL;
+  char *result;
+
+  if (!metrics_registry)
+    return tor_strdup("");
+
+  entries = smartlist_new();
+  out = smartlist_new();
+  smartlist_add_all(entries, metrics_registry);
+  smartlist_sort(entries, compare_metrics_entries_);
+
+  SMARTLIST_FOREACH_BEGIN(entries, const metrics_entry_t *, ent) {
+    if (!prev_name || strcmp(prev_name, ent->name)) {
+      smartlist_add_asprintf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                             ent->name, ent->help, ent->name,
+                             metrics_type_to_string(ent->type));
+      prev_name = ent->name;
+    }
+    if (ent->type == METRICS_TYPE_HISTOGRAM)
+      metrics_format_histogram(out, ent);
+    else
+      metrics_format_value(out, ent);
+  } SMARTLIST_FOREACH_END(ent);
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  smartlist_free(entries);
+  return result;
+}
+
+/** Forget every registered metric.  The storage of the metrics themselves
+ * belongs to the modules that registered them, and is left alone. */
+void
+metrics_free_all(void)
+{
+  if (!metrics_registry)
+    return;
+  SMARTLIST_FOREACH_BEGIN(metrics_registry, metrics_entry_t *, ent) {
+    tor_free(ent->name);
+    tor_free(ent->help);
+    tor_free(ent->labels);
+    tor_free(ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_free(metrics_registry);
+}
@@ -0,0 +1,108 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metrics.h
+ * \brief Header for metrics.c
+ **/
+
+#ifndef TOR_METRICS_H
+#define TOR_METRICS_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+
+/** Largest number of finite bucket bounds that a metrics_histogram_t may
+ * have. */
+#define METRICS_HISTOGRAM_MAX_BOUNDS 32
+
+/** A counter: a value that only ever goes up. */
+typedef struct metrics_counter_t {
+  uint64_t value;
+} metrics_counter_t;
+
+/** A gauge: a value that can go up and down. */
+typedef struct metrics_gauge_t {
+  int64_t value;
+} metrics_gauge_t;
+
+/**
+ * A histogram of observed values, with a fixed set of bucket upper bounds.
+ * Observations are counted in the first bucket whose bound is at least as
+ * large as they are, or in the implicit "+Inf" bucket after the last bound.
+ */
+typedef struct metrics_histogram_t {
+  /** Array of <b>n_bounds</b> bucket upper bounds, in increasing order. */
+  const double *bounds;
+  int n_bounds;
+  /** Number of observations in each bucket, plus one for "+Inf".  These are
+   * not cumulative. */
+  uint64_t counts[METRICS_HISTOGRAM_MAX_BOUNDS + 1];
+  /** Sum of all observed values. */
+  double sum;
+} metrics_histogram_t;
+
+/** Static initializer for a metrics_histogram_t whose bucket bounds are the
+ * array <b>bounds</b>. */
+#define METRICS_HISTOGRAM_INIT(bounds) \
+  { (bounds), (int)ARRAY_LENGTH(bounds), { 0 }, 0.0 }
+
+/** A function that returns the current value of a metric, given the
+ * argument that it was registered with. */
+typedef uint64_t (*metrics_getter_fn_t)(const void *arg);
+
+/** Add <b>n</b> to the counter <b>c</b>. */
+static inline void
+metrics_counter_add(metrics_counter_t *c, uint64_t n)
+{
+  c->value += n;
+}
+
+/** Add one to the counter <b>c</b>. */
+static inline void
+metrics_counter_inc(metrics_counter_t *c)
+{
+  ++c->value;
+}
+
+/** Set the gauge <b>g</b> to <b>v</b>. */
+static inline void
+metrics_gauge_set(metrics_gauge_t *g, int64_t v)
+{
+  g->value = v;
+}
+
+/** Add <b>n</b>, which may be negative, to the gauge <b>g</b>. */
+static inline void
+metrics_gauge_add(metrics_gauge_t *g, int64_t n)
+{
+  g->value += n;
+}
+
+void metrics_histogram_observe(metrics_histogram_t *h, double v);
+void metrics_histogram_clear(metrics_histogram_t *h);
+uint64_t metrics_histogram_get_count(const metrics_histogram_t *h);
+double metrics_histogram_quantile(const metrics_histogram_t *h, double q);
+
+void metrics_register_counter(metrics_counter_t *c, const char *name,
+                              const char *help, const char *labels);
+void metrics_register_gauge(metrics_gauge_t *g, const char *name,
+                            const char *help, const char *labels);
+void metrics_register_histogram(metrics_histogram_t *h, const char *name,
+                                const char *help, const char *labels);
+void metrics_register_counter_fn(metrics_getter_fn_t fn, const void *arg,
+                                 const char *name, const char *help,
+                                 const char *labels);
+void metrics_register_gauge_fn(metrics_getter_fn_t fn, const void *arg,
+                               const char *name, const char *help,
+                               const char *labels);
+int metrics_get_n_registered(void);
+
+uint64_t metrics_read_u64(const void *arg);
+uint64_t metrics_read_u32(const void *arg);
+uint64_t metrics_read_smartlist_len(const void *arg);
+
+char *metrics_format_prometheus(void);
+void metrics_free_all(void);
+
+#endif /* !defined(TOR_METRICS_H) */
@@ -0,0 +1,363 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file profiler.c
+ * \brief Account for the time that the main loop spends in each callback.
+ *
+ * Every callback that the main loop runs -- mainloop_event_t handlers,
+ * periodic events, connection read and write callbacks, and reply queue
+ * processing -- has a profiler_entry_t, found by kind and name.  The
+ * callback's dispatcher wraps it in profiler_timer_start() and
+ * profiler_timer_stop(), which measure its wall-clock time with the
+ * monotonic clock, and its CPU time as well when MainloopStats is set.
+ *
+ * We also measure how late the main loop runs events that were scheduled
+ * or activated: when the loop is stuck in a slow callback, every other
+ * event waits, and that lag is what users see.
+ *
+ * Everything here runs in the main thread.
+ **/
+
+#include "orconfig.h"
+#include "common/profiler.h"
+#include "common/container.h"
+#include "common/metrics.h"
+#include "common/util.h"
+
+#include <time.h>
+
+/** Number of entries that we list in the heartbeat. */
+#define PROFILER_HEARTBEAT_N_ENTRIES 5
+
+struct profiler_entry_t {
+  profiler_kind_t kind;
+  /** "kind/name", as listed by the controller. */
+  char *name;
+  /** Totals since startup. */
+  uint64_t n_calls;
+  uint64_t usec_total;
+  uint64_t usec_max;
+  uint64_t cpu_usec_total;
+  /** Totals since the last heartbeat. */
+  uint64_t interval_n_calls;
+  uint64_t interval_usec_total;
+  uint64_t interval_usec_max;
+};
+
+/** Every profiler_entry_t, in creation order.  We only search it when a
+ * callback is created, and we can't use a strmap_t since some callbacks
+ * are created before we have initialized the siphash key. */
+static smartlist_t *profiler_entries = NULL;
+/** True iff we measure the CPU time of callbacks as well as their wall
+ * time. */
+static int profiler_cpu_time_enabled = 0;
+
+/** Upper bounds, in seconds, of the main loop lag histogram buckets. */
+static const double profiler_lag_bounds[] = {
+  0.001, 0.002, 0.004, 0.008, 0.016, 0.032, 0.064, 0.128, 0.256, 0.512,
+  1.024, 2.048, 4.096,
+};
+/** How late the main loop ran the events that were due. */
+static metrics_histogram_t profiler_lag =
+  METRICS_HISTOGRAM_INIT(profiler_lag_bounds);
+/** Largest lag since startup, in usec. */
+static uint64_t profiler_lag_max_usec = 0;
+/** Lag since the last heartbeat: count, total and maximum, in usec. */
+static uint64_t profiler_interval_lag_n = 0;
+static uint64_t profiler_interval_lag_usec_total = 0;
+static uint64_t profiler_interval_lag_usec_max = 0;
+
+/** Return the name of <b>kind</b>. */
+static const char *
+profiler_kind_to_string(profiler_kind_t kind)
+{
+  switch (kind) {
+    case PROFILER_KIND_EVENT: return "event";
+    case PROFILER_KIND_PERIODIC: return "periodic";
+    case PROFILER_KIND_CONN: return "conn";
+    case PROFILER_KIND_REPLYQUEUE: return "replyqueue";
+  }
+  tor_assert_nonfatal_unreached();
+  return "unknown";
+}
+
+/**
+ * Return the entry for the callback of kind <b>kind</b> called
+ * <b>name</b>, creating it if needed.  Spaces in <b>name</b> become
+ * underscores.  Entries last for the whole process.
+ *
+ * This is a linear search: callers should keep the entry rather than
+ * looking it up every time that the callback runs.
+ */
+profiler_entry_t *
+profiler_entry_get(profiler_kind_t kind, const char *name)
+{
+  profiler_entry_t *ent;
+  char *key = NULL;
+  char *cp;
+
+  tor_asprintf(&key, "%s/%s", profiler_kind_to_string(kind), name);
+  for (cp = key; *cp; ++cp) {
+    if (TOR_ISSPACE(*cp))
+      *cp = '_';
+  }
+
+  if (!profiler_entries)
+    profiler_entries = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(profiler_entries, profiler_entry_t *, e) {
+    if (!strcmp(e->name, key)) {
+      tor_free(key);
+      return e;
+    }
+  } SMARTLIST_FOREACH_END(e);
+
+  ent = tor_malloc_zero(sizeof(profiler_entry_t));
+  ent->kind = kind;
+  ent->name = key;
+  smartlist_add(profiler_entries, ent);
+  return ent;
+}
+
+/** Return the CPU time used so far by this thread, in usec, or -1 if we
+ * can't tell. */
+static int64_t
+profiler_get_thread_cpu_usec(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ((int64_t)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+#endif
+  return -1;
+}
+
+/** Start measuring a callback with <b>timer</b>. */
+void
+profiler_timer_start(profiler_timer_t *timer)
+{
+  monotime_get(&timer->start);
+  timer->cpu_start_usec =
+    profiler_cpu_time_enabled ? profiler_get_thread_cpu_usec() : -1;
+}
+
+/** Stop measuring a callback with <b>timer</b>, and charge the time that
+ * it took to <b>ent</b>. */
+void
+profiler_timer_stop(const profiler_timer_t *timer, profiler_entry_t *ent)
+{
+  monotime_t end;
+  int64_t usec;
+
+  monotime_get(&end);
+  usec = monotime_diff_usec(&timer->start, &end);
+  if (usec < 0)
+    usec = 0;
+
+  ++ent->n_calls;
+  ent->usec_total += usec;
+  if ((uint64_t)usec > ent->usec_max)
+    ent->usec_max = usec;
+  ++ent->interval_n_calls;
+  ent->interval_usec_total += usec;
+  if ((uint64_t)usec > ent->interval_usec_max)
+    ent->interval_usec_max = usec;
+
+  if (timer->cpu_start_usec >= 0) {
+    int64_t cpu_usec = profiler_get_thread_cpu_usec() - timer->cpu_start_usec;
+    if (cpu_usec > 0)
+      ent->cpu_usec_total += cpu_usec;
+  }
+}
+
+/** Note that the main loop ran an event <b>usec</b> microseconds after it
+ * was due. */
+void
+profiler_note_lag(int64_t usec)
+{
+  if (usec < 0)
+    usec = 0;
+  metrics_histogram_observe(&profiler_lag, usec / 1e6);
+  if ((uint64_t)usec > profiler_lag_max_usec)
+    profiler_lag_max_usec = usec;
+  ++profiler_interval_lag_n;
+  profiler_interval_lag_usec_total += usec;
+  if ((uint64_t)usec > profiler_interval_lag_usec_max)
+    profiler_interval_lag_usec_max = usec;
+}
+
+/** Measure the CPU time of callbacks iff <b>enabled</b>.  Reading the
+ * thread CPU clock is a system call on most platforms, so this is off by
+ * default. */
+void
+profiler_set_cpu_time_enabled(int enabled)
+{
+  profiler_cpu_time_enabled = enabled;
+}
+
+/** Return the number of times that the callback of <b>ent</b> ran. */
+uint64_t
+profiler_entry_get_n_calls(const profiler_entry_t *ent)
+{
+  return ent->n_calls;
+}
+
+/** Helper for sorting: order profiler_entry_t by total wall time, most
+ * first. */
+static int
+compare_entries_by_total_(const void **a_, const void **b_)
+{
+  const profiler_entry_t *a = *a_, *b = *b_;
+  if (a->usec_total != b->usec_total)
+    return a->usec_total > b->usec_total ? -1 : 1;
+  return strcmp(a->name, b->name);
+}
+
+/** Helper for sorting: order profiler_entry_t by their longest call since
+ * the last heartbeat, longest first. */
+static int
+compare_entries_by_interval_max_(const void **a_, const void **b_)
+{
+  const profiler_entry_t *a = *a_, *b = *b_;
+  if (a->interval_usec_max != b->interval_usec_max)
+    return a->interval_usec_max > b->interval_usec_max ? -1 : 1;
+  return strcmp(a->name, b->name);
+}
+
+/**
+ * Return a newly allocated string describing the main loop lag and every
+ * callback that has run, for the controller.  The first line describes the
+ * lag; then there is one line per callback, most expensive first.  Times
+ * are in msec.
+ */
+char *
+profiler_format_entries(void)
+{
+  smartlist_t *lines = smartlist_new();
+  smartlist_t *sorted = smartlist_new();
+  const uint64_t n_lag = metrics_histogram_get_count(&profiler_lag);
+  char *result;
+
+  smartlist_add_asprintf(lines, "lag count="U64_FORMAT" mean=%.1f p99=%.1f "
+                         "max=%.1f", U64_PRINTF_ARG(n_lag),
+                         n_lag ? 1000.0 * profiler_lag.sum /
+                                 U64_TO_DBL(n_lag) : 0.0,
+                         1000.0 * metrics_histogram_quantile(&profiler_lag,
+                                                             0.99),
+                         U64_TO_DBL(profiler_lag_max_usec) / 1000.0);
+
+  if (profiler_entries)
+    smartlist_add_all(sorted, profiler_entries);
+  smartlist_sort(sorted, compare_entries_by_total_);
+  SMARTLIST_FOREACH_BEGIN(sorted, const profiler_entry_t *, ent) {
+    if (!ent->n_calls)
+      continue;
+    smartlist_add_asprintf(lines, "%s calls="U64_FORMAT" wall=%.1f "
+                           "max=%.1f cpu=%.1f", ent->name,
+                           U64_PRINTF_ARG(ent->n_calls),
+                           U64_TO_DBL(ent->usec_total) / 1000.0,
+                           U64_TO_DBL(ent->usec_max) / 1000.0,
+                           U64_TO_DBL(ent->cpu_usec_total) / 1000.0);
+  } SMARTLIST_FOREACH_END(ent);
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  smartlist_free(sorted);
+  return result;
+}
+
+/**
+ * Return a newly allocated heartbeat message naming the callbacks that
+ * took the longest since the last heartbeat, and how late the main loop
+ * ran events; or NULL if no callback has run since then.  Start a new
+ * heartbeat interval.
+ */
+char *
+profiler_format_heartbeat(void)
+{
+  smartlist_t *sorted, *parts;
+  char *list, *result = NULL;
+
+  if (!profiler_entries)
+    return NULL;
+
+  sorted = smartlist_new();
+  parts = smartlist_new();
+  SMARTLIST_FOREACH(profiler_entries, profiler_entry_t *, ent,
+                    if (ent->interval_n_calls) smartlist_add(sorted, ent));
+  smartlist_sort(sorted, compare_entries_by_interval_max_);
+
+  SMARTLIST_FOREACH_BEGIN(sorted, const profiler_entry_t *, ent) {
+    if (ent_sl_idx == PROFILER_HEARTBEAT_N_ENTRIES)
+      break;
+    smartlist_add_asprintf(parts, "%s (max %.1f msec, "U64_FORMAT" calls, "
+                           "%.1f msec total)", ent->name,
+                           U64_TO_DBL(ent->interval_usec_max) / 1000.0,
+                           U64_PRINTF_ARG(ent->interval_n_calls),
+                           U64_TO_DBL(ent->interval_usec_total) / 1000.0);
+  } SMARTLIST_FOREACH_END(ent);
+
+  if (smartlist_len(parts)) {
+    list = smartlist_join_strings(parts, ", ", 0, NULL);
+    if (profiler_interval_lag_n) {
+      tor_asprintf(&result, "Main loop: the slowest callbacks since the last "
+                   "heartbeat were %s. Events ran up to %.1f msec late "
+                   "(%.1f msec on average).", list,
+                   U64_TO_DBL(profiler_interval_lag_usec_max) / 1000.0,
+                   U64_TO_DBL(profiler_interval_lag_usec_total) / 1000.0 /
+                   U64_TO_DBL(profiler_interval_lag_n));
+    } else {
+      tor_asprintf(&result, "Main loop: the slowest callbacks since the last "
+                   "heartbeat were %s.", list);
+    }
+    tor_free(list);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(profiler_entries, profiler_entry_t *, ent) {
+    ent->interval_n_calls = 0;
+    ent->interval_usec_total = 0;
+    ent->interval_usec_max = 0;
+  } SMARTLIST_FOREACH_END(ent);
+  profiler_interval_lag_n = 0;
+  profiler_interval_lag_usec_total = 0;
+  profiler_interval_lag_usec_max = 0;
+
+  SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+  smartlist_free(parts);
+  smartlist_free(sorted);
+  return result;
+}
+
+/** Register the main loop lag histogram with the metrics subsystem. */
+void
+profiler_register_metrics(void)
+{
+  metrics_register_histogram(&profiler_lag, "tor_mainloop_lag_seconds",
+                             "How late the main loop ran events that were "
+                             "due.", NULL);
+}
+
+/** Forget all measurements.
+ *
+ * We don't free the entries themselves: callbacks keep pointers to them,
+ * and some of those callbacks outlive tor_free_all(), such as the reply
+ * queues of threadpools that we never free. */
+void
+profiler_free_all(void)
+{
+  if (profiler_entries) {
+    SMARTLIST_FOREACH_BEGIN(profiler_entries, profiler_entry_t *, ent) {
+      const profiler_kind_t kind = ent->kind;
+      char *name = ent->name;
+      memset(ent, 0, sizeof(*ent));
+      ent->kind = kind;
+      ent->name = name;
+    } SMARTLIST_FOREACH_END(ent);
+  }
+  metrics_histogram_clear(&profiler_lag);
+  profiler_lag_max_usec = 0;
+  profiler_interval_lag_n = 0;
+  profiler_interval_lag_usec_total = 0;
+  profiler_interval_lag_usec_max = 0;
+}
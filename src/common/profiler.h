@@ -0,0 +1,54 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file profiler.h
+ * \brief Header for profiler.c
+ **/
+
+#ifndef TOR_PROFILER_H
+#define TOR_PROFILER_H
+
+#include "orconfig.h"
+#include "lib/cc/torint.h"
+#include "common/compat.h"
+
+/** The kinds of main loop callback that we profile. */
+typedef enum profiler_kind_t {
+  /** A mainloop_event_t handler. */
+  PROFILER_KIND_EVENT,
+  /** A periodic event's callback. */
+  PROFILER_KIND_PERIODIC,
+  /** A libevent read or write callback on a connection. */
+  PROFILER_KIND_CONN,
+  /** The processing of a threadpool's reply queue. */
+  PROFILER_KIND_REPLYQUEUE,
+} profiler_kind_t;
+
+/** The time spent in one main loop callback. */
+typedef struct profiler_entry_t profiler_entry_t;
+
+/** A running measurement, from profiler_timer_start() to
+ * profiler_timer_stop(). */
+typedef struct profiler_timer_t {
+  monotime_t start;
+  /** Thread CPU time at the start, in usec, or -1 if we are not measuring
+   * CPU time. */
+  int64_t cpu_start_usec;
+} profiler_timer_t;
+
+profiler_entry_t *profiler_entry_get(profiler_kind_t kind, const char *name);
+
+void profiler_timer_start(profiler_timer_t *timer);
+void profiler_timer_stop(const profiler_timer_t *timer,
+                         profiler_entry_t *ent);
+void profiler_note_lag(int64_t usec);
+void profiler_set_cpu_time_enabled(int enabled);
+
+uint64_t profiler_entry_get_n_calls(const profiler_entry_t *ent);
+char *profiler_format_entries(void);
+char *profiler_format_heartbeat(void);
+void profiler_register_metrics(void);
+void profiler_free_all(void);
+
+#endif /* !defined(TOR_PROFILER_H) */
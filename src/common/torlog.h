@@ -157,6 +157,9 @@ int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 typedef void (*pending_callback_callback)(void);
 void logs_set_pending_callback_callback(pending_callback_callback cb);
 void logs_set_domain_logging(int enabled);
+int logs_set_async(int enabled);
+void logs_flush_async(void);
+uint64_t logs_get_n_async_dropped(void);
 int get_min_log_level(void);
 void switch_logs_debug(void);
 void logs_free_all(void);
@@ -9,13 +9,22 @@
  * for them to send answers back to the main thread.
  *
  * The main structure here is a threadpool_t : it manages a set of worker
- * threads, a queue of pending work, and a reply queue.  Every piece of work
- * is a workqueue_entry_t, containing data to process and a function to
- * process it with.
+ * threads, each with its own queues of pending work, and a reply queue.
+ * Every piece of work is a workqueue_entry_t, containing data to process and
+ * a function to process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in compat_threads.c.
+ * The main thread hands each piece of work to one worker thread, preferring
+ * threads that are idle, and wakes it with that thread's condition variable.
+ * A worker that runs out of work of its own takes work from the queues of
+ * the other threads in its pool ("work stealing"), so that no thread sits
+ * idle while another has a backlog.  Since each queue has its own lock, the
+ * workers don't all contend on one lock when work arrives in bursts.
+ *
+ * The workers inform the main process of completed work by using an
+ * alert_sockets_t object, as implemented in compat_threads.c.  A worker that
+ * has more work queued hands its replies over a few at a time, and the main
+ * thread takes all the pending replies at once, so that neither side takes
+ * the reply queue's lock once per reply.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -27,6 +36,7 @@
 #include "common/compat.h"
 #include "common/compat_libevent.h"
 #include "common/compat_threads.h"
+#include "common/profiler.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "common/util.h"
 #include "common/workqueue.h"
@@ -44,21 +54,13 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_s {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.  Once the threads are running, this array never moves, and its
+   * first n_threads elements never change. */
   struct workerthread_s **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
-  tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
-
-  /** Weak RNG, used to decide when to ignore priority. */
-  tor_weak_rng_t weak_rng;
-
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
+   * at an earlier generation needs to run the update function.  Only the
+   * main thread changes this. */
   unsigned generation;
 
   /** Function that should be run for updates on each thread. */
@@ -70,12 +72,21 @@ struct threadpool_s {
   /** Event to notice when another thread has sent a reply. */
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
+  /** Where we account for the time that we spend processing replies. */
+  profiler_entry_t *reply_profile;
 
   /** Number of elements in threads. */
   int n_threads;
+  /** Number of entries that are queued on some thread, and that no worker
+   * has started yet. */
+  atomic_counter_t n_queued;
   /** Mutex to protect all the above fields. */
   tor_mutex_t lock;
 
+  /** Index of the thread to which we'll give the next piece of work, if no
+   * thread is idle.  Only used by the main thread. */
+  int next_thread;
+
   /** A reply queue to use when constructing new threads. */
   replyqueue_t *reply_queue;
 
@@ -98,6 +109,12 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
+  /** The worker thread on whose queue this entry was put.  The entry stays
+   * on that queue until a worker (this one or another) takes it. */
+  struct workerthread_s *on_thread;
+  /** The update generation of the pool when this entry was queued: a thread
+   * must run any update older than the entry before running the entry. */
+  unsigned generation;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
   /** Priority of this entry. */
@@ -135,9 +152,36 @@ typedef struct workerthread_s {
   unsigned generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
+
+  /** Mutex to protect work, weak_rng and update_pending.  Other threads
+   * acquire it to steal work from this thread. */
+  tor_mutex_t lock;
+  /** Condition variable that we wait on when we have no work, and which
+   * gets signaled when work is queued for this thread. */
+  tor_cond_t condition;
+  /** Queues of pending work for this thread. The queue with priority
+   * <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** Weak RNG, used to decide when to ignore priority. */
+  tor_weak_rng_t weak_rng;
+  /** True iff the main thread has queued an update since this thread last
+   * looked for one. */
+  unsigned int update_pending : 1;
+
+  /** 1 if this thread has run out of work and may be waiting for more.  The
+   * main thread sets it back to 0 when it claims this thread for new work.
+   * Accessed without holding any lock. */
+  atomic_counter_t idle;
+
+  /** Replies that this thread has finished but not yet put on its reply
+   * queue, and how many of them there are.  Only used by this thread. */
+  work_tailq_t replies;
+  int n_replies;
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+/** A worker thread with more work queued puts its replies on the reply queue
+ * once it has this many. */
+#define WORKQUEUE_REPLY_BATCH 4
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -190,14 +234,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&ent->on_pool->n_queued, 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -205,36 +251,41 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
-
-   must hold lock */
+/** Return true iff <b>thread</b> has work in its own queues, or an update
+ * to look at.
+ *
+ * The caller must hold the thread's lock. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
+    if (!TOR_TAILQ_EMPTY(&thread->work[i]))
         return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return thread->update_pending;
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
+/** Extract the next workqueue_entry_t from the queues of <b>owner</b>,
+ * removing it from the relevant queue and marking it as non-pending.  Ignore
+ * priority with probability 1/<b>lower_priority_chance</b> at each level.  If
+ * <b>max_generation</b> is nonnegative, return NULL instead of an entry that
+ * was queued after update <b>max_generation</b>.
  *
- * The caller must hold the lock. */
+ * The caller must hold the owner's lock. */
 static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+worker_thread_extract_next_work(workerthread_t *owner,
+                                int32_t lower_priority_chance,
+                                int64_t max_generation)
 {
-  threadpool_t *pool = thread->in_pool;
   work_tailq_t *queue = NULL, *this_queue;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
+    this_queue = &owner->work[i];
     if (!TOR_TAILQ_EMPTY(this_queue)) {
       queue = this_queue;
-      if (! tor_weak_random_one_in_n(&pool->weak_rng,
-                                     thread->lower_priority_chance)) {
+      if (! tor_weak_random_one_in_n(&owner->weak_rng,
+                                     lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
          * and use the queue where we found work. But with a small
          * probability, we'll keep looking for lower priority work, so that
@@ -248,11 +299,104 @@ worker_thread_extract_next_work(workerthread_t *thread)
     return NULL;
 
   workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
+  if (max_generation >= 0 &&
+      (int)(work->generation - (unsigned)max_generation) > 0)
+    return NULL;
   TOR_TAILQ_REMOVE(queue, work, next_work);
   work->pending = 0;
+  atomic_counter_sub(&owner->in_pool->n_queued, 1);
+  return work;
+}
+
+/** Try to take a piece of work from the queue of another thread in the
+ * same pool as <b>thread</b>.  Return it, or NULL if we found none.
+ *
+ * The caller must not hold any lock. */
+static workqueue_entry_t *
+worker_thread_steal_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work = NULL;
+  int i, n_threads;
+
+  tor_mutex_acquire(&pool->lock);
+  n_threads = pool->n_threads;
+  tor_mutex_release(&pool->lock);
+
+  for (i = 1; i < n_threads && work == NULL; ++i) {
+    workerthread_t *victim = pool->threads[(thread->index + i) % n_threads];
+    tor_mutex_acquire(&victim->lock);
+    /* Don't take work that was queued after an update that we haven't run
+     * yet: the update might be telling us not to do it. */
+    work = worker_thread_extract_next_work(victim,
+                                           thread->lower_priority_chance,
+                                           thread->generation);
+    tor_mutex_release(&victim->lock);
+  }
+
   return work;
 }
 
+/** Run the most recent update of <b>thread</b>'s pool in <b>thread</b>, if
+ * it hasn't run it yet.  Return the update function's result.
+ *
+ * The caller must not hold any lock. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_reply_t (*update_fn)(void*,void*);
+  void *arg;
+
+  tor_mutex_acquire(&pool->lock);
+  if (thread->generation == pool->generation) {
+    tor_mutex_release(&pool->lock);
+    return WQ_RPL_REPLY;
+  }
+  arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  update_fn = pool->update_fn;
+  thread->generation = pool->generation;
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
+/** Put all the replies that <b>thread</b> has been holding on its reply
+ * queue, and wake up the main thread if it needs to know. */
+static void
+worker_thread_flush_replies(workerthread_t *thread)
+{
+  replyqueue_t *queue = thread->reply_queue;
+  int was_empty;
+
+  if (TOR_TAILQ_EMPTY(&thread->replies))
+    return;
+
+  tor_mutex_acquire(&queue->lock);
+  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
+  TOR_TAILQ_CONCAT(&queue->answers, &thread->replies, next_work);
+  tor_mutex_release(&queue->lock);
+  thread->n_replies = 0;
+
+  if (was_empty) {
+    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+      /* XXXX complain! */
+    }
+  }
+}
+
+/** Note that <b>thread</b> has finished <b>work</b>, and pass the reply on
+ * to the main thread, unless we're holding it to deliver with others.  The
+ * reply must not currently be on any thread's work queue. */
+static void
+worker_thread_add_reply(workerthread_t *thread, workqueue_entry_t *work)
+{
+  TOR_TAILQ_INSERT_TAIL(&thread->replies, work, next_work);
+  if (++thread->n_replies >= WORKQUEUE_REPLY_BATCH)
+    worker_thread_flush_replies(thread);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -260,96 +404,110 @@ static void
 worker_thread_main(void *thread_)
 {
   workerthread_t *thread = thread_;
-  threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  int is_idle = 0;
 
-  tor_mutex_acquire(&pool->lock);
+  tor_mutex_acquire(&thread->lock);
   while (1) {
     /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
+    if (thread->update_pending) {
+      thread->update_pending = 0;
+      tor_mutex_release(&thread->lock);
 
-        tor_mutex_acquire(&pool->lock);
-        continue;
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        worker_thread_flush_replies(thread);
+        return;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
-
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
-      result = work->fn(thread->state, work->arg);
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+      tor_mutex_acquire(&thread->lock);
+      continue;
+    }
 
-      /* We may need to exit the thread. */
-      if (result != WQ_RPL_REPLY) {
-        return;
+    work = worker_thread_extract_next_work(thread,
+                                           thread->lower_priority_chance, -1);
+    tor_mutex_release(&thread->lock);
+
+    if (work == NULL) {
+      /* There is no work in this thread's queue.  The main thread is
+       * waiting for the replies we've been holding, so send them now.
+       * Then tell the main thread that we're available, and see if another
+       * thread has work that we can do. */
+      worker_thread_flush_replies(thread);
+      if (!is_idle) {
+        atomic_counter_exchange(&thread->idle, 1);
+        is_idle = 1;
+      }
+      work = worker_thread_steal_work(thread);
+      if (work == NULL) {
+        tor_mutex_acquire(&thread->lock);
+        /* The main thread may have given us work since we looked.  It does
+         * that while holding our lock, so we can't miss its signal. */
+        if (!worker_thread_has_work(thread)) {
+          /* TODO: support an idle-function */
+
+          /* Okay. Now, wait till somebody has work for us. */
+          if (tor_cond_wait(&thread->condition, &thread->lock, NULL) < 0) {
+            log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+          }
+        }
+        continue;
       }
-      tor_mutex_acquire(&pool->lock);
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
-
-    /* TODO: support an idle-function */
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    if (is_idle) {
+      atomic_counter_exchange(&thread->idle, 0);
+      is_idle = 0;
     }
-  }
-}
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
-static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
-{
-  int was_empty;
-  tor_mutex_acquire(&queue->lock);
-  was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
-  tor_mutex_release(&queue->lock);
+    /* We run the work function without holding any lock. This is the main
+     * thread's first opportunity to give us more work. */
+    result = work->fn(thread->state, work->arg);
 
-  if (was_empty) {
-    if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
-      /* XXXX complain! */
+    /* Queue the reply for the main thread. */
+    worker_thread_add_reply(thread, work);
+
+    /* We may need to exit the thread. */
+    if (result != WQ_RPL_REPLY) {
+      worker_thread_flush_replies(thread);
+      return;
     }
+    tor_mutex_acquire(&thread->lock);
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate and start a new worker thread with index <b>index</b> in
+ * <b>pool</b>, to use state object <b>state</b>, and send responses to
+ * <b>replyqueue</b>. */
 static workerthread_t *
-workerthread_new(int32_t lower_priority_chance,
+workerthread_new(int index, int32_t lower_priority_chance,
                  void *state, threadpool_t *pool, replyqueue_t *replyqueue)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  unsigned i, seed;
+  thr->index = index;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
 
+  tor_mutex_init_for_cond(&thr->lock);
+  tor_cond_init(&thr->condition);
+  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+  }
+  crypto_rand((void*)&seed, sizeof(seed));
+  tor_init_weak_random(&thr->weak_rng, seed);
+  atomic_counter_init(&thr->idle);
+  TOR_TAILQ_INIT(&thr->replies);
+
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
+    atomic_counter_destroy(&thr->idle);
+    tor_cond_uninit(&thr->condition);
+    tor_mutex_uninit(&thr->lock);
     tor_free(thr);
     return NULL;
     //LCOV_EXCL_STOP
@@ -358,6 +516,32 @@ workerthread_new(int32_t lower_priority_chance,
   return thr;
 }
 
+/** Return the worker thread in <b>pool</b> that should get the next piece
+ * of work: an idle thread if there is one, or else the next thread in turn.
+ * Only the main thread may call this. */
+static workerthread_t *
+threadpool_choose_thread(threadpool_t *pool)
+{
+  const int n_threads = pool->n_threads;
+  workerthread_t *thr;
+  int i;
+
+  for (i = 0; i < n_threads; ++i) {
+    thr = pool->threads[(pool->next_thread + i) % n_threads];
+    /* Claim the thread, so that we don't give all of a burst of work to
+     * the same idle thread. */
+    if (atomic_counter_get(&thr->idle) &&
+        atomic_counter_exchange(&thr->idle, 0)) {
+      pool->next_thread = (pool->next_thread + i + 1) % n_threads;
+      return thr;
+    }
+  }
+
+  thr = pool->threads[pool->next_thread];
+  pool->next_thread = (pool->next_thread + 1) % n_threads;
+  return thr;
+}
+
 /**
  * Queue an item of work for a thread in a thread pool.  The function
  * <b>fn</b> will be run in a worker thread, and will receive as arguments the
@@ -379,6 +563,8 @@ workerthread_new(int32_t lower_priority_chance,
  *
  * Note that because of priorities and thread behavior, work items may not
  * be executed strictly in order.
+ *
+ * Only the main thread may queue work.
  */
 workqueue_entry_t *
 threadpool_queue_work_priority(threadpool_t *pool,
@@ -391,17 +577,22 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thr = threadpool_choose_thread(pool);
   ent->on_pool = pool;
+  ent->on_thread = thr;
+  /* We're the only thread that changes the generation. */
+  ent->generation = pool->generation;
   ent->pending = 1;
   ent->priority = prio;
+  atomic_counter_add(&pool->n_queued, 1);
 
-  tor_mutex_acquire(&pool->lock);
+  tor_mutex_acquire(&thr->lock);
 
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
+  TOR_TAILQ_INSERT_TAIL(&thr->work[prio], ent, next_work);
 
-  tor_cond_signal_one(&pool->condition);
+  tor_cond_signal_one(&thr->condition);
 
-  tor_mutex_release(&pool->lock);
+  tor_mutex_release(&thr->lock);
 
   return ent;
 }
@@ -461,7 +652,13 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_fn = fn;
   ++pool->generation;
 
-  tor_cond_signal_all(&pool->condition);
+  for (i = 0; i < n_threads; ++i) {
+    workerthread_t *thr = pool->threads[i];
+    tor_mutex_acquire(&thr->lock);
+    thr->update_pending = 1;
+    tor_cond_signal_one(&thr->condition);
+    tor_mutex_release(&thr->lock);
+  }
 
   tor_mutex_release(&pool->lock);
 
@@ -498,9 +695,11 @@ threadpool_start_threads(threadpool_t *pool, int n)
 
   tor_mutex_acquire(&pool->lock);
 
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
+  /* Running threads read the array to steal work, so we can't move it. */
+  if (pool->threads == NULL)
+    pool->threads = tor_calloc(n, sizeof(workerthread_t*));
+  else if (BUG(n > pool->n_threads))
+    n = pool->n_threads; // LCOV_EXCL_LINE
 
   while (pool->n_threads < n) {
     /* For half of our threads, we'll choose lower priorities permissively;
@@ -509,7 +708,7 @@ threadpool_start_threads(threadpool_t *pool, int n)
     int32_t chance = (pool->n_threads & 1) ? CHANCE_STRICT : CHANCE_PERMISSIVE;
 
     void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
-    workerthread_t *thr = workerthread_new(chance,
+    workerthread_t *thr = workerthread_new(pool->n_threads, chance,
                                            state, pool, pool->reply_queue);
 
     if (!thr) {
@@ -520,7 +719,6 @@ threadpool_start_threads(threadpool_t *pool, int n)
       return -1;
       //LCOV_EXCL_STOP
     }
-    thr->index = pool->n_threads;
     pool->threads[pool->n_threads++] = thr;
   }
   tor_mutex_release(&pool->lock);
@@ -545,16 +743,7 @@ threadpool_new(int n_threads,
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
-  tor_cond_init(&pool->condition);
-  unsigned i;
-  for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
-  }
-  {
-    unsigned seed;
-    crypto_rand((void*)&seed, sizeof(seed));
-    tor_init_weak_random(&pool->weak_rng, seed);
-  }
+  atomic_counter_init(&pool->n_queued);
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
@@ -564,7 +753,7 @@ threadpool_new(int n_threads,
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
-    tor_cond_uninit(&pool->condition);
+    atomic_counter_destroy(&pool->n_queued);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
     return NULL;
@@ -574,6 +763,15 @@ threadpool_new(int n_threads,
   return pool;
 }
 
+/** Return the number of work entries, from every user of <b>pool</b>, that
+ * are waiting for a worker thread to start them.  Work that a thread is
+ * running right now doesn't count. */
+int
+threadpool_get_n_queued(threadpool_t *pool)
+{
+  return (int) atomic_counter_get(&pool->n_queued);
+}
+
 /** Return the reply queue associated with a given thread pool. */
 replyqueue_t *
 threadpool_get_replyqueue(threadpool_t *tp)
@@ -610,11 +808,14 @@ static void
 reply_event_cb(evutil_socket_t sock, short events, void *arg)
 {
   threadpool_t *tp = arg;
+  profiler_timer_t timer;
   (void) sock;
   (void) events;
+  profiler_timer_start(&timer);
   replyqueue_process(tp->reply_queue);
   if (tp->reply_cb)
     tp->reply_cb(tp);
+  profiler_timer_stop(&timer, tp->reply_profile);
 }
 
 /** Register the threadpool <b>tp</b>'s reply queue with the libevent
@@ -638,6 +839,8 @@ threadpool_register_reply_event(threadpool_t *tp,
                                   tp);
   tor_assert(tp->reply_event);
   tp->reply_cb = cb;
+  tp->reply_profile = profiler_entry_get(PROFILER_KIND_REPLYQUEUE,
+                                         "replyqueue");
   return event_add(tp->reply_event, NULL);
 }
 
@@ -659,20 +862,22 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  /* Take all the answers at once, so that the workers can keep adding
+   * answers while we handle these.  Any answer that arrives after this
+   * will alert us again. */
+  work_tailq_t answers;
+  TOR_TAILQ_INIT(&answers);
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  TOR_TAILQ_CONCAT(&answers, &queue->answers, next_work);
+  tor_mutex_release(&queue->lock);
+
+  while (!TOR_TAILQ_EMPTY(&answers)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&answers);
+    TOR_TAILQ_REMOVE(&answers, work, next_work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
 
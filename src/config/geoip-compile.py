@@ -0,0 +1,197 @@
+#!/usr/bin/python3
+
+#   This software has been dedicated to the public domain under the CC0
+#   public domain dedication.
+#
+#   To the extent possible under law, the person who associated CC0
+#   with geoip-compile.py has waived all copyright and related or
+#   neighboring rights to geoip-compile.py.
+#
+#   You should have received a copy of the CC0 legalcode along with this
+#   work in doc/cc0.txt.  If not, see
+#      <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+"""Compile one of Tor's text geoip or geoip6 files into a binary database
+   that Tor can map into memory and use without parsing it.
+
+   Usage: geoip-compile.py [--byte-order=native|little|big] INPUT OUTPUT
+
+   The address family is detected from the input.  Point GeoIPFile or
+   GeoIPv6File at the output instead of the text file; Tor recognizes the
+   compiled format by its magic number.  A compiled database only works on
+   machines with the byte order it was compiled for, which is the byte
+   order of this machine unless you say otherwise.
+
+   The format is described in geoip_load_compiled_file() in src/or/geoip.c.
+   The index this script builds must match the one that Tor would build
+   for itself in geoip_ipv4_table_build_index() and
+   geoip_ipv6_table_build_index().
+"""
+
+import hashlib
+import socket
+import struct
+import sys
+
+MAGIC = b'TORGEOIP'
+VERSION = 1
+BYTE_ORDER_MARK = 0x01020304
+
+IPV4_INDEX_BITS = 16
+IPV4_INDEX_SIZE = 1 << IPV4_INDEX_BITS
+
+IPV6_TRIE_STRIDE = 4
+IPV6_TRIE_FANOUT = 1 << IPV6_TRIE_STRIDE
+IPV6_TRIE_MAX_DEPTH = 128 // IPV6_TRIE_STRIDE
+IPV6_TRIE_LEAF_MAX = 8
+IPV6_TRIE_CHILD = 1 << 31
+
+def parse_line(line):
+    """Parse one line of a geoip or geoip6 file.  Return a tuple of
+       (family, low, high, country), or None for blank lines and comments.
+       Addresses are returned as integers."""
+    line = line.strip()
+    if not line or line.startswith('#'):
+        return None
+    fields = [f.strip('"') for f in line.split(',')]
+    if ':' in fields[0]:
+        low = int.from_bytes(socket.inet_pton(socket.AF_INET6, fields[0]),
+                             'big')
+        high = int.from_bytes(socket.inet_pton(socket.AF_INET6, fields[1]),
+                              'big')
+        return (6, low, high, fields[2])
+    return (4, int(fields[0]), int(fields[1]), fields[2])
+
+def read_entries(fname):
+    """Read a geoip or geoip6 file.  Return the address family, the SHA1
+       digest of the file, and a list of (low, high, country) tuples."""
+    content = open(fname, 'rb').read()
+    family = None
+    entries = []
+    for line in content.decode('ascii').split('\n'):
+        parsed = parse_line(line)
+        if parsed is None:
+            continue
+        fam, low, high, cc = parsed
+        if family is None:
+            family = fam
+        elif fam != family:
+            raise ValueError("Mixed address families in %s" % fname)
+        # Tor only loads codes of two letters or digits, such as the
+        # legacy "A1", or "??".
+        if (len(cc) != 2 or not (cc == '??' or cc.isalnum()) or
+                not cc.isascii() or high < low):
+            raise ValueError("Bad line in %s: %r" % (fname, line))
+        entries.append((low, high, cc.lower()))
+    if family is None:
+        raise ValueError("No entries in %s" % fname)
+    return family, hashlib.sha1(content).digest(), entries
+
+def sort_entries(entries):
+    """Sort entries by their low address, and drop any entry that overlaps
+       an earlier one, as Tor does."""
+    result = []
+    for ent in sorted(entries, key=lambda e: e[0]):
+        if result and ent[0] <= result[-1][1]:
+            continue
+        result.append(ent)
+    return result
+
+def build_ipv4_index(entries):
+    """Return the direct index for a sorted list of IPv4 entries: for each
+       /16 prefix, the position of the first entry whose high address is in
+       that prefix or a later one."""
+    index = []
+    i = 0
+    for prefix in range(IPV4_INDEX_SIZE):
+        prefix_low = prefix << (32 - IPV4_INDEX_BITS)
+        while i < len(entries) and entries[i][1] < prefix_low:
+            i += 1
+        index.append(i)
+    index.append(len(entries))
+    return index
+
+def build_ipv6_node(nodes, entries, prefix, depth, lo, hi):
+    """Add a trie node for the addresses starting with the first 'depth'
+       groups of 'prefix', whose overlapping entries are entries[lo:hi].
+       Return the position of the new node in 'nodes'."""
+    node_idx = len(nodes)
+    nodes.append(None)
+    first = [0] * IPV6_TRIE_FANOUT
+    count = [0] * IPV6_TRIE_FANOUT
+    shift = 128 - IPV6_TRIE_STRIDE * (depth + 1)
+    start = end = lo
+    for slot in range(IPV6_TRIE_FANOUT):
+        slot_lo = prefix | (slot << shift)
+        slot_hi = slot_lo | ((1 << shift) - 1)
+        while start < hi and entries[start][1] < slot_lo:
+            start += 1
+        end = max(end, start)
+        while end < hi and entries[end][0] <= slot_hi:
+            end += 1
+        first[slot] = start
+        if end - start > IPV6_TRIE_LEAF_MAX and depth + 1 < IPV6_TRIE_MAX_DEPTH:
+            count[slot] = IPV6_TRIE_CHILD | build_ipv6_node(
+                nodes, entries, slot_lo, depth + 1, start, end)
+        else:
+            count[slot] = end - start
+    nodes[node_idx] = (first, count)
+    return node_idx
+
+def compile_db(family, digest, entries, order):
+    """Return the compiled database for the sorted 'entries' as bytes."""
+    countries = []
+    country_num = {}
+    for ent in entries:
+        if ent[2] not in country_num:
+            country_num[ent[2]] = len(countries)
+            countries.append(ent[2])
+
+    if family == 4:
+        index = build_ipv4_index(entries)
+        n_index = len(index)
+    else:
+        nodes = []
+        build_ipv6_node(nodes, entries, 0, 0, 0, len(entries))
+        n_index = len(nodes)
+
+    out = [MAGIC,
+           struct.pack(order + "LLLLLL", BYTE_ORDER_MARK, VERSION, family,
+                       len(countries), len(entries), n_index),
+           digest, b'\0' * 12]
+    cc = "".join(countries).encode('ascii')
+    out.append(cc + b'\0' * (-len(cc) % 4))
+    for low, high, c in entries:
+        if family == 4:
+            out.append(struct.pack(order + "LLL", low, high, country_num[c]))
+        else:
+            out.append(low.to_bytes(16, 'big') + high.to_bytes(16, 'big') +
+                       struct.pack(order + "L", country_num[c]))
+    if family == 4:
+        out.append(struct.pack(order + "%dL" % len(index), *index))
+    else:
+        for first, count in nodes:
+            out.append(struct.pack(order + "%dL" % (2 * IPV6_TRIE_FANOUT),
+                                   *(first + count)))
+    return b''.join(out)
+
+def main(argv):
+    order = "="
+    args = []
+    for arg in argv[1:]:
+        if arg.startswith("--byte-order="):
+            order = { "native": "=", "little": "<",
+                      "big": ">" }[arg[len("--byte-order="):]]
+        else:
+            args.append(arg)
+    if len(args) != 2:
+        sys.stderr.write(__doc__)
+        return 1
+    family, digest, entries = read_entries(args[0])
+    entries = sort_entries(entries)
+    with open(args[1], 'wb') as f:
+        f.write(compile_db(family, digest, entries, order))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
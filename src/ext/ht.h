@@ -578,6 +578,309 @@ ht_string_hash(const char *s)
     ++((head)->hth_n_entries);                              \
   }
 
+/*
+  The OAHT_ macros provide an open-addressing variant of the above, for
+  small elements that are looked up often.  Instead of chaining separately
+  allocated elements, the table stores the elements themselves in one
+  array and probes it linearly, with the hash of each slot kept in a
+  parallel array so that a probe only has to look at the element when the
+  hashes match.  Elements don't need an HT_ENTRY(), and inserting one
+  doesn't allocate anything unless the table has to grow.
+
+  The price is that elements move: a pointer to an element in the table is
+  only good until the next insertion.  Removing an element only marks its
+  slot, so you can remove elements while iterating over the table.
+
+     OAHT_HEAD(dinosaur_oaht, dinosaur);
+     OAHT_PROTOTYPE(dinosaur_oaht, dinosaur, dinosaur_hash, dinosaurs_equal);
+     OAHT_GENERATE(dinosaur_oaht, dinosaur, dinosaur_hash, dinosaurs_equal,
+                   0.75, tor_reallocarray_, tor_free_);
+
+     int inserted;
+     struct dinosaur *d = OAHT_FIND_OR_INSERT(dinosaur_oaht, dinos, &key,
+                                              &inserted);
+
+  OAHT_FIND_OR_INSERT copies the key element into the table if there was no
+  match; the caller fills in the rest of the new element.
+ */
+
+#define OAHT_HEAD(name, type)                                           \
+  struct name {                                                         \
+    /* The elements themselves. */                                      \
+    struct type *hth_table;                                             \
+    /* The hash of the element in each slot, or OAHT_EMPTY_ if the slot \
+     * has never been used, or OAHT_REMOVED_ if its element was removed. */ \
+    unsigned *hth_hashes;                                               \
+    /* How many slots are there?  Zero, or a power of two. */           \
+    unsigned hth_table_length;                                          \
+    /* How many elements does the table contain? */                     \
+    unsigned hth_n_entries;                                             \
+    /* How many slots hold an element or a removed marker? */           \
+    unsigned hth_n_used;                                                \
+    /* How many slots will we use before rebuilding the table? */       \
+    unsigned hth_load_limit;                                            \
+  }
+
+#define OAHT_INITIALIZER()                      \
+  { NULL, NULL, 0, 0, 0, 0 }
+
+/* Markers for slots without an element. */
+#define OAHT_EMPTY_ 0u
+#define OAHT_REMOVED_ 1u
+/* The hash that we store for an element: never one of the markers. */
+#define OAHT_STORED_HASH_(h) ((h) > OAHT_REMOVED_ ? (h) : (h) + 2)
+/* The smallest table that we allocate. */
+#define OAHT_MIN_LENGTH_ 16u
+
+#define OAHT_EMPTY(head)                        \
+  (((head)->hth_n_entries == 0) || 0)
+
+/* How many elements in 'head'? */
+#define OAHT_SIZE(head)                         \
+  ((head)->hth_n_entries)
+
+/* Return memory usage for a hashtable (not counting the head). */
+#define OAHT_MEM_USAGE(name, head)              \
+  (name##_OAHT_MEM_USAGE(head))
+
+#define OAHT_FIND(name, head, elm)     name##_OAHT_FIND((head), (elm))
+#define OAHT_FIND_OR_INSERT(name, head, elm, inserted)        \
+  name##_OAHT_FIND_OR_INSERT((head), (elm), (inserted))
+#define OAHT_REMOVE(name, head, elm, out)                     \
+  name##_OAHT_REMOVE((head), (elm), (out))
+#define OAHT_REMOVE_AT(name, head, elm) name##_OAHT_REMOVE_AT((head), (elm))
+#define OAHT_START(name, head)         name##_OAHT_NEXT_FROM_((head), 0)
+#define OAHT_NEXT(name, head, elm)                            \
+  name##_OAHT_NEXT_FROM_((head), (unsigned)((elm) - (head)->hth_table) + 1)
+#define OAHT_CLEAR(name, head)         name##_OAHT_CLEAR(head)
+#define OAHT_INIT(name, head)          name##_OAHT_INIT(head)
+#define OAHT_REP_IS_BAD_(name, head)   name##_OAHT_REP_IS_BAD_(head)
+
+#define OAHT_PROTOTYPE(name, type, hashfn, eqfn)                        \
+  int name##_OAHT_GROW(struct name *head, unsigned size);               \
+  void name##_OAHT_CLEAR(struct name *head);                            \
+  int name##_OAHT_REP_IS_BAD_(const struct name *head);                 \
+  static inline void                                                    \
+  name##_OAHT_INIT(struct name *head) {                                 \
+    head->hth_table = NULL;                                             \
+    head->hth_hashes = NULL;                                            \
+    head->hth_table_length = 0;                                         \
+    head->hth_n_entries = 0;                                            \
+    head->hth_n_used = 0;                                               \
+    head->hth_load_limit = 0;                                           \
+  }                                                                     \
+  static inline size_t                                                  \
+  name##_OAHT_MEM_USAGE(const struct name *head) {                      \
+    return (size_t)head->hth_table_length *                             \
+      (sizeof(struct type) + sizeof(unsigned));                         \
+  }                                                                     \
+  /* Helper: return the element in 'head' that matches 'elm', whose     \
+   * stored hash is 'h', or NULL if there is none. */                   \
+  static inline struct type *                                           \
+  name##_OAHT_FIND_H_(const struct name *head, const struct type *elm,  \
+                      unsigned h)                                       \
+  {                                                                     \
+    unsigned mask, i;                                                   \
+    if (!head->hth_table_length)                                        \
+      return NULL;                                                      \
+    mask = head->hth_table_length - 1;                                  \
+    /* This terminates because the load limit keeps one slot empty. */  \
+    for (i = h & mask; head->hth_hashes[i] != OAHT_EMPTY_;              \
+         i = (i + 1) & mask) {                                          \
+      if (head->hth_hashes[i] == h && eqfn(&head->hth_table[i], elm))   \
+        return &head->hth_table[i];                                     \
+    }                                                                   \
+    return NULL;                                                        \
+  }                                                                     \
+  /* Return a pointer to the element in 'head' that matches 'elm', or   \
+   * NULL if there is none. */                                          \
+  static inline struct type *                                           \
+  name##_OAHT_FIND(const struct name *head, const struct type *elm)     \
+  {                                                                     \
+    unsigned h = hashfn(elm);                                           \
+    h = OAHT_STORED_HASH_(h);                                           \
+    return name##_OAHT_FIND_H_(head, elm, h);                           \
+  }                                                                     \
+  /* Return a pointer to the element in 'head' that matches 'elm'.  If  \
+   * there is none, copy 'elm' into the table and return a pointer to   \
+   * the copy.  Set *inserted_out to true iff we inserted 'elm'. */     \
+  static inline struct type *                                           \
+  name##_OAHT_FIND_OR_INSERT(struct name *head, const struct type *elm, \
+                             int *inserted_out)                         \
+  {                                                                     \
+    unsigned h = hashfn(elm), mask, i;                                  \
+    struct type *found;                                                 \
+    h = OAHT_STORED_HASH_(h);                                           \
+    found = name##_OAHT_FIND_H_(head, elm, h);                          \
+    if (found) {                                                        \
+      *inserted_out = 0;                                                \
+      return found;                                                     \
+    }                                                                   \
+    if (head->hth_n_used >= head->hth_load_limit &&                     \
+        name##_OAHT_GROW(head, head->hth_n_entries + 1) < 0) {          \
+      *inserted_out = 0;                                                \
+      return NULL;                                                      \
+    }                                                                   \
+    mask = head->hth_table_length - 1;                                  \
+    i = h & mask;                                                       \
+    while (head->hth_hashes[i] > OAHT_REMOVED_)                         \
+      i = (i + 1) & mask;                                               \
+    if (head->hth_hashes[i] == OAHT_EMPTY_)                             \
+      ++head->hth_n_used;                                               \
+    head->hth_hashes[i] = h;                                            \
+    head->hth_table[i] = *elm;                                          \
+    ++head->hth_n_entries;                                              \
+    *inserted_out = 1;                                                  \
+    return &head->hth_table[i];                                         \
+  }                                                                     \
+  /* Remove 'elm', which must be an element in 'head'.  No other        \
+   * element moves. */                                                  \
+  static inline void                                                    \
+  name##_OAHT_REMOVE_AT(struct name *head, struct type *elm)            \
+  {                                                                     \
+    unsigned i = (unsigned)(elm - head->hth_table);                     \
+    unsigned next = (i + 1) & (head->hth_table_length - 1);             \
+    /* If no probe goes past this slot, it can be empty again. */       \
+    if (head->hth_hashes[next] == OAHT_EMPTY_) {                        \
+      head->hth_hashes[i] = OAHT_EMPTY_;                                \
+      --head->hth_n_used;                                               \
+    } else {                                                            \
+      head->hth_hashes[i] = OAHT_REMOVED_;                              \
+    }                                                                   \
+    --head->hth_n_entries;                                              \
+  }                                                                     \
+  /* Remove the element in 'head' that matches 'elm', if any, copying   \
+   * it into *removed_out if removed_out is set.  Return true iff we     \
+   * removed an element. */                                             \
+  static inline int                                                     \
+  name##_OAHT_REMOVE(struct name *head, const struct type *elm,         \
+                     struct type *removed_out)                          \
+  {                                                                     \
+    struct type *found = name##_OAHT_FIND(head, elm);                   \
+    if (!found)                                                         \
+      return 0;                                                         \
+    if (removed_out)                                                    \
+      *removed_out = *found;                                            \
+    name##_OAHT_REMOVE_AT(head, found);                                 \
+    return 1;                                                           \
+  }                                                                     \
+  /* Helper: return the first element in 'head' in slot 'i' or later,   \
+   * or NULL if there is none. */                                       \
+  static inline struct type *                                           \
+  name##_OAHT_NEXT_FROM_(const struct name *head, unsigned i)           \
+  {                                                                     \
+    for ( ; i < head->hth_table_length; ++i) {                          \
+      if (head->hth_hashes[i] > OAHT_REMOVED_)                          \
+        return &head->hth_table[i];                                     \
+    }                                                                   \
+    return NULL;                                                        \
+  }
+
+#define OAHT_GENERATE(name, type, hashfn, eqfn, load, reallocarrayfn,   \
+                      freefn)                                           \
+  /* Rebuild the table in 'head' with room for at least 'size'          \
+   * elements, dropping removed markers.  We leave room for another     \
+   * size/2 insertions under the load limit, so that we don't rebuild   \
+   * it again right away.  Return 0 on success, -1 on allocation         \
+   * failure. */                                                        \
+  int                                                                   \
+  name##_OAHT_GROW(struct name *head, unsigned size)                    \
+  {                                                                     \
+    unsigned new_len = OAHT_MIN_LENGTH_, mask, i;                       \
+    struct type *new_table;                                             \
+    unsigned *new_hashes;                                               \
+    while ((unsigned)(load * new_len) < size + size / 2) {              \
+      if (new_len >= (1u << 30))                                        \
+        return -1;                                                      \
+      new_len <<= 1;                                                    \
+    }                                                                   \
+    new_table = reallocarrayfn(NULL, new_len, sizeof(struct type));     \
+    new_hashes = reallocarrayfn(NULL, new_len, sizeof(unsigned));       \
+    if (!new_table || !new_hashes) {                                    \
+      if (new_table)                                                    \
+        freefn(new_table);                                              \
+      if (new_hashes)                                                   \
+        freefn(new_hashes);                                             \
+      return -1;                                                        \
+    }                                                                   \
+    memset(new_hashes, 0, new_len * sizeof(unsigned));                  \
+    mask = new_len - 1;                                                 \
+    for (i = 0; i < head->hth_table_length; ++i) {                      \
+      unsigned h = head->hth_hashes[i], j;                              \
+      if (h <= OAHT_REMOVED_)                                           \
+        continue;                                                       \
+      j = h & mask;                                                     \
+      while (new_hashes[j] != OAHT_EMPTY_)                              \
+        j = (j + 1) & mask;                                             \
+      new_hashes[j] = h;                                                \
+      new_table[j] = head->hth_table[i];                                \
+    }                                                                   \
+    if (head->hth_table)                                                \
+      freefn(head->hth_table);                                          \
+    if (head->hth_hashes)                                               \
+      freefn(head->hth_hashes);                                         \
+    head->hth_table = new_table;                                        \
+    head->hth_hashes = new_hashes;                                      \
+    head->hth_table_length = new_len;                                   \
+    head->hth_n_used = head->hth_n_entries;                             \
+    head->hth_load_limit = (unsigned)(load * new_len);                  \
+    if (head->hth_load_limit >= new_len)                                \
+      head->hth_load_limit = new_len - 1;                               \
+    return 0;                                                           \
+  }                                                                     \
+  /* Free all storage held by 'head'.  Does not free 'head' itself, or  \
+   * anything that the elements point to. */                            \
+  void                                                                  \
+  name##_OAHT_CLEAR(struct name *head)                                  \
+  {                                                                     \
+    if (head->hth_table)                                                \
+      freefn(head->hth_table);                                          \
+    if (head->hth_hashes)                                               \
+      freefn(head->hth_hashes);                                         \
+    name##_OAHT_INIT(head);                                             \
+  }                                                                     \
+  /* Debugging helper: return false iff the representation of 'head' is \
+   * internally consistent. */                                          \
+  int                                                                   \
+  name##_OAHT_REP_IS_BAD_(const struct name *head)                      \
+  {                                                                     \
+    unsigned n_entries = 0, n_used = 0, i;                              \
+    if (!head->hth_table_length) {                                      \
+      if (!head->hth_table && !head->hth_hashes &&                      \
+          !head->hth_n_entries && !head->hth_n_used &&                  \
+          !head->hth_load_limit)                                        \
+        return 0;                                                       \
+      else                                                              \
+        return 1;                                                       \
+    }                                                                   \
+    if (!head->hth_table || !head->hth_hashes)                          \
+      return 2;                                                         \
+    if (head->hth_table_length & (head->hth_table_length - 1))          \
+      return 3;                                                         \
+    if (head->hth_load_limit >= head->hth_table_length)                 \
+      return 4;                                                         \
+    for (i = 0; i < head->hth_table_length; ++i) {                      \
+      unsigned h = head->hth_hashes[i], h2;                             \
+      if (h == OAHT_EMPTY_)                                             \
+        continue;                                                       \
+      ++n_used;                                                         \
+      if (h == OAHT_REMOVED_)                                           \
+        continue;                                                       \
+      ++n_entries;                                                      \
+      h2 = hashfn(&head->hth_table[i]);                                 \
+      if (h != OAHT_STORED_HASH_(h2))                                   \
+        return 1000 + i;                                                \
+      if (name##_OAHT_FIND_H_(head, &head->hth_table[i], h) !=          \
+          &head->hth_table[i])                                          \
+        return 10000 + i;                                               \
+    }                                                                   \
+    if (n_entries != head->hth_n_entries)                               \
+      return 5;                                                         \
+    if (n_used != head->hth_n_used || n_used > head->hth_load_limit)    \
+      return 6;                                                         \
+    return 0;                                                           \
+  }
+
 /*
  * Copyright 2005, Nick Mathewson.  Implementation logic is adapted from code
  * by Christopher Clark, retrofit to allow drop-in memory management, and to
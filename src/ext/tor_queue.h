@@ -442,6 +442,15 @@ struct {								\
 	TOR_Q_INVALIDATE_((elm)->field.tqe_next);				\
 } while (0)
 
+#define TOR_TAILQ_CONCAT(head1, head2, field) do {			\
+	if (!TOR_TAILQ_EMPTY(head2)) {					\
+		*(head1)->tqh_last = (head2)->tqh_first;		\
+		(head2)->tqh_first->field.tqe_prev = (head1)->tqh_last;	\
+		(head1)->tqh_last = (head2)->tqh_last;			\
+		TOR_TAILQ_INIT((head2));				\
+	}								\
+} while (0)
+
 /*
  * Circular queue definitions.
  */
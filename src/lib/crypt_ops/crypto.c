@@ -173,6 +173,7 @@ crypto_early_init(void)
       return -1;
     if (crypto_init_siphash_key() < 0)
       return -1;
+    crypto_rand_fast_init();
 
     curve25519_init();
     ed25519_init();
@@ -276,6 +277,7 @@ crypto_thread_cleanup(void)
 #ifndef NEW_THREAD_API
   ERR_remove_thread_state(NULL);
 #endif
+  destroy_thread_fast_rng();
 }
 
 /** Allocate and return a new symmetric cipher using the provided key and iv.
@@ -483,6 +485,7 @@ crypto_global_cleanup(void)
 #endif
 
   crypto_dh_free_all();
+  crypto_rand_fast_shutdown();
 
 #ifndef DISABLE_ENGINES
 #ifndef OPENSSL_1_1_API
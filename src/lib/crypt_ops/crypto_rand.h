@@ -38,6 +38,29 @@ void *smartlist_choose(const struct smartlist_t *sl);
 void smartlist_shuffle(struct smartlist_t *sl);
 int crypto_force_rand_ssleay(void);
 
+/* fast (non-long-term-secret) random numbers */
+typedef struct crypto_fast_rng_t crypto_fast_rng_t;
+crypto_fast_rng_t *crypto_fast_rng_new(void);
+void crypto_fast_rng_free_(crypto_fast_rng_t *rng);
+#define crypto_fast_rng_free(rng) \
+  FREE_AND_NULL(crypto_fast_rng_t, crypto_fast_rng_free_, (rng))
+void crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n);
+unsigned crypto_fast_rng_get_uint(crypto_fast_rng_t *rng, unsigned limit);
+uint64_t crypto_fast_rng_get_uint64(crypto_fast_rng_t *rng, uint64_t limit);
+unsigned crypto_fast_rng_uint_range(crypto_fast_rng_t *rng, unsigned min,
+                                    unsigned max);
+double crypto_fast_rng_get_double(crypto_fast_rng_t *rng);
+
+crypto_fast_rng_t *get_thread_fast_rng(void);
+void destroy_thread_fast_rng(void);
+void crypto_rand_fast_init(void);
+void crypto_rand_fast_shutdown(void);
+
+#ifdef CRYPTO_RAND_FAST_PRIVATE
+STATIC crypto_fast_rng_t *crypto_fast_rng_new_from_seed(const uint8_t *seed);
+STATIC void crypto_fast_rng_note_fork(void);
+#endif
+
 #ifdef CRYPTO_RAND_PRIVATE
 
 STATIC int crypto_strongest_rand_raw(uint8_t *out, size_t out_len);
@@ -0,0 +1,293 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.c
+ *
+ * \brief A fast strong PRNG for use when our underlying cryptographic
+ *   library's PRNG isn't fast enough.
+ *
+ * Each crypto_fast_rng_t holds a 256-bit AES key and an IV, which it uses
+ * in counter mode to fill a buffer with output.  Every time it refills the
+ * buffer, it also replaces its key and IV with the first bytes of the new
+ * output, so that someone who learns the state of the generator can't work
+ * back to output that it has already handed out.  We wipe each byte of the
+ * buffer as we hand it out, for the same reason.  Every
+ * RESEED_AFTER refills, we mix fresh output from crypto_rand() into the
+ * key and IV.
+ *
+ * Forking would leave two processes with the same generator state; so
+ * whenever a process forks, we make every generator in the child reseed
+ * itself before its next use.
+ *
+ * Use these generators for values that are not long-term secrets, and that
+ * we need in bulk on hot paths: padding timeouts, circuit IDs, and the
+ * like.  Keys should still come from crypto_rand() or
+ * crypto_strongest_rand().
+ **/
+
+#define CRYPTO_RAND_FAST_PRIVATE
+
+#include "lib/crypt_ops/crypto_rand.h"
+#include "lib/crypt_ops/crypto.h"
+#include "lib/crypt_ops/crypto_util.h"
+#include "lib/crypt_ops/aes.h"
+#include "common/compat_threads.h"
+#include "common/util.h"
+
+/** How many bytes of key and IV we use for each refill. */
+#define SEED_LEN (CIPHER256_KEY_LEN + CIPHER_IV_LEN)
+
+/** How many bytes of output each refill gives us. */
+#define BUFLEN (4096 - SEED_LEN)
+
+/** How many refills we do before we mix in new bytes from crypto_rand(). */
+#define RESEED_AFTER 16
+
+struct crypto_fast_rng_t {
+  /** How many more refills we can do before we reseed from crypto_rand(). */
+  int16_t n_till_reseed;
+  /** How many bytes of buf.bytes that we have not yet handed out.  They are
+   * the last <b>bytes_left</b> bytes of the buffer. */
+  uint16_t bytes_left;
+  /** The value of fast_rng_fork_generation when we last seeded this
+   * generator. */
+  unsigned fork_generation;
+  /** The key, IV and output, which we generate together so that each refill
+   * replaces the key and IV. */
+  struct cbuf {
+    uint8_t seed[SEED_LEN];
+    uint8_t bytes[BUFLEN];
+  } buf;
+};
+
+/** Incremented in the child whenever this process forks, so that every
+ * generator knows to reseed before its next use. */
+static volatile unsigned fast_rng_fork_generation = 0;
+
+/** Each thread's generator. */
+static tor_threadlocal_t thread_rng;
+/** True iff we have initialized thread_rng. */
+static int thread_rng_initialized = 0;
+
+/** Called in the child after a fork(): mark every generator as needing a
+ * reseed. */
+STATIC void
+crypto_fast_rng_note_fork(void)
+{
+  ++fast_rng_fork_generation;
+}
+
+/** Fill the buffer of <b>rng</b> with new output, and replace its key and
+ * IV. */
+static void
+crypto_fast_rng_refill(crypto_fast_rng_t *rng)
+{
+  aes_cnt_cipher_t *c;
+
+  if (--rng->n_till_reseed <= 0) {
+    uint8_t seed[SEED_LEN];
+    int i;
+    crypto_rand((char *)seed, sizeof(seed));
+    for (i = 0; i < SEED_LEN; ++i)
+      rng->buf.seed[i] ^= seed[i];
+    memwipe(seed, 0, sizeof(seed));
+    rng->n_till_reseed = RESEED_AFTER;
+  }
+
+  c = aes_new_cipher(rng->buf.seed, rng->buf.seed + CIPHER256_KEY_LEN,
+                     CIPHER256_KEY_LEN * 8);
+  memset(&rng->buf, 0, sizeof(rng->buf));
+  aes_crypt_inplace(c, (char *)&rng->buf, sizeof(rng->buf));
+  aes_cipher_free(c);
+
+  rng->bytes_left = BUFLEN;
+}
+
+/** Return a new crypto_fast_rng_t whose first key and IV are
+ * <b>seed</b>.  Only tests should need to pick the seed. */
+STATIC crypto_fast_rng_t *
+crypto_fast_rng_new_from_seed(const uint8_t *seed)
+{
+  crypto_fast_rng_t *rng = tor_malloc_zero(sizeof(crypto_fast_rng_t));
+  memcpy(rng->buf.seed, seed, SEED_LEN);
+  /* We just got our seed: don't mix in more until RESEED_AFTER refills. */
+  rng->n_till_reseed = RESEED_AFTER + 1;
+  rng->fork_generation = fast_rng_fork_generation;
+  crypto_fast_rng_refill(rng);
+  return rng;
+}
+
+/** Return a new crypto_fast_rng_t, seeded from crypto_rand(). */
+crypto_fast_rng_t *
+crypto_fast_rng_new(void)
+{
+  uint8_t seed[SEED_LEN];
+  crypto_fast_rng_t *rng;
+  crypto_rand((char *)seed, sizeof(seed));
+  rng = crypto_fast_rng_new_from_seed(seed);
+  memwipe(seed, 0, sizeof(seed));
+  return rng;
+}
+
+/** Release all storage held by <b>rng</b>. */
+void
+crypto_fast_rng_free_(crypto_fast_rng_t *rng)
+{
+  if (!rng)
+    return;
+  memwipe(rng, 0, sizeof(*rng));
+  tor_free(rng);
+}
+
+/** Write <b>n</b> bytes of output from <b>rng</b> into <b>out</b>. */
+void
+crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n)
+{
+  if (PREDICT_UNLIKELY(rng->fork_generation != fast_rng_fork_generation)) {
+    /* We are in a child process that still has its parent's state. */
+    rng->fork_generation = fast_rng_fork_generation;
+    rng->n_till_reseed = 0;
+    crypto_fast_rng_refill(rng);
+  }
+
+  while (n) {
+    size_t take;
+    uint8_t *src;
+    if (!rng->bytes_left)
+      crypto_fast_rng_refill(rng);
+    take = MIN(n, (size_t)rng->bytes_left);
+    src = rng->buf.bytes + (BUFLEN - rng->bytes_left);
+    memcpy(out, src, take);
+    memwipe(src, 0, take);
+    out += take;
+    n -= take;
+    rng->bytes_left -= take;
+  }
+}
+
+/**
+ * Return a value from <b>rng</b>, chosen uniformly from the values between
+ * 0 and <b>limit</b>-1 inclusive.  <b>limit</b> must be positive.
+ **/
+unsigned
+crypto_fast_rng_get_uint(crypto_fast_rng_t *rng, unsigned limit)
+{
+  unsigned val, cutoff;
+  tor_assert(limit > 0);
+
+  /* As in crypto_rand_int(), we reject values above the largest multiple of
+   * limit, so that we don't favor small results. */
+  cutoff = UINT_MAX - (UINT_MAX % limit);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t *)&val, sizeof(val));
+    if (val < cutoff)
+      return val % limit;
+  }
+}
+
+/**
+ * As crypto_fast_rng_get_uint(), but supports uint64_t.
+ **/
+uint64_t
+crypto_fast_rng_get_uint64(crypto_fast_rng_t *rng, uint64_t limit)
+{
+  uint64_t val, cutoff;
+  tor_assert(limit > 0);
+
+  cutoff = UINT64_MAX - (UINT64_MAX % limit);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t *)&val, sizeof(val));
+    if (val < cutoff)
+      return val % limit;
+  }
+}
+
+/**
+ * Return a value d from <b>rng</b>, chosen uniformly from the range
+ * 0.0 <= d < 1.0.
+ **/
+double
+crypto_fast_rng_get_double(crypto_fast_rng_t *rng)
+{
+  uint32_t u;
+  crypto_fast_rng_getbytes(rng, (uint8_t *)&u, sizeof(u));
+  return ((double)u) / 4294967296.0;
+}
+
+/**
+ * Return a value from <b>rng</b>, chosen uniformly from the values i such
+ * that <b>min</b> <= i < <b>max</b>.
+ **/
+unsigned
+crypto_fast_rng_uint_range(crypto_fast_rng_t *rng, unsigned min,
+                           unsigned max)
+{
+  tor_assert(min < max);
+  return min + crypto_fast_rng_get_uint(rng, max - min);
+}
+
+/** Set up the per-thread generators.  crypto_early_init() calls this, from
+ * the main thread, before any other thread can call
+ * get_thread_fast_rng(). */
+void
+crypto_rand_fast_init(void)
+{
+  if (thread_rng_initialized)
+    return;
+  tor_threadlocal_init(&thread_rng);
+#ifdef USE_PTHREADS
+  {
+    static int atfork_registered = 0;
+    if (!atfork_registered) {
+      pthread_atfork(NULL, NULL, crypto_fast_rng_note_fork);
+      atfork_registered = 1;
+    }
+  }
+#endif /* defined(USE_PTHREADS) */
+  thread_rng_initialized = 1;
+}
+
+/** Return this thread's generator, creating it if need be.  The generator
+ * belongs to this thread: don't pass it to another one. */
+crypto_fast_rng_t *
+get_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+  if (PREDICT_UNLIKELY(!thread_rng_initialized))
+    crypto_rand_fast_init();
+
+  rng = tor_threadlocal_get(&thread_rng);
+  if (PREDICT_UNLIKELY(!rng)) {
+    rng = crypto_fast_rng_new();
+    tor_threadlocal_set(&thread_rng, rng);
+  }
+  return rng;
+}
+
+/** Free this thread's generator, if it has one. */
+void
+destroy_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+  if (!thread_rng_initialized)
+    return;
+  rng = tor_threadlocal_get(&thread_rng);
+  if (!rng)
+    return;
+  crypto_fast_rng_free(rng);
+  tor_threadlocal_set(&thread_rng, NULL);
+}
+
+/** Free the calling thread's generator, and release the storage that we use
+ * to find each thread's generator.  Other threads must not use their
+ * generators after this. */
+void
+crypto_rand_fast_shutdown(void)
+{
+  if (!thread_rng_initialized)
+    return;
+  destroy_thread_fast_rng();
+  tor_threadlocal_destroy(&thread_rng);
+  thread_rng_initialized = 0;
+}
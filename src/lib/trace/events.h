@@ -16,7 +16,8 @@
  * That generic function is then defined by a event tracing framework. For
  * instance, the "log debug" framework sends all trace events to log_debug()
  * which is defined in src/trace/debug.h which can only be enabled at compile
- * time (--enable-event-tracing-debug).
+ * time (--enable-event-tracing-debug). The "USDT" framework turns every
+ * trace event into a statically defined probe (--enable-event-tracing-usdt).
  *
  * By default, every trace events in the code base are replaced by a NOP. See
  * doc/HACKING/Tracing.md for more information on how to use event tracing or
@@ -34,6 +35,12 @@
 #include "lib/trace/debug.h"
 #endif
 
+/* Enable event tracing for USDT probes, which external tracers such as
+ * perf, bpftrace, SystemTap or LTTng can attach to at runtime. */
+#ifdef USE_EVENT_TRACING_USDT
+#include "lib/trace/usdt.h"
+#endif
+
 #else /* TOR_EVENT_TRACING_ENABLED */
 
 /* Reaching this point, we NOP every event declaration because event tracing
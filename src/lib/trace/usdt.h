@@ -0,0 +1,27 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#ifndef TOR_TRACE_USDT_H
+#define TOR_TRACE_USDT_H
+
+/* Map every trace event to a USDT probe (a "statically defined tracing"
+ * probe, as in DTrace and SystemTap).  A probe is a nop instruction, plus a
+ * note in the ELF file recording where its arguments live.  Its arguments
+ * are still evaluated when no tracer is attached, so only pass values that
+ * the caller has already computed or that are a plain load: no function
+ * calls.  Tracers find the probes by provider and name;
+ * here the provider is the trace event's subsystem, so that, for example,
+ * tor_trace(cmux, dequeue, ...) can be attached to with bpftrace as
+ * "usdt:/path/to/tor:cmux:dequeue", or with LTTng as
+ * "--userspace-probe=sdt:/path/to/tor:cmux:dequeue".
+ *
+ * Arguments must be integers or pointers, and there can be at most 12 of
+ * them. */
+
+#include <sys/sdt.h>
+
+#undef tor_trace
+#define tor_trace(subsystem, name, ...) \
+  STAP_PROBEV(subsystem, name, ## __VA_ARGS__)
+
+#endif /* TOR_TRACE_USDT_H */
@@ -58,6 +58,7 @@
 #define CHANNEL_PRIVATE_
 
 #include "or/or.h"
+#include "common/metrics.h"
 #include "or/channel.h"
 #include "or/channeltls.h"
 #include "or/channelpadding.h"
@@ -68,6 +69,7 @@
 #include "or/connection_or.h" /* For var_cell_free() */
 #include "or/circuitmux.h"
 #include "or/entrynodes.h"
+#include "or/dos.h"
 #include "or/geoip.h"
 #include "or/main.h"
 #include "or/nodelist.h"
@@ -914,6 +916,8 @@ channel_free_(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  chan_circid_table_free(chan->circid_table);
+
   tor_free(chan);
 }
 
@@ -985,6 +989,8 @@ channel_force_xfree(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  chan_circid_table_free(chan->circid_table);
+
   tor_free(chan);
 }
 
@@ -2052,6 +2058,20 @@ channel_send_destroy(circid_t circ_id, channel_t *chan, int reason)
   return 0;
 }
 
+/**
+ * Register the channel metrics with the metrics subsystem.
+ */
+void
+channel_register_metrics(void)
+{
+  metrics_register_gauge_fn(metrics_read_smartlist_len, &active_channels,
+                            "tor_channels", "Channels, by state.",
+                            "state=\"active\"");
+  metrics_register_gauge_fn(metrics_read_smartlist_len, &finished_channels,
+                            "tor_channels", "Channels, by state.",
+                            "state=\"finished\"");
+}
+
 /**
  * Dump channel statistics to the log.
  *
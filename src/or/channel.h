@@ -151,6 +151,10 @@ struct channel_s {
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
 
+  /** When (in timestamp units) this channel last became pending in the
+   * scheduler; used to measure how long channels wait to be serviced. */
+  uint32_t sched_pending_since;
+
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
   time_t timestamp_active; /* Any activity */
@@ -275,6 +279,10 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Table of the circuit IDs in use on this channel, for finding the
+   * circuit of each incoming cell. Maintained by circuitlist.c. */
+  chan_circid_table_t *circid_table;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -420,6 +428,7 @@ void channel_free_all(void);
 
 /* Dump some statistics in the log */
 void channel_dumpstats(int severity);
+void channel_register_metrics(void);
 void channel_listener_dumpstats(int severity);
 
 #ifdef TOR_CHANNEL_INTERNAL_
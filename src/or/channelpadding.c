@@ -175,6 +175,7 @@ channelpadding_get_netflow_inactive_timeout_ms(const channel_t *chan)
   int low_timeout = consensus_nf_ito_low;
   int high_timeout = consensus_nf_ito_high;
   int X1, X2;
+  crypto_fast_rng_t *rng;
 
   if (low_timeout == 0 && low_timeout == high_timeout)
     return 0; // No padding
@@ -230,8 +231,9 @@ channelpadding_get_netflow_inactive_timeout_ms(const channel_t *chan)
    * frequency which padding packets will be sent.
    */
 
-  X1 = crypto_rand_int(high_timeout - low_timeout);
-  X2 = crypto_rand_int(high_timeout - low_timeout);
+  rng = get_thread_fast_rng();
+  X1 = crypto_fast_rng_get_uint(rng, high_timeout - low_timeout);
+  X2 = crypto_fast_rng_get_uint(rng, high_timeout - low_timeout);
   return low_timeout + MAX(X1, X2);
 }
 
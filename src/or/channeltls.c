@@ -836,6 +836,11 @@ channel_tls_write_packed_cell_method(channel_t *chan,
   if (tlschan->conn) {
     connection_buf_add(packed_cell->body, cell_network_size,
                             TO_CONN(tlschan->conn));
+    /* Cells that came from a circuit queue carry the time they were queued;
+     * follow some of them through the outbuf. */
+    if (packed_cell->inserted_timestamp)
+      connection_or_cell_latency_probe_start(tlschan->conn,
+                                      packed_cell->inserted_timestamp);
   } else {
     log_info(LD_CHANNEL,
              "something called write_packed_cell on a tlschan "
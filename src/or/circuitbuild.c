@@ -221,7 +221,9 @@ get_unique_circ_id_by_chan(channel_t *chan)
     }
 
     do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
+      crypto_fast_rng_getbytes(get_thread_fast_rng(),
+                               (uint8_t*) &test_circ_id,
+                               sizeof(test_circ_id));
       test_circ_id &= mask;
     } while (test_circ_id == 0);
 
@@ -460,6 +462,7 @@ origin_circuit_init(uint8_t purpose, int flags)
   circ->build_state->is_internal =
     ((flags & CIRCLAUNCH_IS_INTERNAL) ? 1 : 0);
   circ->base_.purpose = purpose;
+  circuit_update_purpose_list(circ);
   return circ;
 }
 
@@ -1475,11 +1478,11 @@ circuit_truncated(origin_circuit_t *circ, crypt_path_t *layer, int reason)
 /** Given a response payload and keys, initialize, then send a created
  * cell back.
  */
-int
-onionskin_answer(or_circuit_t *circ,
-                 const created_cell_t *created_cell,
-                 const char *keys, size_t keys_len,
-                 const uint8_t *rend_circ_nonce)
+MOCK_IMPL(int,
+onionskin_answer,(or_circuit_t *circ,
+                  const created_cell_t *created_cell,
+                  const char *keys, size_t keys_len,
+                  const uint8_t *rend_circ_nonce))
 {
   cell_t cell;
 
@@ -54,6 +54,7 @@
 #include "lib/cc/torint.h"  /* TOR_PRIuSZ */
 
 #include "or/or.h"
+#include "common/metrics.h"
 #include "or/channel.h"
 #include "or/circpathbias.h"
 #include "or/circuitbuild.h"
@@ -109,6 +110,18 @@ static smartlist_t *global_circuitlist = NULL;
  * an element of global_circuitlist. */
 static smartlist_t *global_origin_circuit_list = NULL;
 
+/** How many times has the OOM handler run, how many circuits has it
+ * killed, and how many bytes has it recovered? */
+static metrics_counter_t oom_n_invocations;
+static metrics_counter_t oom_n_circuits_killed;
+static metrics_counter_t oom_n_bytes_recovered;
+
+/** For each purpose, a list of the origin circuits with that purpose, so
+ * that we can find the candidate circuits for a stream without looking at
+ * every circuit. Every element of these is also an element of
+ * global_origin_circuit_list. */
+static smartlist_t *origin_circuits_by_purpose[CIRCUIT_PURPOSE_MAX_ + 1];
+
 /** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT. */
 static smartlist_t *circuits_pending_chans = NULL;
 
@@ -212,6 +225,179 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
  */
 static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
 
+/** One slot of a chan_circid_table_t. */
+typedef struct chan_circid_slot_t {
+  /** The circuit ID of <b>ent</b>, so that probing doesn't need to follow
+   * the pointer. */
+  circid_t circ_id;
+  /** The entry in this slot: NULL if the slot has never been used, or
+   * CIRCID_SLOT_TOMBSTONE if its entry has been removed. */
+  chan_circid_circuit_map_t *ent;
+} chan_circid_slot_t;
+
+/** A small open-addressed table from circuit ID to entry of
+ * chan_circid_map, owned by a channel. It holds the same entries as
+ * chan_circid_map does for its channel, so that finding the circuit of an
+ * incoming cell probes a table that belongs to the channel instead of the
+ * global map. The global map still owns the entries. */
+struct chan_circid_table_t {
+  /** Number of slots minus one. The number of slots is a power of two. */
+  unsigned mask;
+  /** Number of slots that hold an entry. */
+  unsigned n_entries;
+  /** Number of slots that hold an entry or a tombstone. */
+  unsigned n_used;
+  /** Array of mask+1 slots. */
+  chan_circid_slot_t *slots;
+};
+
+/** Marker for a slot whose entry was removed. */
+static chan_circid_circuit_map_t circid_slot_tombstone;
+#define CIRCID_SLOT_TOMBSTONE (&circid_slot_tombstone)
+
+/** Fewest slots that a chan_circid_table_t has. */
+#define CHAN_CIRCID_TABLE_MIN_SLOTS 16
+
+/** Helper: return the first slot to probe for <b>circ_id</b>. Circuit IDs
+ * can be chosen by the other side of the channel, so use a keyed hash. */
+static inline unsigned
+chan_circid_table_hash(const chan_circid_table_t *table, circid_t circ_id)
+{
+  return (unsigned) siphash24g(&circ_id, sizeof(circ_id)) & table->mask;
+}
+
+/** Return the entry for <b>circ_id</b> in <b>table</b>, or NULL if there
+ * is none. <b>table</b> may be NULL. */
+static inline chan_circid_circuit_map_t *
+chan_circid_table_find(const chan_circid_table_t *table, circid_t circ_id)
+{
+  unsigned i;
+
+  if (!table)
+    return NULL;
+  /* There is always an empty slot, so this terminates. */
+  for (i = chan_circid_table_hash(table, circ_id); ;
+       i = (i + 1) & table->mask) {
+    const chan_circid_slot_t *slot = &table->slots[i];
+    if (slot->ent == NULL)
+      return NULL;
+    if (slot->circ_id == circ_id && slot->ent != CIRCID_SLOT_TOMBSTONE)
+      return slot->ent;
+  }
+}
+
+/** Put <b>ent</b> in the first free slot for it in <b>table</b>, which must
+ * have one. */
+static void
+chan_circid_table_place(chan_circid_table_t *table,
+                        chan_circid_circuit_map_t *ent)
+{
+  unsigned i;
+
+  for (i = chan_circid_table_hash(table, ent->circ_id); ;
+       i = (i + 1) & table->mask) {
+    chan_circid_slot_t *slot = &table->slots[i];
+    if (slot->ent == NULL || slot->ent == CIRCID_SLOT_TOMBSTONE) {
+      if (slot->ent == NULL)
+        ++table->n_used;
+      slot->circ_id = ent->circ_id;
+      slot->ent = ent;
+      ++table->n_entries;
+      return;
+    }
+  }
+}
+
+/** Rebuild <b>table</b> with room for its entries and as many again,
+ * dropping its tombstones. */
+static void
+chan_circid_table_rebuild(chan_circid_table_t *table)
+{
+  chan_circid_slot_t *old_slots = table->slots;
+  unsigned old_n_slots = old_slots ? table->mask + 1 : 0;
+  unsigned n_slots = CHAN_CIRCID_TABLE_MIN_SLOTS;
+  unsigned i;
+
+  while (n_slots < (table->n_entries + 1) * 2)
+    n_slots <<= 1;
+
+  table->slots = tor_calloc(n_slots, sizeof(chan_circid_slot_t));
+  table->mask = n_slots - 1;
+  table->n_entries = table->n_used = 0;
+  for (i = 0; i < old_n_slots; ++i) {
+    chan_circid_circuit_map_t *ent = old_slots[i].ent;
+    if (ent && ent != CIRCID_SLOT_TOMBSTONE)
+      chan_circid_table_place(table, ent);
+  }
+  tor_free(old_slots);
+}
+
+/** Add <b>ent</b>, which must not be there yet, to the table of its
+ * channel. */
+static void
+chan_circid_table_add(chan_circid_circuit_map_t *ent)
+{
+  chan_circid_table_t *table = ent->chan->circid_table;
+
+  if (!table) {
+    table = ent->chan->circid_table = tor_malloc_zero(sizeof(*table));
+    chan_circid_table_rebuild(table);
+  } else if ((table->n_used + 1) * 4 > (table->mask + 1) * 3) {
+    chan_circid_table_rebuild(table);
+  }
+  chan_circid_table_place(table, ent);
+}
+
+/** Remove <b>ent</b> from the table of its channel, if it is there. */
+static void
+chan_circid_table_remove(chan_circid_circuit_map_t *ent)
+{
+  chan_circid_table_t *table = ent->chan->circid_table;
+  unsigned i;
+
+  if (!table)
+    return;
+  for (i = chan_circid_table_hash(table, ent->circ_id); ;
+       i = (i + 1) & table->mask) {
+    chan_circid_slot_t *slot = &table->slots[i];
+    if (slot->ent == NULL)
+      return;
+    if (slot->ent == ent) {
+      slot->ent = CIRCID_SLOT_TOMBSTONE;
+      --table->n_entries;
+      break;
+    }
+  }
+  /* Give memory back when a busy channel has lost most of its circuits. */
+  if (table->mask + 1 > CHAN_CIRCID_TABLE_MIN_SLOTS &&
+      table->n_entries * 8 < table->mask + 1)
+    chan_circid_table_rebuild(table);
+}
+
+/** Release all storage held by <b>table</b>, whose channel is going away.
+ * The entries themselves belong to chan_circid_map, but we remove and free
+ * the placeholders among them: otherwise a new channel at the same address
+ * would find them in chan_circid_map but not in its own table. */
+void
+chan_circid_table_free_(chan_circid_table_t *table)
+{
+  unsigned i;
+
+  if (!table)
+    return;
+  for (i = 0; i <= table->mask; ++i) {
+    chan_circid_circuit_map_t *ent = table->slots[i].ent;
+    if (!ent || ent == CIRCID_SLOT_TOMBSTONE || ent->circuit)
+      continue;
+    HT_REMOVE(chan_circid_map, &chan_circid_map, ent);
+    if (_last_circid_chan_ent == ent)
+      _last_circid_chan_ent = NULL;
+    tor_free(ent);
+  }
+  tor_free(table->slots);
+  tor_free(table);
+}
+
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
  * to <b>chan, id</b>.  Adjust the chan,circid map as appropriate, removing
@@ -269,6 +455,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     search.chan = old_chan;
     found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
     if (found) {
+      chan_circid_table_remove(found);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -301,6 +488,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->chan = chan;
     found->circuit = circ;
     HT_INSERT(chan_circid_map, &chan_circid_map, found);
+    chan_circid_table_add(found);
   }
 
   /*
@@ -361,6 +549,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
     HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_table_add(ent);
   }
 }
 
@@ -383,6 +572,8 @@ channel_mark_circid_usable(channel_t *chan, circid_t id)
              "a circuit there.", (unsigned)id, chan);
     return;
   }
+  if (ent)
+    chan_circid_table_remove(ent);
   if (_last_circid_chan_ent == ent)
     _last_circid_chan_ent = NULL;
   tor_free(ent);
@@ -588,6 +779,48 @@ circuit_add_to_origin_circuit_list(origin_circuit_t *origin_circ)
   origin_circ->global_origin_circuit_list_idx = smartlist_len(lst) - 1;
 }
 
+/** Remove <b>origin_circ</b> from the list of origin circuits with its
+ * purpose, if it is in one. */
+static void
+circuit_remove_from_purpose_list(origin_circuit_t *origin_circ)
+{
+  int idx = origin_circ->purpose_list_idx;
+  smartlist_t *lst;
+  if (idx < 0)
+    return;
+  lst = origin_circuits_by_purpose[origin_circ->purpose_list_purpose];
+  tor_assert(lst);
+  tor_assert(idx < smartlist_len(lst));
+  tor_assert(smartlist_get(lst, idx) == origin_circ);
+  smartlist_del(lst, idx);
+  if (idx < smartlist_len(lst)) {
+    origin_circuit_t *replacement = smartlist_get(lst, idx);
+    replacement->purpose_list_idx = idx;
+  }
+  origin_circ->purpose_list_idx = -1;
+}
+
+/** Move <b>origin_circ</b> to the list of origin circuits with its current
+ * purpose. Called whenever the purpose of an origin circuit is set. */
+void
+circuit_update_purpose_list(origin_circuit_t *origin_circ)
+{
+  const uint8_t purpose = TO_CIRCUIT(origin_circ)->purpose;
+  smartlist_t *lst;
+
+  if (origin_circ->purpose_list_idx >= 0 &&
+      origin_circ->purpose_list_purpose == purpose)
+    return;
+  circuit_remove_from_purpose_list(origin_circ);
+  if (BUG(purpose > CIRCUIT_PURPOSE_MAX_))
+    return;
+
+  lst = circuit_get_origin_circuits_by_purpose(purpose);
+  smartlist_add(lst, origin_circ);
+  origin_circ->purpose_list_idx = smartlist_len(lst) - 1;
+  origin_circ->purpose_list_purpose = purpose;
+}
+
 /** Detach from the global circuit list, and deallocate, all
  * circuits that have been marked for close.
  */
@@ -640,6 +873,17 @@ circuit_get_global_origin_circuit_list(void)
   return global_origin_circuit_list;
 }
 
+/** Return a pointer to the list of origin circuits with purpose
+ * <b>purpose</b>. The list is in no particular order; don't modify it. */
+smartlist_t *
+circuit_get_origin_circuits_by_purpose(uint8_t purpose)
+{
+  tor_assert(purpose <= CIRCUIT_PURPOSE_MAX_);
+  if (NULL == origin_circuits_by_purpose[purpose])
+    origin_circuits_by_purpose[purpose] = smartlist_new();
+  return origin_circuits_by_purpose[purpose];
+}
+
 /**
  * Return true if we have any opened general-purpose 3 hop
  * origin circuits.
@@ -951,16 +1195,20 @@ origin_circuit_new(void)
   circ = tor_malloc_zero(sizeof(origin_circuit_t));
   circ->base_.magic = ORIGIN_CIRCUIT_MAGIC;
 
-  circ->next_stream_id = crypto_rand_int(1<<16);
+  circ->next_stream_id = crypto_fast_rng_get_uint(get_thread_fast_rng(),
+                                                  1<<16);
   circ->global_identifier = n_circuits_allocated++;
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
-  circ->remaining_relay_early_cells -= crypto_rand_int(2);
+  circ->remaining_relay_early_cells -=
+    crypto_fast_rng_get_uint(get_thread_fast_rng(), 2);
 
   init_circuit_base(TO_CIRCUIT(circ));
 
   /* Add to origin-list. */
   circ->global_origin_circuit_list_idx = -1;
   circuit_add_to_origin_circuit_list(circ);
+  /* We'll add it to a purpose list once it has a purpose. */
+  circ->purpose_list_idx = -1;
 
   circuit_build_times_update_last_circ(get_circuit_build_times_mutable());
 
@@ -1074,6 +1322,7 @@ circuit_free_(circuit_t *circ)
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
 
     circuit_remove_from_origin_circuit_list(ocirc);
+    circuit_remove_from_purpose_list(ocirc);
 
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
@@ -1228,6 +1477,11 @@ circuit_free_all(void)
   smartlist_free(global_origin_circuit_list);
   global_origin_circuit_list = NULL;
 
+  for (int i = 0; i <= CIRCUIT_PURPOSE_MAX_; ++i) {
+    smartlist_free(origin_circuits_by_purpose[i]);
+    origin_circuits_by_purpose[i] = NULL;
+  }
+
   smartlist_free(circuits_pending_chans);
   circuits_pending_chans = NULL;
 
@@ -1246,6 +1500,7 @@ circuit_free_all(void)
       next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
 
       tor_assert(c->circuit == NULL);
+      chan_circid_table_remove(c);
       tor_free(c);
     }
   }
@@ -1373,7 +1628,6 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
   if (_last_circid_chan_ent &&
@@ -1381,9 +1635,7 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
       chan == _last_circid_chan_ent->chan) {
     found = _last_circid_chan_ent;
   } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_table_find(chan->circid_table, circ_id);
     _last_circid_chan_ent = found;
   }
   if (found && found->circuit) {
@@ -2489,6 +2741,30 @@ conns_compare_by_buffer_age_(const void **a_, const void **b_)
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
+/** Register the circuit and out-of-memory handler metrics with the metrics
+ * subsystem. */
+void
+circuit_register_metrics(void)
+{
+  metrics_register_gauge_fn(metrics_read_smartlist_len, &global_circuitlist,
+                            "tor_circuits", "Circuits at this hop.", NULL);
+  metrics_register_gauge_fn(metrics_read_smartlist_len,
+                            &global_origin_circuit_list,
+                            "tor_origin_circuits",
+                            "Circuits that we built ourselves.", NULL);
+  metrics_register_counter(&oom_n_invocations, "tor_oom_invocations_total",
+                           "Times that the out-of-memory handler ran.",
+                           NULL);
+  metrics_register_counter(&oom_n_circuits_killed,
+                           "tor_oom_circuits_killed_total",
+                           "Circuits killed by the out-of-memory handler.",
+                           NULL);
+  metrics_register_counter(&oom_n_bytes_recovered,
+                           "tor_oom_bytes_recovered_total",
+                           "Bytes recovered by the out-of-memory handler "
+                           "from circuits.", NULL);
+}
+
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
  * bytes' worth.  Kill the 'worst' circuits until we're under
  * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
@@ -2503,6 +2779,7 @@ circuits_handle_oom(size_t current_allocation)
   int n_circuits_killed=0;
   int n_dirconns_killed=0;
   uint32_t now_ts;
+  metrics_counter_inc(&oom_n_invocations);
   log_notice(LD_GENERAL, "We're low on memory (cell queues total alloc:"
              " %"TOR_PRIuSZ" buffer total alloc: %" TOR_PRIuSZ ","
              " tor compress total alloc: %" TOR_PRIuSZ
@@ -2600,6 +2877,8 @@ circuits_handle_oom(size_t current_allocation)
   } SMARTLIST_FOREACH_END(circ);
 
  done_recovering_mem:
+  metrics_counter_add(&oom_n_circuits_killed, n_circuits_killed);
+  metrics_counter_add(&oom_n_bytes_recovered, mem_recovered);
 
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -26,6 +26,11 @@ const origin_circuit_t *CONST_TO_ORIGIN_CIRCUIT(const circuit_t *);
 
 MOCK_DECL(smartlist_t *, circuit_get_global_list, (void));
 smartlist_t *circuit_get_global_origin_circuit_list(void);
+void chan_circid_table_free_(chan_circid_table_t *table);
+#define chan_circid_table_free(table) \
+  FREE_AND_NULL(chan_circid_table_t, chan_circid_table_free_, (table))
+smartlist_t *circuit_get_origin_circuits_by_purpose(uint8_t purpose);
+void circuit_update_purpose_list(origin_circuit_t *origin_circ);
 int circuit_any_opened_circuits(void);
 int circuit_any_opened_circuits_cached(void);
 void circuit_cache_opened_circuit_state(int circuits_are_opened);
@@ -85,6 +90,7 @@ void assert_cpath_layer_ok(const crypt_path_t *cp);
 MOCK_DECL(void, assert_circuit_ok,(const circuit_t *c));
 void circuit_free_all(void);
 void circuits_handle_oom(size_t current_allocation);
+void circuit_register_metrics(void);
 
 void circuit_clear_testing_cell_stats(circuit_t *circ);
 
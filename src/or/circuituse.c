@@ -98,6 +98,36 @@ circuit_matches_with_rend_stream(const edge_connection_t *edge_conn,
   return 1;
 }
 
+/** The most purposes that circuit_get_acceptable_purposes() returns. */
+#define MAX_ACCEPTABLE_PURPOSES 4
+
+/** Set <b>purposes_out</b> to the purposes of the circuits that
+ * circuit_get_best() may return when asked for <b>purpose</b> and
+ * <b>must_be_open</b>, and return how many there are. <b>purposes_out</b>
+ * must have room for MAX_ACCEPTABLE_PURPOSES of them.
+ */
+static int
+circuit_get_acceptable_purposes(uint8_t purpose, int must_be_open,
+                                uint8_t *purposes_out)
+{
+  int n = 0;
+
+  if (purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open) {
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_REND_READY;
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_REND_JOINED;
+  } else if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+             !must_be_open) {
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_INTRODUCING;
+    purposes_out[n++] = CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT;
+  } else {
+    purposes_out[n++] = purpose;
+  }
+  tor_assert(n <= MAX_ACCEPTABLE_PURPOSES);
+  return n;
+}
+
 /** Return 1 if <b>circ</b> could be returned by circuit_get_best().
  * Else return 0.
  */
@@ -111,6 +141,8 @@ circuit_is_acceptable(const origin_circuit_t *origin_circ,
   const circuit_t *circ = TO_CIRCUIT(origin_circ);
   const node_t *exitnode;
   cpath_build_state_t *build_state;
+  uint8_t purposes[MAX_ACCEPTABLE_PURPOSES];
+  int n_purposes, i;
   tor_assert(circ);
   tor_assert(conn);
   tor_assert(conn->socks_request);
@@ -121,21 +153,14 @@ circuit_is_acceptable(const origin_circuit_t *origin_circ,
     return 0;
 
   /* if this circ isn't our purpose, skip. */
-  if (purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open) {
-    if (circ->purpose != CIRCUIT_PURPOSE_C_ESTABLISH_REND &&
-        circ->purpose != CIRCUIT_PURPOSE_C_REND_READY &&
-        circ->purpose != CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED &&
-        circ->purpose != CIRCUIT_PURPOSE_C_REND_JOINED)
-      return 0;
-  } else if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
-             !must_be_open) {
-    if (circ->purpose != CIRCUIT_PURPOSE_C_INTRODUCING &&
-        circ->purpose != CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT)
-      return 0;
-  } else {
-    if (purpose != circ->purpose)
-      return 0;
+  n_purposes = circuit_get_acceptable_purposes(purpose, must_be_open,
+                                               purposes);
+  for (i = 0; i < n_purposes; ++i) {
+    if (circ->purpose == purposes[i])
+      break;
   }
+  if (i == n_purposes)
+    return 0;
 
   /* If this is a timed-out hidden service circuit, skip it. */
   if (origin_circ->hs_circ_has_timed_out) {
@@ -336,6 +361,8 @@ circuit_get_best(const entry_connection_t *conn,
   origin_circuit_t *best=NULL;
   struct timeval now;
   int intro_going_on_but_too_old = 0;
+  uint8_t purposes[MAX_ACCEPTABLE_PURPOSES];
+  int n_purposes, i;
 
   tor_assert(conn);
 
@@ -348,32 +375,38 @@ circuit_get_best(const entry_connection_t *conn,
 
   tor_gettimeofday(&now);
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    origin_circuit_t *origin_circ;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    origin_circ = TO_ORIGIN_CIRCUIT(circ);
-
-    /* Log an info message if we're going to launch a new intro circ in
-     * parallel */
-    if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
-        !must_be_open && origin_circ->hs_circ_has_timed_out &&
-        !circ->marked_for_close) {
-        intro_going_on_but_too_old = 1;
-        continue;
-    }
+  /* Only look at the circuits with a purpose that circuit_is_acceptable()
+   * could accept. */
+  n_purposes = circuit_get_acceptable_purposes(purpose, must_be_open,
+                                               purposes);
+
+  for (i = 0; i < n_purposes; ++i) {
+    SMARTLIST_FOREACH_BEGIN(circuit_get_origin_circuits_by_purpose(
+                                                                purposes[i]),
+                            origin_circuit_t *, origin_circ) {
+      const circuit_t *circ = TO_CIRCUIT(origin_circ);
+
+      /* Log an info message if we're going to launch a new intro circ in
+       * parallel */
+      if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+          !must_be_open && origin_circ->hs_circ_has_timed_out &&
+          !circ->marked_for_close) {
+          intro_going_on_but_too_old = 1;
+          continue;
+      }
 
-    if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
-                               need_uptime,need_internal, (time_t)now.tv_sec))
-      continue;
+      if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
+                                 need_uptime,need_internal,
+                                 (time_t)now.tv_sec))
+        continue;
 
-    /* now this is an acceptable circ to hand back. but that doesn't
-     * mean it's the *best* circ to hand back. try to decide.
-     */
-    if (!best || circuit_is_better(origin_circ,best,conn))
-      best = origin_circ;
+      /* now this is an acceptable circ to hand back. but that doesn't
+       * mean it's the *best* circ to hand back. try to decide.
+       */
+      if (!best || circuit_is_better(origin_circ,best,conn))
+        best = origin_circ;
+    } SMARTLIST_FOREACH_END(origin_circ);
   }
-  SMARTLIST_FOREACH_END(circ);
 
   if (!best && intro_going_on_but_too_old)
     log_info(LD_REND|LD_CIRC, "There is an intro circuit being created "
@@ -387,18 +420,29 @@ circuit_get_best(const entry_connection_t *conn,
 static int
 count_pending_general_client_circuits(void)
 {
+  /* The purposes for which CIRCUIT_PURPOSE_COUNTS_TOWARDS_MAXPENDING() is
+   * true. */
+  static const uint8_t purposes[] = {
+    CIRCUIT_PURPOSE_C_GENERAL,
+    CIRCUIT_PURPOSE_C_HSDIR_GET,
+  };
   int count = 0;
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(purposes); ++i) {
+    SMARTLIST_FOREACH_BEGIN(circuit_get_origin_circuits_by_purpose(
+                                                                purposes[i]),
+                            const origin_circuit_t *, origin_circ) {
+      const circuit_t *circ = TO_CIRCUIT(origin_circ);
+      tor_assert_nonfatal(
+                   CIRCUIT_PURPOSE_COUNTS_TOWARDS_MAXPENDING(circ->purpose));
+      if (circ->marked_for_close ||
+          circ->state == CIRCUIT_STATE_OPEN)
+        continue;
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    if (circ->marked_for_close ||
-        circ->state == CIRCUIT_STATE_OPEN ||
-        !CIRCUIT_PURPOSE_COUNTS_TOWARDS_MAXPENDING(circ->purpose) ||
-        !CIRCUIT_IS_ORIGIN(circ))
-      continue;
-
-    ++count;
+      ++count;
+    } SMARTLIST_FOREACH_END(origin_circ);
   }
-  SMARTLIST_FOREACH_END(circ);
 
   return count;
 }
@@ -3090,6 +3134,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
   circ->purpose = new_purpose;
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
+    circuit_update_purpose_list(TO_ORIGIN_CIRCUIT(circ));
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
                                           old_purpose);
   }
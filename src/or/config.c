@@ -96,6 +96,7 @@
 #include "or/rendclient.h"
 #include "or/rendservice.h"
 #include "or/hs_config.h"
+#include "or/hs_service.h"
 #include "or/rephist.h"
 #include "or/router.h"
 #include "common/sandbox.h"
@@ -112,6 +113,7 @@
 #endif
 
 #include "common/procmon.h"
+#include "common/profiler.h"
 
 #include "or/dirauth/dirvote.h"
 #include "or/dirauth/mode.h"
@@ -253,6 +255,7 @@ static config_var_t option_vars_[] = {
   V(AlternateDirAuthority,       LINELIST, NULL),
   OBSOLETE("AlternateHSAuthority"),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
   OBSOLETE("AuthDirBadDir"),
   OBSOLETE("AuthDirBadDirCCs"),
   V(AuthDirBadExit,              LINELIST, NULL),
@@ -356,6 +359,10 @@ static config_var_t option_vars_[] = {
   V(DoSConnectionEnabled,        AUTOBOOL, "auto"),
   V(DoSConnectionMaxConcurrentCount,       UINT, "0"),
   V(DoSConnectionDefenseType,    INT,      "0"),
+  /* DoS address tracking options. */
+  V(DoSIPv4PrefixLength,         UINT,     "0"),
+  V(DoSIPv6PrefixLength,         UINT,     "0"),
+  V(DoSMaxTrackedPrefixes,       UINT,     "0"),
   /* DoS single hop client options. */
   V(DoSRefuseSingleHopClientRendezvous,    AUTOBOOL, "auto"),
   V(DownloadExtraInfo,           BOOL,     "0"),
@@ -430,6 +437,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("CloseHSServiceRendCircuitsImmediatelyOnTimeout"),
   V(HiddenServiceSingleHopMode,  BOOL,     "0"),
   V(HiddenServiceNonAnonymousMode,BOOL,    "0"),
+  V(HSDirCacheCompression,       BOOL,     "0"),
   V(HTTPProxy,                   STRING,   NULL),
   V(HTTPProxyAuthenticator,      STRING,   NULL),
   V(HTTPSProxy,                  STRING,   NULL),
@@ -440,6 +448,7 @@ static config_var_t option_vars_[] = {
   V(ServerTransportListenAddr,   LINELIST, NULL),
   V(ServerTransportOptions,      LINELIST, NULL),
   V(SigningKeyLifetime,          INTERVAL, "30 days"),
+  V(SketchClientStatistics,      BOOL,     "0"),
   V(Socks4Proxy,                 STRING,   NULL),
   V(Socks5Proxy,                 STRING,   NULL),
   V(Socks5ProxyUsername,         STRING,   NULL),
@@ -463,10 +472,12 @@ static config_var_t option_vars_[] = {
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
   V(MaxConsensusAgeForDiffs,     INTERVAL, "0 seconds"),
+  V(MaxMemInHSDirCache,          MEMUNIT,  "0"),
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
   V(MaxUnparseableDescSizeToLog, MEMUNIT, "10 MB"),
+  VPORT(MetricsPort),
   V(MinMeasuredBWsForAuthToIgnoreAdvertised, INT, "500"),
   VAR("MyFamily",                LINELIST, MyFamily_lines,       NULL),
   V(NewCircuitPeriod,            INTERVAL, "30 seconds"),
@@ -2062,6 +2073,12 @@ options_act(const or_options_t *old_options)
     return -1;
   }
 
+  /* Onion services decrypt their INTRODUCE2 cells on the worker threads. At
+   * startup, do_main_loop() launches them once our keys are loaded. */
+  if (old_options && hs_service_get_num_services() > 0) {
+    cpu_init();
+  }
+
   /* Inform the scheduler subsystem that a configuration changed happened. It
    * might be a change of scheduler or parameter. */
   scheduler_conf_changed();
@@ -2251,6 +2268,8 @@ options_act(const or_options_t *old_options)
     }
   }
 
+  profiler_set_cpu_time_enabled(options->MainloopStats);
+
   /* Only collect directory-request statistics on relays and bridges. */
   options->DirReqStatistics = options->DirReqStatistics_option &&
     server_mode(options);
@@ -3474,6 +3493,21 @@ options_validate(or_options_t *old_options, or_options_t *options,
     REJECT("TokenBucketRefillInterval must be between 1 and 1000 inclusive.");
   }
 
+  /* For the DoS address tracking options, 0 means "use the consensus". */
+  if (options->DoSIPv4PrefixLength > 32) {
+    REJECT("DoSIPv4PrefixLength must be between 0 and 32 inclusive.");
+  }
+  if (options->DoSIPv6PrefixLength > 128) {
+    REJECT("DoSIPv6PrefixLength must be between 0 and 128 inclusive.");
+  }
+  if (options->DoSMaxTrackedPrefixes > DOS_MAX_TRACKED_PREFIXES_MAX) {
+    tor_asprintf(msg,
+                 "DoSMaxTrackedPrefixes must be between 0 and %d, but "
+                 "was set to %d", DOS_MAX_TRACKED_PREFIXES_MAX,
+                 options->DoSMaxTrackedPrefixes);
+    return -1;
+  }
+
   if (options->ExcludeExitNodes || options->ExcludeNodes) {
     options->ExcludeExitNodesUnion_ = routerset_new();
     routerset_union(options->ExcludeExitNodesUnion_,options->ExcludeExitNodes);
@@ -5783,8 +5817,12 @@ options_init_logs(const or_options_t *old_options, or_options_t *options,
   }
   smartlist_free(elts);
 
-  if (ok && !validate_only)
+  if (ok && !validate_only) {
     logs_set_domain_logging(options->LogMessageDomains);
+    if (logs_set_async(options->AsyncLogging) < 0)
+      log_warn(LD_CONFIG, "Couldn't start the log writer thread for "
+               "AsyncLogging. Logging synchronously instead.");
+  }
 
   return ok?0:-1;
 }
@@ -6647,6 +6685,27 @@ warn_nonlocal_ext_orports(const smartlist_t *ports, const char *portname)
   } SMARTLIST_FOREACH_END(port);
 }
 
+/** Return -1 if any MetricsPort in <b>ports</b> is on a wildcard or
+ * publicly routable address, and 0 otherwise.  The MetricsPort has no
+ * authentication, so we only serve it to our own host or network. */
+static int
+check_metrics_ports_are_private(const smartlist_t *ports)
+{
+  SMARTLIST_FOREACH_BEGIN(ports, const port_cfg_t *, port) {
+    if (port->type != CONN_TYPE_METRICS_LISTENER)
+      continue;
+    if (tor_addr_is_null(&port->addr) ||
+        !tor_addr_is_internal(&port->addr, 0)) {
+      log_warn(LD_CONFIG, "You specified the address '%s' for MetricsPort. "
+               "Anybody who can reach the MetricsPort can read its data, so "
+               "it must be on a loopback or private address.",
+               fmt_addrport(&port->addr, port->port));
+      return -1;
+    }
+  } SMARTLIST_FOREACH_END(port);
+  return 0;
+}
+
 /** Given a list of port_cfg_t in <b>ports</b>, warn if any controller port
  * there is listening on any non-loopback address.  If <b>forbid_nonlocal</b>
  * is true, then emit a stronger warning and remove the port from the list.
@@ -7403,6 +7462,15 @@ parse_ports(or_options_t *options, int validate_only,
       goto err;
     }
   }
+  if (parse_port_config(ports,
+                        options->MetricsPort_lines,
+                        "Metrics", CONN_TYPE_METRICS_LISTENER,
+                        "127.0.0.1", 0,
+                        CL_PORT_NO_STREAM_OPTIONS) < 0 ||
+      check_metrics_ports_are_private(ports) < 0) {
+    *msg = tor_strdup("Invalid MetricsPort configuration");
+    goto err;
+  }
   if (! options->ClientOnly) {
     if (parse_port_config(ports,
                           options->ORPort_lines,
@@ -86,6 +86,7 @@
 #include "or/ext_orport.h"
 #include "or/geoip.h"
 #include "or/main.h"
+#include "or/metricsport.h"
 #include "or/hibernate.h"
 #include "or/hs_common.h"
 #include "or/hs_ident.h"
@@ -103,6 +104,7 @@
 #include "or/transports.h"
 #include "or/routerparse.h"
 #include "common/sandbox.h"
+#include "lib/trace/events.h"
 
 #ifdef HAVE_PWD_H
 #include <pwd.h>
@@ -172,7 +174,8 @@ static smartlist_t *outgoing_addrs = NULL;
     case CONN_TYPE_AP_TRANS_LISTENER: \
     case CONN_TYPE_AP_NATD_LISTENER: \
     case CONN_TYPE_AP_DNS_LISTENER: \
-    case CONN_TYPE_AP_HTTP_CONNECT_LISTENER
+    case CONN_TYPE_AP_HTTP_CONNECT_LISTENER: \
+    case CONN_TYPE_METRICS_LISTENER
 
 /**************************************************************/
 
@@ -221,6 +224,8 @@ conn_type_to_string(int type)
     case CONN_TYPE_EXT_OR: return "Extended OR";
     case CONN_TYPE_EXT_OR_LISTENER: return "Extended OR listener";
     case CONN_TYPE_AP_HTTP_CONNECT_LISTENER: return "HTTP tunnel listener";
+    case CONN_TYPE_METRICS_LISTENER: return "Metrics listener";
+    case CONN_TYPE_METRICS: return "Metrics";
     default:
       log_warn(LD_BUG, "unknown connection type %d", type);
       tor_snprintf(buf, sizeof(buf), "unknown [%d]", type);
@@ -306,6 +311,11 @@ conn_state_to_string(int type, int state)
           return "waiting for authentication (protocol v1)";
       }
       break;
+    case CONN_TYPE_METRICS:
+      switch (state) {
+        case METRICS_CONN_STATE_OPEN: return "waiting for request";
+      }
+      break;
   }
 
   log_warn(LD_BUG, "unknown connection state %d (type %d)", state, type);
@@ -1675,6 +1685,10 @@ connection_handle_listener_read(connection_t *conn, int new_type)
       log_notice(LD_CONTROL, "New control connection opened from %s.",
                  fmt_and_decorate_addr(&addr));
     }
+    if (new_type == CONN_TYPE_METRICS) {
+      log_info(LD_NET, "New MetricsPort connection opened from %s.",
+               fmt_and_decorate_addr(&addr));
+    }
 
   } else if (conn->socket_family == AF_UNIX && conn->type != CONN_TYPE_AP) {
     tor_assert(conn->type == CONN_TYPE_CONTROL_LISTENER);
@@ -1767,6 +1781,9 @@ connection_init_accepted_conn(connection_t *conn,
     case CONN_TYPE_CONTROL:
       conn->state = CONTROL_CONN_STATE_NEEDAUTH;
       break;
+    case CONN_TYPE_METRICS:
+      conn->state = METRICS_CONN_STATE_OPEN;
+      break;
   }
   return 0;
 }
@@ -3379,6 +3396,8 @@ connection_handle_read_impl(connection_t *conn)
       return connection_handle_listener_read(conn, CONN_TYPE_DIR);
     case CONN_TYPE_CONTROL_LISTENER:
       return connection_handle_listener_read(conn, CONN_TYPE_CONTROL);
+    case CONN_TYPE_METRICS_LISTENER:
+      return connection_handle_listener_read(conn, CONN_TYPE_METRICS);
     case CONN_TYPE_AP_DNS_LISTENER:
       /* This should never happen; eventdns.c handles the reads here. */
       tor_fragile_assert();
@@ -3926,6 +3945,8 @@ connection_handle_write_impl(connection_t *conn, int force)
      * the *_buf_tls functions, we should make them return ssize_t or size_t
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
+    if (result > 0)
+      connection_or_cell_latency_probe_flushed(or_conn, (size_t)result);
   } else {
     CONN_LOG_PROTECT(conn,
                      result = buf_flush_to_socket(conn->outbuf, conn->s,
@@ -3969,6 +3990,8 @@ connection_handle_write_impl(connection_t *conn, int force)
   }
 
   connection_buckets_decrement(conn, approx_time(), n_read, n_written);
+  tor_trace(connection, flush, conn->global_identifier, conn->type, result,
+            n_written, conn->outbuf_flushlen);
 
   if (result > 0) {
     /* If we wrote any bytes from our buffer, then call the appropriate
@@ -4384,7 +4407,8 @@ connection_is_listener(connection_t *conn)
       conn->type == CONN_TYPE_AP_NATD_LISTENER ||
       conn->type == CONN_TYPE_AP_HTTP_CONNECT_LISTENER ||
       conn->type == CONN_TYPE_DIR_LISTENER ||
-      conn->type == CONN_TYPE_CONTROL_LISTENER)
+      conn->type == CONN_TYPE_CONTROL_LISTENER ||
+      conn->type == CONN_TYPE_METRICS_LISTENER)
     return 1;
   return 0;
 }
@@ -4567,6 +4591,8 @@ connection_process_inbuf(connection_t *conn, int package_partial)
       return connection_dir_process_inbuf(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_process_inbuf(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_process_inbuf(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -4625,6 +4651,8 @@ connection_finished_flushing(connection_t *conn)
       return connection_dir_finished_flushing(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_finished_flushing(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_finished_flushing(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -4680,6 +4708,8 @@ connection_reached_eof(connection_t *conn)
       return connection_dir_reached_eof(TO_DIR_CONN(conn));
     case CONN_TYPE_CONTROL:
       return connection_control_reached_eof(TO_CONTROL_CONN(conn));
+    case CONN_TYPE_METRICS:
+      return connection_metrics_reached_eof(conn);
     default:
       log_err(LD_BUG,"got unexpected conn type %d.", conn->type);
       tor_fragile_assert();
@@ -5142,6 +5172,10 @@ assert_connection_ok(connection_t *conn, time_t now)
       tor_assert(conn->state >= CONTROL_CONN_STATE_MIN_);
       tor_assert(conn->state <= CONTROL_CONN_STATE_MAX_);
       break;
+    case CONN_TYPE_METRICS:
+      tor_assert(conn->state >= METRICS_CONN_STATE_MIN_);
+      tor_assert(conn->state <= METRICS_CONN_STATE_MAX_);
+      break;
     default:
       tor_assert(0);
   }
@@ -60,6 +60,7 @@
 #include "or/scheduler.h"
 #include "or/torcert.h"
 #include "or/channelpadding.h"
+#include "lib/trace/events.h"
 
 #include "or/cell_st.h"
 #include "or/cell_queue_st.h"
@@ -2284,6 +2285,49 @@ connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
     channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 }
 
+/** Called when we have just added to <b>conn</b>'s outbuf a cell that was
+ * queued on its circuit at <b>queued_timestamp</b>.  Unless we are already
+ * following a cell through the outbuf, start following this one, so that
+ * we can tell how long it waits there. */
+void
+connection_or_cell_latency_probe_start(or_connection_t *conn,
+                                       uint32_t queued_timestamp)
+{
+  tor_assert(conn);
+  if (conn->cell_latency_probe_bytes)
+    return;
+  conn->cell_latency_probe_bytes = connection_get_outbuf_len(TO_CONN(conn));
+  conn->cell_latency_probe_queued = queued_timestamp;
+  conn->cell_latency_probe_added = monotime_coarse_get_stamp();
+}
+
+/** Called when we have flushed <b>n_flushed</b> bytes from <b>conn</b>'s
+ * outbuf to TLS.  If that includes the cell that we are following, note
+ * how long it waited in the outbuf and since it was queued. */
+void
+connection_or_cell_latency_probe_flushed(or_connection_t *conn,
+                                         size_t n_flushed)
+{
+  uint32_t now;
+
+  tor_assert(conn);
+  if (!conn->cell_latency_probe_bytes)
+    return;
+  if (n_flushed < conn->cell_latency_probe_bytes) {
+    conn->cell_latency_probe_bytes -= n_flushed;
+    return;
+  }
+
+  now = monotime_coarse_get_stamp();
+  rep_hist_note_cell_latency(CELL_LATENCY_OUTBUF,
+           (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+                                now - conn->cell_latency_probe_added));
+  rep_hist_note_cell_latency(CELL_LATENCY_TOTAL,
+           (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+                                now - conn->cell_latency_probe_queued));
+  conn->cell_latency_probe_bytes = 0;
+}
+
 /** See whether there's a variable-length cell waiting on <b>or_conn</b>'s
  * inbuf.  Return values as for fetch_var_cell_from_buf(). */
 static int
@@ -2333,6 +2377,8 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
+      tor_trace(orconn, var_cell_recv, TO_CONN(conn)->global_identifier,
+                var_cell->circ_id, var_cell->command, var_cell->payload_len);
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
@@ -2355,6 +2401,8 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
        * network-order string) */
       cell_unpack(&cell, buf, wide_circ_ids);
 
+      tor_trace(orconn, cell_recv, TO_CONN(conn)->global_identifier,
+                cell.circ_id, cell.command);
       channel_tls_handle_cell(&cell, conn);
     }
   }
@@ -87,6 +87,10 @@ void connection_or_write_cell_to_buf(const cell_t *cell,
                                      or_connection_t *conn);
 MOCK_DECL(void,connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
                                                    or_connection_t *conn));
+void connection_or_cell_latency_probe_start(or_connection_t *conn,
+                                            uint32_t queued_timestamp);
+void connection_or_cell_latency_probe_flushed(or_connection_t *conn,
+                                              size_t n_flushed);
 int connection_or_send_versions(or_connection_t *conn, int v3_plus);
 MOCK_DECL(int,connection_or_send_netinfo,(or_connection_t *conn));
 int connection_or_send_certs_cell(or_connection_t *conn);
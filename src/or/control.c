@@ -106,6 +106,7 @@
 
 #include "lib/crypt_ops/crypto_s2k.h"
 #include "common/procmon.h"
+#include "common/profiler.h"
 
 /** Yield true iff <b>s</b> is the state of a control_connection_t that has
  * finished authentication and is accepting commands. */
@@ -1923,6 +1924,10 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
   } else if (!strcmp(question, "limits/max-mem-in-queues")) {
     tor_asprintf(answer, U64_FORMAT,
                  U64_PRINTF_ARG(get_options()->MaxMemInQueues));
+  } else if (!strcmp(question, "stats/cell-latency")) {
+    *answer = rep_hist_format_cell_latency();
+  } else if (!strcmp(question, "stats/mainloop")) {
+    *answer = profiler_format_entries();
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_t *server_key;
     if (!server_mode(get_options())) {
@@ -3353,6 +3358,11 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  ITEM("stats/cell-latency", misc,
+       "How long relayed cells have waited in each stage of the outbound "
+       "path."),
+  ITEM("stats/mainloop", misc,
+       "Time spent in each main loop callback, and main loop lag."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -14,9 +14,12 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for decrypting INTRODUCE2 cells in hs_service.c.
  *  </ul>
  **/
+
+#define CPUWORKER_PRIVATE
 #include "or/or.h"
 #include "or/channel.h"
 #include "or/circuitbuild.h"
@@ -31,10 +34,14 @@
 #include "or/rephist.h"
 #include "or/router.h"
 #include "common/workqueue.h"
+#include "common/compat_libevent.h"
+#include "common/metrics.h"
+#include "lib/trace/events.h"
 
 #include "or/or_circuit_st.h"
 
 static void queue_pending_tasks(void);
+static void flush_onion_batch_cb(mainloop_event_t *ev, void *arg);
 
 typedef struct worker_state_s {
   int generation;
@@ -77,6 +84,10 @@ static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
 
+/** Event to queue the onionskins that we've been collecting into a batch,
+ * once we're done with the current round of the main loop. */
+static mainloop_event_t *flush_onion_batch_event = NULL;
+
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
  * during Tor's lifetime.
  */
@@ -104,12 +115,23 @@ cpu_init(void)
 
     tor_assert(r == 0);
   }
+  if (!flush_onion_batch_event) {
+    flush_onion_batch_event =
+      mainloop_event_postloop_new(flush_onion_batch_cb, NULL);
+  }
 
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
   crypto_seed_weak_rng(&request_sample_rng);
 }
 
+/** Return true iff cpu_init() has started the worker threads. */
+int
+cpuworker_is_running(void)
+{
+  return threadpool != NULL;
+}
+
 /** Magic numbers to make sure our cpuworker_requests don't grow any
  * mis-framing bugs. */
 #define CPUWORKER_REQUEST_MAGIC 0xda4afeed
@@ -170,6 +192,30 @@ typedef struct cpuworker_job_u {
   } u;
 } cpuworker_job_t;
 
+/** Largest number of onionskins that we put in a single batch. */
+#define CPUWORKER_BATCH_MAX 8
+
+/** A batch of onionskin jobs.  We queue each batch as a single piece of
+ * work: one worker thread handles all of its jobs back to back, and the main
+ * thread gets all of their replies at once.  This saves us a work
+ * allocation, a reply, and a wakeup per onionskin when we're busy.
+ *
+ * We only put more than one onionskin in a batch when there is already
+ * work on the threadpool that no worker thread has started, so that
+ * batching never leaves a thread idle. */
+typedef struct cpuworker_batch_t {
+  /** How many jobs do we have room for? */
+  int n_alloc;
+  /** How many jobs are there? */
+  int n_jobs;
+  /** The jobs themselves. */
+  cpuworker_job_t jobs[FLEXIBLE_ARRAY_MEMBER];
+} cpuworker_batch_t;
+
+/** The batch to which we're adding onionskins, if any.  We haven't queued it
+ * on the threadpool yet. */
+static cpuworker_batch_t *open_batch = NULL;
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -217,6 +263,32 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** Upper bounds, in seconds, of the buckets of the onionskin timing
+ * histograms. */
+static const double onionskin_time_bounds[] = {
+  0.00005, 0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05,
+  0.1, 0.2, 0.5, 1.0,
+};
+/** Indexed by handshake type: histograms of the time that the cpuworkers
+ * spent on the onionskins that we timed, and of the time between queueing
+ * those onionskins and getting the answers. */
+static metrics_histogram_t onionskin_internal_metric[
+                                            MAX_ONION_HANDSHAKE_TYPE+1] = {
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+};
+static metrics_histogram_t onionskin_roundtrip_metric[
+                                            MAX_ONION_HANDSHAKE_TYPE+1] = {
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+  METRICS_HISTOGRAM_INIT(onionskin_time_bounds),
+};
+/** Indexed by handshake type: how many answers have we had from the
+ * cpuworkers, and how many of them were failures? */
+static metrics_counter_t onionskins_n_answered[MAX_ONION_HANDSHAKE_TYPE+1];
+static metrics_counter_t onionskins_n_failed[MAX_ONION_HANDSHAKE_TYPE+1];
+
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
@@ -308,11 +380,46 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Register the cpuworker metrics with the metrics subsystem. */
+void
+cpuworker_register_metrics(void)
+{
+  static const uint16_t types[] = { ONION_HANDSHAKE_TYPE_TAP,
+                                    ONION_HANDSHAKE_TYPE_FAST,
+                                    ONION_HANDSHAKE_TYPE_NTOR };
+  static const char *names[] = { "tap", "fast", "ntor" };
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(types); ++i) {
+    char *labels = NULL;
+    const uint16_t t = types[i];
+
+    tor_asprintf(&labels, "type=\"%s\"", names[i]);
+    metrics_register_counter(&onionskins_n_answered[t],
+                             "tor_cpuworker_onionskins_total",
+                             "Onionskins answered by the cpuworkers.",
+                             labels);
+    metrics_register_counter(&onionskins_n_failed[t],
+                             "tor_cpuworker_onionskins_failed_total",
+                             "Onionskins that the cpuworkers could not "
+                             "decode.", labels);
+    metrics_register_histogram(&onionskin_internal_metric[t],
+                               "tor_cpuworker_onionskin_seconds",
+                               "Time spent by a cpuworker on a sample of "
+                               "the onionskins.", labels);
+    metrics_register_histogram(&onionskin_roundtrip_metric[t],
+                               "tor_cpuworker_onionskin_roundtrip_seconds",
+                               "Time from queueing a sample of the "
+                               "onionskins to getting their answers.",
+                               labels);
+    tor_free(labels);
+  }
+}
+
+/** Handle the reply to a single onionskin job from the worker threads. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_one(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -323,6 +430,8 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memcpy(&rpl, &job->u.reply, sizeof(rpl));
 
   tor_assert(rpl.magic == CPUWORKER_REPLY_MAGIC);
+  tor_trace(cpuworker, job_reply, job, job->circ, rpl.handshake_type,
+            rpl.success);
 
   if (rpl.timed && rpl.success &&
       rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
@@ -338,6 +447,11 @@ cpuworker_onion_handshake_replyfn(void *work_)
       ++onionskins_n_processed[rpl.handshake_type];
       onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
+      metrics_histogram_observe(&onionskin_internal_metric[rpl.handshake_type],
+                                rpl.n_usec / 1e6);
+      metrics_histogram_observe(
+                             &onionskin_roundtrip_metric[rpl.handshake_type],
+                             usec_roundtrip / 1e6);
       if (onionskins_n_processed[rpl.handshake_type] >= 500000) {
         /* Scale down every 500000 handshakes.  On a busy server, that's
          * less impressive than it sounds. */
@@ -348,6 +462,12 @@ cpuworker_onion_handshake_replyfn(void *work_)
     }
   }
 
+  if (rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
+    metrics_counter_inc(&onionskins_n_answered[rpl.handshake_type]);
+    if (!rpl.success)
+      metrics_counter_inc(&onionskins_n_failed[rpl.handshake_type]);
+  }
+
   circ = job->circ;
 
   log_debug(LD_OR,
@@ -393,17 +513,28 @@ cpuworker_onion_handshake_replyfn(void *work_)
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
-  tor_free(job);
+}
+
+/** Handle a reply from the worker threads to a batch of onionskins. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
+{
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_onion_handshake_reply_one(&batch->jobs[i]);
+  }
+
+  tor_free(batch);
   queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
+/** Process a single onionskin job in a worker thread with state
+ * <b>state</b>. */
 static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+cpuworker_onion_handshake_one(worker_state_t *state, cpuworker_job_t *job)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
-
   /* variables for onion processing */
   server_onion_keys_t *onion_keys = state->onion_keys;
   cpuworker_request_t req;
@@ -423,12 +554,14 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   rpl.handshake_type = cc->handshake_type;
   if (req.timed)
     tor_gettimeofday(&tv_start);
+  tor_trace(cpuworker, job_start, job, cc->handshake_type);
   n = onion_skin_server_handshake(cc->handshake_type,
                                   cc->onionskin, cc->handshake_len,
                                   onion_keys,
                                   cell_out->reply,
                                   rpl.keys, CPATH_KEY_MATERIAL_LEN,
                                   rpl.rend_auth_material);
+  tor_trace(cpuworker, job_finish, job, cc->handshake_type, n);
   if (n < 0) {
     /* failure */
     log_debug(LD_OR,"onion_skin_server_handshake failed.");
@@ -471,6 +604,118 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   return WQ_RPL_REPLY;
 }
 
+/** Implementation function for onion handshake requests: process every
+ * onionskin in a batch. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  int i;
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    workqueue_reply_t r = cpuworker_onion_handshake_one(state,
+                                                        &batch->jobs[i]);
+    if (r != WQ_RPL_REPLY)
+      return r;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Allocate and return a new empty batch with room for <b>n_alloc</b>
+ * jobs. */
+static cpuworker_batch_t *
+cpuworker_batch_new(int n_alloc)
+{
+  cpuworker_batch_t *batch =
+    tor_malloc_zero(sizeof(cpuworker_batch_t) +
+                    n_alloc * sizeof(cpuworker_job_t));
+  batch->n_alloc = n_alloc;
+  return batch;
+}
+
+/** If <b>batch</b> has a job for <b>circ</b>, remove it from the batch and
+ * return true.  Otherwise return false. */
+static int
+cpuworker_batch_remove_circ(cpuworker_batch_t *batch, or_circuit_t *circ)
+{
+  int i;
+  for (i = 0; i < batch->n_jobs; ++i) {
+    if (batch->jobs[i].circ != circ)
+      continue;
+    /* Order doesn't matter, so move the last job into this slot. */
+    if (i != batch->n_jobs - 1)
+      memcpy(&batch->jobs[i], &batch->jobs[batch->n_jobs - 1],
+             sizeof(cpuworker_job_t));
+    --batch->n_jobs;
+    memwipe(&batch->jobs[batch->n_jobs], 0xe0, sizeof(cpuworker_job_t));
+    tor_assert(total_pending_tasks > 0);
+    --total_pending_tasks;
+    return 1;
+  }
+  return 0;
+}
+
+/** Queue <b>batch</b> on the threadpool, and take ownership of it.  Return 0
+ * on success, or -1 on failure. */
+static int
+cpuworker_batch_queue(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  tor_assert(batch->n_jobs > 0);
+
+  queue_entry = threadpool_queue_work_priority(threadpool,
+                                      WQ_PRI_HIGH,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      batch);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= batch->n_jobs;
+    memwipe(batch, 0, sizeof(cpuworker_batch_t) +
+            batch->n_alloc * sizeof(cpuworker_job_t));
+    tor_free(batch);
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued batch %p of %d onionskins (qe=%p)",
+            batch, batch->n_jobs, queue_entry);
+
+  for (i = 0; i < batch->n_jobs; ++i) {
+    batch->jobs[i].circ->workqueue_entry = queue_entry;
+  }
+  return 0;
+}
+
+/** Queue the batch of onionskins that we've been collecting, if any.
+ * Return 0 on success, or -1 on failure. */
+static int
+cpuworker_flush_open_batch(void)
+{
+  cpuworker_batch_t *batch = open_batch;
+  open_batch = NULL;
+  if (!batch)
+    return 0;
+  if (batch->n_jobs == 0) {
+    tor_free(batch);
+    return 0;
+  }
+  return cpuworker_batch_queue(batch);
+}
+
+/** Callback: once we're done with a round of the main loop, queue the
+ * onionskins that we collected during it. */
+static void
+flush_onion_batch_cb(mainloop_event_t *ev, void *arg)
+{
+  (void) ev;
+  (void) arg;
+  if (cpuworker_flush_open_batch() < 0)
+    log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+}
+
 /** Take pending tasks from the queue and assign them to cpuworkers. */
 static void
 queue_pending_tasks(void)
@@ -514,10 +759,9 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
   cpuworker_job_t *job;
   cpuworker_request_t req;
-  int should_time;
+  int should_time, workers_are_busy;
 
   tor_assert(threadpool);
 
@@ -551,49 +795,89 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   if (should_time)
     tor_gettimeofday(&req.started_at);
 
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  /* If nothing is waiting for a worker thread, don't make this onionskin
+   * wait for others to join it.  We share the threadpool with other kinds
+   * of work, so we count all of it. */
+  workers_are_busy = threadpool_get_n_queued(threadpool) > 0;
+  if (!open_batch)
+    open_batch = cpuworker_batch_new(workers_are_busy ?
+                                     CPUWORKER_BATCH_MAX : 1);
+
+  job = &open_batch->jobs[open_batch->n_jobs++];
   job->circ = circ;
   memcpy(&job->u.request, &req, sizeof(req));
   memwipe(&req, 0, sizeof(req));
 
   ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
-  }
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
+  log_debug(LD_OR, "Added task %p to batch %p (circ=%p)",
+            job, open_batch, job->circ);
+  tor_trace(cpuworker, job_assign, job, circ,
+            job->u.request.create_cell.handshake_type, open_batch->n_jobs);
 
-  circ->workqueue_entry = queue_entry;
+  if (!workers_are_busy || open_batch->n_jobs == open_batch->n_alloc)
+    return cpuworker_flush_open_batch();
 
+  mainloop_event_activate(flush_onion_batch_event);
   return 0;
 }
 
+/** Release the storage held by the cpuworker subsystem in the main thread.
+ * The worker threads keep running. */
+void
+cpuworker_free_all(void)
+{
+  /* The circuits in the open batch are freed along with the others. */
+  tor_free(open_batch);
+  mainloop_event_free(flush_onion_batch_event);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the threadpool that the cpuworkers use, or NULL if we haven't
+ * started it. */
+STATIC threadpool_t *
+cpuworker_get_threadpool(void)
+{
+  return threadpool;
+}
+
+/** Return the number of onionskins in the batch that we haven't queued
+ * yet. */
+STATIC int
+cpuworker_get_open_batch_len(void)
+{
+  return open_batch ? open_batch->n_jobs : 0;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
  * remove it from the worker queue. */
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
-  if (circ->workqueue_entry == NULL)
+  cpuworker_batch_t *batch;
+  int i;
+  if (circ->workqueue_entry == NULL) {
+    /* It may be in the batch that we haven't queued yet. */
+    if (open_batch)
+      cpuworker_batch_remove_circ(open_batch, circ);
     return;
+  }
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
+  batch = workqueue_entry_cancel(circ->workqueue_entry);
+  if (batch) {
+    /* It successfully cancelled.  Queue the rest of its batch again. */
+    cpuworker_batch_remove_circ(batch, circ);
     circ->workqueue_entry = NULL;
+    for (i = 0; i < batch->n_jobs; ++i) {
+      batch->jobs[i].circ->workqueue_entry = NULL;
+    }
+    if (batch->n_jobs == 0) {
+      tor_free(batch);
+    } else if (cpuworker_batch_queue(batch) < 0) {
+      log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    }
   }
+  /* if (!batch), this is done in cpuworker_onion_handshake_replyfn. */
 }
 
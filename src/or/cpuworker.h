@@ -13,6 +13,7 @@
 #define TOR_CPUWORKER_H
 
 void cpu_init(void);
+int cpuworker_is_running(void);
 void cpuworkers_rotate_keyinfo(void);
 struct workqueue_entry_s;
 enum workqueue_reply_t;
@@ -32,6 +33,16 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
+void cpuworker_register_metrics(void);
+void cpuworker_free_all(void);
+
+#ifdef CPUWORKER_PRIVATE
+#ifdef TOR_UNIT_TESTS
+struct threadpool_s;
+STATIC struct threadpool_s *cpuworker_get_threadpool(void);
+STATIC int cpuworker_get_open_batch_len(void);
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(CPUWORKER_PRIVATE) */
 
 #endif /* !defined(TOR_CPUWORKER_H) */
 
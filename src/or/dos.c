@@ -9,11 +9,11 @@
 #define DOS_PRIVATE
 
 #include "or/or.h"
+#include "common/metrics.h"
 #include "or/channel.h"
 #include "or/config.h"
 #include "or/connection_or.h"
 #include "lib/crypt_ops/crypto_rand.h"
-#include "or/geoip.h"
 #include "or/main.h"
 #include "or/networkstatus.h"
 #include "or/nodelist.h"
@@ -70,6 +70,51 @@ static uint64_t conn_num_addr_rejected;
 /* Keep stats for the heartbeat. */
 static uint64_t num_single_hop_client_refused;
 
+/* Consensus parameters controlling the DoS state table. */
+static uint32_t dos_ipv4_prefix_length;
+static uint32_t dos_ipv6_prefix_length;
+static uint32_t dos_max_tracked_prefixes;
+
+/*
+ * DoS state table.
+ *
+ * The statistics of both mitigations are kept per address prefix, so that
+ * an attacker can't escape the limits by spreading over the many addresses
+ * of a single allocation, in a table that is separate from the geoip client
+ * cache. It is an open addressing hash table with linear probing whose
+ * fixed-size records embed the circuit token bucket, and it never holds more
+ * than DoSMaxTrackedPrefixes records.
+ *
+ * A record can be dropped without losing anything when its prefix has no
+ * open connection, isn't marked, and its circuit bucket would be full again
+ * on the next refill, because a new record would then behave in exactly the
+ * same way. Those idle records are only purged when the table needs to grow
+ * or is full.
+ */
+
+/* A record of the DoS state table. */
+typedef struct dos_state_entry_t {
+  /* The tracked prefix, as an IPv6 address with all bits past the prefix
+   * length cleared. IPv4 prefixes are stored as IPv4-mapped addresses. */
+  uint8_t prefix[16];
+  /* Hash of the prefix, or 0 if this slot is unused. */
+  uint32_t hash;
+  /* Statistics of all the addresses in the prefix. */
+  dos_client_stats_t stats;
+} dos_state_entry_t;
+
+/* Smallest number of slots the DoS state table is allocated with. */
+#define DOS_STATE_TABLE_MIN_CAPACITY 256
+
+/* The DoS state table: an array of state_table_capacity slots, of which
+ * state_table_n_entries are used. The capacity is always a power of two,
+ * and the table is never more than three quarters full. */
+static dos_state_entry_t *state_table = NULL;
+static uint32_t state_table_capacity = 0;
+static uint32_t state_table_n_entries = 0;
+/* When did we last purge idle records because the table was full? */
+static time_t state_table_last_purge_ts = 0;
+
 /* Return true iff the circuit creation mitigation is enabled. We look at the
  * consensus for this else a default value is returned. */
 MOCK_IMPL(STATIC unsigned int,
@@ -186,12 +231,300 @@ get_param_conn_defense_type(const networkstatus_t *ns)
                                  DOS_CONN_DEFENSE_NONE, DOS_CONN_DEFENSE_MAX);
 }
 
+/* Return the parameter for the length of the IPv4 prefixes that we track as
+ * a single client. */
+static uint32_t
+get_param_ipv4_prefix_length(const networkstatus_t *ns)
+{
+  if (get_options()->DoSIPv4PrefixLength) {
+    return get_options()->DoSIPv4PrefixLength;
+  }
+  return networkstatus_get_param(ns, "DoSIPv4PrefixLength",
+                                 DOS_IPV4_PREFIX_LENGTH_DEFAULT, 1, 32);
+}
+
+/* Return the parameter for the length of the IPv6 prefixes that we track as
+ * a single client. */
+static uint32_t
+get_param_ipv6_prefix_length(const networkstatus_t *ns)
+{
+  if (get_options()->DoSIPv6PrefixLength) {
+    return get_options()->DoSIPv6PrefixLength;
+  }
+  return networkstatus_get_param(ns, "DoSIPv6PrefixLength",
+                                 DOS_IPV6_PREFIX_LENGTH_DEFAULT, 1, 128);
+}
+
+/* Return the parameter for the maximum number of address prefixes that we
+ * keep statistics for. */
+STATIC uint32_t
+get_param_max_tracked_prefixes(const networkstatus_t *ns)
+{
+  if (get_options()->DoSMaxTrackedPrefixes) {
+    return get_options()->DoSMaxTrackedPrefixes;
+  }
+  return networkstatus_get_param(ns, "DoSMaxTrackedPrefixes",
+                                 DOS_MAX_TRACKED_PREFIXES_DEFAULT,
+                                 1, DOS_MAX_TRACKED_PREFIXES_MAX);
+}
+
+/* DoS state table private API. */
+
+/* Set <b>prefix_out</b> to the tracked prefix that contains <b>addr</b>,
+ * in the form stored in a dos_state_entry_t. Return 0 on success, or -1 if
+ * we don't track addresses of that family. */
+static int
+dos_state_make_prefix(const tor_addr_t *addr, uint8_t *prefix_out)
+{
+  unsigned int bits, i;
+
+  switch (tor_addr_family(addr)) {
+  case AF_INET:
+    memset(prefix_out, 0, 10);
+    prefix_out[10] = prefix_out[11] = 0xff;
+    set_uint32(prefix_out + 12, tor_addr_to_ipv4n(addr));
+    bits = 96 + dos_ipv4_prefix_length;
+    break;
+  case AF_INET6:
+    memcpy(prefix_out, tor_addr_to_in6_addr8(addr), 16);
+    bits = dos_ipv6_prefix_length;
+    break;
+  default:
+    return -1;
+  }
+
+  for (i = 0; i < 16; ++i) {
+    if (bits >= 8) {
+      bits -= 8;
+    } else {
+      prefix_out[i] &= (uint8_t) (0xff00 >> bits);
+      bits = 0;
+    }
+  }
+  return 0;
+}
+
+/* Return the hash of <b>prefix</b> that we use in the state table. It is
+ * never 0, since that marks an unused slot. */
+static inline uint32_t
+dos_state_hash(const uint8_t *prefix)
+{
+  uint32_t hash = (uint32_t) siphash24g(prefix, 16);
+  return hash ? hash : 1;
+}
+
+/* Return the slot of the state table that holds <b>prefix</b>, or the
+ * unused slot where it should be inserted if it isn't in the table. The
+ * table must have been allocated. */
+static dos_state_entry_t *
+dos_state_find_slot(const uint8_t *prefix, uint32_t hash)
+{
+  const uint32_t mask = state_table_capacity - 1;
+  uint32_t idx = hash & mask;
+
+  /* This terminates because the table is never full. */
+  while (state_table[idx].hash) {
+    if (state_table[idx].hash == hash &&
+        fast_memeq(state_table[idx].prefix, prefix, 16)) {
+      break;
+    }
+    idx = (idx + 1) & mask;
+  }
+  return &state_table[idx];
+}
+
+/* Return true iff dropping the given statistics at <b>now</b> loses nothing
+ * because a new record for the same prefix would behave identically. */
+static int
+dos_state_stats_are_idle(const dos_client_stats_t *stats, time_t now)
+{
+  const cc_client_stats_t *cc_stats = &stats->cc_stats;
+  uint64_t elapsed_time_last_refill;
+
+  if (stats->concurrent_count > 0 || cc_stats->marked_until_ts >= now) {
+    return 0;
+  }
+  /* Never filled buckets and clock jumps both refill to the burst. */
+  if (cc_stats->last_circ_bucket_refill_ts == 0 ||
+      now < cc_stats->last_circ_bucket_refill_ts) {
+    return 1;
+  }
+  elapsed_time_last_refill =
+    (uint64_t) now - cc_stats->last_circ_bucket_refill_ts;
+  if (elapsed_time_last_refill > UINT32_MAX) {
+    return 1;
+  }
+  return cc_stats->circuit_bucket +
+         elapsed_time_last_refill * dos_cc_circuit_rate >=
+         dos_cc_circuit_burst;
+}
+
+/* Move every record of the state table into a new table of
+ * <b>new_capacity</b> slots, which must be a power of two. If <b>now</b> is
+ * positive, drop the records that are idle at that time. */
+static void
+dos_state_table_rebuild(uint32_t new_capacity, time_t now)
+{
+  dos_state_entry_t *old_table = state_table;
+  uint32_t old_capacity = state_table_capacity, i;
+
+  tor_assert(new_capacity >= DOS_STATE_TABLE_MIN_CAPACITY);
+  tor_assert((new_capacity & (new_capacity - 1)) == 0);
+
+  state_table = tor_calloc(new_capacity, sizeof(dos_state_entry_t));
+  state_table_capacity = new_capacity;
+  state_table_n_entries = 0;
+
+  for (i = 0; i < old_capacity; ++i) {
+    const dos_state_entry_t *ent = &old_table[i];
+    if (!ent->hash) {
+      continue;
+    }
+    if (now > 0 && dos_state_stats_are_idle(&ent->stats, now)) {
+      continue;
+    }
+    *dos_state_find_slot(ent->prefix, ent->hash) = *ent;
+    state_table_n_entries++;
+  }
+  /* The new table must still have room for everything we kept. */
+  tor_assert_nonfatal((uint64_t) state_table_n_entries * 4 <=
+                      (uint64_t) state_table_capacity * 3);
+  tor_free(old_table);
+}
+
+/* Release the state table. */
+static void
+dos_state_table_free(void)
+{
+  tor_free(state_table);
+  state_table_capacity = 0;
+  state_table_n_entries = 0;
+  state_table_last_purge_ts = 0;
+}
+
+/* Forget every record of the state table. The connections we were counting
+ * won't be found in it anymore, so stop tracking them as well so we don't
+ * try to decrement a counter that doesn't exist. */
+static void
+dos_state_table_reset(void)
+{
+  if (!state_table_n_entries) {
+    goto end;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_OR) {
+      TO_OR_CONN(conn)->tracked_for_dos_mitigation = 0;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+ end:
+  dos_state_table_free();
+}
+
+/* Return the statistics of the prefix that contains <b>addr</b>, or NULL if
+ * we have none. */
+STATIC dos_client_stats_t *
+dos_state_lookup(const tor_addr_t *addr)
+{
+  uint8_t prefix[16];
+  dos_state_entry_t *ent;
+
+  tor_assert(addr);
+
+  if (!state_table_n_entries || dos_state_make_prefix(addr, prefix) < 0) {
+    return NULL;
+  }
+  ent = dos_state_find_slot(prefix, dos_state_hash(prefix));
+  return ent->hash ? &ent->stats : NULL;
+}
+
+/* Return the number of address prefixes in the state table. */
+STATIC uint32_t
+dos_state_n_entries(void)
+{
+  return state_table_n_entries;
+}
+
+/* Return the statistics of the prefix that contains <b>addr</b>, adding a
+ * new record for it at <b>now</b> if we have none. Return NULL if the
+ * address can't be tracked, which happens if the table is full of prefixes
+ * that are in use. */
+STATIC dos_client_stats_t *
+dos_state_lookup_or_add(const tor_addr_t *addr, time_t now)
+{
+  uint8_t prefix[16];
+  uint32_t hash;
+  dos_state_entry_t *ent;
+
+  tor_assert(addr);
+
+  if (dos_state_make_prefix(addr, prefix) < 0) {
+    return NULL;
+  }
+  hash = dos_state_hash(prefix);
+  if (state_table) {
+    ent = dos_state_find_slot(prefix, hash);
+    if (ent->hash) {
+      return &ent->stats;
+    }
+  }
+
+  if (state_table_n_entries >= dos_max_tracked_prefixes) {
+    /* Purging is a full pass over the table, so do it at most once per
+     * second while we are full. */
+    if (state_table_last_purge_ts != now) {
+      state_table_last_purge_ts = now;
+      dos_state_table_rebuild(state_table_capacity, now);
+    }
+    if (state_table_n_entries >= dos_max_tracked_prefixes) {
+      static ratelim_t full_limit = RATELIM_INIT(3600);
+      log_fn_ratelim(&full_limit, LOG_NOTICE, LD_DOS,
+                     "DoS mitigation is tracking %" PRIu32 " address "
+                     "prefixes, which is the maximum. New prefixes won't be "
+                     "tracked until some become idle. You can raise the "
+                     "limit with DoSMaxTrackedPrefixes.",
+                     dos_state_n_entries());
+      return NULL;
+    }
+  }
+
+  /* Keep the load factor at or below 3/4, which keeps probes short. Idle
+   * records are dropped while we are moving everything anyway. */
+  if ((uint64_t) (state_table_n_entries + 1) * 4 >
+      (uint64_t) state_table_capacity * 3) {
+    uint32_t new_capacity = state_table_capacity ?
+      state_table_capacity * 2 : DOS_STATE_TABLE_MIN_CAPACITY;
+    dos_state_table_rebuild(new_capacity, now);
+  }
+
+  ent = dos_state_find_slot(prefix, hash);
+  memset(ent, 0, sizeof(*ent));
+  memcpy(ent->prefix, prefix, sizeof(ent->prefix));
+  ent->hash = hash;
+  state_table_n_entries++;
+  return &ent->stats;
+}
+
 /* Set circuit creation parameters located in the consensus or their default
  * if none are present. Called at initialization or when the consensus
  * changes. */
 static void
 set_dos_parameters(const networkstatus_t *ns)
 {
+  uint32_t ipv4_prefix_length = get_param_ipv4_prefix_length(ns);
+  uint32_t ipv6_prefix_length = get_param_ipv6_prefix_length(ns);
+
+  /* The records of the state table are keyed by prefix, so they can't be
+   * kept if the prefix lengths change. */
+  if (ipv4_prefix_length != dos_ipv4_prefix_length ||
+      ipv6_prefix_length != dos_ipv6_prefix_length) {
+    dos_state_table_reset();
+  }
+  dos_ipv4_prefix_length = ipv4_prefix_length;
+  dos_ipv6_prefix_length = ipv6_prefix_length;
+  dos_max_tracked_prefixes = get_param_max_tracked_prefixes(ns);
+
   /* Get the default consensus param values. */
   dos_cc_enabled = get_param_cc_enabled(ns);
   dos_cc_min_concurrent_conn = get_param_cc_min_concurrent_connection(ns);
@@ -369,7 +702,7 @@ cc_channel_addr_is_marked(channel_t *chan)
 {
   time_t now;
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *entry;
   cc_client_stats_t *stats = NULL;
 
   if (chan == NULL) {
@@ -384,16 +717,16 @@ cc_channel_addr_is_marked(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+  /* We are only interested in addresses that we track. */
+  entry = dos_state_lookup(&addr);
   if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+    /* We can have a connection creating circuits but not tracked by the DoS
+     * state table. Once this DoS subsystem is enabled, we can end up here
+     * with no entry for the channel. */
     goto end;
   }
   now = approx_time();
-  stats = &entry->dos_stats.cc_stats;
+  stats = &entry->cc_stats;
 
  end:
   return stats && stats->marked_until_ts >= now;
@@ -437,7 +770,7 @@ void
 dos_cc_new_create_cell(channel_t *chan)
 {
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *entry;
 
   tor_assert(chan);
 
@@ -455,12 +788,13 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
+  /* We are only interested in addresses that we track. */
+  entry = dos_state_lookup(&addr);
   if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+    /* We can have a connection creating circuits but not tracked by the DoS
+     * state table. Once this DoS subsystem is enabled, we can end up here
+     * with no entry for the channel. Without a tracked connection, the
+     * address can't be detected anyway. */
     goto end;
   }
 
@@ -471,26 +805,26 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* First of all, we'll try to refill the circuit bucket opportunistically
    * before we assess. */
-  cc_stats_refill_bucket(&entry->dos_stats.cc_stats, &addr);
+  cc_stats_refill_bucket(&entry->cc_stats, &addr);
 
   /* Take a token out of the circuit bucket if we are above 0 so we don't
    * underflow the bucket. */
-  if (entry->dos_stats.cc_stats.circuit_bucket > 0) {
-    entry->dos_stats.cc_stats.circuit_bucket--;
+  if (entry->cc_stats.circuit_bucket > 0) {
+    entry->cc_stats.circuit_bucket--;
   }
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(entry)) {
     /* If this is the first time we mark this entry, log it a info level.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
-    if (entry->dos_stats.cc_stats.marked_until_ts == 0) {
+    if (entry->cc_stats.marked_until_ts == 0) {
       log_debug(LD_DOS, "Detected circuit creation DoS by address: %s",
                 fmt_addr(&addr));
       cc_num_marked_addrs++;
     }
-    cc_mark_client(&entry->dos_stats.cc_stats);
+    cc_mark_client(&entry->cc_stats);
   }
 
  end:
@@ -530,7 +864,7 @@ dos_cc_get_defense_type(channel_t *chan)
 dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *entry;
 
   tor_assert(addr);
 
@@ -539,15 +873,15 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
+  /* We are only interested in addresses that we track. */
+  entry = dos_state_lookup(addr);
   if (entry == NULL) {
     goto end;
   }
 
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (entry->concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -558,41 +892,6 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 
 /* General API */
 
-/* Take any appropriate actions for the given geoip entry that is about to get
- * freed. This is called for every entry that is being freed.
- *
- * This function will clear out the connection tracked flag if the concurrent
- * count of the entry is above 0 so if those connections end up being seen by
- * this subsystem, we won't try to decrement the counter for a new geoip entry
- * that might have been added after this call for the same address. */
-void
-dos_geoip_entry_about_to_free(const clientmap_entry_t *geoip_ent)
-{
-  tor_assert(geoip_ent);
-
-  /* The count is down to 0 meaning no connections right now, we can safely
-   * clear the geoip entry from the cache. */
-  if (geoip_ent->dos_stats.concurrent_count == 0) {
-    goto end;
-  }
-
-  /* For each connection matching the geoip entry address, we'll clear the
-   * tracked flag because the entry is about to get removed from the geoip
-   * cache. We do not try to decrement if the flag is not set. */
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
-                            CMP_EXACT)) {
-        or_conn->tracked_for_dos_mitigation = 0;
-      }
-    }
-  } SMARTLIST_FOREACH_END(conn);
-
- end:
-  return;
-}
-
 /* Note down that we've just refused a single hop client. This increments a
  * counter later used for the heartbeat. */
 void
@@ -620,6 +919,30 @@ dos_should_refuse_single_hop_client(void)
                                        0 /* default */, 0, 1);
 }
 
+/* Register the statistics that we keep for the heartbeat with the metrics
+ * subsystem. */
+void
+dos_register_metrics(void)
+{
+  metrics_register_counter_fn(metrics_read_u64, &cc_num_rejected_cells,
+                              "tor_dos_circuit_rejected_cells_total",
+                              "CREATE cells rejected by the circuit creation "
+                              "DoS mitigation.", NULL);
+  metrics_register_counter_fn(metrics_read_u32, &cc_num_marked_addrs,
+                              "tor_dos_circuit_marked_addresses_total",
+                              "Addresses marked as malicious by the circuit "
+                              "creation DoS mitigation.", NULL);
+  metrics_register_counter_fn(metrics_read_u64, &conn_num_addr_rejected,
+                              "tor_dos_connection_rejected_total",
+                              "Connections rejected by the concurrent "
+                              "connection DoS mitigation.", NULL);
+  metrics_register_counter_fn(metrics_read_u64,
+                              &num_single_hop_client_refused,
+                              "tor_dos_single_hop_refused_total",
+                              "Single hop clients refused as a rendezvous "
+                              "point.", NULL);
+}
+
 /* Log a heartbeat message with some statistics. */
 void
 dos_log_heartbeat(void)
@@ -672,7 +995,7 @@ dos_log_heartbeat(void)
 void
 dos_new_client_conn(or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *entry;
 
   tor_assert(or_conn);
 
@@ -690,20 +1013,17 @@ dos_new_client_conn(or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (BUG(entry == NULL)) {
-    /* Should never happen because we note down the address in the geoip
-     * cache before this is called. */
+  entry = dos_state_lookup_or_add(&or_conn->real_addr, approx_time());
+  if (entry == NULL) {
+    /* The state table is full, or this isn't an address we can track. */
     goto end;
   }
 
-  entry->dos_stats.concurrent_count++;
+  entry->concurrent_count++;
   or_conn->tracked_for_dos_mitigation = 1;
   log_debug(LD_DOS, "Client address %s has now %u concurrent connections.",
             fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            entry->concurrent_count);
 
  end:
   return;
@@ -713,7 +1033,7 @@ dos_new_client_conn(or_connection_t *or_conn)
 void
 dos_close_client_conn(const or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *entry;
 
   tor_assert(or_conn);
 
@@ -724,27 +1044,25 @@ dos_close_client_conn(const or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* This can happen because we can close a connection before the channel
-     * got to be noted down in the geoip cache. */
+  /* A record with open connections is never dropped from the state table,
+   * and connections stop being tracked when the table is reset. */
+  entry = dos_state_lookup(&or_conn->real_addr);
+  if (BUG(entry == NULL)) {
     goto end;
   }
 
   /* Extra super duper safety. Going below 0 means an underflow which could
    * lead to most likely a false positive. In theory, this should never happen
    * but lets be extra safe. */
-  if (BUG(entry->dos_stats.concurrent_count == 0)) {
+  if (BUG(entry->concurrent_count == 0)) {
     goto end;
   }
 
-  entry->dos_stats.concurrent_count--;
+  entry->concurrent_count--;
   log_debug(LD_DOS, "Client address %s has lost a connection. Concurrent "
                     "connections are now at %u",
             fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            entry->concurrent_count);
 
  end:
   return;
@@ -789,6 +1107,10 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  /* Both subsystems keep their statistics in the state table. */
+  dos_state_table_free();
+  dos_ipv4_prefix_length = dos_ipv6_prefix_length = 0;
 }
 
 /* Initialize the Denial of Service subsystem. */
@@ -29,8 +29,9 @@ typedef struct cc_client_stats_t {
 } cc_client_stats_t;
 
 /* This object is a top level object that contains everything related to the
- * per-IP client DoS mitigation. Because it is per-IP, it is used in the geoip
- * clientmap_entry_t object. */
+ * per-address client DoS mitigation. One is kept for every tracked address
+ * prefix (see DoSIPv4PrefixLength and DoSIPv6PrefixLength) in the DoS state
+ * table of dos.c. */
 typedef struct dos_client_stats_t {
   /* Concurrent connection count from the specific address. 2^32 is most
    * likely way too big for the amount of allowed file descriptors. */
@@ -43,15 +44,22 @@ typedef struct dos_client_stats_t {
 
 /* General API. */
 
-/* Stub. */
-struct clientmap_entry_t;
+/* DoSIPv4PrefixLength default: every IPv4 address is tracked on its own. */
+#define DOS_IPV4_PREFIX_LENGTH_DEFAULT 32
+/* DoSIPv6PrefixLength default: a /64 is usually assigned to a single
+ * customer, so we track it as one client. */
+#define DOS_IPV6_PREFIX_LENGTH_DEFAULT 64
+/* DoSMaxTrackedPrefixes default. */
+#define DOS_MAX_TRACKED_PREFIXES_DEFAULT (1 << 18)
+/* Largest value of DoSMaxTrackedPrefixes that we honor. */
+#define DOS_MAX_TRACKED_PREFIXES_MAX (1 << 28)
 
 void dos_init(void);
 void dos_free_all(void);
 void dos_consensus_has_changed(const networkstatus_t *ns);
 int dos_enabled(void);
 void dos_log_heartbeat(void);
-void dos_geoip_entry_about_to_free(const struct clientmap_entry_t *geoip_ent);
+void dos_register_metrics(void);
 
 void dos_new_client_conn(or_connection_t *or_conn);
 void dos_close_client_conn(const or_connection_t *or_conn);
@@ -125,10 +133,17 @@ STATIC uint32_t get_param_cc_circuit_burst(const networkstatus_t *ns);
 STATIC uint32_t get_param_cc_min_concurrent_connection(
                                             const networkstatus_t *ns);
 
+STATIC uint32_t get_param_max_tracked_prefixes(const networkstatus_t *ns);
+
 STATIC uint64_t get_circuit_rate_per_second(void);
 STATIC void cc_stats_refill_bucket(cc_client_stats_t *stats,
                                    const tor_addr_t *addr);
 
+STATIC dos_client_stats_t *dos_state_lookup(const tor_addr_t *addr);
+STATIC dos_client_stats_t *dos_state_lookup_or_add(const tor_addr_t *addr,
+                                                   time_t now);
+STATIC uint32_t dos_state_n_entries(void);
+
 MOCK_DECL(STATIC unsigned int, get_param_cc_enabled,
           (const networkstatus_t *ns));
 MOCK_DECL(STATIC unsigned int, get_param_conn_enabled,
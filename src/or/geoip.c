@@ -15,7 +15,10 @@
  *
  * The geoip lookup tables are implemented as sorted lists of disjoint address
  * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * are also indexed by their names in a hashtable.  To avoid a binary search
+ * over the whole list on every lookup, the IPv4 table has a direct index on
+ * the first 16 bits of the address, and the IPv6 table has a small prefix
+ * trie; both narrow each lookup down to a few candidate ranges.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
  * function.  For more information on the file format they read, see that
@@ -31,29 +34,126 @@
 #include "or/or.h"
 #include "ht.h"
 #include "common/buffers.h"
+#include "common/hyperloglog.h"
 #include "or/config.h"
 #include "or/control.h"
 #include "or/dnsserv.h"
-#include "or/dos.h"
 #include "or/geoip.h"
 #include "or/routerlist.h"
 
 static void init_geoip_countries(void);
 
-/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
+/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country.
+ *
+ * This layout is also used, unchanged, in compiled GeoIP database files. */
 typedef struct geoip_ipv4_entry_t {
   uint32_t ip_low; /**< The lowest IP in the range, in host order */
   uint32_t ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
+  uint32_t country; /**< An index into geoip_countries, or into the
+                     * table's country_map if it has one. */
 } geoip_ipv4_entry_t;
 
-/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country. */
+/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country.
+ *
+ * This layout is also used, unchanged, in compiled GeoIP database files. */
 typedef struct geoip_ipv6_entry_t {
   struct in6_addr ip_low; /**< The lowest IP in the range, in host order */
   struct in6_addr ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
+  uint32_t country; /**< An index into geoip_countries, or into the
+                     * table's country_map if it has one. */
 } geoip_ipv6_entry_t;
 
+/** Number of leading bits of an IPv4 address that we use as a direct index
+ * into the IPv4 lookup table. */
+#define GEOIP_IPV4_INDEX_BITS 16
+/** Number of distinct prefixes in the IPv4 direct index. */
+#define GEOIP_IPV4_INDEX_SIZE (1u<<GEOIP_IPV4_INDEX_BITS)
+
+/** A GeoIP lookup table for IPv4 addresses.
+ *
+ * The ranges are kept in a single flat array, sorted by ip_low, with
+ * overlapping ranges removed.  Once the table is indexed, <b>index</b> maps
+ * every /16 prefix to the first range whose ip_high falls in that prefix or
+ * in a later one, so that a lookup only has to search the handful of ranges
+ * between index[prefix] and index[prefix+1]. */
+typedef struct geoip_ipv4_table_t {
+  /** Array of all known ranges. */
+  geoip_ipv4_entry_t *entries;
+  /** Number of ranges in <b>entries</b>. */
+  unsigned n_entries;
+  /** Number of ranges we have allocated space for in <b>entries</b>. */
+  unsigned n_allocated;
+  /** True iff <b>entries</b> is sorted and <b>index</b> is up-to-date. */
+  unsigned is_indexed;
+  /** Array of GEOIP_IPV4_INDEX_SIZE+1 positions in <b>entries</b>, as
+   * described above. */
+  uint32_t *index;
+  /** If this table was loaded from a compiled database, the read-only
+   * mapping that holds <b>entries</b> and <b>index</b>.  Otherwise NULL. */
+  tor_mmap_t *map;
+  /** If <b>map</b> is set, an array of <b>n_countries</b> positions in
+   * geoip_countries, indexed by the country numbers used in the database. */
+  uint32_t *country_map;
+  /** Number of elements in <b>country_map</b>. */
+  unsigned n_countries;
+} geoip_ipv4_table_t;
+
+/** Number of address bits consumed by each level of the IPv6 trie. */
+#define GEOIP_IPV6_TRIE_STRIDE 4
+/** Number of children of each IPv6 trie node. */
+#define GEOIP_IPV6_TRIE_FANOUT (1u<<GEOIP_IPV6_TRIE_STRIDE)
+/** Number of levels needed to consume an entire IPv6 address. */
+#define GEOIP_IPV6_TRIE_MAX_DEPTH (128 / GEOIP_IPV6_TRIE_STRIDE)
+/** Largest number of ranges that we search linearly instead of splitting a
+ * prefix into a new trie node. */
+#define GEOIP_IPV6_TRIE_LEAF_MAX 8
+/** Flag set in geoip_ipv6_trie_node_t.n when the slot refers to a child
+ * node rather than to a run of ranges. */
+#define GEOIP_IPV6_TRIE_CHILD (1u<<31)
+
+/** A node in the IPv6 prefix trie.  Each node covers one prefix, and has one
+ * slot for each value of the next GEOIP_IPV6_TRIE_STRIDE address bits. */
+typedef struct geoip_ipv6_trie_node_t {
+  /** For each slot, the position of the first range that overlaps the
+   * slot's prefix. */
+  uint32_t first[GEOIP_IPV6_TRIE_FANOUT];
+  /** For each slot, either the number of ranges starting at first[] that
+   * overlap the slot's prefix, or GEOIP_IPV6_TRIE_CHILD ORed with the index
+   * of the node that splits the slot further. */
+  uint32_t n[GEOIP_IPV6_TRIE_FANOUT];
+} geoip_ipv6_trie_node_t;
+
+/** A GeoIP lookup table for IPv6 addresses.
+ *
+ * As for IPv4, the ranges are kept in a sorted flat array.  Once the table
+ * is indexed, <b>nodes</b> holds a prefix trie (rooted at nodes[0]) that
+ * narrows every lookup down to at most GEOIP_IPV6_TRIE_LEAF_MAX candidate
+ * ranges. */
+typedef struct geoip_ipv6_table_t {
+  /** Array of all known ranges. */
+  geoip_ipv6_entry_t *entries;
+  /** Number of ranges in <b>entries</b>. */
+  unsigned n_entries;
+  /** Number of ranges we have allocated space for in <b>entries</b>. */
+  unsigned n_allocated;
+  /** True iff <b>entries</b> is sorted and <b>nodes</b> is up-to-date. */
+  unsigned is_indexed;
+  /** Array of trie nodes. */
+  geoip_ipv6_trie_node_t *nodes;
+  /** Number of nodes in <b>nodes</b>. */
+  unsigned n_nodes;
+  /** Number of nodes we have allocated space for in <b>nodes</b>. */
+  unsigned n_nodes_allocated;
+  /** If this table was loaded from a compiled database, the read-only
+   * mapping that holds <b>entries</b> and <b>nodes</b>.  Otherwise NULL. */
+  tor_mmap_t *map;
+  /** If <b>map</b> is set, an array of <b>n_countries</b> positions in
+   * geoip_countries, indexed by the country numbers used in the database. */
+  uint32_t *country_map;
+  /** Number of elements in <b>country_map</b>. */
+  unsigned n_countries;
+} geoip_ipv6_table_t;
+
 /** A per-country record for GeoIP request history. */
 typedef struct geoip_country_t {
   char countrycode[3];
@@ -66,9 +166,10 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
- * by their respective ip_low. */
-static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
+/** Lookup tables for all known IPv4 and IPv6 ranges, or NULL if we have not
+ * loaded any data for the respective family. */
+static geoip_ipv4_table_t *geoip_ipv4_table = NULL;
+static geoip_ipv6_table_t *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
@@ -123,19 +224,63 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Allocate and return a new, empty IPv4 lookup table. */
+static geoip_ipv4_table_t *
+geoip_ipv4_table_new(void)
 {
-  intptr_t idx;
-  void *idxplus1_;
+  return tor_malloc_zero(sizeof(geoip_ipv4_table_t));
+}
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+/** Release all storage held by the IPv4 lookup table <b>t</b>. */
+static void
+geoip_ipv4_table_free_(geoip_ipv4_table_t *t)
+{
+  if (!t)
     return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+  if (t->map) {
+    tor_munmap_file(t->map);
+  } else {
+    tor_free(t->entries);
+    tor_free(t->index);
+  }
+  tor_free(t->country_map);
+  tor_free(t);
+}
+#define geoip_ipv4_table_free(t) \
+  FREE_AND_NULL(geoip_ipv4_table_t, geoip_ipv4_table_free_, (t))
+
+/** Allocate and return a new, empty IPv6 lookup table. */
+static geoip_ipv6_table_t *
+geoip_ipv6_table_new(void)
+{
+  return tor_malloc_zero(sizeof(geoip_ipv6_table_t));
+}
+
+/** Release all storage held by the IPv6 lookup table <b>t</b>. */
+static void
+geoip_ipv6_table_free_(geoip_ipv6_table_t *t)
+{
+  if (!t)
     return;
+  if (t->map) {
+    tor_munmap_file(t->map);
+  } else {
+    tor_free(t->entries);
+    tor_free(t->nodes);
+  }
+  tor_free(t->country_map);
+  tor_free(t);
+}
+#define geoip_ipv6_table_free(t) \
+  FREE_AND_NULL(geoip_ipv6_table_t, geoip_ipv6_table_free_, (t))
+
+/** Return the position of the 2-letter country code <b>country</b> in
+ * geoip_countries, adding it if it is not already there. */
+static intptr_t
+geoip_add_country(const char *country)
+{
+  intptr_t idx;
+  void *idxplus1_;
 
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
@@ -153,19 +298,107 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** If <b>t</b> was loaded from a compiled database, copy its entries onto
+ * the heap so that we can add to them, and release the mapping. */
+static void
+geoip_ipv4_table_unshare(geoip_ipv4_table_t *t)
+{
+  geoip_ipv4_entry_t *entries;
+  unsigned i;
+
+  if (!t->map)
+    return;
+  entries = tor_calloc(t->n_entries ? t->n_entries : 1,
+                       sizeof(geoip_ipv4_entry_t));
+  for (i = 0; i < t->n_entries; ++i) {
+    entries[i] = t->entries[i];
+    entries[i].country = entries[i].country < t->n_countries ?
+      t->country_map[entries[i].country] : 0;
+  }
+  tor_munmap_file(t->map);
+  t->map = NULL;
+  tor_free(t->country_map);
+  t->n_countries = 0;
+  t->entries = entries;
+  t->n_allocated = t->n_entries ? t->n_entries : 1;
+  t->index = NULL;
+  t->is_indexed = 0;
+}
+
+/** If <b>t</b> was loaded from a compiled database, copy its entries onto
+ * the heap so that we can add to them, and release the mapping. */
+static void
+geoip_ipv6_table_unshare(geoip_ipv6_table_t *t)
+{
+  geoip_ipv6_entry_t *entries;
+  unsigned i;
+
+  if (!t->map)
+    return;
+  entries = tor_calloc(t->n_entries ? t->n_entries : 1,
+                       sizeof(geoip_ipv6_entry_t));
+  for (i = 0; i < t->n_entries; ++i) {
+    entries[i] = t->entries[i];
+    entries[i].country = entries[i].country < t->n_countries ?
+      t->country_map[entries[i].country] : 0;
+  }
+  tor_munmap_file(t->map);
+  t->map = NULL;
+  tor_free(t->country_map);
+  t->n_countries = 0;
+  t->entries = entries;
+  t->n_allocated = t->n_entries ? t->n_entries : 1;
+  t->nodes = NULL;
+  t->n_nodes = t->n_nodes_allocated = 0;
+  t->is_indexed = 0;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
-    geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
+    geoip_ipv4_table_t *t = geoip_ipv4_table;
+    geoip_ipv4_entry_t *ent;
+    geoip_ipv4_table_unshare(t);
+    if (t->n_entries == t->n_allocated) {
+      t->n_allocated = t->n_allocated ? t->n_allocated * 2 : 1024;
+      t->entries = tor_reallocarray(t->entries, t->n_allocated,
+                                    sizeof(geoip_ipv4_entry_t));
+    }
+    ent = &t->entries[t->n_entries++];
     ent->ip_low = tor_addr_to_ipv4h(low);
     ent->ip_high = tor_addr_to_ipv4h(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv4_entries, ent);
+    ent->country = (uint32_t)idx;
+    t->is_indexed = 0;
   } else if (tor_addr_family(low) == AF_INET6) {
-    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
+    geoip_ipv6_table_t *t = geoip_ipv6_table;
+    geoip_ipv6_entry_t *ent;
+    geoip_ipv6_table_unshare(t);
+    if (t->n_entries == t->n_allocated) {
+      t->n_allocated = t->n_allocated ? t->n_allocated * 2 : 1024;
+      t->entries = tor_reallocarray(t->entries, t->n_allocated,
+                                    sizeof(geoip_ipv6_entry_t));
+    }
+    ent = &t->entries[t->n_entries++];
     ent->ip_low = *tor_addr_to_in6_assert(low);
     ent->ip_high = *tor_addr_to_in6_assert(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv6_entries, ent);
+    ent->country = (uint32_t)idx;
+    t->is_indexed = 0;
   }
 }
 
@@ -181,11 +414,11 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (!geoip_countries)
     init_geoip_countries();
   if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
-      geoip_ipv4_entries = smartlist_new();
+    if (!geoip_ipv4_table)
+      geoip_ipv4_table = geoip_ipv4_table_new();
   } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
-      geoip_ipv6_entries = smartlist_new();
+    if (!geoip_ipv6_table)
+      geoip_ipv6_table = geoip_ipv6_table_new();
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -241,9 +474,9 @@ geoip_parse_entry(const char *line, sa_family_t family)
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv4_entry_t */
 static int
-geoip_ipv4_compare_entries_(const void **_a, const void **_b)
+geoip_ipv4_compare_entries_(const void *_a, const void *_b)
 {
-  const geoip_ipv4_entry_t *a = *_a, *b = *_b;
+  const geoip_ipv4_entry_t *a = _a, *b = _b;
   if (a->ip_low < b->ip_low)
     return -1;
   else if (a->ip_low > b->ip_low)
@@ -252,48 +485,168 @@ geoip_ipv4_compare_entries_(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv6_entry_t */
 static int
-geoip_ipv6_compare_entries_(const void **_a, const void **_b)
+geoip_ipv6_compare_entries_(const void *_a, const void *_b)
 {
-  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
+  const geoip_ipv6_entry_t *a = _a, *b = _b;
   return fast_memcmp(a->ip_low.s6_addr, b->ip_low.s6_addr,
                      sizeof(struct in6_addr));
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
+/** Sort the ranges in <b>t</b>, drop any range that overlaps an earlier one,
+ * and rebuild the /16 direct index. */
+static void
+geoip_ipv4_table_build_index(geoip_ipv4_table_t *t)
 {
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
+  unsigned i, n_kept = 0, n_dropped = 0;
+  uint32_t prefix;
 
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
+  qsort(t->entries, t->n_entries, sizeof(geoip_ipv4_entry_t),
+        geoip_ipv4_compare_entries_);
+  for (i = 0; i < t->n_entries; ++i) {
+    if (n_kept && t->entries[i].ip_low <= t->entries[n_kept-1].ip_high) {
+      ++n_dropped;
+      continue;
+    }
+    t->entries[n_kept++] = t->entries[i];
+  }
+  t->n_entries = n_kept;
+  if (n_dropped)
+    log_info(LD_GENERAL, "Ignored %u overlapping IPv4 GeoIP ranges.",
+             n_dropped);
+
+  if (!t->index)
+    t->index = tor_calloc(GEOIP_IPV4_INDEX_SIZE + 1, sizeof(uint32_t));
+  /* Since the ranges are disjoint and sorted by ip_low, they are sorted by
+   * ip_high too, so we can fill in the index in one pass. */
+  i = 0;
+  for (prefix = 0; prefix < GEOIP_IPV4_INDEX_SIZE; ++prefix) {
+    const uint32_t prefix_low = prefix << (32 - GEOIP_IPV4_INDEX_BITS);
+    while (i < t->n_entries && t->entries[i].ip_high < prefix_low)
+      ++i;
+    t->index[prefix] = i;
+  }
+  t->index[GEOIP_IPV4_INDEX_SIZE] = t->n_entries;
+  t->is_indexed = 1;
+}
+
+/** Return the value of the <b>depth</b>th GEOIP_IPV6_TRIE_STRIDE-bit group
+ * of <b>addr</b>, counting from the most significant bits. */
+static inline unsigned
+geoip_ipv6_trie_slot(const struct in6_addr *addr, unsigned depth)
+{
+  const uint8_t byte = addr->s6_addr[depth / 2];
+  return (depth & 1) ? (byte & 0x0f) : (byte >> 4);
+}
+
+/** Set <b>lo_out</b> and <b>hi_out</b> to the lowest and highest addresses
+ * that start with the first <b>depth</b> bit groups of <b>prefix</b>,
+ * followed by the group <b>slot</b>. */
+static void
+geoip_ipv6_trie_slot_bounds(const struct in6_addr *prefix, unsigned depth,
+                            unsigned slot, struct in6_addr *lo_out,
+                            struct in6_addr *hi_out)
+{
+  unsigned i;
+  uint8_t *lo = lo_out->s6_addr, *hi = hi_out->s6_addr;
+  memcpy(lo, prefix->s6_addr, sizeof(struct in6_addr));
+  if (depth & 1) {
+    lo[depth/2] = (lo[depth/2] & 0xf0) | slot;
+    i = depth/2 + 1;
+  } else {
+    lo[depth/2] = slot << 4;
+    i = depth/2;
+  }
+  memcpy(hi, lo, sizeof(struct in6_addr));
+  if (!(depth & 1))
+    hi[i++] |= 0x0f;
+  for ( ; i < sizeof(struct in6_addr); ++i) {
+    lo[i] = 0;
+    hi[i] = 0xff;
+  }
+}
+
+/** Add a trie node to <b>t</b> for the addresses that start with the first
+ * <b>depth</b> bit groups of <b>prefix</b>.  The ranges that overlap this
+ * prefix are those between positions <b>lo</b> (inclusive) and <b>hi</b>
+ * (exclusive).  Return the index of the new node. */
+static uint32_t
+geoip_ipv6_trie_build_node(geoip_ipv6_table_t *t,
+                           const struct in6_addr *prefix, unsigned depth,
+                           uint32_t lo, uint32_t hi)
+{
+  geoip_ipv6_trie_node_t node;
+  uint32_t node_idx, start = lo, end = lo;
+  unsigned slot;
+
+  if (t->n_nodes == t->n_nodes_allocated) {
+    t->n_nodes_allocated = t->n_nodes_allocated ? t->n_nodes_allocated*2 : 64;
+    t->nodes = tor_reallocarray(t->nodes, t->n_nodes_allocated,
+                                sizeof(geoip_ipv6_trie_node_t));
+  }
+  node_idx = t->n_nodes++;
+
+  for (slot = 0; slot < GEOIP_IPV6_TRIE_FANOUT; ++slot) {
+    struct in6_addr slot_lo, slot_hi;
+    geoip_ipv6_trie_slot_bounds(prefix, depth, slot, &slot_lo, &slot_hi);
+    while (start < hi &&
+           fast_memcmp(t->entries[start].ip_high.s6_addr, slot_lo.s6_addr,
+                       sizeof(struct in6_addr)) < 0)
+      ++start;
+    if (end < start)
+      end = start;
+    while (end < hi &&
+           fast_memcmp(t->entries[end].ip_low.s6_addr, slot_hi.s6_addr,
+                       sizeof(struct in6_addr)) <= 0)
+      ++end;
+
+    node.first[slot] = start;
+    if (end - start > GEOIP_IPV6_TRIE_LEAF_MAX &&
+        depth + 1 < GEOIP_IPV6_TRIE_MAX_DEPTH) {
+      node.n[slot] = GEOIP_IPV6_TRIE_CHILD |
+        geoip_ipv6_trie_build_node(t, &slot_lo, depth + 1, start, end);
+    } else {
+      node.n[slot] = end - start;
+    }
+  }
+
+  /* Recursive calls may have moved t->nodes, so copy the node in last. */
+  memcpy(&t->nodes[node_idx], &node, sizeof(node));
+  return node_idx;
+}
+
+/** Sort the ranges in <b>t</b>, drop any range that overlaps an earlier one,
+ * and rebuild the prefix trie. */
+static void
+geoip_ipv6_table_build_index(geoip_ipv6_table_t *t)
+{
+  unsigned i, n_kept = 0, n_dropped = 0;
+  struct in6_addr root_prefix;
+
+  qsort(t->entries, t->n_entries, sizeof(geoip_ipv6_entry_t),
+        geoip_ipv6_compare_entries_);
+  for (i = 0; i < t->n_entries; ++i) {
+    if (n_kept &&
+        fast_memcmp(t->entries[i].ip_low.s6_addr,
+                    t->entries[n_kept-1].ip_high.s6_addr,
+                    sizeof(struct in6_addr)) <= 0) {
+      ++n_dropped;
+      continue;
+    }
+    t->entries[n_kept++] = t->entries[i];
+  }
+  t->n_entries = n_kept;
+  if (n_dropped)
+    log_info(LD_GENERAL, "Ignored %u overlapping IPv6 GeoIP ranges.",
+             n_dropped);
+
+  tor_free(t->nodes);
+  t->n_nodes = t->n_nodes_allocated = 0;
+  memset(&root_prefix, 0, sizeof(root_prefix));
+  geoip_ipv6_trie_build_node(t, &root_prefix, 0, 0, t->n_entries);
+  t->is_indexed = 1;
 }
 
 /** Return 1 if we should collect geoip stats on bridge users, and
@@ -322,6 +675,189 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Magic string at the start of every compiled GeoIP database. */
+#define GEOIP_DB_MAGIC "TORGEOIP"
+/** Length of GEOIP_DB_MAGIC, not counting the NUL. */
+#define GEOIP_DB_MAGIC_LEN 8
+/** Version of the compiled GeoIP database format that we understand. */
+#define GEOIP_DB_VERSION 1
+/** Value of the byte-order field of a compiled GeoIP database that was
+ * written in our native byte order. */
+#define GEOIP_DB_BYTE_ORDER_MARK 0x01020304u
+/** Length of the header of a compiled GeoIP database. */
+#define GEOIP_DB_HEADER_LEN 64
+
+/** Try to load a compiled GeoIP database for <b>family</b> from
+ * <b>filename</b>, replacing the current table for that family.
+ *
+ * A compiled database, as produced by src/config/geoip-compile.py, holds
+ * the same lookup table that we would build after parsing the text file, so
+ * that we can map it read-only and use it as-is.  That makes loading it take
+ * constant time, and lets every tor process on a host share one copy of it.
+ * All integers are in the byte order of the machine that will use the file.
+ * It contains:
+ *
+ *   - A 64-byte header: the 8-byte magic "TORGEOIP"; uint32 fields for the
+ *     byte-order mark 0x01020304, the format version (1), the address family
+ *     (4 or 6), the number of countries, the number of ranges, and the number
+ *     of index elements; the 20-byte SHA1 digest of the text file it was
+ *     compiled from; and 12 bytes of zeros.
+ *   - One 2-byte code for each country, of ASCII letters or digits (as in
+ *     the legacy "A1") or "??", padded with zeros to a multiple of 4 bytes.
+ *   - The sorted, disjoint ranges, as geoip_ipv4_entry_t or
+ *     geoip_ipv6_entry_t.  Their country fields are positions in the list of
+ *     country codes above.
+ *   - For IPv4, the GEOIP_IPV4_INDEX_SIZE+1 elements of the direct index;
+ *     for IPv6, the nodes of the prefix trie, as geoip_ipv6_trie_node_t, with
+ *     the root first and every child after its parent.
+ *
+ * Return 1 if <b>filename</b> is not a compiled GeoIP database, 0 if we
+ * loaded it, or -1 if it is one but we could not use it.
+ */
+static int
+geoip_load_compiled_file(sa_family_t family, const char *filename)
+{
+  tor_mmap_t *map;
+  const char *data, *countries, *entries, *index_data;
+  const char *problem = NULL;
+  uint32_t n_countries, n_entries, n_index;
+  uint64_t countries_len, entries_len, index_len;
+  uint32_t *country_map;
+  unsigned i;
+
+  map = tor_mmap_file(filename);
+  if (!map)
+    return 1;
+  data = map->data;
+  if (map->size < GEOIP_DB_HEADER_LEN ||
+      fast_memneq(data, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN)) {
+    tor_munmap_file(map);
+    return 1;
+  }
+
+  n_countries = get_uint32(data + 20);
+  n_entries = get_uint32(data + 24);
+  n_index = get_uint32(data + 28);
+  countries_len = ((uint64_t)n_countries * 2 + 3) & ~(uint64_t)3;
+  if (family == AF_INET) {
+    entries_len = (uint64_t)n_entries * sizeof(geoip_ipv4_entry_t);
+    index_len = (uint64_t)n_index * sizeof(uint32_t);
+  } else {
+    entries_len = (uint64_t)n_entries * sizeof(geoip_ipv6_entry_t);
+    index_len = (uint64_t)n_index * sizeof(geoip_ipv6_trie_node_t);
+  }
+
+  if (get_uint32(data + 8) != GEOIP_DB_BYTE_ORDER_MARK) {
+    problem = "compiled for a machine with a different byte order";
+    goto err;
+  }
+  if (get_uint32(data + 12) != GEOIP_DB_VERSION) {
+    problem = "in an unsupported format version";
+    goto err;
+  }
+  if (get_uint32(data + 16) != (family == AF_INET ? 4 : 6)) {
+    problem = "for the wrong address family";
+    goto err;
+  }
+  if (n_entries >= GEOIP_IPV6_TRIE_CHILD ||
+      (family == AF_INET && n_index != GEOIP_IPV4_INDEX_SIZE + 1) ||
+      (family == AF_INET6 && n_index == 0) ||
+      GEOIP_DB_HEADER_LEN + countries_len + entries_len + index_len !=
+        map->size) {
+    problem = "truncated or corrupt";
+    goto err;
+  }
+
+  countries = data + GEOIP_DB_HEADER_LEN;
+  entries = countries + countries_len;
+  index_data = entries + entries_len;
+
+  /* Check the index, so that lookups can trust it. This takes time in
+   * proportion to the index size, which is small and fixed for IPv4. */
+  if (family == AF_INET) {
+    const uint32_t *idx = (const uint32_t *)index_data;
+    for (i = 0; i < GEOIP_IPV4_INDEX_SIZE; ++i) {
+      if (idx[i] > idx[i+1])
+        break;
+    }
+    if (i < GEOIP_IPV4_INDEX_SIZE || idx[GEOIP_IPV4_INDEX_SIZE] != n_entries) {
+      problem = "corrupt (bad index)";
+      goto err;
+    }
+  } else {
+    const geoip_ipv6_trie_node_t *nodes =
+      (const geoip_ipv6_trie_node_t *)index_data;
+    for (i = 0; i < n_index && !problem; ++i) {
+      unsigned slot;
+      for (slot = 0; slot < GEOIP_IPV6_TRIE_FANOUT; ++slot) {
+        const uint32_t n = nodes[i].n[slot];
+        if (n & GEOIP_IPV6_TRIE_CHILD) {
+          const uint32_t child = n & ~GEOIP_IPV6_TRIE_CHILD;
+          if (child <= i || child >= n_index)
+            problem = "corrupt (bad trie)";
+        } else if (nodes[i].first[slot] > n_entries ||
+                   n > n_entries - nodes[i].first[slot]) {
+          problem = "corrupt (bad trie)";
+        }
+      }
+    }
+    if (problem)
+      goto err;
+  }
+  for (i = 0; i < n_countries; ++i) {
+    const char *cc = countries + 2*i;
+    if (!(TOR_ISALNUM(cc[0]) && TOR_ISALNUM(cc[1])) &&
+        fast_memneq(cc, "??", 2)) {
+      problem = "corrupt (bad country code)";
+      goto err;
+    }
+  }
+
+  country_map = tor_calloc(n_countries ? n_countries : 1, sizeof(uint32_t));
+  for (i = 0; i < n_countries; ++i) {
+    char cc[3];
+    memcpy(cc, countries + 2*i, 2);
+    cc[2] = '\0';
+    country_map[i] = (uint32_t)geoip_add_country(cc);
+  }
+
+  if (family == AF_INET) {
+    geoip_ipv4_table_free(geoip_ipv4_table);
+    geoip_ipv4_table = geoip_ipv4_table_new();
+    geoip_ipv4_table->map = map;
+    geoip_ipv4_table->entries = (geoip_ipv4_entry_t *)entries;
+    geoip_ipv4_table->n_entries = geoip_ipv4_table->n_allocated = n_entries;
+    geoip_ipv4_table->index = (uint32_t *)index_data;
+    geoip_ipv4_table->country_map = country_map;
+    geoip_ipv4_table->n_countries = n_countries;
+    geoip_ipv4_table->is_indexed = 1;
+    memcpy(geoip_digest, data + 32, DIGEST_LEN);
+  } else {
+    geoip_ipv6_table_free(geoip_ipv6_table);
+    geoip_ipv6_table = geoip_ipv6_table_new();
+    geoip_ipv6_table->map = map;
+    geoip_ipv6_table->entries = (geoip_ipv6_entry_t *)entries;
+    geoip_ipv6_table->n_entries = geoip_ipv6_table->n_allocated = n_entries;
+    geoip_ipv6_table->nodes = (geoip_ipv6_trie_node_t *)index_data;
+    geoip_ipv6_table->n_nodes = geoip_ipv6_table->n_nodes_allocated = n_index;
+    geoip_ipv6_table->country_map = country_map;
+    geoip_ipv6_table->n_countries = n_countries;
+    geoip_ipv6_table->is_indexed = 1;
+    memcpy(geoip6_digest, data + 32, DIGEST_LEN);
+  }
+
+  log_notice(LD_GENERAL, "Loaded compiled GEOIP %s database %s "
+             "(%u ranges).", (family == AF_INET) ? "IPv4" : "IPv6",
+             filename, n_entries);
+  return 0;
+
+ err:
+  log_warn(LD_GENERAL, "Compiled GEOIP %s database %s is %s; not using it.",
+           (family == AF_INET) ? "IPv4" : "IPv6", filename, problem);
+  tor_munmap_file(map);
+  return -1;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -339,6 +875,9 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If <b>filename</b> is instead a compiled GeoIP database, map it into
+ * memory and use it directly; see geoip_load_compiled_file().
  */
 int
 geoip_load_file(sa_family_t family, const char *filename)
@@ -348,31 +887,31 @@ geoip_load_file(sa_family_t family, const char *filename)
   const or_options_t *options = get_options();
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
   crypto_digest_t *geoip_digest_env = NULL;
+  int r;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
+  if (!geoip_countries)
+    init_geoip_countries();
+  r = geoip_load_compiled_file(family, filename);
+  if (r <= 0) {
+    if (r == 0 && family == AF_INET)
+      refresh_all_country_info();
+    return r;
+  }
+
   if (!(f = tor_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.  %s",
            filename, msg);
     return -1;
   }
-  if (!geoip_countries)
-    init_geoip_countries();
 
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
-    geoip_ipv4_entries = smartlist_new();
+    geoip_ipv4_table_free(geoip_ipv4_table);
+    geoip_ipv4_table = geoip_ipv4_table_new();
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
-    }
-    geoip_ipv6_entries = smartlist_new();
+    geoip_ipv6_table_free(geoip_ipv6_table);
+    geoip_ipv6_table = geoip_ipv6_table_new();
   }
   geoip_digest_env = crypto_digest_new();
 
@@ -389,10 +928,10 @@ geoip_load_file(sa_family_t family, const char *filename)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
+  /* Build the lookup index and remember file digests so that we can include
+   * it in our extra-info descriptors. */
   if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
+    geoip_ipv4_table_build_index(geoip_ipv4_table);
     /* Okay, now we need to maybe change our mind about what is in
      * which country. We do this for IPv4 only since that's what we
      * store in node->country. */
@@ -400,7 +939,7 @@ geoip_load_file(sa_family_t family, const char *filename)
     crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
   } else {
     /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
+    geoip_ipv6_table_build_index(geoip_ipv6_table);
     crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
   }
   crypto_digest_free(geoip_digest_env);
@@ -408,6 +947,19 @@ geoip_load_file(sa_family_t family, const char *filename)
   return 0;
 }
 
+/** Return the position in geoip_countries of the country numbered
+ * <b>country</b> in a table with the given <b>country_map</b> of length
+ * <b>n_countries</b>.  Tables without a country map already use positions in
+ * geoip_countries. */
+static inline int
+geoip_map_country(const uint32_t *country_map, unsigned n_countries,
+                  uint32_t country)
+{
+  if (!country_map)
+    return (int)country;
+  return country < n_countries ? (int)country_map[country] : 0;
+}
+
 /** Given an IP address in host order, return a number representing the
  * country to which that address belongs, -1 for "No geoip information
  * available", or 0 for the 'unknown country'.  The return value will always
@@ -417,12 +969,32 @@ geoip_load_file(sa_family_t family, const char *filename)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  geoip_ipv4_table_t *t = geoip_ipv4_table;
+  const uint32_t prefix = ipaddr >> (32 - GEOIP_IPV4_INDEX_BITS);
+  uint32_t lo, hi;
+
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (!t->is_indexed)
+    geoip_ipv4_table_build_index(t);
+
+  /* The only range that can contain ipaddr is the first one whose ip_high is
+   * at least ipaddr.  It is at or after index[prefix], and no later than
+   * index[prefix+1], since that range's ip_high is past our prefix. */
+  lo = t->index[prefix];
+  hi = t->index[prefix+1];
+  while (lo < hi) {
+    const uint32_t mid = lo + (hi - lo) / 2;
+    if (t->entries[mid].ip_high < ipaddr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < t->n_entries &&
+      t->entries[lo].ip_low <= ipaddr && ipaddr <= t->entries[lo].ip_high)
+    return geoip_map_country(t->country_map, t->n_countries,
+                             t->entries[lo].country);
+  return 0;
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -433,13 +1005,38 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
+  geoip_ipv6_table_t *t = geoip_ipv6_table;
+  const geoip_ipv6_trie_node_t *node;
+  unsigned depth, slot;
+  uint32_t i, end;
 
-  if (!geoip_ipv6_entries)
+  if (!t)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (!t->is_indexed)
+    geoip_ipv6_table_build_index(t);
+
+  node = &t->nodes[0];
+  for (depth = 0; ; ++depth) {
+    slot = geoip_ipv6_trie_slot(addr, depth);
+    if (!(node->n[slot] & GEOIP_IPV6_TRIE_CHILD))
+      break;
+    /* Only a corrupt compiled database could make us run out of address. */
+    if (BUG(depth + 1 >= GEOIP_IPV6_TRIE_MAX_DEPTH))
+      return 0;
+    node = &t->nodes[node->n[slot] & ~GEOIP_IPV6_TRIE_CHILD];
+  }
+
+  end = node->first[slot] + node->n[slot];
+  for (i = node->first[slot]; i < end; ++i) {
+    const geoip_ipv6_entry_t *ent = &t->entries[i];
+    if (fast_memcmp(addr->s6_addr, ent->ip_low.s6_addr,
+                    sizeof(struct in6_addr)) >= 0 &&
+        fast_memcmp(addr->s6_addr, ent->ip_high.s6_addr,
+                    sizeof(struct in6_addr)) <= 0)
+      return geoip_map_country(t->country_map, t->n_countries,
+                               ent->country);
+  }
+  return 0;
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -488,9 +1085,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -515,6 +1112,188 @@ geoip_db_digest(sa_family_t family)
 static HT_HEAD(clientmap, clientmap_entry_t) client_history =
      HT_INITIALIZER();
 
+/** Special string to signify that no transport was used for a connection.
+ * Pluggable transport names can't have symbols in their names, so this
+ * string will never collide with a real transport. */
+#define NO_TRANSPORT_NAME "<OR>"
+
+/** Number of hash bits used to select a register in the sketches that count
+ * unique clients when SketchClientStatistics is set.  Each sketch takes
+ * 2^GEOIP_SKETCH_PRECISION bytes, and gives estimates with a relative
+ * standard error of about 2.3%. */
+#define GEOIP_SKETCH_PRECISION 11
+
+/** Number of hourly sketches of connecting clients that we keep for the
+ * heartbeat message: the last six full hours and the current one. */
+#define GEOIP_SKETCH_HEARTBEAT_HOURS 7
+
+/** HyperLogLog sketches counting the unique clients that we have seen for
+ * one geoip_client_action_t, used instead of client_history when
+ * SketchClientStatistics is set.  As with client_history, a client is
+ * identified by its address together with its transport name. */
+typedef struct client_sketches_t {
+  /** One sketch per country, indexed by position in geoip_countries, or NULL
+   * for countries we have not seen any clients from. */
+  hyperloglog_t **by_country;
+  /** Number of elements in <b>by_country</b>. */
+  int n_by_country;
+  /** Sketches of the clients connecting over IPv4 and over IPv6. */
+  hyperloglog_t *ipv4;
+  hyperloglog_t *ipv6;
+  /** Map from transport name, or NO_TRANSPORT_NAME, to a sketch of the
+   * clients that used it.  Only used for GEOIP_CLIENT_CONNECT. */
+  strmap_t *by_transport;
+} client_sketches_t;
+
+/** Sketches of unique clients, indexed by geoip_client_action_t. */
+static client_sketches_t client_sketches[2];
+
+/** Ring of sketches of the clients that connected in each recent hour, for
+ * the heartbeat.  The sketch for hour H is at index
+ * H % GEOIP_SKETCH_HEARTBEAT_HOURS. */
+static hyperloglog_t *heartbeat_sketches[GEOIP_SKETCH_HEARTBEAT_HOURS];
+/** The most recent hour (in hours since the epoch) that has a sketch in
+ * heartbeat_sketches. */
+static time_t heartbeat_sketch_hour = 0;
+
+/** Return a newly allocated sketch for counting clients. */
+static hyperloglog_t *
+client_sketch_new(void)
+{
+  return hyperloglog_new(GEOIP_SKETCH_PRECISION);
+}
+
+/** Helper: free a hyperloglog_t stored in a strmap_t. */
+static void
+client_sketch_free_void(void *hll)
+{
+  hyperloglog_free_(hll);
+}
+
+/** Forget all the clients we have sketched for <b>action</b>. */
+static void
+client_sketches_clear(geoip_client_action_t action)
+{
+  client_sketches_t *s = &client_sketches[action];
+  int i;
+  for (i = 0; i < s->n_by_country; ++i)
+    hyperloglog_free(s->by_country[i]);
+  tor_free(s->by_country);
+  s->n_by_country = 0;
+  hyperloglog_free(s->ipv4);
+  hyperloglog_free(s->ipv6);
+  strmap_free(s->by_transport, client_sketch_free_void);
+  s->by_transport = NULL;
+}
+
+/** Return the heartbeat sketch of the clients that connected during
+ * <b>hour</b> (in hours since the epoch), creating it if needed, or NULL if
+ * that hour is too far in the past to be kept.  Sketches for hours that have
+ * fallen out of the heartbeat window are reset. */
+static hyperloglog_t *
+heartbeat_sketch_for_hour(time_t hour)
+{
+  hyperloglog_t **hllp;
+  int i;
+
+  if (hour + GEOIP_SKETCH_HEARTBEAT_HOURS <= heartbeat_sketch_hour)
+    return NULL;
+  for (i = 0; heartbeat_sketch_hour + i < hour &&
+         i < GEOIP_SKETCH_HEARTBEAT_HOURS; ++i) {
+    hllp = &heartbeat_sketches[(heartbeat_sketch_hour + 1 + i) %
+                               GEOIP_SKETCH_HEARTBEAT_HOURS];
+    if (*hllp)
+      hyperloglog_clear(*hllp);
+  }
+  if (hour > heartbeat_sketch_hour)
+    heartbeat_sketch_hour = hour;
+
+  hllp = &heartbeat_sketches[hour % GEOIP_SKETCH_HEARTBEAT_HOURS];
+  if (!*hllp)
+    *hllp = client_sketch_new();
+  return *hllp;
+}
+
+/** Add the client at <b>addr</b>, using <b>transport_name</b> (if any) and
+ * located in <b>country</b>, to the sketches for <b>action</b>.  If it is a
+ * connecting client, also add it to the heartbeat sketch for <b>now</b>. */
+static void
+client_sketches_add(geoip_client_action_t action, const tor_addr_t *addr,
+                    const char *transport_name, int country, time_t now)
+{
+  client_sketches_t *s = &client_sketches[action];
+  hyperloglog_t **hllp = NULL;
+  uint64_t hash = tor_addr_hash(addr);
+
+  if (transport_name)
+    hash ^= siphash24g(transport_name, strlen(transport_name));
+
+  if (country >= s->n_by_country) {
+    int n = geoip_get_n_countries();
+    if (n <= country)
+      n = country + 1;
+    s->by_country = tor_reallocarray(s->by_country, n,
+                                     sizeof(hyperloglog_t *));
+    memset(s->by_country + s->n_by_country, 0,
+           (n - s->n_by_country) * sizeof(hyperloglog_t *));
+    s->n_by_country = n;
+  }
+  if (!s->by_country[country])
+    s->by_country[country] = client_sketch_new();
+  hyperloglog_add_hash(s->by_country[country], hash);
+
+  if (tor_addr_family(addr) == AF_INET)
+    hllp = &s->ipv4;
+  else if (tor_addr_family(addr) == AF_INET6)
+    hllp = &s->ipv6;
+  if (hllp) {
+    if (!*hllp)
+      *hllp = client_sketch_new();
+    hyperloglog_add_hash(*hllp, hash);
+  }
+
+  if (action == GEOIP_CLIENT_CONNECT) {
+    const char *name = transport_name ? transport_name : NO_TRANSPORT_NAME;
+    hyperloglog_t *hll;
+
+    if (!s->by_transport)
+      s->by_transport = strmap_new();
+    hll = strmap_get(s->by_transport, name);
+    if (!hll) {
+      hll = client_sketch_new();
+      strmap_set(s->by_transport, name, hll);
+    }
+    hyperloglog_add_hash(hll, hash);
+
+    hll = heartbeat_sketch_for_hour(now / 3600);
+    if (hll)
+      hyperloglog_add_hash(hll, hash);
+  }
+}
+
+/** Return an estimate of the number of clients counted by <b>hll</b>, or 0
+ * if <b>hll</b> is NULL. */
+static unsigned
+client_sketch_estimate(const hyperloglog_t *hll)
+{
+  uint64_t n = hll ? hyperloglog_estimate(hll) : 0;
+  return n > UINT_MAX ? UINT_MAX : (unsigned)n;
+}
+
+/** Return a newly allocated line for a statistics document that reports
+ * the relative standard error of the unique client counts labeled
+ * <b>keyword</b>, or an empty string if we are counting clients exactly. */
+static char *
+client_sketch_error_line(const char *keyword)
+{
+  char *line = NULL;
+  if (!get_options()->SketchClientStatistics)
+    return tor_strdup("");
+  tor_asprintf(&line, "%s-estimate-error %.2f%%\n", keyword,
+               100.0 * hyperloglog_relative_error(GEOIP_SKETCH_PRECISION));
+  return line;
+}
+
 /** Hashtable helper: compute a hash of a clientmap_entry_t. */
 static inline unsigned
 clientmap_entry_hash(const clientmap_entry_t *a)
@@ -561,9 +1340,6 @@ clientmap_entry_free_(clientmap_entry_t *ent)
   if (!ent)
     return;
 
-  /* This entry is about to be freed so pass it to the DoS subsystem to see if
-   * any actions can be taken about it. */
-  dos_geoip_entry_about_to_free(ent);
   geoip_decrement_client_history_cache_size(clientmap_entry_size(ent));
 
   tor_free(ent->transport_name);
@@ -600,6 +1376,7 @@ static void
 client_history_clear(void)
 {
   clientmap_entry_t **ent, **next, *this;
+  client_sketches_clear(GEOIP_CLIENT_CONNECT);
   for (ent = HT_START(clientmap, &client_history); ent != NULL;
        ent = next) {
     if ((*ent)->action == GEOIP_CLIENT_CONNECT) {
@@ -625,12 +1402,9 @@ geoip_note_client_seen(geoip_client_action_t action,
   clientmap_entry_t *ent;
 
   if (action == GEOIP_CLIENT_CONNECT) {
-    /* Only remember statistics if the DoS mitigation subsystem is enabled. If
-     * not, only if as entry guard or as bridge. */
-    if (!dos_enabled()) {
-      if (!options->EntryStatistics && !should_record_bridge_info(options)) {
-        return;
-      }
+    /* Only remember statistics as entry guard or as bridge. */
+    if (!options->EntryStatistics && !should_record_bridge_info(options)) {
+      return;
     }
   } else {
     /* Only gather directory-request statistics if configured, and
@@ -643,15 +1417,22 @@ geoip_note_client_seen(geoip_client_action_t action,
             safe_str_client(fmt_addr((addr))),
             transport_name ? transport_name : "<no transport>");
 
-  ent = geoip_lookup_client(addr, transport_name, action);
-  if (! ent) {
-    ent = clientmap_entry_new(action, addr, transport_name);
-    HT_INSERT(clientmap, &client_history, ent);
+  if (options->SketchClientStatistics) {
+    int country_idx = geoip_get_country_by_addr(addr);
+    if (country_idx < 0)
+      country_idx = 0; /** unresolved requests are stored at index 0. */
+    client_sketches_add(action, addr, transport_name, country_idx, now);
+  } else {
+    ent = geoip_lookup_client(addr, transport_name, action);
+    if (! ent) {
+      ent = clientmap_entry_new(action, addr, transport_name);
+      HT_INSERT(clientmap, &client_history, ent);
+    }
+    if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+      ent->last_seen_in_minutes = (unsigned)(now/60);
+    else
+      ent->last_seen_in_minutes = 0;
   }
-  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
-    ent->last_seen_in_minutes = (unsigned)(now/60);
-  else
-    ent->last_seen_in_minutes = 0;
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS) {
     int country_idx = geoip_get_country_by_addr(addr);
@@ -753,9 +1534,9 @@ geoip_client_cache_handle_oom(time_t now, size_t min_remove_bytes)
     time_t cutoff;
 
     /* If k has reached the minimum lifetime, we have to stop else we might
-     * remove every single entries which would be pretty bad for the DoS
-     * mitigation subsystem if by just filling the geoip cache, it was enough
-     * to trigger the OOM and clean every single entries. */
+     * remove every single entries which would be pretty bad for our client
+     * statistics if by just filling the geoip cache, it was enough to
+     * trigger the OOM and clean every single entries. */
     if (k <= GEOIP_CLIENT_CACHE_OOM_MIN_CUTOFF) {
       break;
     }
@@ -976,15 +1757,23 @@ geoip_get_transport_history(void)
       that have been used. */
   smartlist_t *transports_used = smartlist_new();
 
-  /* Special string to signify that no transport was used for this
-     connection. Pluggable transport names can't have symbols in their
-     names, so this string will never collide with a real transport. */
-  static const char* no_transport_str = "<OR>";
-
   clientmap_entry_t **ent;
   smartlist_t *string_chunks = smartlist_new();
   char *the_string = NULL;
 
+  if (get_options()->SketchClientStatistics) {
+    strmap_t *sketches = client_sketches[GEOIP_CLIENT_CONNECT].by_transport;
+    /* If we haven't seen any clients yet, return NULL. */
+    if (!sketches || strmap_isempty(sketches))
+      goto done;
+    STRMAP_FOREACH(sketches, transport_name, hyperloglog_t *, hll) {
+      uintptr_t val = client_sketch_estimate(hll);
+      strmap_set(transport_counts, transport_name, (void*)val);
+      smartlist_add_strdup(transports_used, transport_name);
+    } STRMAP_FOREACH_END;
+    goto format;
+  }
+
   /* If we haven't seen any clients yet, return NULL. */
   if (HT_EMPTY(&client_history))
     goto done;
@@ -1009,7 +1798,7 @@ geoip_get_transport_history(void)
     void *ptr;
     const char *transport_name = (*ent)->transport_name;
     if (!transport_name)
-      transport_name = no_transport_str;
+      transport_name = NO_TRANSPORT_NAME;
 
     /* Increase the count for this transport name. */
     ptr = strmap_get(transport_counts, transport_name);
@@ -1029,6 +1818,7 @@ geoip_get_transport_history(void)
               (int)val);
   }
 
+ format:
   /* Sort the transport names (helps with unit testing). */
   smartlist_sort_strings(transports_used);
 
@@ -1187,7 +1977,14 @@ geoip_get_client_history(geoip_client_action_t action,
     return -1;
 
   counts = tor_calloc(n_countries, sizeof(unsigned));
-  HT_FOREACH(cm_ent, clientmap, &client_history) {
+  if (get_options()->SketchClientStatistics) {
+    const client_sketches_t *s = &client_sketches[action];
+    for (i = 0; i < n_countries && i < s->n_by_country; ++i)
+      counts[i] = client_sketch_estimate(s->by_country[i]);
+    ipv4_count = client_sketch_estimate(s->ipv4);
+    ipv6_count = client_sketch_estimate(s->ipv6);
+    total = ipv4_count + ipv6_count;
+  } else HT_FOREACH(cm_ent, clientmap, &client_history) {
     int country;
     if ((*cm_ent)->action != (int)action)
       continue;
@@ -1319,6 +2116,7 @@ geoip_reset_dirreq_stats(time_t now)
   SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c, {
       c->n_v3_ns_requests = 0;
   });
+  client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS);
   {
     clientmap_entry_t **ent, **next, *this;
     for (ent = HT_START(clientmap, &client_history); ent != NULL;
@@ -1362,6 +2160,7 @@ geoip_format_dirreq_stats(time_t now)
   int i;
   char *v3_ips_string = NULL, *v3_reqs_string = NULL,
        *v3_direct_dl_string = NULL, *v3_tunneled_dl_string = NULL;
+  char *error_line = NULL;
   char *result = NULL;
 
   if (!start_of_dirreq_stats_interval)
@@ -1382,6 +2181,7 @@ geoip_format_dirreq_stats(time_t now)
 
   v3_direct_dl_string = geoip_get_dirreq_history(DIRREQ_DIRECT);
   v3_tunneled_dl_string = geoip_get_dirreq_history(DIRREQ_TUNNELED);
+  error_line = client_sketch_error_line("dirreq-v3-ips");
 
   /* Put everything together into a single string. */
   tor_asprintf(&result, "dirreq-stats-end %s (%d s)\n"
@@ -1390,7 +2190,8 @@ geoip_format_dirreq_stats(time_t now)
               "dirreq-v3-resp ok=%u,not-enough-sigs=%u,unavailable=%u,"
                    "not-found=%u,not-modified=%u,busy=%u\n"
               "dirreq-v3-direct-dl %s\n"
-              "dirreq-v3-tunneled-dl %s\n",
+              "dirreq-v3-tunneled-dl %s\n"
+              "%s",
               t,
               (unsigned) (now - start_of_dirreq_stats_interval),
               v3_ips_string ? v3_ips_string : "",
@@ -1402,9 +2203,11 @@ geoip_format_dirreq_stats(time_t now)
               ns_v3_responses[GEOIP_REJECT_NOT_MODIFIED],
               ns_v3_responses[GEOIP_REJECT_BUSY],
               v3_direct_dl_string ? v3_direct_dl_string : "",
-              v3_tunneled_dl_string ? v3_tunneled_dl_string : "");
+              v3_tunneled_dl_string ? v3_tunneled_dl_string : "",
+              error_line);
 
   /* Free partial strings. */
+  tor_free(error_line);
   tor_free(v3_ips_string);
   tor_free(v3_reqs_string);
   tor_free(v3_direct_dl_string);
@@ -1540,6 +2343,7 @@ geoip_format_bridge_stats(time_t now)
 {
   char *out = NULL;
   char *country_data = NULL, *ipver_data = NULL, *transport_data = NULL;
+  char *error_line = NULL;
   long duration = now - start_of_bridge_stats_interval;
   char written[ISO_TIME_LEN+1];
 
@@ -1552,18 +2356,23 @@ geoip_format_bridge_stats(time_t now)
   geoip_get_client_history(GEOIP_CLIENT_CONNECT, &country_data, &ipver_data);
   transport_data = geoip_get_transport_history();
 
+  error_line = client_sketch_error_line("bridge-ips");
+
   tor_asprintf(&out,
                "bridge-stats-end %s (%ld s)\n"
                "bridge-ips %s\n"
                "bridge-ip-versions %s\n"
-               "bridge-ip-transports %s\n",
+               "bridge-ip-transports %s\n"
+               "%s",
                written, duration,
                country_data ? country_data : "",
                ipver_data ? ipver_data : "",
-               transport_data ? transport_data : "");
+               transport_data ? transport_data : "",
+               error_line);
   tor_free(country_data);
   tor_free(ipver_data);
   tor_free(transport_data);
+  tor_free(error_line);
 
   return out;
 }
@@ -1606,6 +2415,23 @@ format_client_stats_heartbeat(time_t now)
   if (!start_of_bridge_stats_interval)
     return NULL; /* Not initialized. */
 
+  if (get_options()->SketchClientStatistics) {
+    /* Merge the sketches for the current hour and the n_hours before it. */
+    const time_t hour = now / 3600;
+    hyperloglog_t *merged = client_sketch_new();
+    time_t h;
+    for (h = hour - n_hours; h <= hour; ++h) {
+      hyperloglog_t *hll =
+        heartbeat_sketches[h % GEOIP_SKETCH_HEARTBEAT_HOURS];
+      if (hll && h <= heartbeat_sketch_hour &&
+          h + GEOIP_SKETCH_HEARTBEAT_HOURS > heartbeat_sketch_hour)
+        hyperloglog_merge(merged, hll);
+    }
+    n_clients = (int)MIN(client_sketch_estimate(merged), INT_MAX);
+    hyperloglog_free(merged);
+    goto format;
+  }
+
   /* count unique IPs */
   HT_FOREACH(ent, clientmap, &client_history) {
     /* only count directly connecting clients */
@@ -1616,6 +2442,7 @@ format_client_stats_heartbeat(time_t now)
     n_clients++;
   }
 
+ format:
   tor_asprintf(&out, "Heartbeat: "
                "In the last %d hours, I have seen %d unique clients.",
                n_hours,
@@ -1662,6 +2489,11 @@ geoip_bridge_stats_write(time_t now)
     }
   }
 
+  /* The sketches can't forget old clients one by one the way the client
+   * history does, so start the next interval with empty ones. */
+  if (get_options()->SketchClientStatistics)
+    client_sketches_clear(GEOIP_CLIENT_CONNECT);
+
  done:
   return start_of_bridge_stats_interval + WRITE_STATS_INTERVAL;
 }
@@ -1738,7 +2570,7 @@ char *
 geoip_format_entry_stats(time_t now)
 {
   char t[ISO_TIME_LEN+1];
-  char *data = NULL;
+  char *data = NULL, *error_line = NULL;
   char *result;
 
   if (!start_of_entry_stats_interval)
@@ -1748,12 +2580,15 @@ geoip_format_entry_stats(time_t now)
 
   geoip_get_client_history(GEOIP_CLIENT_CONNECT, &data, NULL);
   format_iso_time(t, now);
+  error_line = client_sketch_error_line("entry-ips");
   tor_asprintf(&result,
                "entry-stats-end %s (%u s)\n"
-               "entry-ips %s\n",
+               "entry-ips %s\n"
+               "%s",
                t, (unsigned) (now - start_of_entry_stats_interval),
-               data ? data : "");
+               data ? data : "", error_line);
   tor_free(data);
+  tor_free(error_line);
   return result;
 }
 
@@ -1839,20 +2674,10 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_ipv4_table_free(geoip_ipv4_table);
+  geoip_ipv6_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -1868,6 +2693,14 @@ geoip_free_all(void)
     }
     HT_CLEAR(clientmap, &client_history);
   }
+  client_sketches_clear(GEOIP_CLIENT_CONNECT);
+  client_sketches_clear(GEOIP_CLIENT_NETWORKSTATUS);
+  {
+    int i;
+    for (i = 0; i < GEOIP_SKETCH_HEARTBEAT_HOURS; ++i)
+      hyperloglog_free(heartbeat_sketches[i]);
+    heartbeat_sketch_hour = 0;
+  }
   {
     dirreq_map_entry_t **ent, **next, *this;
     for (ent = HT_START(dirreqmap, &dirreq_map); ent != NULL; ent = next) {
@@ -13,7 +13,6 @@
 #define TOR_GEOIP_H
 
 #include "lib/testsupport/testsupport.h"
-#include "or/dos.h"
 
 #ifdef GEOIP_PRIVATE
 STATIC int geoip_parse_entry(const char *line, sa_family_t family);
@@ -24,7 +23,7 @@ STATIC void clear_geoip_db(void);
 
 /** Entry in a map from IP address to the last time we've seen an incoming
  * connection from that IP address. Used by bridges only to track which
- * countries have them blocked, or the DoS mitigation subsystem if enabled. */
+ * countries have them blocked. */
 typedef struct clientmap_entry_t {
   HT_ENTRY(clientmap_entry_t) node;
   tor_addr_t addr;
@@ -38,10 +37,6 @@ typedef struct clientmap_entry_t {
    * 4000 CE, please remember to add more bits to last_seen_in_minutes.) */
   unsigned int last_seen_in_minutes:30;
   unsigned int action:2;
-
-  /* This object is used to keep some statistics per client address for the
-   * DoS mitigation subsystem. */
-  dos_client_stats_t dos_stats;
 } clientmap_entry_t;
 
 int should_record_bridge_info(const or_options_t *options);
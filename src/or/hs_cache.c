@@ -10,7 +10,9 @@
 #define HS_CACHE_PRIVATE
 
 #include "or/or.h"
+#include "common/compat_time.h"
 #include "or/config.h"
+#include "lib/compress/compress.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "or/hs_ident.h"
 #include "or/hs_common.h"
@@ -31,20 +33,69 @@ static int cached_client_descriptor_has_expired(time_t now,
 /* Directory descriptor cache. Map indexed by blinded key. */
 static digest256map_t *hs_cache_v3_dir;
 
+/* Every entry of the directory cache, from the least to the most recently
+ * stored or looked up. We evict from the head when the cache is too big. */
+static TOR_TAILQ_HEAD(hs_cache_dir_lru_t, hs_cache_dir_descriptor_t)
+  hs_cache_v3_dir_lru = TOR_TAILQ_HEAD_INITIALIZER(hs_cache_v3_dir_lru);
+
+/* Statistics of the directory cache. */
+static hs_cache_dir_stats_t dir_stats;
+
+/* Scratch buffer holding the last descriptor that we decompressed for a
+ * lookup. Lookups of compressed entries return a pointer into it, which is
+ * only valid until the next lookup. */
+static char *dir_lookup_buf = NULL;
+
+/* By default, the directory cache may use this fraction of MaxMemInQueues. */
+#define HS_CACHE_DIR_DEFAULT_MAX_MEM_DIVISOR 5
+
+/* Return the size of a cache entry in bytes. */
+static size_t
+cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+{
+  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
+          + (entry->encoded_desc ? entry->encoded_desc_len : 0)
+          + entry->compressed_desc_len);
+}
+
+/* Take a descriptor that was just removed from the cache map out of the LRU
+ * list and of our accounting. */
+static void
+unlink_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
+{
+  size_t size = cache_get_dir_entry_size(desc);
+
+  TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, desc, lru_next);
+  dir_stats.n_entries--;
+  dir_stats.n_bytes -= size;
+  /* Update our cache entry allocation size for the OOM. */
+  rend_cache_decrement_allocation(size);
+}
+
 /* Remove a given descriptor from our cache. */
 static void
-remove_v3_desc_as_dir(const hs_cache_dir_descriptor_t *desc)
+remove_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
   tor_assert(desc);
   digest256map_remove(hs_cache_v3_dir, desc->key);
+  unlink_v3_desc_as_dir(desc);
 }
 
 /* Store a given descriptor in our cache. */
 static void
 store_v3_desc_as_dir(hs_cache_dir_descriptor_t *desc)
 {
+  size_t size;
+
   tor_assert(desc);
+  size = cache_get_dir_entry_size(desc);
   digest256map_set(hs_cache_v3_dir, desc->key, desc);
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, desc, lru_next);
+  dir_stats.n_entries++;
+  dir_stats.n_bytes += size;
+  /* Update our total cache size with this entry for the OOM. This uses the
+   * old HS protocol cache subsystem for which we are tied with. */
+  rend_cache_increment_allocation(size);
 }
 
 /* Query our cache and return the entry or NULL if not found. */
@@ -67,6 +118,7 @@ cache_dir_desc_free_(hs_cache_dir_descriptor_t *desc)
   }
   hs_desc_plaintext_data_free(desc->plaintext_data);
   tor_free(desc->encoded_desc);
+  tor_free(desc->compressed_desc);
   tor_free(desc);
 }
 
@@ -85,19 +137,46 @@ static hs_cache_dir_descriptor_t *
 cache_dir_desc_new(const char *desc)
 {
   hs_cache_dir_descriptor_t *dir_desc;
+  hs_desc_plaintext_data_t *plaintext;
 
   tor_assert(desc);
 
   dir_desc = tor_malloc_zero(sizeof(hs_cache_dir_descriptor_t));
-  dir_desc->plaintext_data =
+  dir_desc->plaintext_data = plaintext =
     tor_malloc_zero(sizeof(hs_desc_plaintext_data_t));
-  dir_desc->encoded_desc = tor_strdup(desc);
 
-  if (hs_desc_decode_plaintext(desc, dir_desc->plaintext_data) < 0) {
+  if (hs_desc_decode_plaintext(desc, plaintext) < 0) {
     log_debug(LD_DIR, "Unable to decode descriptor. Rejecting.");
     goto err;
   }
 
+  /* We only ever serve the descriptor as we got it, so don't keep a second
+   * copy of its biggest part around. */
+  if (plaintext->superencrypted_blob) {
+    memwipe(plaintext->superencrypted_blob, 0,
+            plaintext->superencrypted_blob_size);
+    tor_free(plaintext->superencrypted_blob);
+    plaintext->superencrypted_blob_size = 0;
+  }
+
+  dir_desc->encoded_desc_len = strlen(desc);
+  if (get_options()->HSDirCacheCompression) {
+    char *compressed = NULL;
+    size_t compressed_len = 0;
+    if (tor_compress(&compressed, &compressed_len, desc,
+                     dir_desc->encoded_desc_len, ZLIB_METHOD) == 0 &&
+        compressed_len < dir_desc->encoded_desc_len) {
+      dir_desc->compressed_desc = compressed;
+      dir_desc->compressed_desc_len = compressed_len;
+    } else {
+      tor_free(compressed);
+    }
+  }
+  if (!dir_desc->compressed_desc) {
+    dir_desc->encoded_desc = tor_memdup_nulterm(desc,
+                                                dir_desc->encoded_desc_len);
+  }
+
   /* The blinded pubkey is the indexed key. */
   dir_desc->key = dir_desc->plaintext_data->blinded_pubkey.pubkey;
   dir_desc->created_ts = time(NULL);
@@ -108,12 +187,72 @@ cache_dir_desc_new(const char *desc)
   return NULL;
 }
 
-/* Return the size of a cache entry in bytes. */
-static size_t
-cache_get_dir_entry_size(const hs_cache_dir_descriptor_t *entry)
+/* Return the encoded descriptor of the cache entry <b>entry</b>, or NULL if
+ * we can't decompress it. A decompressed descriptor is only valid until the
+ * next call to this function. */
+static const char *
+cache_dir_desc_get_encoded(const hs_cache_dir_descriptor_t *entry)
 {
-  return (sizeof(*entry) + hs_desc_plaintext_obj_size(entry->plaintext_data)
-          + strlen(entry->encoded_desc));
+  size_t len = 0;
+
+  if (entry->encoded_desc) {
+    return entry->encoded_desc;
+  }
+
+  tor_free(dir_lookup_buf);
+  if (tor_uncompress(&dir_lookup_buf, &len, entry->compressed_desc,
+                     entry->compressed_desc_len, ZLIB_METHOD, 1,
+                     LOG_WARN) < 0 ||
+      BUG(len != entry->encoded_desc_len)) {
+    tor_free(dir_lookup_buf);
+    return NULL;
+  }
+  return dir_lookup_buf;
+}
+
+/* Return the most bytes that the directory cache may use, or 0 if it has no
+ * limit. */
+static uint64_t
+cache_dir_get_max_bytes(void)
+{
+  const or_options_t *options = get_options();
+
+  if (options->MaxMemInHSDirCache) {
+    return options->MaxMemInHSDirCache;
+  }
+  return options->MaxMemInQueues / HS_CACHE_DIR_DEFAULT_MAX_MEM_DIVISOR;
+}
+
+/* Evict the least recently used entries of the directory cache until it
+ * fits in its memory limit. Never evict <b>keep</b>, which can be NULL.
+ * Return the number of bytes removed. */
+STATIC size_t
+cache_dir_enforce_limit(const hs_cache_dir_descriptor_t *keep)
+{
+  const uint64_t max_bytes = cache_dir_get_max_bytes();
+  size_t bytes_removed = 0;
+  hs_cache_dir_descriptor_t *entry;
+
+  if (!max_bytes) {
+    return 0;
+  }
+
+  while (dir_stats.n_bytes > max_bytes &&
+         (entry = TOR_TAILQ_FIRST(&hs_cache_v3_dir_lru)) != NULL &&
+         entry != keep) {
+    bytes_removed += cache_get_dir_entry_size(entry);
+    remove_v3_desc_as_dir(entry);
+    cache_dir_desc_free(entry);
+    dir_stats.n_evicted++;
+  }
+
+  if (bytes_removed) {
+    log_info(LD_REND, "HSDir cache is over its limit of "U64_FORMAT" bytes. "
+             "Evicted the least recently used descriptors, freeing "
+             U64_FORMAT" bytes.", U64_PRINTF_ARG(max_bytes),
+             U64_PRINTF_ARG(bytes_removed));
+  }
+  return bytes_removed;
 }
 
 /* Try to store a valid version 3 descriptor in the directory cache. Return 0
@@ -146,7 +285,6 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
      * remove the entry we currently have from our cache so we can then
      * store the new one. */
     remove_v3_desc_as_dir(cache_entry);
-    rend_cache_decrement_allocation(cache_get_dir_entry_size(cache_entry));
     cache_dir_desc_free(cache_entry);
   }
   /* Store the descriptor we just got. We are sure here that either we
@@ -154,9 +292,8 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
    * has been removed from the cache. */
   store_v3_desc_as_dir(desc);
 
-  /* Update our total cache size with this entry for the OOM. This uses the
-   * old HS protocol cache subsystem for which we are tied with. */
-  rend_cache_increment_allocation(cache_get_dir_entry_size(desc));
+  /* Make room for it if needed, without evicting the new descriptor. */
+  cache_dir_enforce_limit(desc);
 
   /* XXX: Update HS statistics. We should have specific stats for v3. */
 
@@ -168,15 +305,16 @@ cache_store_v3_as_dir(hs_cache_dir_descriptor_t *desc)
 
 /* Using the query which is the base64 encoded blinded key of a version 3
  * descriptor, lookup in our directory cache the entry. If found, 1 is
- * returned and desc_out is populated with a newly allocated string being the
- * encoded descriptor. If not found, 0 is returned and desc_out is untouched.
- * On error, a negative value is returned and desc_out is untouched. */
+ * returned and desc_out is populated with the encoded descriptor, which is
+ * only valid until the next lookup. If not found, 0 is returned and desc_out
+ * is untouched. On error, a negative value is returned and desc_out is
+ * untouched. */
 static int
 cache_lookup_v3_as_dir(const char *query, const char **desc_out)
 {
   int found = 0;
   ed25519_public_key_t blinded_key;
-  const hs_cache_dir_descriptor_t *entry;
+  hs_cache_dir_descriptor_t *entry;
 
   tor_assert(query);
 
@@ -188,12 +326,23 @@ cache_lookup_v3_as_dir(const char *query, const char **desc_out)
   }
 
   entry = lookup_v3_desc_as_dir(blinded_key.pubkey);
-  if (entry != NULL) {
-    found = 1;
-    if (desc_out) {
-      *desc_out = entry->encoded_desc;
+  if (entry == NULL) {
+    dir_stats.n_misses++;
+    return 0;
+  }
+
+  if (desc_out) {
+    const char *encoded = cache_dir_desc_get_encoded(entry);
+    if (encoded == NULL) {
+      goto err;
     }
+    *desc_out = encoded;
   }
+  found = 1;
+  dir_stats.n_hits++;
+  /* Move the entry to the most recently used end of the list. */
+  TOR_TAILQ_REMOVE(&hs_cache_v3_dir_lru, entry, lru_next);
+  TOR_TAILQ_INSERT_TAIL(&hs_cache_v3_dir_lru, entry, lru_next);
 
   return found;
 
@@ -219,7 +368,6 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
 
   DIGEST256MAP_FOREACH_MODIFY(hs_cache_v3_dir, key,
                               hs_cache_dir_descriptor_t *, entry) {
-    size_t entry_size;
     time_t cutoff = global_cutoff;
     if (!cutoff) {
       /* Cutoff is the lifetime of the entry found in the descriptor. */
@@ -233,12 +381,15 @@ cache_clean_v3_as_dir(time_t now, time_t global_cutoff)
     }
     /* Here, our entry has expired, remove and free. */
     MAP_DEL_CURRENT(key);
-    entry_size = cache_get_dir_entry_size(entry);
-    bytes_removed += entry_size;
+    bytes_removed += cache_get_dir_entry_size(entry);
+    unlink_v3_desc_as_dir(entry);
     /* Entry is not in the cache anymore, destroy it. */
     cache_dir_desc_free(entry);
-    /* Update our cache entry allocation size for the OOM. */
-    rend_cache_decrement_allocation(entry_size);
+    if (global_cutoff) {
+      dir_stats.n_evicted++;
+    } else {
+      dir_stats.n_expired++;
+    }
     /* Logging. */
     {
       char key_b64[BASE64_DIGEST256_LEN + 1];
@@ -287,9 +438,9 @@ hs_cache_store_as_dir(const char *desc)
 }
 
 /* Using the query, lookup in our directory cache the entry. If found, 1 is
- * returned and desc_out is populated with a newly allocated string being
- * the encoded descriptor. If not found, 0 is returned and desc_out is
- * untouched. On error, a negative value is returned and desc_out is
+ * returned and desc_out is populated with the encoded descriptor, which is
+ * only valid until the next lookup. If not found, 0 is returned and desc_out
+ * is untouched. On error, a negative value is returned and desc_out is
  * untouched. */
 int
 hs_cache_lookup_as_dir(uint32_t version, const char *query,
@@ -324,6 +475,36 @@ hs_cache_clean_as_dir(time_t now)
   /* Now, clean the v3 cache. Set the cutoff to 0 telling the cleanup function
    * to compute the cutoff by itself using the lifetime value. */
   cache_clean_v3_as_dir(now, 0);
+
+  /* The memory limit might have been lowered since we last stored. */
+  cache_dir_enforce_limit(NULL);
+}
+
+/* Return the statistics of the directory cache. */
+const hs_cache_dir_stats_t *
+hs_cache_get_dir_stats(void)
+{
+  return &dir_stats;
+}
+
+/* Log a heartbeat message about the directory cache, if we have ever used
+ * it. */
+void
+hs_cache_dir_log_heartbeat(void)
+{
+  if (!dir_stats.n_entries && !dir_stats.n_hits && !dir_stats.n_misses) {
+    return;
+  }
+  log_notice(LD_HEARTBEAT, "Onion service descriptor cache: "
+             U64_FORMAT" descriptors using "U64_FORMAT" bytes; "
+             U64_FORMAT" hits, "U64_FORMAT" misses, "
+             U64_FORMAT" expired and "U64_FORMAT" evicted.",
+             U64_PRINTF_ARG(dir_stats.n_entries),
+             U64_PRINTF_ARG(dir_stats.n_bytes),
+             U64_PRINTF_ARG(dir_stats.n_hits),
+             U64_PRINTF_ARG(dir_stats.n_misses),
+             U64_PRINTF_ARG(dir_stats.n_expired),
+             U64_PRINTF_ARG(dir_stats.n_evicted));
 }
 
 /********************** Client-side HS cache ******************/
@@ -331,6 +512,9 @@ hs_cache_clean_as_dir(time_t now)
 /* Client-side HS descriptor cache. Map indexed by service identity key. */
 static digest256map_t *hs_cache_v3_client;
 
+/* Statistics of the client-side HS descriptor cache. */
+static hs_cache_client_stats_t client_stats;
+
 /* Client-side introduction point state cache. Map indexed by service public
  * identity key (onion address). It contains hs_cache_client_intro_state_t
  * objects all related to a specific service. */
@@ -398,12 +582,21 @@ cache_client_desc_new(const char *desc_str,
 {
   hs_descriptor_t *desc = NULL;
   hs_cache_client_descriptor_t *client_desc = NULL;
+  monotime_t start, end;
+  int64_t decode_usec;
+  int ret;
 
   tor_assert(desc_str);
   tor_assert(service_identity_pk);
 
   /* Decode the descriptor we just fetched. */
-  if (hs_client_decode_descriptor(desc_str, service_identity_pk, &desc) < 0) {
+  monotime_get(&start);
+  ret = hs_client_decode_descriptor(desc_str, service_identity_pk, &desc);
+  monotime_get(&end);
+  decode_usec = monotime_diff_usec(&start, &end);
+  client_stats.n_decoded++;
+  client_stats.decode_usec += decode_usec;
+  if (ret < 0) {
     goto end;
   }
   tor_assert(desc);
@@ -756,6 +949,43 @@ hs_cache_lookup_as_client(const ed25519_public_key_t *key)
   return NULL;
 }
 
+/* Return true iff storing the encoded descriptor <b>desc_str</b> for the
+ * service <b>identity_pk</b> would leave our cache as it is, because we
+ * already have that descriptor or a newer one. This only decodes the
+ * plaintext part of the descriptor, so that we can skip decrypting the
+ * rest. */
+STATIC int
+cache_client_desc_is_redundant(const char *desc_str,
+                               const ed25519_public_key_t *identity_pk)
+{
+  const hs_cache_client_descriptor_t *cache_entry;
+  hs_desc_plaintext_data_t *plaintext = NULL;
+  int redundant = 0;
+
+  cache_entry = lookup_v3_desc_as_client(identity_pk->pubkey);
+  if (cache_entry == NULL) {
+    goto end;
+  }
+  if (!strcmp(cache_entry->encoded_desc, desc_str)) {
+    redundant = 1;
+    goto end;
+  }
+
+  plaintext = tor_malloc_zero(sizeof(*plaintext));
+  if (hs_desc_decode_plaintext(desc_str, plaintext) < 0) {
+    /* Let the full decoding fail and log. */
+    goto end;
+  }
+  /* As in cache_store_as_client(), we only discard a descriptor if our
+   * cached one has a greater revision counter. */
+  redundant = cache_entry->desc->plaintext_data.revision_counter >
+              plaintext->revision_counter;
+
+ end:
+  hs_desc_plaintext_data_free(plaintext);
+  return redundant;
+}
+
 /** Public API: Given an encoded descriptor, store it in the client HS
  *  cache. Return -1 on error, 0 on success .*/
 int
@@ -767,6 +997,13 @@ hs_cache_store_as_client(const char *desc_str,
   tor_assert(desc_str);
   tor_assert(identity_pk);
 
+  /* Decrypting a descriptor is expensive: don't do it if we would end up
+   * keeping the one we have. */
+  if (cache_client_desc_is_redundant(desc_str, identity_pk)) {
+    client_stats.n_decode_skipped++;
+    return 0;
+  }
+
   /* Create client cache descriptor object */
   client_desc = cache_client_desc_new(desc_str, identity_pk);
   if (!client_desc) {
@@ -787,6 +1024,29 @@ hs_cache_store_as_client(const char *desc_str,
   return -1;
 }
 
+/* Return the statistics of the client descriptor cache. */
+const hs_cache_client_stats_t *
+hs_cache_get_client_stats(void)
+{
+  return &client_stats;
+}
+
+/* Log a heartbeat message about the client descriptor cache, if we have
+ * ever used it. */
+void
+hs_cache_client_log_heartbeat(void)
+{
+  if (!client_stats.n_decoded && !client_stats.n_decode_skipped) {
+    return;
+  }
+  log_notice(LD_HEARTBEAT, "Onion service client: decoded "U64_FORMAT
+             " descriptors in "U64_FORMAT" msec, and skipped decoding "
+             U64_FORMAT" that we already had.",
+             U64_PRINTF_ARG(client_stats.n_decoded),
+             U64_PRINTF_ARG(client_stats.decode_usec / 1000),
+             U64_PRINTF_ARG(client_stats.n_decode_skipped));
+}
+
 /* Clean all client caches using the current time now. */
 void
 hs_cache_clean_as_client(time_t now)
@@ -968,9 +1228,13 @@ hs_cache_free_all(void)
 {
   digest256map_free(hs_cache_v3_dir, cache_dir_desc_free_void);
   hs_cache_v3_dir = NULL;
+  TOR_TAILQ_INIT(&hs_cache_v3_dir_lru);
+  memset(&dir_stats, 0, sizeof(dir_stats));
+  tor_free(dir_lookup_buf);
 
   digest256map_free(hs_cache_v3_client, cache_client_desc_free_void);
   hs_cache_v3_client = NULL;
+  memset(&client_stats, 0, sizeof(client_stats));
 
   digest256map_free(hs_cache_client_intro_state,
                     cache_client_intro_state_free_void);
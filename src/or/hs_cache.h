@@ -58,16 +58,54 @@ typedef struct hs_cache_dir_descriptor_t {
   hs_desc_plaintext_data_t *plaintext_data;
 
   /* Encoded descriptor which is basically in text form. It's a NUL terminated
-   * string thus safe to strlen(). */
+   * string thus safe to strlen(). NULL if we keep the descriptor compressed,
+   * in which case compressed_desc is set. */
   char *encoded_desc;
+  /* Length of the encoded descriptor, not counting the NUL. */
+  size_t encoded_desc_len;
+
+  /* Encoded descriptor compressed with zlib, if HSDirCacheCompression is set
+   * and compressing it saved space. */
+  char *compressed_desc;
+  size_t compressed_desc_len;
+
+  /* Position of this entry in the cache's LRU list. */
+  TOR_TAILQ_ENTRY(hs_cache_dir_descriptor_t) lru_next;
 } hs_cache_dir_descriptor_t;
 
+/* Statistics of the directory cache, for the heartbeat. */
+typedef struct hs_cache_dir_stats_t {
+  /* Number of descriptors in the cache, and the bytes that they use. */
+  size_t n_entries;
+  size_t n_bytes;
+  /* Number of lookups that found a descriptor, and that did not. */
+  uint64_t n_hits;
+  uint64_t n_misses;
+  /* Number of descriptors removed because they expired, and because the
+   * cache was over its memory limit. */
+  uint64_t n_expired;
+  uint64_t n_evicted;
+} hs_cache_dir_stats_t;
+
+/* Statistics of the client descriptor cache. */
+typedef struct hs_cache_client_stats_t {
+  /* Number of descriptors that we fully decoded, and the total time that it
+   * took in microseconds. */
+  uint64_t n_decoded;
+  uint64_t decode_usec;
+  /* Number of descriptors that we didn't decrypt because we already had the
+   * same one or a newer one. */
+  uint64_t n_decode_skipped;
+} hs_cache_client_stats_t;
+
 /* Public API */
 
 void hs_cache_init(void);
 void hs_cache_free_all(void);
 void hs_cache_clean_as_dir(time_t now);
 size_t hs_cache_handle_oom(time_t now, size_t min_remove_bytes);
+const hs_cache_dir_stats_t *hs_cache_get_dir_stats(void);
+void hs_cache_dir_log_heartbeat(void);
 
 unsigned int hs_cache_get_max_descriptor_size(void);
 
@@ -86,6 +124,8 @@ int hs_cache_store_as_client(const char *desc_str,
                              const ed25519_public_key_t *identity_pk);
 void hs_cache_clean_as_client(time_t now);
 void hs_cache_purge_as_client(void);
+const hs_cache_client_stats_t *hs_cache_get_client_stats(void);
+void hs_cache_client_log_heartbeat(void);
 
 /* Client failure cache. */
 void hs_cache_client_intro_state_note(const ed25519_public_key_t *service_pk,
@@ -118,9 +158,12 @@ typedef struct hs_cache_client_descriptor_t {
 } hs_cache_client_descriptor_t;
 
 STATIC size_t cache_clean_v3_as_dir(time_t now, time_t global_cutoff);
+STATIC size_t cache_dir_enforce_limit(const hs_cache_dir_descriptor_t *keep);
 
 STATIC hs_cache_client_descriptor_t *
 lookup_v3_desc_as_client(const uint8_t *key);
+STATIC int cache_client_desc_is_redundant(const char *desc_str,
+                                      const ed25519_public_key_t *identity_pk);
 
 #endif /* defined(HS_CACHE_PRIVATE) */
 
@@ -139,45 +139,38 @@ decrypt_introduce2(const uint8_t *enc_key, const uint8_t *encrypted_section,
 
 /* Given a pointer to the decrypted data of the ENCRYPTED section of an
  * INTRODUCE2 cell of length decrypted_len, parse and validate the cell
- * content. Return a newly allocated cell structure or NULL on error. The
- * circuit and service object are only used for logging purposes. */
+ * content. Return a newly allocated cell structure or NULL on error. This
+ * can be called from a worker thread. */
 static trn_cell_introduce_encrypted_t *
 parse_introduce2_encrypted(const uint8_t *decrypted_data,
-                           size_t decrypted_len, const origin_circuit_t *circ,
-                           const hs_service_t *service)
+                           size_t decrypted_len)
 {
   trn_cell_introduce_encrypted_t *enc_cell = NULL;
 
   tor_assert(decrypted_data);
-  tor_assert(circ);
-  tor_assert(service);
 
   if (trn_cell_introduce_encrypted_parse(&enc_cell, decrypted_data,
                                          decrypted_len) < 0) {
     log_info(LD_REND, "Unable to parse the decrypted ENCRYPTED section of "
-                      "the INTRODUCE2 cell on circuit %u for service %s",
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+                      "the INTRODUCE2 cell.");
     goto err;
   }
 
   if (trn_cell_introduce_encrypted_get_onion_key_type(enc_cell) !=
       HS_CELL_ONION_KEY_TYPE_NTOR) {
     log_info(LD_REND, "INTRODUCE2 onion key type is invalid. Got %u but "
-                      "expected %u on circuit %u for service %s",
+                      "expected %u.",
              trn_cell_introduce_encrypted_get_onion_key_type(enc_cell),
-             HS_CELL_ONION_KEY_TYPE_NTOR, TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             HS_CELL_ONION_KEY_TYPE_NTOR);
     goto err;
   }
 
   if (trn_cell_introduce_encrypted_getlen_onion_key(enc_cell) !=
       CURVE25519_PUBKEY_LEN) {
     log_info(LD_REND, "INTRODUCE2 onion key length is invalid. Got %u but "
-                      "expected %d on circuit %u for service %s",
+                      "expected %d.",
              (unsigned)trn_cell_introduce_encrypted_getlen_onion_key(enc_cell),
-             CURVE25519_PUBKEY_LEN, TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+             CURVE25519_PUBKEY_LEN);
     goto err;
   }
   /* XXX: Validate NSPEC field as well. */
@@ -621,23 +614,19 @@ hs_cell_parse_intro_established(const uint8_t *payload, size_t payload_len)
   return ret;
 }
 
-/* Parsse the INTRODUCE2 cell using data which contains everything we need to
- * do so and contains the destination buffers of information we extract and
- * compute from the cell. Return 0 on success else a negative value. The
- * service and circ are only used for logging purposes. */
+/* Do the cheap part of parsing the INTRODUCE2 cell in data: decode it, and
+ * check the length of its ENCRYPTED section. Return the length of the
+ * ENCRYPTED section, which is at the very end of the payload, on success else
+ * a negative value. The service and circ are only used for logging
+ * purposes. */
 ssize_t
-hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
+hs_cell_check_introduce2(hs_cell_introduce2_data_t *data,
                          const origin_circuit_t *circ,
                          const hs_service_t *service)
 {
-  int ret = -1;
-  time_t elapsed;
-  uint8_t *decrypted = NULL;
+  ssize_t ret = -1;
   size_t encrypted_section_len;
-  const uint8_t *encrypted_section;
   trn_cell_introduce1_t *cell = NULL;
-  trn_cell_introduce_encrypted_t *enc_cell = NULL;
-  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
 
   tor_assert(data);
   tor_assert(circ);
@@ -654,7 +643,6 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
            TO_CIRCUIT(circ)->n_circ_id,
            safe_str_client(service->onion_address));
 
-  encrypted_section = trn_cell_introduce1_getconstarray_encrypted(cell);
   encrypted_section_len = trn_cell_introduce1_getlen_encrypted(cell);
 
   /* Encrypted section must at least contain the CLIENT_PK and MAC which is
@@ -666,14 +654,71 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
     goto done;
   }
 
-  /* Check our replay cache for this introduction point. */
-  if (replaycache_add_test_and_elapsed(data->replay_cache, encrypted_section,
+  /* The ENCRYPTED section is the last field of the cell. */
+  tor_assert(encrypted_section_len <= data->payload_len);
+  ret = (ssize_t) encrypted_section_len;
+
+ done:
+  trn_cell_introduce1_free(cell);
+  return ret;
+}
+
+/* Return 1 if the replay cache <b>replay_cache</b> of an introduction point
+ * has seen the INTRODUCE2 cell in data before, else add the cell to it and
+ * return 0. The cell's ENCRYPTED section, which is what we remember, is the
+ * last encrypted_section_len bytes of its payload.
+ *
+ * Only call this once the cell has passed hs_cell_decrypt_introduce2(): if
+ * cells that don't authenticate went in, anybody could fill the cache with
+ * junk. This has to be done on the main thread. */
+int
+hs_cell_introduce2_is_replay(replaycache_t *replay_cache,
+                             const hs_cell_introduce2_data_t *data,
+                             size_t encrypted_section_len)
+{
+  const uint8_t *encrypted_section;
+  time_t elapsed;
+
+  tor_assert(data);
+  tor_assert(encrypted_section_len <= data->payload_len);
+
+  encrypted_section = data->payload + data->payload_len -
+                      encrypted_section_len;
+  if (replaycache_add_test_and_elapsed(replay_cache, encrypted_section,
                                        encrypted_section_len, &elapsed)) {
     log_warn(LD_REND, "Possible replay detected! An INTRODUCE2 cell with the"
                       "same ENCRYPTED section was seen %ld seconds ago. "
                       "Dropping cell.", (long int) elapsed);
-    goto done;
+    return 1;
   }
+  return 0;
+}
+
+/* Do the expensive part of parsing the INTRODUCE2 cell in data, which must
+ * have passed hs_cell_check_introduce2() that returned encrypted_section_len:
+ * compute the key material, validate the MAC and decrypt the ENCRYPTED
+ * section. On success, the onion_pk, rendezvous_cookie, client_pk and
+ * link_specifiers of data are populated.
+ *
+ * This only touches data, so it is safe to call from a worker thread as long
+ * as the main thread doesn't touch data in the meantime. The replay_cache of
+ * data is not used. Return 0 on success else a negative value. */
+int
+hs_cell_decrypt_introduce2(hs_cell_introduce2_data_t *data,
+                           size_t encrypted_section_len)
+{
+  int ret = -1;
+  uint8_t *decrypted = NULL;
+  const uint8_t *encrypted_section;
+  trn_cell_introduce_encrypted_t *enc_cell = NULL;
+  hs_ntor_intro_cell_keys_t *intro_keys = NULL;
+
+  tor_assert(data);
+  tor_assert(encrypted_section_len >= CURVE25519_PUBKEY_LEN + DIGEST256_LEN);
+  tor_assert(encrypted_section_len <= data->payload_len);
+
+  encrypted_section =
+    data->payload + (data->payload_len - encrypted_section_len);
 
   /* Build the key material out of the key material found in the cell. */
   intro_keys = get_introduce2_key_material(data->auth_pk, data->enc_kp,
@@ -682,9 +727,7 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                            &data->client_pk);
   if (intro_keys == NULL) {
     log_info(LD_REND, "Invalid INTRODUCE2 encrypted data. Unable to "
-                      "compute key material on circuit %u for service %s",
-             TO_CIRCUIT(circ)->n_circ_id,
-             safe_str_client(service->onion_address));
+                      "compute key material.");
     goto done;
   }
 
@@ -702,10 +745,7 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                           intro_keys->mac_key, sizeof(intro_keys->mac_key),
                           mac, sizeof(mac));
     if (tor_memcmp(mac, encrypted_section + mac_offset, sizeof(mac))) {
-      log_info(LD_REND, "Invalid MAC validation for INTRODUCE2 cell on "
-                        "circuit %u for service %s",
-               TO_CIRCUIT(circ)->n_circ_id,
-               safe_str_client(service->onion_address));
+      log_info(LD_REND, "Invalid MAC validation for INTRODUCE2 cell.");
       goto done;
     }
   }
@@ -725,16 +765,13 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                    encrypted_data, encrypted_data_len);
     if (decrypted == NULL) {
       log_info(LD_REND, "Unable to decrypt the ENCRYPTED section of an "
-                        "INTRODUCE2 cell on circuit %u for service %s",
-               TO_CIRCUIT(circ)->n_circ_id,
-               safe_str_client(service->onion_address));
+                        "INTRODUCE2 cell.");
       goto done;
     }
 
     /* Parse this blob into an encrypted cell structure so we can then extract
      * the data we need out of it. */
-    enc_cell = parse_introduce2_encrypted(decrypted, encrypted_data_len,
-                                          circ, service);
+    enc_cell = parse_introduce2_encrypted(decrypted, encrypted_data_len);
     memwipe(decrypted, 0, encrypted_data_len);
     if (enc_cell == NULL) {
       goto done;
@@ -762,7 +799,6 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
 
   /* Success. */
   ret = 0;
-  log_info(LD_REND, "Valid INTRODUCE2 cell. Launching rendezvous circuit.");
 
  done:
   if (intro_keys) {
@@ -771,10 +807,43 @@ hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
   }
   tor_free(decrypted);
   trn_cell_introduce_encrypted_free(enc_cell);
-  trn_cell_introduce1_free(cell);
   return ret;
 }
 
+/* Parsse the INTRODUCE2 cell using data which contains everything we need to
+ * do so and contains the destination buffers of information we extract and
+ * compute from the cell. Return 0 on success else a negative value. The
+ * service and circ are only used for logging purposes. */
+ssize_t
+hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
+                         const origin_circuit_t *circ,
+                         const hs_service_t *service)
+{
+  ssize_t encrypted_section_len;
+
+  tor_assert(data);
+  tor_assert(circ);
+  tor_assert(service);
+
+  encrypted_section_len = hs_cell_check_introduce2(data, circ, service);
+  if (encrypted_section_len < 0) {
+    return -1;
+  }
+  if (hs_cell_decrypt_introduce2(data, encrypted_section_len) < 0) {
+    log_info(LD_REND, "Dropping INTRODUCE2 cell on circuit %u for "
+                      "service %s.", TO_CIRCUIT(circ)->n_circ_id,
+             safe_str_client(service->onion_address));
+    return -1;
+  }
+  if (hs_cell_introduce2_is_replay(data->replay_cache, data,
+                                   encrypted_section_len)) {
+    return -1;
+  }
+
+  log_info(LD_REND, "Valid INTRODUCE2 cell. Launching rendezvous circuit.");
+  return 0;
+}
+
 /* Build a RENDEZVOUS1 cell with the given rendezvous cookie and handshake
  * info. The encoded cell is put in cell_out and the length of the data is
  * returned. This can't fail. */
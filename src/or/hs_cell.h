@@ -86,7 +86,8 @@ typedef struct hs_cell_introduce2_data_t {
   curve25519_public_key_t client_pk;
   /* Link specifiers of the rendezvous point. Contains link_specifier_t. */
   smartlist_t *link_specifiers;
-  /* Replay cache of the introduction point. */
+  /* Replay cache of the introduction point, which hs_cell_parse_introduce2()
+   * checks once the cell has authenticated. */
   replaycache_t *replay_cache;
 } hs_cell_introduce2_data_t;
 
@@ -110,6 +111,14 @@ ssize_t hs_cell_parse_intro_established(const uint8_t *payload,
 ssize_t hs_cell_parse_introduce2(hs_cell_introduce2_data_t *data,
                                  const origin_circuit_t *circ,
                                  const hs_service_t *service);
+ssize_t hs_cell_check_introduce2(hs_cell_introduce2_data_t *data,
+                                 const origin_circuit_t *circ,
+                                 const hs_service_t *service);
+int hs_cell_decrypt_introduce2(hs_cell_introduce2_data_t *data,
+                               size_t encrypted_section_len);
+int hs_cell_introduce2_is_replay(replaycache_t *replay_cache,
+                                 const hs_cell_introduce2_data_t *data,
+                                 size_t encrypted_section_len);
 int hs_cell_parse_introduce_ack(const uint8_t *payload, size_t payload_len);
 int hs_cell_parse_rendezvous2(const uint8_t *payload, size_t payload_len,
                               uint8_t *handshake_info,
@@ -961,7 +961,10 @@ hs_circ_handle_intro_established(const hs_service_t *service,
 /* We just received an INTRODUCE2 cell on the established introduction circuit
  * circ.  Handle the INTRODUCE2 payload of size payload_len for the given
  * circuit and service. This cell is associated with the intro point object ip
- * and the subcredential. Return 0 on success else a negative value. */
+ * and the subcredential. Return 0 on success else a negative value.
+ *
+ * This does all the work on the main thread; see hs_service.c for the
+ * version that hands the expensive part to the worker threads. */
 int
 hs_circ_handle_introduce2(const hs_service_t *service,
                           const origin_circuit_t *circ,
@@ -970,7 +973,6 @@ hs_circ_handle_introduce2(const hs_service_t *service,
                           const uint8_t *payload, size_t payload_len)
 {
   int ret = -1;
-  time_t elapsed;
   hs_cell_introduce2_data_t data;
 
   tor_assert(service);
@@ -993,10 +995,35 @@ hs_circ_handle_introduce2(const hs_service_t *service,
     goto done;
   }
 
+  ret = hs_circ_launch_introduce2(service, ip, &data);
+
+ done:
+  SMARTLIST_FOREACH(data.link_specifiers, link_specifier_t *, lspec,
+                    link_specifier_free(lspec));
+  smartlist_free(data.link_specifiers);
+  memwipe(&data, 0, sizeof(data));
+  return ret;
+}
+
+/* We just finished parsing and decrypting a valid INTRODUCE2 cell into data
+ * for the given service on the intro point object ip. Unless we've already
+ * seen its rendezvous cookie, launch a circuit to the rendezvous point.
+ * Return 0 on success else a negative value. */
+int
+hs_circ_launch_introduce2(const hs_service_t *service,
+                          hs_service_intro_point_t *ip,
+                          const hs_cell_introduce2_data_t *data)
+{
+  time_t elapsed;
+
+  tor_assert(service);
+  tor_assert(ip);
+  tor_assert(data);
+
   /* Check whether we've seen this REND_COOKIE before to detect repeats. */
   if (replaycache_add_test_and_elapsed(
            service->state.replay_cache_rend_cookie,
-           data.rendezvous_cookie, sizeof(data.rendezvous_cookie),
+           data->rendezvous_cookie, sizeof(data->rendezvous_cookie),
            &elapsed)) {
     /* A Tor client will send a new INTRODUCE1 cell with the same REND_COOKIE
      * as its previous one if its intro circ times out while in state
@@ -1007,7 +1034,7 @@ hs_circ_handle_introduce2(const hs_service_t *service,
     log_info(LD_REND, "We received an INTRODUCE2 cell with same REND_COOKIE "
                       "field %ld seconds ago. Dropping cell.",
              (long int) elapsed);
-    goto done;
+    return -1;
   }
 
   /* At this point, we just confirmed that the full INTRODUCE2 cell is valid
@@ -1015,16 +1042,9 @@ hs_circ_handle_introduce2(const hs_service_t *service,
   ip->introduce2_count++;
 
   /* Launch rendezvous circuit with the onion key and rend cookie. */
-  launch_rendezvous_point_circuit(service, ip, &data);
+  launch_rendezvous_point_circuit(service, ip, data);
   /* Success. */
-  ret = 0;
-
- done:
-  SMARTLIST_FOREACH(data.link_specifiers, link_specifier_t *, lspec,
-                    link_specifier_free(lspec));
-  smartlist_free(data.link_specifiers);
-  memwipe(&data, 0, sizeof(data));
-  return ret;
+  return 0;
 }
 
 /* Circuit <b>circ</b> just finished the rend ntor key exchange. Use the key
@@ -46,6 +46,10 @@ int hs_circ_handle_introduce2(const hs_service_t *service,
                               hs_service_intro_point_t *ip,
                               const uint8_t *subcredential,
                               const uint8_t *payload, size_t payload_len);
+struct hs_cell_introduce2_data_t;
+int hs_circ_launch_introduce2(const hs_service_t *service,
+                              hs_service_intro_point_t *ip,
+                              const struct hs_cell_introduce2_data_t *data);
 int hs_circ_send_introduce1(origin_circuit_t *intro_circ,
                             origin_circuit_t *rend_circ,
                             const hs_desc_intro_point_t *ip,
@@ -218,28 +218,30 @@ build_mac(const uint8_t *mac_key, size_t mac_key_len,
   crypto_digest_free(digest);
 }
 
-/* Using a given decriptor object, build the secret input needed for the
- * KDF and put it in the dst pointer which is an already allocated buffer
- * of size dstlen. */
+/* Using the blinded key, subcredential and revision counter of a
+ * descriptor, build the secret input needed for the KDF and put it in the dst
+ * pointer which is an already allocated buffer of size dstlen. */
 static void
-build_secret_input(const hs_descriptor_t *desc, uint8_t *dst, size_t dstlen)
+build_secret_input(const ed25519_public_key_t *blinded_pubkey,
+                   const uint8_t *subcredential, uint64_t revision_counter,
+                   uint8_t *dst, size_t dstlen)
 {
   size_t offset = 0;
 
-  tor_assert(desc);
+  tor_assert(blinded_pubkey);
+  tor_assert(subcredential);
   tor_assert(dst);
   tor_assert(HS_DESC_ENCRYPTED_SECRET_INPUT_LEN <= dstlen);
 
   /* XXX use the destination length as the memcpy length */
   /* Copy blinded public key. */
-  memcpy(dst, desc->plaintext_data.blinded_pubkey.pubkey,
-         sizeof(desc->plaintext_data.blinded_pubkey.pubkey));
-  offset += sizeof(desc->plaintext_data.blinded_pubkey.pubkey);
+  memcpy(dst, blinded_pubkey->pubkey, sizeof(blinded_pubkey->pubkey));
+  offset += sizeof(blinded_pubkey->pubkey);
   /* Copy subcredential. */
-  memcpy(dst + offset, desc->subcredential, sizeof(desc->subcredential));
-  offset += sizeof(desc->subcredential);
+  memcpy(dst + offset, subcredential, DIGEST256_LEN);
+  offset += DIGEST256_LEN;
   /* Copy revision counter value. */
-  set_uint64(dst + offset, tor_htonll(desc->plaintext_data.revision_counter));
+  set_uint64(dst + offset, tor_htonll(revision_counter));
   offset += sizeof(uint64_t);
   tor_assert(HS_DESC_ENCRYPTED_SECRET_INPUT_LEN == offset);
 }
@@ -247,7 +249,8 @@ build_secret_input(const hs_descriptor_t *desc, uint8_t *dst, size_t dstlen)
 /* Do the KDF construction and put the resulting data in key_out which is of
  * key_out_len length. It uses SHAKE-256 as specified in the spec. */
 static void
-build_kdf_key(const hs_descriptor_t *desc,
+build_kdf_key(const ed25519_public_key_t *blinded_pubkey,
+              const uint8_t *subcredential, uint64_t revision_counter,
               const uint8_t *salt, size_t salt_len,
               uint8_t *key_out, size_t key_out_len,
               int is_superencrypted_layer)
@@ -255,12 +258,12 @@ build_kdf_key(const hs_descriptor_t *desc,
   uint8_t secret_input[HS_DESC_ENCRYPTED_SECRET_INPUT_LEN];
   crypto_xof_t *xof;
 
-  tor_assert(desc);
   tor_assert(salt);
   tor_assert(key_out);
 
   /* Build the secret input for the KDF computation. */
-  build_secret_input(desc, secret_input, sizeof(secret_input));
+  build_secret_input(blinded_pubkey, subcredential, revision_counter,
+                     secret_input, sizeof(secret_input));
 
   xof = crypto_xof_new();
   /* Feed our KDF. [SHAKE it like a polaroid picture --Yawning]. */
@@ -282,11 +285,13 @@ build_kdf_key(const hs_descriptor_t *desc,
   memwipe(secret_input,  0, sizeof(secret_input));
 }
 
-/* Using the given descriptor and salt, run it through our KDF function and
- * then extract a secret key in key_out, the IV in iv_out and MAC in mac_out.
- * This function can't fail. */
+/* Using the given descriptor keys and salt, run it through our KDF function
+ * and then extract a secret key in key_out, the IV in iv_out and MAC in
+ * mac_out. This function can't fail. */
 static void
-build_secret_key_iv_mac(const hs_descriptor_t *desc,
+build_secret_key_iv_mac(const ed25519_public_key_t *blinded_pubkey,
+                        const uint8_t *subcredential,
+                        uint64_t revision_counter,
                         const uint8_t *salt, size_t salt_len,
                         uint8_t *key_out, size_t key_len,
                         uint8_t *iv_out, size_t iv_len,
@@ -296,13 +301,13 @@ build_secret_key_iv_mac(const hs_descriptor_t *desc,
   size_t offset = 0;
   uint8_t kdf_key[HS_DESC_ENCRYPTED_KDF_OUTPUT_LEN];
 
-  tor_assert(desc);
   tor_assert(salt);
   tor_assert(key_out);
   tor_assert(iv_out);
   tor_assert(mac_out);
 
-  build_kdf_key(desc, salt, salt_len, kdf_key, sizeof(kdf_key),
+  build_kdf_key(blinded_pubkey, subcredential, revision_counter,
+                salt, salt_len, kdf_key, sizeof(kdf_key),
                 is_superencrypted_layer);
   /* Copy the bytes we need for both the secret key and IV. */
   memcpy(key_out, kdf_key, key_len);
@@ -317,6 +322,27 @@ build_secret_key_iv_mac(const hs_descriptor_t *desc,
 
 /* === ENCODING === */
 
+/* A descriptor that is being encoded. Building the plaintext of a descriptor
+ * needs the descriptor itself, but the expensive part of encoding it
+ * (encrypting both layers, signing, and decoding the result to check it)
+ * only needs what is copied in here, so it can be done on any thread. */
+struct hs_desc_encoding_t {
+  /* Version of the descriptor format. */
+  uint32_t version;
+  /* Descriptor values that the encryption keys are derived from. */
+  ed25519_public_key_t blinded_pubkey;
+  uint8_t subcredential[DIGEST256_LEN];
+  uint64_t revision_counter;
+  /* The descriptor lines that precede the superencrypted section. */
+  smartlist_t *lines;
+  /* Plaintext of the inner (encrypted) layer of the descriptor. */
+  char *inner_plaintext;
+  /* Key pair that signs the descriptor. */
+  ed25519_keypair_t signing_kp;
+  /* An encoded descriptor must be strictly smaller than this. */
+  size_t max_len;
+};
+
 /* Encode the given link specifier objects into a newly allocated string.
  * This can't fail so caller can always assume a valid string being
  * returned. */
@@ -608,12 +634,12 @@ build_encrypted(const uint8_t *key, const uint8_t *iv, const char *plaintext,
   return encrypted_len;
 }
 
-/* Encrypt the given <b>plaintext</b> buffer using <b>desc</b> to get the
+/* Encrypt the given <b>plaintext</b> buffer using <b>enc</b> to get the
  * keys. Set encrypted_out with the encrypted data and return the length of
  * it. <b>is_superencrypted_layer</b> is set if this is the outer encrypted
  * layer of the descriptor. */
 static size_t
-encrypt_descriptor_data(const hs_descriptor_t *desc, const char *plaintext,
+encrypt_descriptor_data(const hs_desc_encoding_t *enc, const char *plaintext,
                         char **encrypted_out, int is_superencrypted_layer)
 {
   char *final_blob;
@@ -623,7 +649,7 @@ encrypt_descriptor_data(const hs_descriptor_t *desc, const char *plaintext,
   uint8_t secret_key[HS_DESC_ENCRYPTED_KEY_LEN], secret_iv[CIPHER_IV_LEN];
   uint8_t mac_key[DIGEST256_LEN], mac[DIGEST256_LEN];
 
-  tor_assert(desc);
+  tor_assert(enc);
   tor_assert(plaintext);
   tor_assert(encrypted_out);
 
@@ -632,7 +658,8 @@ encrypt_descriptor_data(const hs_descriptor_t *desc, const char *plaintext,
 
   /* KDF construction resulting in a key from which the secret key, IV and MAC
    * key are extracted which is what we need for the encryption. */
-  build_secret_key_iv_mac(desc, salt, sizeof(salt),
+  build_secret_key_iv_mac(&enc->blinded_pubkey, enc->subcredential,
+                          enc->revision_counter, salt, sizeof(salt),
                           secret_key, sizeof(secret_key),
                           secret_iv, sizeof(secret_iv),
                           mac_key, sizeof(mac_key),
@@ -809,8 +836,7 @@ get_inner_encrypted_layer_plaintext(const hs_descriptor_t *desc)
  * layer plaintext, or NULL if an error occurred. It's the responsibility of
  * the caller to free the returned string. */
 static char *
-get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
-                                    const char *layer2_b64_ciphertext)
+get_outer_encrypted_layer_plaintext(const char *layer2_b64_ciphertext)
 {
   char *layer1_str = NULL;
   smartlist_t *lines = smartlist_new();
@@ -819,7 +845,6 @@ get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
    * data. Real client auth is not yet implemented, but client auth data MUST
    * always be present in descriptors. In the future this function will be
    * refactored to use real client auth data if they exist (#20700). */
-  (void) *desc;
 
   /* Specify auth type */
   smartlist_add_asprintf(lines, "%s %s\n", str_desc_auth_type, "x25519");
@@ -865,12 +890,12 @@ get_outer_encrypted_layer_plaintext(const hs_descriptor_t *desc,
 }
 
 /* Encrypt <b>encoded_str</b> into an encrypted blob and then base64 it before
- * returning it. <b>desc</b> is provided to derive the encryption
+ * returning it. <b>enc</b> is provided to derive the encryption
  * keys. <b>is_superencrypted_layer</b> is set if <b>encoded_str</b> is the
  * middle (superencrypted) layer of the descriptor. It's the responsibility of
  * the caller to free the returned string. */
 static char *
-encrypt_desc_data_and_base64(const hs_descriptor_t *desc,
+encrypt_desc_data_and_base64(const hs_desc_encoding_t *enc,
                              const char *encoded_str,
                              int is_superencrypted_layer)
 {
@@ -878,7 +903,7 @@ encrypt_desc_data_and_base64(const hs_descriptor_t *desc,
   ssize_t enc_b64_len, ret_len, enc_len;
   char *encrypted_blob = NULL;
 
-  enc_len = encrypt_descriptor_data(desc, encoded_str, &encrypted_blob,
+  enc_len = encrypt_descriptor_data(enc, encoded_str, &encrypted_blob,
                                     is_superencrypted_layer);
   /* Get the encoded size plus a NUL terminating byte. */
   enc_b64_len = base64_encode_size(enc_len, BASE64_ENCODE_MULTILINE) + 1;
@@ -893,49 +918,44 @@ encrypt_desc_data_and_base64(const hs_descriptor_t *desc,
   return enc_b64;
 }
 
-/* Generate and encode the superencrypted portion of <b>desc</b>. This also
- * involves generating the encrypted portion of the descriptor, and performing
- * the superencryption. A newly allocated NUL-terminated string pointer
- * containing the encrypted encoded blob is put in encrypted_blob_out. Return 0
- * on success else a negative value. */
+/* Generate and encode the superencrypted portion of the descriptor being
+ * encoded in <b>enc</b>. This involves encrypting the inner layer of the
+ * descriptor, and performing the superencryption. A newly allocated
+ * NUL-terminated string pointer containing the encrypted encoded blob is put
+ * in encrypted_blob_out. Return 0 on success else a negative value. */
 static int
-encode_superencrypted_data(const hs_descriptor_t *desc,
+encode_superencrypted_data(const hs_desc_encoding_t *enc,
                            char **encrypted_blob_out)
 {
   int ret = -1;
-  char *layer2_str = NULL;
   char *layer2_b64_ciphertext = NULL;
   char *layer1_str = NULL;
   char *layer1_b64_ciphertext = NULL;
 
-  tor_assert(desc);
+  tor_assert(enc);
+  tor_assert(enc->inner_plaintext);
   tor_assert(encrypted_blob_out);
 
-  /* Func logic: We first create the inner layer of the descriptor (layer2).
-   * We then encrypt it and use it to create the middle layer of the descriptor
-   * (layer1).  Finally we superencrypt the middle layer and return it to our
-   * caller. */
-
-  /* Create inner descriptor layer */
-  layer2_str = get_inner_encrypted_layer_plaintext(desc);
-  if (!layer2_str) {
-    goto err;
-  }
+  /* Func logic: The inner layer of the descriptor (layer2) has already been
+   * created. We encrypt it and use it to create the middle layer of the
+   * descriptor (layer1).  Finally we superencrypt the middle layer and return
+   * it to our caller. */
 
   /* Encrypt and b64 the inner layer */
-  layer2_b64_ciphertext = encrypt_desc_data_and_base64(desc, layer2_str, 0);
+  layer2_b64_ciphertext =
+    encrypt_desc_data_and_base64(enc, enc->inner_plaintext, 0);
   if (!layer2_b64_ciphertext) {
     goto err;
   }
 
   /* Now create middle descriptor layer given the inner layer */
-  layer1_str = get_outer_encrypted_layer_plaintext(desc,layer2_b64_ciphertext);
+  layer1_str = get_outer_encrypted_layer_plaintext(layer2_b64_ciphertext);
   if (!layer1_str) {
     goto err;
   }
 
   /* Encrypt and base64 the middle layer */
-  layer1_b64_ciphertext = encrypt_desc_data_and_base64(desc, layer1_str, 1);
+  layer1_b64_ciphertext = encrypt_desc_data_and_base64(enc, layer1_str, 1);
   if (!layer1_b64_ciphertext) {
     goto err;
   }
@@ -945,67 +965,35 @@ encode_superencrypted_data(const hs_descriptor_t *desc,
 
  err:
   tor_free(layer1_str);
-  tor_free(layer2_str);
   tor_free(layer2_b64_ciphertext);
 
   *encrypted_blob_out = layer1_b64_ciphertext;
   return ret;
 }
 
-/* Encode a v3 HS descriptor. Return 0 on success and set encoded_out to the
- * newly allocated string of the encoded descriptor. On error, -1 is returned
- * and encoded_out is untouched. */
+/* Finish encoding the v3 HS descriptor in <b>enc</b>: encrypt it and sign
+ * it. Return 0 on success and set encoded_out to the newly allocated string
+ * of the encoded descriptor. On error, -1 is returned and encoded_out is
+ * untouched. This can be called from any thread, but only once per encoding
+ * object. */
 static int
-desc_encode_v3(const hs_descriptor_t *desc,
-               const ed25519_keypair_t *signing_kp, char **encoded_out)
+desc_encoding_finish_v3(hs_desc_encoding_t *enc, char **encoded_out)
 {
   int ret = -1;
   char *encoded_str = NULL;
   size_t encoded_len;
-  smartlist_t *lines = smartlist_new();
+  smartlist_t *lines;
 
-  tor_assert(desc);
-  tor_assert(signing_kp);
+  tor_assert(enc);
+  tor_assert(enc->lines);
   tor_assert(encoded_out);
-  tor_assert(desc->plaintext_data.version == 3);
 
-  if (BUG(desc->subcredential == NULL)) {
-    goto err;
-  }
-
-  /* Build the non-encrypted values. */
-  {
-    char *encoded_cert;
-    /* Encode certificate then create the first line of the descriptor. */
-    if (desc->plaintext_data.signing_key_cert->cert_type
-        != CERT_TYPE_SIGNING_HS_DESC) {
-      log_err(LD_BUG, "HS descriptor signing key has an unexpected cert type "
-              "(%d)", (int) desc->plaintext_data.signing_key_cert->cert_type);
-      goto err;
-    }
-    if (tor_cert_encode_ed22519(desc->plaintext_data.signing_key_cert,
-                                &encoded_cert) < 0) {
-      /* The function will print error logs. */
-      goto err;
-    }
-    /* Create the hs descriptor line. */
-    smartlist_add_asprintf(lines, "%s %" PRIu32, str_hs_desc,
-                           desc->plaintext_data.version);
-    /* Add the descriptor lifetime line (in minutes). */
-    smartlist_add_asprintf(lines, "%s %" PRIu32, str_lifetime,
-                           desc->plaintext_data.lifetime_sec / 60);
-    /* Create the descriptor certificate line. */
-    smartlist_add_asprintf(lines, "%s\n%s", str_desc_cert, encoded_cert);
-    tor_free(encoded_cert);
-    /* Create the revision counter line. */
-    smartlist_add_asprintf(lines, "%s %" PRIu64, str_rev_counter,
-                           desc->plaintext_data.revision_counter);
-  }
+  lines = enc->lines;
 
   /* Build the superencrypted data section. */
   {
     char *enc_b64_blob=NULL;
-    if (encode_superencrypted_data(desc, &enc_b64_blob) < 0) {
+    if (encode_superencrypted_data(enc, &enc_b64_blob) < 0) {
       goto err;
     }
     smartlist_add_asprintf(lines,
@@ -1027,7 +1015,7 @@ desc_encode_v3(const hs_descriptor_t *desc,
     char ed_sig_b64[ED25519_SIG_BASE64_LEN + 1];
     if (ed25519_sign_prefixed(&sig,
                               (const uint8_t *) encoded_str, encoded_len,
-                              str_desc_sig_prefix, signing_kp) < 0) {
+                              str_desc_sig_prefix, &enc->signing_kp) < 0) {
       log_warn(LD_BUG, "Can't sign encoded HS descriptor!");
       tor_free(encoded_str);
       goto err;
@@ -1043,9 +1031,8 @@ desc_encode_v3(const hs_descriptor_t *desc,
   /* Free previous string that we used so compute the signature. */
   tor_free(encoded_str);
   encoded_str = smartlist_join_strings(lines, "\n", 1, NULL);
-  *encoded_out = encoded_str;
 
-  if (strlen(encoded_str) >= hs_cache_get_max_descriptor_size()) {
+  if (strlen(encoded_str) >= enc->max_len) {
     log_warn(LD_GENERAL, "We just made an HS descriptor that's too big (%d)."
              "Failing.", (int)strlen(encoded_str));
     tor_free(encoded_str);
@@ -1055,14 +1042,95 @@ desc_encode_v3(const hs_descriptor_t *desc,
   /* XXX: Trigger a control port event. */
 
   /* Success! */
+  *encoded_out = encoded_str;
   ret = 0;
 
  err:
   SMARTLIST_FOREACH(lines, char *, l, tor_free(l));
   smartlist_free(lines);
+  enc->lines = NULL;
   return ret;
 }
 
+/* Start encoding the v3 HS descriptor <b>desc</b>, which will be signed
+ * with <b>signing_kp</b>: build all of its plaintext. Return a new encoding
+ * object on success, or NULL on error. */
+static hs_desc_encoding_t *
+desc_encoding_new_v3(const hs_descriptor_t *desc,
+                     const ed25519_keypair_t *signing_kp)
+{
+  hs_desc_encoding_t *enc = NULL;
+  smartlist_t *lines = smartlist_new();
+
+  tor_assert(desc);
+  tor_assert(signing_kp);
+  tor_assert(desc->plaintext_data.version == 3);
+
+  if (BUG(desc->subcredential == NULL)) {
+    goto err;
+  }
+
+  /* Build the non-encrypted values. */
+  {
+    char *encoded_cert;
+    /* Encode certificate then create the first line of the descriptor. */
+    if (desc->plaintext_data.signing_key_cert->cert_type
+        != CERT_TYPE_SIGNING_HS_DESC) {
+      log_err(LD_BUG, "HS descriptor signing key has an unexpected cert type "
+              "(%d)", (int) desc->plaintext_data.signing_key_cert->cert_type);
+      goto err;
+    }
+    if (tor_cert_encode_ed22519(desc->plaintext_data.signing_key_cert,
+                                &encoded_cert) < 0) {
+      /* The function will print error logs. */
+      goto err;
+    }
+    /* Create the hs descriptor line. */
+    smartlist_add_asprintf(lines, "%s %" PRIu32, str_hs_desc,
+                           desc->plaintext_data.version);
+    /* Add the descriptor lifetime line (in minutes). */
+    smartlist_add_asprintf(lines, "%s %" PRIu32, str_lifetime,
+                           desc->plaintext_data.lifetime_sec / 60);
+    /* Create the descriptor certificate line. */
+    smartlist_add_asprintf(lines, "%s\n%s", str_desc_cert, encoded_cert);
+    tor_free(encoded_cert);
+    /* Create the revision counter line. */
+    smartlist_add_asprintf(lines, "%s %" PRIu64, str_rev_counter,
+                           desc->plaintext_data.revision_counter);
+  }
+
+  enc = tor_malloc_zero(sizeof(*enc));
+  enc->version = desc->plaintext_data.version;
+  enc->lines = lines;
+  lines = NULL;
+
+  /* Create inner descriptor layer. It is encrypted with the rest when the
+   * encoding is finished. */
+  enc->inner_plaintext = get_inner_encrypted_layer_plaintext(desc);
+  if (!enc->inner_plaintext) {
+    goto err;
+  }
+
+  memcpy(&enc->blinded_pubkey, &desc->plaintext_data.blinded_pubkey,
+         sizeof(enc->blinded_pubkey));
+  memcpy(enc->subcredential, desc->subcredential,
+         sizeof(enc->subcredential));
+  enc->revision_counter = desc->plaintext_data.revision_counter;
+  memcpy(&enc->signing_kp, signing_kp, sizeof(enc->signing_kp));
+  /* The consensus parameter can only be read from the main thread. */
+  enc->max_len = hs_cache_get_max_descriptor_size();
+
+  return enc;
+
+ err:
+  if (lines) {
+    SMARTLIST_FOREACH(lines, char *, l, tor_free(l));
+    smartlist_free(lines);
+  }
+  hs_desc_encoding_free(enc);
+  return NULL;
+}
+
 /* === DECODING === */
 
 /* Given an encoded string of the link specifiers, return a newly allocated
@@ -1349,7 +1417,10 @@ decrypt_desc_layer,(const hs_descriptor_t *desc,
 
   /* KDF construction resulting in a key from which the secret key, IV and MAC
    * key are extracted which is what we need for the decryption. */
-  build_secret_key_iv_mac(desc, salt, HS_DESC_ENCRYPTED_SALT_LEN,
+  build_secret_key_iv_mac(&desc->plaintext_data.blinded_pubkey,
+                          desc->subcredential,
+                          desc->plaintext_data.revision_counter,
+                          salt, HS_DESC_ENCRYPTED_SALT_LEN,
                           secret_key, sizeof(secret_key),
                           secret_iv, sizeof(secret_iv),
                           mac_key, sizeof(mac_key),
@@ -2190,11 +2261,12 @@ static int
   desc_decode_plaintext_v3,
 };
 
-/* Fully decode the given descriptor plaintext and store the data in the
- * plaintext data object. Returns 0 on success else a negative value. */
-int
-hs_desc_decode_plaintext(const char *encoded,
-                         hs_desc_plaintext_data_t *plaintext)
+/* As hs_desc_decode_plaintext(), but reject descriptors of <b>max_len</b>
+ * bytes or more instead of looking up the limit in the consensus. */
+static int
+desc_decode_plaintext_with_limit(const char *encoded,
+                                 hs_desc_plaintext_data_t *plaintext,
+                                 size_t max_len)
 {
   int ok = 0, ret = -1;
   memarea_t *area = NULL;
@@ -2207,7 +2279,7 @@ hs_desc_decode_plaintext(const char *encoded,
 
   /* Check that descriptor is within size limits. */
   encoded_len = strlen(encoded);
-  if (encoded_len >= hs_cache_get_max_descriptor_size()) {
+  if (encoded_len >= max_len) {
     log_warn(LD_REND, "Service descriptor is too big (%lu bytes)",
              (unsigned long) encoded_len);
     goto err;
@@ -2263,15 +2335,24 @@ hs_desc_decode_plaintext(const char *encoded,
   return ret;
 }
 
-/* Fully decode an encoded descriptor and set a newly allocated descriptor
- * object in desc_out. Subcredentials are used if not NULL else it's ignored.
- *
- * Return 0 on success. A negative value is returned on error and desc_out is
- * set to NULL. */
+/* Fully decode the given descriptor plaintext and store the data in the
+ * plaintext data object. Returns 0 on success else a negative value. */
 int
-hs_desc_decode_descriptor(const char *encoded,
-                          const uint8_t *subcredential,
-                          hs_descriptor_t **desc_out)
+hs_desc_decode_plaintext(const char *encoded,
+                         hs_desc_plaintext_data_t *plaintext)
+{
+  return desc_decode_plaintext_with_limit(encoded, plaintext,
+                                          hs_cache_get_max_descriptor_size());
+}
+
+/* As hs_desc_decode_descriptor(), but reject descriptors of <b>max_len</b>
+ * bytes or more instead of looking up the limit in the consensus. This is
+ * safe to call from any thread. */
+static int
+desc_decode_descriptor_with_limit(const char *encoded,
+                                  const uint8_t *subcredential,
+                                  size_t max_len,
+                                  hs_descriptor_t **desc_out)
 {
   int ret = -1;
   hs_descriptor_t *desc;
@@ -2288,7 +2369,8 @@ hs_desc_decode_descriptor(const char *encoded,
 
   memcpy(desc->subcredential, subcredential, sizeof(desc->subcredential));
 
-  ret = hs_desc_decode_plaintext(encoded, &desc->plaintext_data);
+  ret = desc_decode_plaintext_with_limit(encoded, &desc->plaintext_data,
+                                         max_len);
   if (ret < 0) {
     goto err;
   }
@@ -2315,53 +2397,100 @@ hs_desc_decode_descriptor(const char *encoded,
   return ret;
 }
 
+/* Fully decode an encoded descriptor and set a newly allocated descriptor
+ * object in desc_out. Subcredentials are used if not NULL else it's ignored.
+ *
+ * Return 0 on success. A negative value is returned on error and desc_out is
+ * set to NULL. */
+int
+hs_desc_decode_descriptor(const char *encoded,
+                          const uint8_t *subcredential,
+                          hs_descriptor_t **desc_out)
+{
+  return desc_decode_descriptor_with_limit(encoded, subcredential,
+                                           hs_cache_get_max_descriptor_size(),
+                                           desc_out);
+}
+
 /* Table of encode function version specific. The functions are indexed by the
  * version number so v3 callback is at index 3 in the array. */
-static int
-  (*encode_handlers[])(
+static hs_desc_encoding_t *
+  (*encoding_new_handlers[])(
       const hs_descriptor_t *desc,
-      const ed25519_keypair_t *signing_kp,
+      const ed25519_keypair_t *signing_kp) =
+{
+  /* v0 */ NULL, /* v1 */ NULL, /* v2 */ NULL,
+  desc_encoding_new_v3,
+};
+
+/* Table of the functions that finish an encoding, by version. */
+static int
+  (*encoding_finish_handlers[])(
+      hs_desc_encoding_t *enc,
       char **encoded_out) =
 {
   /* v0 */ NULL, /* v1 */ NULL, /* v2 */ NULL,
-  desc_encode_v3,
+  desc_encoding_finish_v3,
 };
 
-/* Encode the given descriptor desc including signing with the given key pair
- * signing_kp. On success, encoded_out points to a newly allocated NUL
- * terminated string that contains the encoded descriptor as a string.
+/* Start encoding the given descriptor desc, which will be signed with the
+ * given key pair signing_kp. This builds everything that needs the
+ * descriptor itself, so the descriptor can change or go away once this
+ * returns; call hs_desc_encoding_finish() to get the encoded descriptor.
  *
- * Return 0 on success and encoded_out is a valid pointer. On error, -1 is
- * returned and encoded_out is set to NULL. */
-MOCK_IMPL(int,
-hs_desc_encode_descriptor,(const hs_descriptor_t *desc,
-                           const ed25519_keypair_t *signing_kp,
-                           char **encoded_out))
+ * This must be called from the main thread. Return a newly allocated
+ * encoding object on success, or NULL on error. */
+hs_desc_encoding_t *
+hs_desc_encoding_new(const hs_descriptor_t *desc,
+                     const ed25519_keypair_t *signing_kp)
 {
-  int ret = -1;
   uint32_t version;
 
   tor_assert(desc);
-  tor_assert(encoded_out);
+  tor_assert(signing_kp);
 
   /* Make sure we support the version of the descriptor format. */
   version = desc->plaintext_data.version;
   if (!hs_desc_is_supported_version(version)) {
-    goto err;
+    return NULL;
   }
   /* Extra precaution. Having no handler for the supported version should
    * never happened else we forgot to add it but we bumped the version. */
-  tor_assert(ARRAY_LENGTH(encode_handlers) >= version);
-  tor_assert(encode_handlers[version]);
+  tor_assert(ARRAY_LENGTH(encoding_new_handlers) >= version);
+  tor_assert(encoding_new_handlers[version]);
+
+  return encoding_new_handlers[version](desc, signing_kp);
+}
+
+/* Finish the encoding <b>enc</b>: encrypt and sign the descriptor, and check
+ * that the result decodes. This is the expensive part of encoding a
+ * descriptor, and it is safe to call from any thread; it can only be called
+ * once for each encoding object.
+ *
+ * Return 0 on success and encoded_out points to a newly allocated NUL
+ * terminated string that contains the encoded descriptor. On error, -1 is
+ * returned and encoded_out is set to NULL. */
+int
+hs_desc_encoding_finish(hs_desc_encoding_t *enc, char **encoded_out)
+{
+  int ret = -1;
+
+  tor_assert(enc);
+  tor_assert(encoded_out);
 
-  ret = encode_handlers[version](desc, signing_kp, encoded_out);
+  tor_assert(ARRAY_LENGTH(encoding_finish_handlers) >= enc->version);
+  tor_assert(encoding_finish_handlers[enc->version]);
+
+  ret = encoding_finish_handlers[enc->version](enc, encoded_out);
   if (ret < 0) {
     goto err;
   }
 
   /* Try to decode what we just encoded. Symmetry is nice! */
-  ret = hs_desc_decode_descriptor(*encoded_out, desc->subcredential, NULL);
+  ret = desc_decode_descriptor_with_limit(*encoded_out, enc->subcredential,
+                                          enc->max_len, NULL);
   if (BUG(ret < 0)) {
+    tor_free(*encoded_out);
     goto err;
   }
 
@@ -2372,6 +2501,53 @@ hs_desc_encode_descriptor,(const hs_descriptor_t *desc,
   return ret;
 }
 
+/* Free the given encoding object. */
+void
+hs_desc_encoding_free_(hs_desc_encoding_t *enc)
+{
+  if (!enc) {
+    return;
+  }
+
+  if (enc->lines) {
+    SMARTLIST_FOREACH(enc->lines, char *, l, tor_free(l));
+    smartlist_free(enc->lines);
+  }
+  if (enc->inner_plaintext) {
+    memwipe(enc->inner_plaintext, 0, strlen(enc->inner_plaintext));
+    tor_free(enc->inner_plaintext);
+  }
+  memwipe(enc, 0, sizeof(*enc));
+  tor_free(enc);
+}
+
+/* Encode the given descriptor desc including signing with the given key pair
+ * signing_kp. On success, encoded_out points to a newly allocated NUL
+ * terminated string that contains the encoded descriptor as a string.
+ *
+ * Return 0 on success and encoded_out is a valid pointer. On error, -1 is
+ * returned and encoded_out is set to NULL. */
+MOCK_IMPL(int,
+hs_desc_encode_descriptor,(const hs_descriptor_t *desc,
+                           const ed25519_keypair_t *signing_kp,
+                           char **encoded_out))
+{
+  int ret = -1;
+  hs_desc_encoding_t *enc;
+
+  tor_assert(desc);
+  tor_assert(encoded_out);
+
+  enc = hs_desc_encoding_new(desc, signing_kp);
+  if (!enc) {
+    *encoded_out = NULL;
+    return -1;
+  }
+  ret = hs_desc_encoding_finish(enc, encoded_out);
+  hs_desc_encoding_free(enc);
+  return ret;
+}
+
 /* Free the descriptor plaintext data object. */
 void
 hs_desc_plaintext_data_free_(hs_desc_plaintext_data_t *desc)
@@ -196,6 +196,10 @@ typedef struct hs_descriptor_t {
   uint8_t subcredential[DIGEST256_LEN];
 } hs_descriptor_t;
 
+/* A descriptor that is being encoded, possibly on a worker thread. Opaque
+ * outside of hs_descriptor.c. */
+typedef struct hs_desc_encoding_t hs_desc_encoding_t;
+
 /* Return true iff the given descriptor format version is supported. */
 static inline int
 hs_desc_is_supported_version(uint32_t version)
@@ -232,6 +236,13 @@ MOCK_DECL(int,
                                      const ed25519_keypair_t *signing_kp,
                                      char **encoded_out));
 
+hs_desc_encoding_t *hs_desc_encoding_new(const hs_descriptor_t *desc,
+                                         const ed25519_keypair_t *signing_kp);
+int hs_desc_encoding_finish(hs_desc_encoding_t *enc, char **encoded_out);
+void hs_desc_encoding_free_(hs_desc_encoding_t *enc);
+#define hs_desc_encoding_free(enc) \
+  FREE_AND_NULL(hs_desc_encoding_t, hs_desc_encoding_free_, (enc))
+
 int hs_desc_decode_descriptor(const char *encoded,
                               const uint8_t *subcredential,
                               hs_descriptor_t **desc_out);
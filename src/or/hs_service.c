@@ -15,6 +15,7 @@
 #include "or/circuituse.h"
 #include "or/config.h"
 #include "or/connection.h"
+#include "or/cpuworker.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "or/directory.h"
@@ -28,7 +29,9 @@
 #include "or/routerlist.h"
 #include "or/shared_random_client.h"
 #include "or/statefile.h"
+#include "common/workqueue.h"
 
+#include "or/hs_cell.h"
 #include "or/hs_circuit.h"
 #include "or/hs_common.h"
 #include "or/hs_config.h"
@@ -436,7 +439,8 @@ service_intro_point_new(const extend_info_t *ei, unsigned int is_legacy)
       crypto_rand_int_range(intro_point_min_lifetime,intro_point_max_lifetime);
   }
 
-  ip->replay_cache = replaycache_new(0, 0);
+  ip->replay_cache =
+    replaycache_new_bucketed(0, 1, HS_SERVICE_INTRO_REPLAY_CACHE_MAX_ENTRIES);
 
   /* Initialize the base object. We don't need the certificate object. */
   ip->base.link_specifiers = smartlist_new();
@@ -1063,6 +1067,7 @@ service_descriptor_free_(hs_service_descriptor_t *desc)
   if (!desc) {
     return;
   }
+  service_desc_invalidate_encoding(desc);
   hs_descriptor_free(desc->desc);
   memwipe(&desc->signing_kp, 0, sizeof(desc->signing_kp));
   memwipe(&desc->blinded_kp, 0, sizeof(desc->blinded_kp));
@@ -1089,6 +1094,168 @@ service_descriptor_new(void)
   return sdesc;
 }
 
+/* Forget the encoded form of the given descriptor because its content or
+ * revision counter changed. If a worker thread is encoding it, the result
+ * will be thrown away. */
+STATIC void
+service_desc_invalidate_encoding(hs_service_descriptor_t *desc)
+{
+  tor_assert(desc);
+
+  tor_free(desc->encoded_desc);
+  if (desc->encode_job) {
+    desc->encode_job->desc = NULL;
+    desc->encode_job = NULL;
+  }
+}
+
+/* Return the encoded form of the given descriptor, encoding and signing it
+ * if it hasn't been since it last changed. Return NULL if it can't be
+ * encoded. The returned string belongs to desc. */
+STATIC const char *
+service_desc_get_encoded(hs_service_descriptor_t *desc)
+{
+  tor_assert(desc);
+
+  /* If a worker thread is encoding it, we don't wait for it. Whichever
+   * encoding we get first is kept. */
+  if (!desc->encoded_desc) {
+    hs_desc_encode_descriptor(desc->desc, &desc->signing_kp,
+                              &desc->encoded_desc);
+  }
+  return desc->encoded_desc;
+}
+
+/* Start encoding the given descriptor of the given service for a worker
+ * thread, and attach the job to the descriptor. Return the new job, or NULL
+ * on error. */
+STATIC desc_encode_job_t *
+desc_encode_job_new(const hs_service_t *service,
+                    hs_service_descriptor_t *desc)
+{
+  desc_encode_job_t *job;
+  hs_desc_encoding_t *encoding;
+
+  tor_assert(service);
+  tor_assert(desc);
+  tor_assert(!desc->encode_job);
+
+  encoding = hs_desc_encoding_new(desc->desc, &desc->signing_kp);
+  if (!encoding) {
+    return NULL;
+  }
+  job = tor_malloc_zero(sizeof(*job));
+  job->desc = desc;
+  ed25519_pubkey_copy(&job->identity_pk, &service->keys.identity_pk);
+  job->encoding = encoding;
+  desc->encode_job = job;
+  return job;
+}
+
+/* Free the given descriptor encoding job, detaching it from its descriptor
+ * if needed. */
+STATIC void
+desc_encode_job_free_(desc_encode_job_t *job)
+{
+  if (!job) {
+    return;
+  }
+  if (job->desc && job->desc->encode_job == job) {
+    job->desc->encode_job = NULL;
+  }
+  hs_desc_encoding_free(job->encoding);
+  tor_free(job->encoded_desc);
+  tor_free(job);
+}
+
+/* Worker thread function: encrypt and sign the descriptor of the job. */
+static workqueue_reply_t
+desc_encode_job_threadfn(void *state_, void *work_)
+{
+  desc_encode_job_t *job = work_;
+  (void) state_;
+
+  /* On error, encoded_desc stays NULL and the main thread tries again. */
+  hs_desc_encoding_finish(job->encoding, &job->encoded_desc);
+  return WQ_RPL_REPLY;
+}
+
+/* Main thread function: a worker thread is done encoding a descriptor. Keep
+ * the result, and upload the descriptor. */
+STATIC void
+desc_encode_job_replyfn(void *work_)
+{
+  desc_encode_job_t *job = work_;
+  hs_service_descriptor_t *desc = job->desc;
+  hs_service_t *service;
+
+  if (desc == NULL) {
+    log_debug(LD_REND, "Service descriptor changed or went away while we "
+                       "were encoding it. Discarding the result.");
+    goto done;
+  }
+  desc->encode_job = NULL;
+  if (job->encoded_desc == NULL) {
+    log_info(LD_REND, "A worker thread couldn't encode a service descriptor. "
+                      "Trying again.");
+  } else if (!desc->encoded_desc) {
+    desc->encoded_desc = job->encoded_desc;
+    job->encoded_desc = NULL;
+  }
+
+  /* The descriptor would have been freed with its service, so we should
+   * always find them. */
+  service = find_service(hs_service_map, &job->identity_pk);
+  if (BUG(service == NULL)) {
+    goto done;
+  }
+  if (BUG(desc != service->desc_current && desc != service->desc_next)) {
+    goto done;
+  }
+  /* If the worker thread couldn't encode it, this tries again, and complains
+   * about it. */
+  upload_descriptor_to_all(service, desc);
+
+ done:
+  desc_encode_job_free(job);
+}
+
+/* Encode the given descriptor of the given service on a worker thread, and
+ * upload it once it's encoded. Return 0 if a worker thread takes care of it,
+ * or -1 if the caller should do it itself (which is cheap if the descriptor
+ * is already encoded). */
+static int
+service_desc_encode_in_background(const hs_service_t *service,
+                                  hs_service_descriptor_t *desc)
+{
+  desc_encode_job_t *job;
+
+  tor_assert(service);
+  tor_assert(desc);
+
+  if (desc->encode_job) {
+    /* Already being encoded. */
+    return 0;
+  }
+  if (desc->encoded_desc || !cpuworker_is_running()) {
+    return -1;
+  }
+
+  job = desc_encode_job_new(service, desc);
+  if (!job) {
+    return -1;
+  }
+  /* Circuit handshakes are more urgent than this. */
+  if (!cpuworker_queue_work(WQ_PRI_LOW, desc_encode_job_threadfn,
+                            desc_encode_job_replyfn, job)) {
+    log_warn(LD_BUG, "Couldn't queue service descriptor encoding on "
+                     "threadpool");
+    desc_encode_job_free(job);
+    return -1;
+  }
+  return 0;
+}
+
 /* Move descriptor(s) from the src service to the dst service. We do this
  * during SIGHUP when we re-create our hidden services. */
 static void
@@ -1288,6 +1455,7 @@ build_desc_intro_points(const hs_service_t *service,
   encrypted = &desc->desc->encrypted_data;
   /* Cleanup intro points, we are about to set them from scratch. */
   hs_descriptor_clear_intro_points(desc->desc);
+  service_desc_invalidate_encoding(desc);
 
   DIGEST256MAP_FOREACH(desc->intro_points.map, key,
                        const hs_service_intro_point_t *, ip) {
@@ -1426,7 +1594,6 @@ build_service_descriptor(hs_service_t *service, time_t now,
                          uint64_t time_period_num,
                          hs_service_descriptor_t **desc_out)
 {
-  char *encoded_desc;
   hs_service_descriptor_t *desc;
 
   tor_assert(service);
@@ -1451,14 +1618,8 @@ build_service_descriptor(hs_service_t *service, time_t now,
   /* Set the revision counter for this descriptor */
   set_descriptor_revision_counter(desc->desc);
 
-  /* Let's make sure that we've created a descriptor that can actually be
-   * encoded properly. This function also checks if the encoded output is
-   * decodable after. */
-  if (BUG(hs_desc_encode_descriptor(desc->desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
-    goto err;
-  }
-  tor_free(encoded_desc);
+  /* We don't encode the descriptor yet: its introduction points change
+   * before it is uploaded, and the upload checks that it can be encoded. */
 
   /* Assign newly built descriptor to the next slot. */
   *desc_out = desc;
@@ -1825,6 +1986,12 @@ intro_point_should_expire(const hs_service_intro_point_t *ip,
     goto expired;
   }
 
+  /* Once its replay cache is full, the intro point would treat every cell
+   * as a replay. */
+  if (ip->replay_cache && replaycache_is_full(ip->replay_cache)) {
+    goto expired;
+  }
+
   if (ip->time_to_expire <= now) {
     goto expired;
   }
@@ -2281,7 +2448,7 @@ static void
 upload_descriptor_to_hsdir(const hs_service_t *service,
                            hs_service_descriptor_t *desc, const node_t *hsdir)
 {
-  char *encoded_desc = NULL;
+  const char *encoded_desc;
 
   tor_assert(service);
   tor_assert(desc);
@@ -2295,10 +2462,11 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
     goto end;
   }
 
-  /* First of all, we'll encode the descriptor. This should NEVER fail but
-   * just in case, let's make sure we have an actual usable descriptor. */
-  if (BUG(hs_desc_encode_descriptor(desc->desc, &desc->signing_kp,
-                                    &encoded_desc) < 0)) {
+  /* First of all, we'll encode the descriptor, unless it already is. This
+   * should NEVER fail but just in case, let's make sure we have an actual
+   * usable descriptor. */
+  encoded_desc = service_desc_get_encoded(desc);
+  if (BUG(encoded_desc == NULL)) {
     goto end;
   }
 
@@ -2329,7 +2497,6 @@ upload_descriptor_to_hsdir(const hs_service_t *service,
   }
 
  end:
-  tor_free(encoded_desc);
   return;
 }
 
@@ -2583,6 +2750,7 @@ upload_descriptor_to_all(const hs_service_t *service,
 
   /* Update the revision counter of this descriptor */
   increment_descriptor_revision_counter(desc->desc);
+  service_desc_invalidate_encoding(desc);
 
   smartlist_free(responsible_dirs);
   return;
@@ -2705,6 +2873,12 @@ run_upload_descriptor_event(time_t now)
         service_desc_schedule_upload(desc, now, 0);
       }
 
+      /* We are already waiting for a worker thread to encode this
+       * descriptor so we can upload it. */
+      if (desc->encode_job) {
+        continue;
+      }
+
       /* Can this descriptor be uploaded? */
       if (!should_service_upload_descriptor(service, desc, now)) {
         continue;
@@ -2723,6 +2897,11 @@ run_upload_descriptor_event(time_t now)
        * accurate because all circuits have been established. */
       build_desc_intro_points(service, desc, now);
 
+      /* Encrypting and signing the descriptor is the expensive part, so a
+       * worker thread does it if we have them, and uploads when it's done. */
+      if (service_desc_encode_in_background(service, desc) == 0) {
+        continue;
+      }
       upload_descriptor_to_all(service, desc);
     } FOR_EACH_DESCRIPTOR_END;
   } FOR_EACH_SERVICE_END;
@@ -2888,6 +3067,324 @@ service_handle_intro_established(origin_circuit_t *circ,
   return -1;
 }
 
+/* ========== */
+/* INTRODUCE2 worker threads. */
+/* ========== */
+
+/* Computing the key material and decrypting an INTRODUCE2 cell is by far the
+ * most expensive thing a service does for an introduction, so a flood of
+ * them would saturate the main loop. Instead, the main thread only does the
+ * cheap checks of hs_cell_check_introduce2() and queues the cell. The worker
+ * threads of cpuworker.c decrypt it with hs_cell_decrypt_introduce2(), and
+ * the main thread launches the rendezvous circuit when the reply comes back.
+ *
+ * Cells wait in a priority queue before we hand them to the worker threads:
+ * the fewer cells are already waiting from the same introduction point, the
+ * sooner a cell gets processed, so that a flood through one intro point
+ * doesn't starve the others. The queue is bounded, dropping the cell that
+ * would be processed last when it is full, and cells that waited too long
+ * are dropped since their client has probably given up by then. */
+
+/* Maximum number of INTRODUCE2 cells waiting for a worker thread. */
+#define INTRO2_QUEUE_MAX_LEN 1024
+/* Drop INTRODUCE2 cells that waited longer than this, in msec. */
+#define INTRO2_QUEUE_MAX_DELAY_MSEC (5*1000)
+/* How many cells per CPU we hand to the worker threads at once. The rest
+ * wait in our queue, so that they get processed in priority order. */
+#define INTRO2_JOBS_PER_CPU 4
+
+/* Cells waiting for a worker thread. Priority queue of intro2_job_t. */
+static smartlist_t *intro2_queue = NULL;
+/* Map from intro point auth key to the number of its cells in
+ * intro2_queue, stored as an uintptr_t. */
+static digest256map_t *intro2_queue_count_by_ip = NULL;
+/* Number of cells being processed by the worker threads. */
+static int intro2_n_jobs_in_flight = 0;
+/* Number given to the next cell we queue. */
+static uint64_t intro2_next_seq = 0;
+
+/* Free the given job and everything it holds. */
+STATIC void
+intro2_job_free_(intro2_job_t *job)
+{
+  if (!job) {
+    return;
+  }
+  if (job->data) {
+    if (job->data->link_specifiers) {
+      SMARTLIST_FOREACH(job->data->link_specifiers, link_specifier_t *,
+                        lspec, link_specifier_free(lspec));
+      smartlist_free(job->data->link_specifiers);
+    }
+    memwipe(job->data, 0, sizeof(*job->data));
+    tor_free(job->data);
+  }
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/* Compare two jobs by priority then by arrival. */
+static int
+compare_intro2_jobs_(const void *a_, const void *b_)
+{
+  const intro2_job_t *a = a_, *b = b_;
+  if (a->priority != b->priority) {
+    return a->priority < b->priority ? -1 : 1;
+  }
+  if (a->seq != b->seq) {
+    return a->seq < b->seq ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Add delta to the number of queued cells from the intro point of job.
+ * Return the number before the change. */
+static uintptr_t
+intro2_queue_count_adjust(const intro2_job_t *job, int delta)
+{
+  void *val;
+  uintptr_t count;
+
+  if (!intro2_queue_count_by_ip) {
+    intro2_queue_count_by_ip = digest256map_new();
+  }
+  val = digest256map_get(intro2_queue_count_by_ip, job->intro_auth_pk.pubkey);
+  count = (uintptr_t) val;
+  if (BUG(delta < 0 && count < (uintptr_t) -delta)) {
+    delta = - (int) count;
+  }
+  if (count + delta == 0) {
+    digest256map_remove(intro2_queue_count_by_ip, job->intro_auth_pk.pubkey);
+  } else {
+    digest256map_set(intro2_queue_count_by_ip, job->intro_auth_pk.pubkey,
+                     (void *) (count + delta));
+  }
+  return count;
+}
+
+/* Remove job from the queue and free it, noting that its cell was
+ * dropped. */
+static void
+intro2_queue_drop(intro2_job_t *job)
+{
+  smartlist_pqueue_remove(intro2_queue, compare_intro2_jobs_,
+                          offsetof(intro2_job_t, heap_idx), job);
+  intro2_queue_count_adjust(job, -1);
+  hs_stats_note_introduce2_dropped();
+  intro2_job_free(job);
+}
+
+/* Put job in the queue of cells waiting for a worker thread, taking
+ * ownership of it. If the queue is full, drop whichever of job and the
+ * queued cells would be processed last. Return 0 if job was queued, or -1 if
+ * it was dropped. */
+STATIC int
+intro2_queue_add(intro2_job_t *job, uint64_t now_msec)
+{
+  tor_assert(job);
+
+  if (!intro2_queue) {
+    intro2_queue = smartlist_new();
+  }
+
+  job->priority = (unsigned int) intro2_queue_count_adjust(job, 1);
+  job->seq = intro2_next_seq++;
+  job->queued_at_msec = now_msec;
+
+  if (smartlist_len(intro2_queue) >= INTRO2_QUEUE_MAX_LEN) {
+    intro2_job_t *worst = job;
+    /* This is linear, but only when we're already dropping cells. */
+    SMARTLIST_FOREACH(intro2_queue, intro2_job_t *, j,
+                      if (compare_intro2_jobs_(j, worst) > 0) worst = j);
+    static ratelim_t full_ratelim = RATELIM_INIT(60);
+    log_fn_ratelim(&full_ratelim, LOG_NOTICE, LD_REND,
+                   "Our queue of INTRODUCE2 cells is full: dropping cells. "
+                   "Our onion service is receiving introductions faster "
+                   "than it can handle them.");
+    if (worst == job) {
+      intro2_queue_count_adjust(job, -1);
+      hs_stats_note_introduce2_dropped();
+      intro2_job_free(job);
+      return -1;
+    }
+    intro2_queue_drop(worst);
+  }
+
+  smartlist_pqueue_add(intro2_queue, compare_intro2_jobs_,
+                       offsetof(intro2_job_t, heap_idx), job);
+  return 0;
+}
+
+/* Remove the next cell to process from the queue and return it, or return
+ * NULL if there is none. Cells that waited too long at now_msec are dropped
+ * along the way. */
+STATIC intro2_job_t *
+intro2_queue_next(uint64_t now_msec)
+{
+  while (intro2_queue && smartlist_len(intro2_queue)) {
+    intro2_job_t *job = smartlist_pqueue_pop(intro2_queue,
+                                             compare_intro2_jobs_,
+                                             offsetof(intro2_job_t,
+                                                      heap_idx));
+    intro2_queue_count_adjust(job, -1);
+    if (now_msec > job->queued_at_msec + INTRO2_QUEUE_MAX_DELAY_MSEC) {
+      log_info(LD_REND, "Dropping an INTRODUCE2 cell that waited %u msec "
+                        "for a worker thread.",
+               (unsigned) (now_msec - job->queued_at_msec));
+      hs_stats_note_introduce2_dropped();
+      intro2_job_free(job);
+      continue;
+    }
+    return job;
+  }
+  return NULL;
+}
+
+/* Free every cell in the queue. */
+static void
+intro2_queue_free_all(void)
+{
+  if (intro2_queue) {
+    SMARTLIST_FOREACH(intro2_queue, intro2_job_t *, job,
+                      intro2_job_free(job));
+    smartlist_free(intro2_queue);
+    intro2_queue = NULL;
+  }
+  digest256map_free(intro2_queue_count_by_ip, NULL);
+  intro2_queue_count_by_ip = NULL;
+}
+
+/* Worker thread function: decrypt the INTRODUCE2 cell of the job. */
+static workqueue_reply_t
+intro2_job_threadfn(void *state_, void *work_)
+{
+  intro2_job_t *job = work_;
+  (void) state_;
+
+  job->success =
+    hs_cell_decrypt_introduce2(job->data, job->encrypted_section_len) == 0;
+  return WQ_RPL_REPLY;
+}
+
+static void intro2_queue_process(void);
+
+/* Main thread function: a worker thread is done with the job. If its cell
+ * was valid, launch the rendezvous circuit. */
+static void
+intro2_job_replyfn(void *work_)
+{
+  intro2_job_t *job = work_;
+  hs_ident_circuit_t ident;
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+
+  tor_assert(intro2_n_jobs_in_flight > 0);
+  --intro2_n_jobs_in_flight;
+
+  if (!job->success) {
+    log_info(LD_REND, "Invalid INTRODUCE2 cell on circuit with global "
+                      "identifier %u. Dropping it.", job->circ_global_id);
+    goto done;
+  }
+
+  /* The service or its intro point could have gone away in the meantime. */
+  memset(&ident, 0, sizeof(ident));
+  ed25519_pubkey_copy(&ident.identity_pk, &job->identity_pk);
+  ed25519_pubkey_copy(&ident.intro_auth_pk, &job->intro_auth_pk);
+  get_objects_from_ident(&ident, &service, &ip, NULL);
+  if (service == NULL || ip == NULL) {
+    log_info(LD_REND, "Service or introduction point of an INTRODUCE2 cell "
+                      "went away while we were decrypting it. Dropping it.");
+    goto done;
+  }
+
+  /* Now that the cell has authenticated, check for a replay. Only the main
+   * thread can use the replay cache. */
+  if (hs_cell_introduce2_is_replay(ip->replay_cache, job->data,
+                                   job->encrypted_section_len)) {
+    goto done;
+  }
+
+  log_info(LD_REND, "Valid INTRODUCE2 cell. Launching rendezvous circuit.");
+  hs_circ_launch_introduce2(service, ip, job->data);
+
+ done:
+  memwipe(&ident, 0, sizeof(ident));
+  intro2_job_free(job);
+  intro2_queue_process();
+}
+
+/* Hand as many queued cells as we can to the worker threads. */
+static void
+intro2_queue_process(void)
+{
+  const int max_in_flight =
+    get_num_cpus(get_options()) * INTRO2_JOBS_PER_CPU;
+  uint64_t now_msec = monotime_coarse_absolute_msec();
+
+  while (intro2_n_jobs_in_flight < max_in_flight) {
+    intro2_job_t *job = intro2_queue_next(now_msec);
+    if (!job) {
+      break;
+    }
+    if (!cpuworker_queue_work(WQ_PRI_MED, intro2_job_threadfn,
+                              intro2_job_replyfn, job)) {
+      log_warn(LD_BUG, "Couldn't queue INTRODUCE2 cell on threadpool");
+      intro2_job_free(job);
+      continue;
+    }
+    ++intro2_n_jobs_in_flight;
+  }
+}
+
+/* Check the INTRODUCE2 cell in payload received on circ for the given
+ * service and intro point ip, and queue it for the worker threads. Return 0
+ * on success, including when the cell had to be dropped because we're
+ * overloaded, else a negative value. */
+static int
+service_queue_introduce2(const hs_service_t *service,
+                         const origin_circuit_t *circ,
+                         hs_service_intro_point_t *ip,
+                         const uint8_t *subcredential,
+                         const uint8_t *payload, size_t payload_len)
+{
+  intro2_job_t *job;
+  ssize_t encrypted_section_len;
+
+  if (BUG(payload_len > sizeof(job->payload))) {
+    return -1;
+  }
+
+  job = tor_malloc_zero(sizeof(*job));
+  ed25519_pubkey_copy(&job->identity_pk, &service->keys.identity_pk);
+  ed25519_pubkey_copy(&job->intro_auth_pk, &ip->auth_key_kp.pubkey);
+  job->circ_global_id = circ->global_identifier;
+  memcpy(&job->enc_kp, &ip->enc_key_kp, sizeof(job->enc_kp));
+  memcpy(job->subcredential, subcredential, sizeof(job->subcredential));
+  memcpy(job->payload, payload, payload_len);
+
+  /* The worker thread gets its own copy of everything. */
+  job->data = tor_malloc_zero(sizeof(*job->data));
+  job->data->auth_pk = &job->intro_auth_pk;
+  job->data->enc_kp = &job->enc_kp;
+  job->data->subcredential = job->subcredential;
+  job->data->payload = job->payload;
+  job->data->payload_len = payload_len;
+
+  encrypted_section_len = hs_cell_check_introduce2(job->data, circ,
+                                                   service);
+  if (encrypted_section_len < 0) {
+    intro2_job_free(job);
+    return -1;
+  }
+  job->encrypted_section_len = encrypted_section_len;
+  job->data->link_specifiers = smartlist_new();
+
+  intro2_queue_add(job, monotime_coarse_absolute_msec());
+  intro2_queue_process();
+  return 0;
+}
+
 /* We just received an INTRODUCE2 cell on the established introduction circuit
  * circ. Handle the cell and return 0 on success else a negative value. */
 static int
@@ -2924,10 +3421,19 @@ service_handle_introduce2(origin_circuit_t *circ, const uint8_t *payload,
   /* If we have an IP object, we MUST have a descriptor object. */
   tor_assert(desc);
 
-  /* The following will parse, decode and launch the rendezvous point circuit.
-   * Both current and legacy cells are handled. */
-  if (hs_circ_handle_introduce2(service, circ, ip, desc->desc->subcredential,
-                                payload, payload_len) < 0) {
+  /* Without worker threads, we parse, decode and launch the rendezvous point
+   * circuit right away. Both current and legacy cells are handled. */
+  if (!cpuworker_is_running()) {
+    if (hs_circ_handle_introduce2(service, circ, ip,
+                                  desc->desc->subcredential,
+                                  payload, payload_len) < 0) {
+      goto err;
+    }
+    return 0;
+  }
+
+  if (service_queue_introduce2(service, circ, ip, desc->desc->subcredential,
+                               payload, payload_len) < 0) {
     goto err;
   }
 
@@ -3161,14 +3667,10 @@ hs_service_lookup_current_desc(const ed25519_public_key_t *pk)
 
   service = find_service(hs_service_map, pk);
   if (service && service->desc_current) {
-    char *encoded_desc = NULL;
-    /* No matter what is the result (which should never be a failure), return
-     * the encoded variable, if success it will contain the right thing else
-     * it will be NULL. */
-    hs_desc_encode_descriptor(service->desc_current->desc,
-                              &service->desc_current->signing_kp,
-                              &encoded_desc);
-    return encoded_desc;
+    /* This should never fail, but if it does, return NULL. */
+    const char *encoded_desc =
+      service_desc_get_encoded(service->desc_current);
+    return encoded_desc ? tor_strdup(encoded_desc) : NULL;
   }
 
   return NULL;
@@ -3516,7 +4018,9 @@ hs_service_new(const or_options_t *options)
   service->config.version = HS_SERVICE_DEFAULT_VERSION;
   /* Allocate the CLIENT_PK replay cache in service state. */
   service->state.replay_cache_rend_cookie =
-    replaycache_new(REND_REPLAY_TIME_INTERVAL, REND_REPLAY_TIME_INTERVAL);
+    replaycache_new_bucketed(REND_REPLAY_TIME_INTERVAL,
+                             HS_SERVICE_REND_REPLAY_CACHE_N_BUCKETS,
+                             HS_SERVICE_REND_REPLAY_CACHE_MAX_ENTRIES);
 
   return service;
 }
@@ -3596,6 +4100,7 @@ hs_service_free_all(void)
 {
   rend_service_free_all();
   service_free_all();
+  intro2_queue_free_all();
 }
 
 #ifdef TOR_UNIT_TESTS
@@ -31,6 +31,18 @@
 #define HS_SERVICE_NEXT_UPLOAD_TIME_MIN (60 * 60)
 #define HS_SERVICE_NEXT_UPLOAD_TIME_MAX (120 * 60)
 
+/* Most INTRODUCE2 cells that the replay cache of an introduction point
+ * remembers. Once it's full, we stop using the intro point, as if it had
+ * seen too many introductions. */
+#define HS_SERVICE_INTRO_REPLAY_CACHE_MAX_ENTRIES \
+  (INTRO_POINT_MAX_LIFETIME_INTRODUCTIONS * 2)
+
+/* Number of intervals the REND_REPLAY_TIME_INTERVAL of the rendezvous cookie
+ * replay cache of a service is split in, and the most cookies it remembers.
+ * When it's full, it forgets the oldest interval early. */
+#define HS_SERVICE_REND_REPLAY_CACHE_N_BUCKETS 5
+#define HS_SERVICE_REND_REPLAY_CACHE_MAX_ENTRIES (1 << 18)
+
 /* Service side introduction point. */
 typedef struct hs_service_intro_point_t {
   /* Top level intropoint "shared" data between client/service. */
@@ -131,6 +143,16 @@ typedef struct hs_service_descriptor_t {
    *  from this list, this means we received new dirinfo and we need to
    *  reupload our descriptor. */
   smartlist_t *previous_hsdirs;
+
+  /* The descriptor encoded and signed, or NULL if it hasn't been encoded
+   * since it last changed. Since encoding picks fresh salts and fake client
+   * auth data, any encoding of the same content is as good as another, so we
+   * reuse this for every HSDir and for the control port. */
+  char *encoded_desc;
+
+  /* If the descriptor is being encoded on a worker thread, the job doing
+   * it; otherwise NULL. */
+  struct desc_encode_job_t *encode_job;
 } hs_service_descriptor_t;
 
 /* Service key material. */
@@ -304,6 +326,66 @@ STATIC hs_service_intro_point_t *service_intro_point_find_by_ident(
                                          const hs_ident_circuit_t *ident);
 #endif
 
+/* An INTRODUCE2 cell waiting for, or being processed by, a worker
+ * thread. */
+typedef struct intro2_job_t {
+  /* Identity key of the service and auth key of the intro point that
+   * received the cell, which might be gone by the time we're done. */
+  ed25519_public_key_t identity_pk;
+  ed25519_public_key_t intro_auth_pk;
+  /* Global identifier of the introduction circuit, for logging. */
+  uint32_t circ_global_id;
+  /* Copies of the intro point encryption keypair, the subcredential and the
+   * cell payload, that data points to. */
+  curve25519_keypair_t enc_kp;
+  uint8_t subcredential[DIGEST256_LEN];
+  uint8_t payload[RELAY_PAYLOAD_SIZE];
+  /* Length of the ENCRYPTED section at the end of the payload. */
+  size_t encrypted_section_len;
+  /* The cell to decrypt, and where we put what's in it. */
+  struct hs_cell_introduce2_data_t *data;
+  /* Set by the worker thread: true iff the cell is valid. */
+  int success;
+
+  /* Number of cells from the same intro point that were already in the
+   * queue when we added this one. Lower is processed first. */
+  unsigned int priority;
+  /* Order in which cells were added to the queue, to break ties. */
+  uint64_t seq;
+  /* When we added the cell to the queue, in msec. */
+  uint64_t queued_at_msec;
+  /* Position in the queue, used by the smartlist_pqueue functions. */
+  int heap_idx;
+} intro2_job_t;
+
+STATIC void intro2_job_free_(intro2_job_t *job);
+#define intro2_job_free(job) \
+  FREE_AND_NULL(intro2_job_t, intro2_job_free_, (job))
+STATIC int intro2_queue_add(intro2_job_t *job, uint64_t now_msec);
+STATIC intro2_job_t *intro2_queue_next(uint64_t now_msec);
+
+/* A service descriptor being encoded by a worker thread. */
+typedef struct desc_encode_job_t {
+  /* The descriptor, or NULL if it changed or went away since we started, in
+   * which case the result is thrown away. */
+  hs_service_descriptor_t *desc;
+  /* Identity key of the service, to find it again when we're done. */
+  ed25519_public_key_t identity_pk;
+  /* The encoding in progress. */
+  hs_desc_encoding_t *encoding;
+  /* Set by the worker thread: the encoded descriptor, or NULL on error. */
+  char *encoded_desc;
+} desc_encode_job_t;
+
+STATIC desc_encode_job_t *desc_encode_job_new(const hs_service_t *service,
+                                              hs_service_descriptor_t *desc);
+STATIC void desc_encode_job_free_(desc_encode_job_t *job);
+#define desc_encode_job_free(job) \
+  FREE_AND_NULL(desc_encode_job_t, desc_encode_job_free_, (job))
+STATIC void desc_encode_job_replyfn(void *work_);
+STATIC const char *service_desc_get_encoded(hs_service_descriptor_t *desc);
+STATIC void service_desc_invalidate_encoding(hs_service_descriptor_t *desc);
+
 /* Service accessors. */
 STATIC hs_service_t *find_service(hs_service_ht *map,
                                   const ed25519_public_key_t *pk);
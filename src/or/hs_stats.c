@@ -14,6 +14,8 @@
 static uint32_t n_introduce2_v3 = 0;
 /** Number of v2 INTRODUCE2 cells received */
 static uint32_t n_introduce2_v2 = 0;
+/** Number of v3 INTRODUCE2 cells dropped because we were overloaded */
+static uint32_t n_introduce2_dropped = 0;
 /** Number of attempts to make a circuit to a rendezvous point */
 static uint32_t n_rendezvous_launches = 0;
 
@@ -42,6 +44,22 @@ hs_stats_get_n_introduce2_v2_cells(void)
   return n_introduce2_v2;
 }
 
+/** Note that we dropped a v3 INTRODUCE2 cell because we couldn't process
+ * our INTRODUCE2 cells fast enough. */
+void
+hs_stats_note_introduce2_dropped(void)
+{
+  n_introduce2_dropped++;
+}
+
+/** Return the number of v3 INTRODUCE2 cells we dropped because we were
+ * overloaded. */
+uint32_t
+hs_stats_get_n_introduce2_dropped(void)
+{
+  return n_introduce2_dropped;
+}
+
 /** Note that we attempted to launch another circuit to a rendezvous point. */
 void
 hs_stats_note_service_rendezvous_launch(void)
@@ -83,8 +83,10 @@
 #include "or/hs_cache.h"
 #include "or/hs_circuitmap.h"
 #include "or/hs_client.h"
+#include "or/hs_service.h"
 #include "or/keypin.h"
 #include "or/main.h"
+#include "or/metricsport.h"
 #include "or/microdesc.h"
 #include "or/networkstatus.h"
 #include "or/nodelist.h"
@@ -92,6 +94,7 @@
 #include "or/onion.h"
 #include "or/periodic.h"
 #include "or/policies.h"
+#include "common/profiler.h"
 #include "or/protover.h"
 #include "or/transports.h"
 #include "or/relay.h"
@@ -885,15 +888,43 @@ connection_count_moribund, (void))
   return moribund;
 }
 
+/** Profiler entries for the read and write callbacks of each type of
+ * connection, created as needed. */
+static profiler_entry_t *conn_read_profile[CONN_TYPE_MAX_+1];
+static profiler_entry_t *conn_write_profile[CONN_TYPE_MAX_+1];
+
+/** Return the profiler entry for the read callback (if <b>is_write</b> is
+ * false) or the write callback (if it is true) of connections of type
+ * <b>type</b>. */
+static profiler_entry_t *
+conn_get_profiler_entry(unsigned int type, int is_write)
+{
+  profiler_entry_t **entries = is_write ? conn_write_profile :
+                                          conn_read_profile;
+  tor_assert(type <= CONN_TYPE_MAX_);
+  if (!entries[type]) {
+    char name[64];
+    tor_snprintf(name, sizeof(name), "%s %s", conn_type_to_string(type),
+                 is_write ? "write" : "read");
+    entries[type] = profiler_entry_get(PROFILER_KIND_CONN, name);
+  }
+  return entries[type];
+}
+
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
  * some data to read. */
 static void
 conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 {
   connection_t *conn = _conn;
+  /* conn may be freed by the time we stop the timer. */
+  profiler_entry_t *profile = conn_get_profiler_entry(conn->type, 0);
+  profiler_timer_t timer;
   (void)fd;
   (void)event;
 
+  profiler_timer_start(&timer);
+
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
   /* assert_connection_ok(conn, time(NULL)); */
@@ -915,6 +946,8 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+
+  profiler_timer_stop(&timer, profile);
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -923,9 +956,14 @@ static void
 conn_write_callback(evutil_socket_t fd, short events, void *_conn)
 {
   connection_t *conn = _conn;
+  /* conn may be freed by the time we stop the timer. */
+  profiler_entry_t *profile = conn_get_profiler_entry(conn->type, 1);
+  profiler_timer_t timer;
   (void)fd;
   (void)events;
 
+  profiler_timer_start(&timer);
+
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
@@ -953,6 +991,8 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
 
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+
+  profiler_timer_stop(&timer, profile);
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -2877,8 +2917,10 @@ do_main_loop(void)
   now = time(NULL);
   directory_info_has_arrived(now, 1, 0);
 
-  if (server_mode(get_options()) || dir_server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
+  if (server_mode(get_options()) || dir_server_mode(get_options()) ||
+      hs_service_get_num_services() > 0) {
+    /* launch cpuworkers. Need to do this *after* we've read the onion key.
+     * Onion services use them to decrypt INTRODUCE2 cells. */
     cpu_init();
   }
   consdiffmgr_enable_background_compression();
@@ -3445,6 +3487,8 @@ tor_init(int argc, char *argv[])
                       * cheap. */
   /* Initialize the HS subsystem. */
   hs_init();
+  /* Register the metrics that we serve on the MetricsPort. */
+  metricsport_init();
 
   {
   /* We search for the "quiet" option first, since it decides whether we
@@ -3668,10 +3712,12 @@ tor_free_all(int postfork)
   protover_free_all();
   bridges_free_all();
   consdiffmgr_free_all();
+  cpuworker_free_all();
   hs_free_all();
   dos_free_all();
   circuitmux_ewma_free_all();
   accounting_free_all();
+  metricsport_free_all();
 
   if (!postfork) {
     config_free_all();
@@ -3699,6 +3745,7 @@ tor_free_all(int postfork)
   mainloop_event_free(schedule_active_linked_connections_event);
   mainloop_event_free(postloop_cleanup_ev);
   mainloop_event_free(handle_deferred_signewnym_ev);
+  profiler_free_all();
 
 #ifdef HAVE_SYSTEMD_209
   periodic_timer_free(systemd_watchdog_timer);
@@ -0,0 +1,218 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metricsport.c
+ * \brief Serve our metrics to local monitoring tools over HTTP.
+ *
+ * The counters, gauges and histograms that the other modules register with
+ * the metrics subsystem (see common/metrics.c) are served on the optional
+ * MetricsPort, in the Prometheus text exposition format, in answer to
+ * "GET /metrics".  Each connection gets one answer and is then closed.
+ *
+ * This module also registers the metrics of the modules that have no
+ * better place to do it, and calls the functions that register the rest.
+ **/
+
+#define METRICSPORT_PRIVATE
+
+#include "or/or.h"
+#include "common/buffers.h"
+#include "common/metrics.h"
+#include "common/profiler.h"
+#include "or/channel.h"
+#include "or/circuitlist.h"
+#include "or/connection.h"
+#include "or/connection_or.h"
+#include "or/cpuworker.h"
+#include "or/directory.h"
+#include "or/dos.h"
+#include "or/main.h"
+#include "or/metricsport.h"
+#include "or/onion.h"
+#include "or/proto_http.h"
+#include "or/rephist.h"
+
+#include "or/connection_st.h"
+
+/** Number of HTTP requests that we have answered on the MetricsPort. */
+static metrics_counter_t n_metricsport_requests;
+
+/** Getter for the number of bytes that we have read from the network. */
+static uint64_t
+metrics_get_bytes_read(const void *arg)
+{
+  (void) arg;
+  return get_bytes_read();
+}
+
+/** Getter for the number of bytes that we have written to the network. */
+static uint64_t
+metrics_get_bytes_written(const void *arg)
+{
+  (void) arg;
+  return get_bytes_written();
+}
+
+/** Getter for the number of log messages that AsyncLogging dropped. */
+static uint64_t
+metrics_get_n_async_log_dropped(const void *arg)
+{
+  (void) arg;
+  return logs_get_n_async_dropped();
+}
+
+/** Getter for the number of open connections. */
+static uint64_t
+metrics_get_n_connections(const void *arg)
+{
+  (void) arg;
+  return smartlist_len(get_connection_array());
+}
+
+/** Register every metric that we serve.  Call this once, at startup. */
+void
+metricsport_init(void)
+{
+  metrics_register_counter_fn(metrics_get_bytes_read, NULL,
+                              "tor_bytes_read_total",
+                              "Bytes read from the network.", NULL);
+  metrics_register_counter_fn(metrics_get_bytes_written, NULL,
+                              "tor_bytes_written_total",
+                              "Bytes written to the network.", NULL);
+  metrics_register_gauge_fn(metrics_get_n_connections, NULL,
+                            "tor_connections",
+                            "Open connections, including listeners.", NULL);
+  metrics_register_counter_fn(metrics_get_n_async_log_dropped, NULL,
+                              "tor_log_async_dropped_total",
+                              "Log messages dropped because an "
+                              "AsyncLogging buffer was full.", NULL);
+  metrics_register_counter(&n_metricsport_requests,
+                           "tor_metricsport_requests_total",
+                           "HTTP requests answered on the MetricsPort.",
+                           NULL);
+
+  channel_register_metrics();
+  circuit_register_metrics();
+  cpuworker_register_metrics();
+  dos_register_metrics();
+  onion_queue_register_metrics();
+  profiler_register_metrics();
+  rep_hist_register_cell_latency_metrics();
+}
+
+/** Forget every registered metric. */
+void
+metricsport_free_all(void)
+{
+  metrics_free_all();
+}
+
+/** Return a newly allocated HTTP/1.0 response with status line
+ * <b>status</b>, and the body <b>body</b> as text/plain. */
+static char *
+metricsport_format_response(const char *status, const char *body)
+{
+  char *response = NULL;
+  tor_asprintf(&response,
+               "HTTP/1.0 %s\r\n"
+               "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+               "Content-Length: %lu\r\n"
+               "Connection: close\r\n\r\n%s",
+               status, (unsigned long)strlen(body), body);
+  return response;
+}
+
+/**
+ * Answer the HTTP request whose headers are <b>headers</b>.  Set
+ * *<b>reply_out</b> to a newly allocated HTTP response, and return its
+ * status code.
+ */
+STATIC int
+metricsport_handle_request(const char *headers, char **reply_out)
+{
+  char *command = NULL, *url = NULL;
+  int code;
+
+  if (parse_http_command(headers, &command, &url) < 0) {
+    *reply_out = metricsport_format_response("400 Bad Request",
+                                             "Bad request.\n");
+    code = 400;
+  } else if (strcmp(command, "GET")) {
+    *reply_out = metricsport_format_response("405 Method Not Allowed",
+                                             "Only GET is supported.\n");
+    code = 405;
+  } else if (strcmp(url, "/metrics")) {
+    *reply_out = metricsport_format_response("404 Not Found",
+                                             "Try /metrics.\n");
+    code = 404;
+  } else {
+    char *body;
+    metrics_counter_inc(&n_metricsport_requests);
+    body = metrics_format_prometheus();
+    *reply_out = metricsport_format_response("200 OK", body);
+    tor_free(body);
+    code = 200;
+  }
+
+  tor_free(command);
+  tor_free(url);
+  return code;
+}
+
+/** Called when there is new data on the inbuf of the MetricsPort
+ * connection <b>conn</b>.  Once we have a whole request, answer it, and
+ * close the connection once the answer is flushed. */
+int
+connection_metrics_process_inbuf(connection_t *conn)
+{
+  char *headers = NULL, *reply = NULL;
+  int code;
+
+  tor_assert(conn);
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+
+  switch (fetch_from_buf_http(conn->inbuf, &headers, MAX_HEADERS_SIZE,
+                              NULL, NULL, 0, 0)) {
+    case -1:
+      log_info(LD_NET, "Headers on MetricsPort connection from %s were too "
+               "long; closing.", fmt_and_decorate_addr(&conn->addr));
+      connection_mark_for_close(conn);
+      return -1;
+    case 0:
+      /* Not a whole request yet. */
+      return 0;
+  }
+
+  code = metricsport_handle_request(headers, &reply);
+  log_debug(LD_NET, "Answered MetricsPort request from %s with %d.",
+            fmt_and_decorate_addr(&conn->addr), code);
+  connection_buf_add(reply, strlen(reply), conn);
+  connection_mark_and_flush(conn);
+
+  tor_free(headers);
+  tor_free(reply);
+  return 0;
+}
+
+/** Called when we have flushed everything on the outbuf of the MetricsPort
+ * connection <b>conn</b>. */
+int
+connection_metrics_finished_flushing(connection_t *conn)
+{
+  tor_assert(conn);
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+  /* We mark the connection for close as soon as we have answered, so there
+   * is nothing left to do. */
+  return 0;
+}
+
+/** Called when the MetricsPort connection <b>conn</b> reaches EOF. */
+int
+connection_metrics_reached_eof(connection_t *conn)
+{
+  tor_assert(conn);
+  tor_assert(conn->type == CONN_TYPE_METRICS);
+  connection_mark_for_close(conn);
+  return 0;
+}
@@ -0,0 +1,23 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file metricsport.h
+ * \brief Header file for metricsport.c.
+ **/
+
+#ifndef TOR_METRICSPORT_H
+#define TOR_METRICSPORT_H
+
+void metricsport_init(void);
+void metricsport_free_all(void);
+
+int connection_metrics_process_inbuf(connection_t *conn);
+int connection_metrics_finished_flushing(connection_t *conn);
+int connection_metrics_reached_eof(connection_t *conn);
+
+#ifdef METRICSPORT_PRIVATE
+STATIC int metricsport_handle_request(const char *headers, char **reply_out);
+#endif
+
+#endif /* !defined(TOR_METRICSPORT_H) */
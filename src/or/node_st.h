@@ -49,6 +49,12 @@ struct node_t {
   routerinfo_t *ri;
   routerstatus_t *rs;
 
+  /** The distinct addresses of this node that are in the nodelist's address
+   * set, so that we can remove them when they change. */
+  tor_addr_t *addrs_in_set;
+  /** Number of elements in <b>addrs_in_set</b>. */
+  int n_addrs_in_set;
+
   /* local info: copied from routerstatus, then possibly frobbed based
    * on experience.  Authorities set this stuff directly.  Note that
    * these reflect knowledge of the primary (IPv4) OR port only.  */
@@ -99,7 +99,8 @@ static void count_usable_descriptors(int *num_present,
 static void update_router_have_minimum_dir_info(void);
 static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
-static void node_add_to_address_set(const node_t *node);
+static void node_update_address_set(node_t *node);
+static void node_remove_from_address_set(node_t *node);
 
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
@@ -119,7 +120,8 @@ typedef struct nodelist_t {
    */
   HT_HEAD(nodelist_ed_map, node_t) nodes_by_ed_id;
 
-  /* Set of addresses that belong to nodes we believe in. */
+  /* Set of addresses that belong to nodes we believe in.  An address is in
+   * it once for each node that has it. */
   address_set_t *node_addrs;
 
   /* The valid-after time of the last live consensus that initialized the
@@ -401,36 +403,182 @@ node_addrs_changed(node_t *node)
   node->country = -1;
 }
 
-/** Add all address information about <b>node</b> to the current address
- * set (if there is one).
- */
-static void
-node_add_to_address_set(const node_t *node)
+/** Largest number of distinct addresses that a node can have: an IPv4 and
+ * an IPv6 address from each of its routerstatus and routerinfo, and an IPv6
+ * address from its microdescriptor. */
+#define NODE_MAX_ADDRESSES 5
+
+/** Add <b>addr</b> to the <b>n</b> addresses in <b>addrs</b> unless it is
+ * null or already there.  Return the new number of addresses. */
+static int
+node_addrs_add_unique(tor_addr_t *addrs, int n, const tor_addr_t *addr)
 {
-  if (!the_nodelist || !the_nodelist->node_addrs)
-    return;
+  int i;
+  if (tor_addr_is_null(addr))
+    return n;
+  for (i = 0; i < n; ++i) {
+    if (tor_addr_eq(&addrs[i], addr))
+      return n;
+  }
+  tor_assert(n < NODE_MAX_ADDRESSES);
+  tor_addr_copy(&addrs[n], addr);
+  return n + 1;
+}
 
-  /* These various address sources can be redundant, but it's likely faster
-   * to add them all than to compare them all for equality. */
+/** Set <b>addrs_out</b> to the distinct addresses of <b>node</b>, and
+ * return how many there are. */
+static int
+node_get_distinct_addresses(const node_t *node, tor_addr_t *addrs_out)
+{
+  tor_addr_t addr;
+  int n = 0;
 
+  /* These various address sources are usually redundant. */
   if (node->rs) {
-    if (node->rs->addr)
-      address_set_add_ipv4h(the_nodelist->node_addrs, node->rs->addr);
-    if (!tor_addr_is_null(&node->rs->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->rs->ipv6_addr);
+    tor_addr_from_ipv4h(&addr, node->rs->addr);
+    n = node_addrs_add_unique(addrs_out, n, &addr);
+    n = node_addrs_add_unique(addrs_out, n, &node->rs->ipv6_addr);
   }
   if (node->ri) {
-    if (node->ri->addr)
-      address_set_add_ipv4h(the_nodelist->node_addrs, node->ri->addr);
-    if (!tor_addr_is_null(&node->ri->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->ri->ipv6_addr);
+    tor_addr_from_ipv4h(&addr, node->ri->addr);
+    n = node_addrs_add_unique(addrs_out, n, &addr);
+    n = node_addrs_add_unique(addrs_out, n, &node->ri->ipv6_addr);
   }
   if (node->md) {
-    if (!tor_addr_is_null(&node->md->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->md->ipv6_addr);
+    n = node_addrs_add_unique(addrs_out, n, &node->md->ipv6_addr);
+  }
+  return n;
+}
+
+/** Return true iff <b>addr</b> is one of the <b>n</b> addresses in
+ * <b>addrs</b>. */
+static int
+node_addrs_contain(const tor_addr_t *addrs, int n, const tor_addr_t *addr)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (tor_addr_eq(&addrs[i], addr))
+      return 1;
+  }
+  return 0;
+}
+
+/** Replace the current address set with an empty one, sized for at least
+ * <b>n_addresses_guess</b> addresses. */
+static void
+nodelist_reset_address_set(int n_addresses_guess)
+{
+  address_set_free(the_nodelist->node_addrs);
+  the_nodelist->node_addrs = address_set_new(n_addresses_guess);
+}
+
+/** Make the current address set hold exactly the current addresses of
+ * <b>node</b>, removing the ones it no longer has.  Return 0 on success, or
+ * -1 if the address set is too full; in that case, <b>node</b> is left in
+ * an unknown state and the address set must be rebuilt. */
+static int
+node_try_update_address_set(node_t *node)
+{
+  tor_addr_t addrs[NODE_MAX_ADDRESSES];
+  int n, i;
+
+  if (!the_nodelist || !the_nodelist->node_addrs)
+    return 0;
+
+  n = node_get_distinct_addresses(node, addrs);
+
+  for (i = 0; i < node->n_addrs_in_set; ++i) {
+    if (!node_addrs_contain(addrs, n, &node->addrs_in_set[i]))
+      address_set_remove(the_nodelist->node_addrs, &node->addrs_in_set[i]);
+  }
+  for (i = 0; i < n; ++i) {
+    if (node_addrs_contain(node->addrs_in_set, node->n_addrs_in_set,
+                           &addrs[i]))
+      continue;
+    if (address_set_add(the_nodelist->node_addrs, &addrs[i]) < 0)
+      return -1;
   }
+
+  tor_free(node->addrs_in_set);
+  node->n_addrs_in_set = n;
+  if (n)
+    node->addrs_in_set = tor_memdup(addrs, n * sizeof(tor_addr_t));
+  return 0;
+}
+
+/** Replace the current address set with a new one, sized for at least
+ * <b>n_addresses_guess</b> addresses, that holds the addresses of every
+ * node. */
+static void
+nodelist_rebuild_address_set(int n_addresses_guess)
+{
+  int attempt;
+
+  for (attempt = 0; attempt < 4; ++attempt) {
+    int ok = 1;
+
+    nodelist_reset_address_set(n_addresses_guess);
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+      tor_free(node->addrs_in_set);
+      node->n_addrs_in_set = 0;
+    } SMARTLIST_FOREACH_END(node);
+
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+      if (node_try_update_address_set(node) < 0) {
+        ok = 0;
+        break;
+      }
+    } SMARTLIST_FOREACH_END(node);
+    if (ok)
+      return;
+
+    n_addresses_guess = MAX(n_addresses_guess, 1) * 2;
+  }
+
+  /* Since nodes that share an address share its slot, this can only happen
+   * if the set is unreasonably unlucky.  The DoS subsystem would then count
+   * connections from some nodes as client connections, which isn't worth
+   * failing over. */
+  log_info(LD_GENERAL, "Unable to fit every node address in the nodelist "
+           "address set.");
+}
+
+/** Add all address information about <b>node</b> to the current address
+ * set (if there is one), and remove the addresses that it no longer has.
+ */
+static void
+node_update_address_set(node_t *node)
+{
+  if (node_try_update_address_set(node) < 0) {
+    nodelist_rebuild_address_set(
+                   2 * address_set_get_n_items(the_nodelist->node_addrs));
+  }
+}
+
+/** Remove all the addresses of <b>node</b> from the current address set (if
+ * there is one). */
+static void
+node_remove_from_address_set(node_t *node)
+{
+  int i;
+
+  if (the_nodelist && the_nodelist->node_addrs) {
+    for (i = 0; i < node->n_addrs_in_set; ++i)
+      address_set_remove(the_nodelist->node_addrs, &node->addrs_in_set[i]);
+  }
+  tor_free(node->addrs_in_set);
+  node->n_addrs_in_set = 0;
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the current address set, or NULL if there is none. */
+STATIC const address_set_t *
+nodelist_get_address_set(void)
+{
+  return the_nodelist ? the_nodelist->node_addrs : NULL;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Return true if <b>addr</b> is the address of some node in the nodelist.
  * If not, probably return false. */
 int
@@ -495,7 +643,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
                          networkstatus_get_latest_consensus());
   }
 
-  node_add_to_address_set(node);
+  node_update_address_set(node);
 
   return node;
 }
@@ -538,7 +686,7 @@ nodelist_add_microdesc(microdesc_t *md)
     node_set_hsdir_index(node, ns);
   }
   node_add_to_ed25519_map(node);
-  node_add_to_address_set(node);
+  node_update_address_set(node);
 
   return node;
 }
@@ -547,7 +695,7 @@ nodelist_add_microdesc(microdesc_t *md)
 #define ESTIMATED_ADDRESS_PER_NODE 2
 
 /* Return the estimated number of address per node_t. This is used for the
- * size of the bloom filter in the nodelist (node_addrs). */
+ * initial size of the address set in the nodelist (node_addrs). */
 MOCK_IMPL(int,
 get_estimated_address_per_node, (void))
 {
@@ -572,11 +720,13 @@ nodelist_set_consensus(networkstatus_t *ns)
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
-  /* Conservatively estimate that every node will have 2 addresses. */
-  const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
-                                  get_estimated_address_per_node();
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  /* The address set is updated in place, and only rebuilt if it gets too
+   * full. Conservatively estimate that every node will have 2 addresses. */
+  if (!the_nodelist->node_addrs) {
+    const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
+                                    get_estimated_address_per_node();
+    nodelist_reset_address_set(estimated_addresses);
+  }
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
@@ -621,9 +771,10 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   nodelist_purge();
 
-  /* Now add all the nodes we have to the address set. */
+  /* Now bring the address set up to date with the nodes we have. Nodes that
+   * were purged have already removed their addresses. */
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-    node_add_to_address_set(node);
+    node_update_address_set(node);
   } SMARTLIST_FOREACH_END(node);
 
   if (! authdir) {
@@ -679,6 +830,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    node_update_address_set(node);
   }
 }
 
@@ -692,6 +844,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      node_update_address_set(node);
     }
   }
 }
@@ -708,6 +862,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tor_assert(tmp == node);
   }
   node_remove_from_ed25519_map(node);
+  node_remove_from_address_set(node);
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
@@ -749,6 +904,7 @@ node_free_(node_t *node)
   if (node->md)
     node->md->held_by_nodes--;
   tor_assert(node->nodelist_idx == -1);
+  tor_free(node->addrs_in_set);
   tor_free(node);
 }
 
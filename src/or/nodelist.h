@@ -154,6 +154,7 @@ int count_loading_descriptors_progress(void);
 
 STATIC void
 node_set_hsdir_index(node_t *node, const networkstatus_t *ns);
+STATIC const struct address_set_t *nodelist_get_address_set(void);
 
 #endif /* defined(TOR_UNIT_TESTS) */
 
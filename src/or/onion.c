@@ -62,11 +62,16 @@
  * onion_fast.c for more information.
  **/
 
+#define ONION_PRIVATE
+
 #include "or/or.h"
+#include "common/metrics.h"
 #include "or/circuitbuild.h"
 #include "or/circuitlist.h"
+#include "or/channel.h"
 #include "or/config.h"
 #include "or/cpuworker.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "or/networkstatus.h"
 #include "or/onion.h"
@@ -76,6 +81,7 @@
 #include "or/relay.h"
 #include "or/rephist.h"
 #include "or/router.h"
+#include "siphash.h"
 
 #include "or/cell_st.h"
 #include "or/extend_info_st.h"
@@ -88,17 +94,54 @@
  * to process a waiting onion handshake. */
 typedef struct onion_queue_t {
   TOR_TAILQ_ENTRY(onion_queue_t) next;
+  /** Link in the queue of this entry's flow. */
+  TOR_TAILQ_ENTRY(onion_queue_t) flow_next;
   or_circuit_t *circ;
   uint16_t handshake_type;
+  /** Index of this entry's flow in ol_flows[handshake_type]. */
+  uint16_t flow_idx;
   create_cell_t *onionskin;
-  time_t when_added;
+  monotime_coarse_t when_added;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
-#define ONIONQUEUE_WAIT_CUTOFF 5
+#define ONIONQUEUE_WAIT_CUTOFF_MSEC 5000
+
+/** How many flows we spread the onionskins of each handshake type across.
+ * Must be a power of two. */
+#define ONION_QUEUE_N_FLOWS 256
 
-/** Array of queues of circuits waiting for CPU workers. An element is NULL
- * if that queue is empty.*/
+/** A flow of onionskins: all the queued onionskins of one handshake type
+ * from the peers whose address hashes to the same flow.
+ *
+ * We take onionskins from the active flows in turn, so that a peer that
+ * floods us with CREATE cells mostly delays its own requests.  On each flow
+ * we run a CoDel controller (Nichols and Jacobson, "Controlling Queue
+ * Delay", 2012): once the requests at the head of a flow have been waiting
+ * longer than a target delay for a whole interval, we drop them at an
+ * increasing rate until the delay comes back down. */
+typedef struct onion_queue_flow_t {
+  /** The entries of this flow, oldest first. */
+  TOR_TAILQ_HEAD(, onion_queue_t) entries;
+  /** Link in ol_active_flows, if this flow has any entries. */
+  TOR_TAILQ_ENTRY(onion_queue_flow_t) next_active;
+  /** Number of entries in this flow. */
+  int n_entries;
+  /** If not zero, one interval after the delay of this flow went above the
+   * target. */
+  monotime_coarse_t first_above_time;
+  /** When we'll drop the next entry, if we are in the dropping state. */
+  monotime_coarse_t drop_next;
+  /** Number of entries that we have dropped since we entered the dropping
+   * state, and its value when we entered it. */
+  uint32_t drop_count;
+  uint32_t last_drop_count;
+  /** True iff we are in the dropping state. */
+  unsigned int dropping : 1;
+} onion_queue_flow_t;
+
+/** Array of queues of circuits waiting for CPU workers, in the order that
+ * they arrived. An element is NULL if that queue is empty.*/
 static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
               ol_list[MAX_ONION_HANDSHAKE_TYPE+1] =
 { TOR_TAILQ_HEAD_INITIALIZER(ol_list[0]), /* tap */
@@ -109,6 +152,44 @@ static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
 /** Number of entries of each type currently in each element of ol_list[]. */
 static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
+/** The flows of each handshake type that the entries of ol_list[] are also
+ * queued on. */
+static onion_queue_flow_t
+              ol_flows[MAX_ONION_HANDSHAKE_TYPE+1][ONION_QUEUE_N_FLOWS];
+
+/** For each handshake type, the flows that have entries, in the order that
+ * we'll next take an entry from them. */
+static TOR_TAILQ_HEAD(onion_flow_list_t, onion_queue_flow_t)
+              ol_active_flows[MAX_ONION_HANDSHAKE_TYPE+1] =
+{ TOR_TAILQ_HEAD_INITIALIZER(ol_active_flows[0]), /* tap */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_active_flows[1]), /* fast */
+  TOR_TAILQ_HEAD_INITIALIZER(ol_active_flows[2]), /* ntor */
+};
+
+/** True iff we have initialized ol_flows[] and ol_flow_key. */
+static int ol_flows_initialized = 0;
+
+/** Key that we use to hash peers to flows.  It is random, so that nobody
+ * can choose addresses that share a flow with somebody else's. */
+static struct sipkey ol_flow_key;
+
+/** Statistics about each element of ol_list[]. */
+static onion_queue_stats_t ol_stats[MAX_ONION_HANDSHAKE_TYPE+1];
+
+/** Upper bounds, in seconds, of the buckets of ol_delay_metric[]. */
+static const double onion_queue_delay_bounds[] = {
+  0.001, 0.002, 0.004, 0.008, 0.016, 0.032, 0.064, 0.128, 0.256, 0.512,
+  1.024, 2.048, 4.096,
+};
+
+/** Histograms of how long the requests in each element of ol_list[] waited,
+ * for the MetricsPort. */
+static metrics_histogram_t ol_delay_metric[MAX_ONION_HANDSHAKE_TYPE+1] = {
+  METRICS_HISTOGRAM_INIT(onion_queue_delay_bounds), /* tap */
+  METRICS_HISTOGRAM_INIT(onion_queue_delay_bounds), /* fast */
+  METRICS_HISTOGRAM_INIT(onion_queue_delay_bounds), /* ntor */
+};
+
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
 
@@ -181,14 +262,217 @@ have_room_for_onionskin(uint16_t type)
   return 1;
 }
 
+/** Initialize ol_flows[] and ol_flow_key, if we haven't already. */
+static void
+onion_queue_flows_init(void)
+{
+  int i, j;
+
+  if (ol_flows_initialized)
+    return;
+
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i) {
+    for (j = 0; j < ONION_QUEUE_N_FLOWS; ++j)
+      TOR_TAILQ_INIT(&ol_flows[i][j].entries);
+  }
+  crypto_rand((char*) &ol_flow_key, sizeof(ol_flow_key));
+  ol_flows_initialized = 1;
+}
+
+/** Return the index of the flow that we queue the onionskins for
+ * <b>circ</b> on. It depends on the address of the peer that sent them, or
+ * on the channel they came from if we can't tell that address. */
+STATIC unsigned
+onion_queue_flow_idx(const or_circuit_t *circ)
+{
+  tor_addr_t addr;
+  uint64_t h;
+
+  onion_queue_flows_init();
+
+  if (!circ->p_chan)
+    return 0;
+  if (channel_get_addr_if_possible(circ->p_chan, &addr))
+    h = tor_addr_keyed_hash(&ol_flow_key, &addr);
+  else
+    h = siphash24(&circ->p_chan->global_identifier,
+                  sizeof(circ->p_chan->global_identifier), &ol_flow_key);
+  return (unsigned)(h & (ONION_QUEUE_N_FLOWS - 1));
+}
+
+/** Return the flow of the queue entry <b>ent</b>. */
+static inline onion_queue_flow_t *
+onion_queue_entry_get_flow(const onion_queue_t *ent)
+{
+  return &ol_flows[ent->handshake_type][ent->flow_idx];
+}
+
+/** Return the flow of type <b>type</b> with the most entries, or NULL if
+ * they are all empty. */
+static onion_queue_flow_t *
+onion_queue_longest_flow(uint16_t type)
+{
+  onion_queue_flow_t *flow, *longest = NULL;
+  TOR_TAILQ_FOREACH(flow, &ol_active_flows[type], next_active) {
+    if (!longest || flow->n_entries > longest->n_entries)
+      longest = flow;
+  }
+  return longest;
+}
+
+/** Remove <b>ent</b> from the queue and close its circuit, because we
+ * won't be able to answer it in time. */
+static void
+onion_queue_entry_drop(onion_queue_t *ent)
+{
+  or_circuit_t *circ = ent->circ;
+
+  onion_queue_entry_remove(ent);
+  log_info(LD_CIRC,
+           "Circuit create request waited too long; canceling due to "
+           "overload.");
+  if (! TO_CIRCUIT(circ)->marked_for_close) {
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+  }
+}
+
+/** Return the CoDel target delay of the onion queue, in msec: how long we
+ * let the requests in a flow wait before we consider dropping them.  Zero
+ * turns CoDel off. */
+static uint32_t
+onion_queue_codel_target_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_TARGET_MSEC 100
+#define MIN_ONION_QUEUE_CODEL_TARGET_MSEC 0
+#define MAX_ONION_QUEUE_CODEL_TARGET_MSEC ONIONQUEUE_WAIT_CUTOFF_MSEC
+
+  return networkstatus_get_param(NULL, "OnionQueueCoDelTarget",
+                                 DEFAULT_ONION_QUEUE_CODEL_TARGET_MSEC,
+                                 MIN_ONION_QUEUE_CODEL_TARGET_MSEC,
+                                 MAX_ONION_QUEUE_CODEL_TARGET_MSEC);
+}
+
+/** Return the CoDel interval of the onion queue, in msec: how long the
+ * delay of a flow must stay above the target before we start dropping its
+ * requests. */
+static uint32_t
+onion_queue_codel_interval_msec(void)
+{
+#define DEFAULT_ONION_QUEUE_CODEL_INTERVAL_MSEC 1000
+#define MIN_ONION_QUEUE_CODEL_INTERVAL_MSEC 1
+#define MAX_ONION_QUEUE_CODEL_INTERVAL_MSEC 60000
+
+  return networkstatus_get_param(NULL, "OnionQueueCoDelInterval",
+                                 DEFAULT_ONION_QUEUE_CODEL_INTERVAL_MSEC,
+                                 MIN_ONION_QUEUE_CODEL_INTERVAL_MSEC,
+                                 MAX_ONION_QUEUE_CODEL_INTERVAL_MSEC);
+}
+
+/** Set <b>flow</b>'s next drop time to <b>interval</b> msec after
+ * <b>when</b>, divided by the square root of its drop count, so that we
+ * drop faster the longer the delay stays high. */
+static void
+onion_queue_codel_schedule(onion_queue_flow_t *flow,
+                           const monotime_coarse_t *when, uint32_t interval)
+{
+  /* Find 256 times the square root of the count, by Newton's method. */
+  uint64_t n = ((uint64_t)MAX(flow->drop_count, 1)) << 16;
+  uint64_t root = n, next = (n + 1) / 2;
+
+  while (next < root) {
+    root = next;
+    next = (root + n / root) / 2;
+  }
+  monotime_coarse_add_msec(&flow->drop_next, when,
+                           (uint32_t)(((uint64_t)interval << 8) / root));
+}
+
+/** Return true iff CoDel lets us drop <b>head</b>, the first entry of
+ * <b>flow</b>, at time <b>now</b>: that is, iff the delay of the flow has
+ * been above <b>target</b> for at least <b>interval</b>. */
+static int
+onion_queue_codel_ok_to_drop(onion_queue_flow_t *flow,
+                             const onion_queue_t *head,
+                             const monotime_coarse_t *now,
+                             uint32_t target, uint32_t interval)
+{
+  if (!head ||
+      monotime_coarse_diff_msec(&head->when_added, now) < (int64_t)target) {
+    monotime_coarse_zero(&flow->first_above_time);
+    return 0;
+  }
+  if (monotime_coarse_is_zero(&flow->first_above_time)) {
+    monotime_coarse_add_msec(&flow->first_above_time, now, interval);
+    return 0;
+  }
+  return monotime_coarse_diff_msec(&flow->first_above_time, now) >= 0;
+}
+
+/** Return the entry of <b>flow</b> that we should process next, at time
+ * <b>now</b>, after dropping any entries that CoDel tells us to.  Return
+ * NULL if we dropped every entry of the flow. */
+static onion_queue_t *
+onion_queue_flow_next(onion_queue_flow_t *flow, const monotime_coarse_t *now)
+{
+  const uint32_t target = onion_queue_codel_target_msec();
+  const uint32_t interval = onion_queue_codel_interval_msec();
+  onion_queue_t *head = TOR_TAILQ_FIRST(&flow->entries);
+  int ok_to_drop;
+
+  if (!target)
+    return head;
+
+  ok_to_drop = onion_queue_codel_ok_to_drop(flow, head, now,
+                                            target, interval);
+  if (flow->dropping) {
+    if (!ok_to_drop) {
+      flow->dropping = 0;
+      return head;
+    }
+    while (flow->dropping &&
+           monotime_coarse_diff_msec(&flow->drop_next, now) >= 0) {
+      ++ol_stats[head->handshake_type].n_codel_dropped;
+      onion_queue_entry_drop(head);
+      ++flow->drop_count;
+      head = TOR_TAILQ_FIRST(&flow->entries);
+      if (!onion_queue_codel_ok_to_drop(flow, head, now, target, interval))
+        flow->dropping = 0;
+      else
+        onion_queue_codel_schedule(flow, &flow->drop_next, interval);
+    }
+  } else if (ok_to_drop) {
+    uint32_t delta = flow->drop_count - flow->last_drop_count;
+    ++ol_stats[head->handshake_type].n_codel_dropped;
+    onion_queue_entry_drop(head);
+    head = TOR_TAILQ_FIRST(&flow->entries);
+    flow->dropping = (head != NULL);
+    /* If we were dropping recently, carry on at about the rate that we
+     * stopped at. */
+    if (delta > 1 &&
+        monotime_coarse_diff_msec(&flow->drop_next, now) <
+        16 * (int64_t)interval)
+      flow->drop_count = delta;
+    else
+      flow->drop_count = 1;
+    onion_queue_codel_schedule(flow, now, interval);
+    flow->last_drop_count = flow->drop_count;
+  }
+  return head;
+}
+
 /** Add <b>circ</b> to the end of ol_list and return 0, except
  * if ol_list is too long, in which case do nothing and return -1.
+ *
+ * If ol_list is too long but some other flow has more entries than the
+ * flow of <b>circ</b>, we make room by dropping the oldest entry of the
+ * longest flow instead.
  */
 int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  onion_queue_flow_t *flow;
+  monotime_coarse_t now;
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -199,16 +483,20 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
     /* LCOV_EXCL_STOP */
   }
 
+  monotime_coarse_get(&now);
   tmp = tor_malloc_zero(sizeof(onion_queue_t));
   tmp->circ = circ;
   tmp->handshake_type = onionskin->handshake_type;
+  tmp->flow_idx = onion_queue_flow_idx(circ);
   tmp->onionskin = onionskin;
   tmp->when_added = now;
+  flow = onion_queue_entry_get_flow(tmp);
 
   if (!have_room_for_onionskin(onionskin->handshake_type)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
+    onion_queue_flow_t *longest;
     char *m;
     if (onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR &&
         (m = rate_limit_log(&last_warned, approx_time()))) {
@@ -219,8 +507,13 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
-    return -1;
+    longest = onion_queue_longest_flow(onionskin->handshake_type);
+    if (!longest || longest->n_entries <= flow->n_entries + 1) {
+      tor_free(tmp);
+      return -1;
+    }
+    ++ol_stats[onionskin->handshake_type].n_evicted;
+    onion_queue_entry_drop(TOR_TAILQ_FIRST(&longest->entries));
   }
 
   ++ol_entries[onionskin->handshake_type];
@@ -231,21 +524,20 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 
   circ->onionqueue_entry = tmp;
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
+  if (flow->n_entries++ == 0)
+    TOR_TAILQ_INSERT_TAIL(&ol_active_flows[onionskin->handshake_type],
+                          flow, next_active);
+  TOR_TAILQ_INSERT_TAIL(&flow->entries, tmp, flow_next);
 
   /* cull elderly requests. */
   while (1) {
     onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
+    if (monotime_coarse_diff_msec(&head->when_added, &now) <
+        ONIONQUEUE_WAIT_CUTOFF_MSEC)
       break;
 
-    circ = head->circ;
-    circ->onionqueue_entry = NULL;
-    onion_queue_entry_remove(head);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    if (! TO_CIRCUIT(circ)->marked_for_close) {
-      circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-    }
+    ++ol_stats[onionskin->handshake_type].n_expired;
+    onion_queue_entry_drop(head);
   }
   return 0;
 }
@@ -308,16 +600,35 @@ decide_next_handshake_type(void)
 
 /** Remove the highest priority item from ol_list[] and return it, or
  * return NULL if the lists are empty.
+ *
+ * We take the item from the next active flow of the handshake type that we
+ * choose, dropping whatever CoDel tells us to drop on the way.
  */
 or_circuit_t *
 onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
-  uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
-
-  if (!head)
-    return NULL; /* no onions pending, we're done */
+  onion_queue_t *head = NULL;
+  monotime_coarse_t now;
+  int64_t delay;
+  int bucket;
+
+  monotime_coarse_get(&now);
+  while (!head) {
+    uint16_t handshake_to_choose = decide_next_handshake_type();
+    onion_queue_flow_t *flow =
+      TOR_TAILQ_FIRST(&ol_active_flows[handshake_to_choose]);
+
+    if (!flow)
+      return NULL; /* no onions pending, we're done */
+
+    /* This flow has had its turn. */
+    TOR_TAILQ_REMOVE(&ol_active_flows[handshake_to_choose], flow,
+                     next_active);
+    TOR_TAILQ_INSERT_TAIL(&ol_active_flows[handshake_to_choose], flow,
+                          next_active);
+    head = onion_queue_flow_next(flow, &now);
+  }
 
   tor_assert(head->circ);
   tor_assert(head->handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
@@ -332,6 +643,14 @@ onion_next_task(create_cell_t **onionskin_out)
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
 
+  delay = monotime_coarse_diff_msec(&head->when_added, &now);
+  bucket = delay <= 0 ? 0 : tor_log2((uint64_t)delay) + 1;
+  ++ol_stats[head->handshake_type].n_processed;
+  ++ol_stats[head->handshake_type].delay_hist[
+                               MIN(bucket, ONION_QUEUE_DELAY_HIST_LEN - 1)];
+  metrics_histogram_observe(&ol_delay_metric[head->handshake_type],
+                            delay / 1000.0);
+
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
   circ->onionqueue_entry = NULL;
@@ -347,6 +666,112 @@ onion_num_pending(uint16_t handshake_type)
   return ol_entries[handshake_type];
 }
 
+/** Return the statistics about the queue of <b>handshake_type</b>-style
+ * create requests. */
+const onion_queue_stats_t *
+onion_queue_get_stats(uint16_t handshake_type)
+{
+  tor_assert(handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
+  return &ol_stats[handshake_type];
+}
+
+/** Getter for the number of requests pending in the queue whose handshake
+ * type <b>arg</b> points to. */
+static uint64_t
+onion_queue_get_n_pending(const void *arg)
+{
+  return onion_num_pending(*(const uint16_t *)arg);
+}
+
+/** Register the onion queue metrics with the metrics subsystem. */
+void
+onion_queue_register_metrics(void)
+{
+  static const uint16_t types[] = { ONION_HANDSHAKE_TYPE_TAP,
+                                    ONION_HANDSHAKE_TYPE_NTOR };
+  static const char *names[] = { "tap", "ntor" };
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(types); ++i) {
+    onion_queue_stats_t *st = &ol_stats[types[i]];
+    char *labels = NULL, *drop_labels = NULL;
+
+    tor_asprintf(&labels, "type=\"%s\"", names[i]);
+    metrics_register_gauge_fn(onion_queue_get_n_pending, &types[i],
+                              "tor_onion_queue_pending",
+                              "Create requests waiting in the onion queue.",
+                              labels);
+    metrics_register_counter_fn(metrics_read_u64, &st->n_processed,
+                                "tor_onion_queue_processed_total",
+                                "Create requests taken off the onion queue "
+                                "to be answered.", labels);
+    metrics_register_histogram(&ol_delay_metric[types[i]],
+                               "tor_onion_queue_delay_seconds",
+                               "How long the create requests that we "
+                               "answered waited in the onion queue.", labels);
+
+#define REGISTER_DROPPED(field, reason)                                 \
+    STMT_BEGIN                                                          \
+      tor_asprintf(&drop_labels, "%s,reason=\"%s\"", labels, (reason)); \
+      metrics_register_counter_fn(metrics_read_u64, &st->field,         \
+                                  "tor_onion_queue_dropped_total",      \
+                                  "Create requests dropped from the "   \
+                                  "onion queue.", drop_labels);         \
+      tor_free(drop_labels);                                            \
+    STMT_END
+    REGISTER_DROPPED(n_codel_dropped, "codel");
+    REGISTER_DROPPED(n_evicted, "evicted");
+    REGISTER_DROPPED(n_expired, "expired");
+#undef REGISTER_DROPPED
+
+    tor_free(labels);
+  }
+}
+
+/** Log the statistics about the onion queues for the heartbeat. */
+void
+onion_queue_log_heartbeat(void)
+{
+  static const uint16_t types[] = { ONION_HANDSHAKE_TYPE_TAP,
+                                    ONION_HANDSHAKE_TYPE_NTOR };
+  unsigned i;
+  int j;
+
+  for (i = 0; i < ARRAY_LENGTH(types); ++i) {
+    const onion_queue_stats_t *st = &ol_stats[types[i]];
+    smartlist_t *hist;
+    char *hist_str;
+
+    if (!st->n_processed && !st->n_codel_dropped && !st->n_evicted &&
+        !st->n_expired)
+      continue;
+
+    hist = smartlist_new();
+    for (j = 0; j < ONION_QUEUE_DELAY_HIST_LEN - 1; ++j) {
+      smartlist_add_asprintf(hist, "<%d:"U64_FORMAT, 1 << j,
+                             U64_PRINTF_ARG(st->delay_hist[j]));
+    }
+    smartlist_add_asprintf(hist, ">=%d:"U64_FORMAT, 1 << (j - 1),
+                           U64_PRINTF_ARG(st->delay_hist[j]));
+    hist_str = smartlist_join_strings(hist, " ", 0, NULL);
+
+    log_notice(LD_HEARTBEAT, "Onion queue (%s): processed "U64_FORMAT
+               " requests; dropped "U64_FORMAT" that waited too long, "
+               U64_FORMAT" to make room, and "U64_FORMAT" that expired. "
+               "Queue delays in msec: %s",
+               types[i] == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "TAP",
+               U64_PRINTF_ARG(st->n_processed),
+               U64_PRINTF_ARG(st->n_codel_dropped),
+               U64_PRINTF_ARG(st->n_evicted),
+               U64_PRINTF_ARG(st->n_expired),
+               hist_str);
+
+    SMARTLIST_FOREACH(hist, char *, cp, tor_free(cp));
+    smartlist_free(hist);
+    tor_free(hist_str);
+  }
+}
+
 /** Go through ol_list, find the onion_queue_t element which points to
  * circ, remove and free that element. Leave circ itself alone.
  */
@@ -370,6 +795,8 @@ onion_pending_remove(or_circuit_t *circ)
 static void
 onion_queue_entry_remove(onion_queue_t *victim)
 {
+  onion_queue_flow_t *flow;
+
   if (victim->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
      * We should have rejected this far before this point */
@@ -382,6 +809,16 @@ onion_queue_entry_remove(onion_queue_t *victim)
 
   TOR_TAILQ_REMOVE(&ol_list[victim->handshake_type], victim, next);
 
+  flow = onion_queue_entry_get_flow(victim);
+  TOR_TAILQ_REMOVE(&flow->entries, victim, flow_next);
+  if (--flow->n_entries == 0) {
+    TOR_TAILQ_REMOVE(&ol_active_flows[victim->handshake_type], flow,
+                     next_active);
+    /* CoDel starts over when a flow empties. */
+    monotime_coarse_zero(&flow->first_above_time);
+    flow->dropping = 0;
+  }
+
   if (victim->circ)
     victim->circ->onionqueue_entry = NULL;
 
@@ -392,7 +829,8 @@ onion_queue_entry_remove(onion_queue_t *victim)
   tor_free(victim);
 }
 
-/** Remove all circuits from the pending list.  Called from tor_free_all. */
+/** Remove all circuits from the pending list, and forget our statistics
+ * about them.  Called from tor_free_all. */
 void
 clear_pending_onions(void)
 {
@@ -406,6 +844,11 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  memset(ol_flows, 0, sizeof(ol_flows));
+  ol_flows_initialized = 0;
+  memset(ol_stats, 0, sizeof(ol_stats));
+  for (i=0; i<=MAX_ONION_HANDSHAKE_TYPE; i++)
+    metrics_histogram_clear(&ol_delay_metric[i]);
 }
 
 /* ============================================================ */
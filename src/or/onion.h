@@ -19,6 +19,30 @@ int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
 
+/** Number of buckets in the histograms of onion queue delays. */
+#define ONION_QUEUE_DELAY_HIST_LEN 14
+
+/** Statistics about the queue of create requests of one handshake type. */
+typedef struct onion_queue_stats_t {
+  /** Number of requests that we took off the queue to process. */
+  uint64_t n_processed;
+  /** Number of requests that we dropped because their flow had waited too
+   * long, because we needed room for a request from a shorter flow, and
+   * because they were too old to be worth answering. */
+  uint64_t n_codel_dropped;
+  uint64_t n_evicted;
+  uint64_t n_expired;
+  /** Histogram of how long the processed requests waited.  Bucket 0
+   * counts delays under 1 msec, and bucket i counts delays of at least
+   * 2^(i-1) msec but under 2^i msec, except that the last bucket counts all
+   * the longer delays too. */
+  uint64_t delay_hist[ONION_QUEUE_DELAY_HIST_LEN];
+} onion_queue_stats_t;
+
+const onion_queue_stats_t *onion_queue_get_stats(uint16_t handshake_type);
+void onion_queue_log_heartbeat(void);
+void onion_queue_register_metrics(void);
+
 typedef struct server_onion_keys_t {
   uint8_t my_identity[DIGEST_LEN];
   crypto_pk_t *onion_key;
@@ -121,5 +145,9 @@ int extend_cell_format(uint8_t *command_out, uint16_t *len_out,
 int extended_cell_format(uint8_t *command_out, uint16_t *len_out,
                          uint8_t *payload_out, const extended_cell_t *cell_in);
 
+#ifdef ONION_PRIVATE
+STATIC unsigned onion_queue_flow_idx(const or_circuit_t *circ);
+#endif /* defined(ONION_PRIVATE) */
+
 #endif /* !defined(TOR_ONION_H) */
 
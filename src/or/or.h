@@ -232,8 +232,12 @@ typedef enum {
 #define CONN_TYPE_EXT_OR_LISTENER 17
 /** Type for sockets listening for HTTP CONNECT tunnel connections. */
 #define CONN_TYPE_AP_HTTP_CONNECT_LISTENER 18
+/** Type for sockets listening for MetricsPort connections. */
+#define CONN_TYPE_METRICS_LISTENER 19
+/** Type for HTTP connections to the MetricsPort. */
+#define CONN_TYPE_METRICS 20
 
-#define CONN_TYPE_MAX_ 19
+#define CONN_TYPE_MAX_ 21
 /* !!!! If _CONN_TYPE_MAX is ever over 31, we must grow the type field in
  * connection_t. */
 
@@ -390,6 +394,11 @@ typedef enum {
 #define CONTROL_CONN_STATE_NEEDAUTH 2
 #define CONTROL_CONN_STATE_MAX_ 2
 
+#define METRICS_CONN_STATE_MIN_ 1
+/** State for a MetricsPort connection: waiting for an HTTP request. */
+#define METRICS_CONN_STATE_OPEN 1
+#define METRICS_CONN_STATE_MAX_ 1
+
 #define DIR_PURPOSE_MIN_ 4
 /** A connection to a directory server: set after a v2 rendezvous
  * descriptor is downloaded. */
@@ -1027,6 +1036,7 @@ typedef uint16_t streamid_t;
 /* channel_t typedef; struct channel_s is in channel.h */
 
 typedef struct channel_s channel_t;
+typedef struct chan_circid_table_t chan_circid_table_t;
 
 /* channel_listener_t typedef; struct channel_listener_s is in channel.h */
 
@@ -1713,6 +1723,8 @@ typedef struct {
 
   int LogMessageDomains; /**< Boolean: Should we log the domain(s) in which
                           * each log message occurs? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our log
+                     * messages to files and syslog? */
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
   char *SyslogIdentityTag; /**< Identity tag to add for syslog logging. */
@@ -1823,6 +1835,8 @@ typedef struct {
   /** Ports to listen on for directory connections. */
   config_line_t *DirPort_lines;
   config_line_t *DNSPort_lines; /**< Ports to listen on for DNS requests. */
+  /** Ports to listen on for MetricsPort connections. */
+  config_line_t *MetricsPort_lines;
 
   /* MaxMemInQueues value as input by the user. We clean this up to be
    * MaxMemInQueues. */
@@ -2296,6 +2310,11 @@ typedef struct {
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
+  /** If true, count unique clients for bridge, entry and directory request
+   * statistics with fixed-size HyperLogLog sketches instead of remembering
+   * every client address. */
+  int SketchClientStatistics;
+
   /** If true, the user wants us to collect statistics as hidden service
    * directory, introduction point, or rendezvous point. */
   int HiddenServiceStatistics_option;
@@ -2686,6 +2705,15 @@ typedef struct {
    * use the default. */
   int MaxConsensusAgeForDiffs;
 
+  /** As an HSDir, the most memory that the v3 onion service descriptor
+   * cache may use before we evict the least recently used descriptors.  If
+   * 0, use a fraction of MaxMemInQueues. */
+  uint64_t MaxMemInHSDirCache;
+
+  /** Bool (default: 0): As an HSDir, should we keep the onion service
+   * descriptors that we cache compressed in memory? */
+  int HSDirCacheCompression;
+
   /** Bool (default: 0). Tells Tor to never try to exec another program.
    */
   int NoExec;
@@ -2739,6 +2767,16 @@ typedef struct {
    * used against it. See the dos_conn_defense_type_t enum. */
   int DoSConnectionDefenseType;
 
+  /** Length of the IPv4 prefixes whose addresses share their DoS statistics
+   * and limits. */
+  int DoSIPv4PrefixLength;
+  /** Length of the IPv6 prefixes whose addresses share their DoS statistics
+   * and limits. */
+  int DoSIPv6PrefixLength;
+  /** Maximum number of address prefixes the DoS subsystem keeps statistics
+   * for. */
+  int DoSMaxTrackedPrefixes;
+
   /** Autobool: Do we refuse single hop client rendezvous? */
   int DoSRefuseSingleHopClientRendezvous;
 } or_options_t;
@@ -84,6 +84,17 @@ struct or_connection_t {
    * bytes TLS actually sent - used for overhead estimation for scheduling.
    */
   uint64_t bytes_xmitted, bytes_xmitted_by_tls;
+
+  /*
+   * A probe for how long cells wait in our outbuf: while
+   * cell_latency_probe_bytes is nonzero, it is the number of bytes that we
+   * still have to flush before the probe cell has been handed to TLS.  The
+   * two timestamps (in timestamp units) record when the probe cell was
+   * queued on its circuit and when it was added to our outbuf.
+   */
+  size_t cell_latency_probe_bytes;
+  uint32_t cell_latency_probe_queued;
+  uint32_t cell_latency_probe_added;
 };
 
 #endif
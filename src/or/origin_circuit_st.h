@@ -79,6 +79,12 @@ struct origin_circuit_t {
    * present. */
   int global_origin_circuit_list_idx;
 
+  /** Index into the list of origin circuits with purpose
+   * <b>purpose_list_purpose</b>, or -1 if not present. */
+  int purpose_list_idx;
+  /** The purpose under which this circuit is currently indexed. */
+  uint8_t purpose_list_purpose;
+
   /** How many more relay_early cells can we send on this circuit, according
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
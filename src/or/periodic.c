@@ -13,6 +13,7 @@
 
 #include "or/or.h"
 #include "common/compat_libevent.h"
+#include "common/profiler.h"
 #include "or/config.h"
 #include "or/main.h"
 #include "or/periodic.h"
@@ -108,6 +109,8 @@ periodic_event_setup(periodic_event_item_t *event)
   event->ev = mainloop_event_new(periodic_event_dispatch,
                                  event);
   tor_assert(event->ev);
+  mainloop_event_set_profiler_entry(event->ev,
+                     profiler_entry_get(PROFILER_KIND_PERIODIC, event->name));
 }
 
 /** Handles initial dispatch for periodic events. It should happen 1 second
@@ -81,6 +81,7 @@
 #include "or/routerparse.h"
 #include "or/scheduler.h"
 #include "or/rephist.h"
+#include "lib/trace/events.h"
 
 #include "or/cell_st.h"
 #include "or/cell_queue_st.h"
@@ -245,6 +246,7 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
            "relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
   }
+  tor_trace(relay, decrypt, circ, cell->circ_id, cell_direction, recognized);
 
   circuit_update_channel_usage(circ, cell);
 
@@ -2783,15 +2785,19 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    tor_assert(cell);
 
     /* Calculate the exact time that this cell has spent in the queue. */
-    if (get_options()->CellStatistics ||
-        get_options()->TestingEnableCellStatsEvent) {
+    {
       uint32_t timestamp_now = monotime_coarse_get_stamp();
       uint32_t msec_waiting =
         (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
                          timestamp_now - cell->inserted_timestamp);
 
+      rep_hist_note_cell_latency(CELL_LATENCY_CIRCUITMUX, msec_waiting);
+      tor_trace(cmux, dequeue, circ, chan->global_identifier, queue->n,
+                msec_waiting);
+
       if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
         or_circ = TO_OR_CIRCUIT(circ);
         or_circ->total_cell_waiting_time += msec_waiting;
@@ -2958,6 +2964,8 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
    * this function use the stack for the cell memory. */
   cell_queue_append_packed_copy(circ, queue, exitward, cell,
                                 chan->wide_circ_ids, 1);
+  tor_trace(cmux, enqueue, circ, chan->global_identifier, cell->command,
+            queue->n);
 
   /* Check and run the OOM if needed. */
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
@@ -60,6 +60,9 @@
  * <li>Link protocol statistics, used by relays to count how many times
  * each link protocol has been used.
  *
+ * <li>Cell latency statistics: histograms of how long the cells that we
+ * relay wait in each stage of the outbound path.
+ *
  * </ul>
  *
  * The entry points for this module are scattered throughout the
@@ -88,6 +91,7 @@
 #include "or/channelpadding.h"
 #include "or/connection_or.h"
 #include "or/statefile.h"
+#include "common/metrics.h"
 
 #include "or/networkstatus_st.h"
 #include "or/or_circuit_st.h"
@@ -3170,6 +3174,131 @@ rep_hist_log_link_protocol_counts(void)
              U64_PRINTF_ARG(link_proto_count[4][0]));
 }
 
+/** Upper bounds, in seconds, of the cell latency histogram buckets.  As
+ * in an HDR histogram, every power of two gets two buckets, so that the
+ * relative error of any quantile stays under 50% from one millisecond (the
+ * resolution of our coarse monotonic clock) up to several seconds. */
+static const double cell_latency_bounds[] = {
+  0.001, 0.0015, 0.002, 0.003, 0.004, 0.006, 0.008, 0.012, 0.016, 0.024,
+  0.032, 0.048, 0.064, 0.096, 0.128, 0.192, 0.256, 0.384, 0.512, 0.768,
+  1.024, 1.536, 2.048, 3.072, 4.096, 6.144, 8.192,
+};
+
+/** Histograms of cell latency, indexed by cell_latency_stage_t. */
+static metrics_histogram_t cell_latency[CELL_LATENCY_N_STAGES] = {
+  METRICS_HISTOGRAM_INIT(cell_latency_bounds),
+  METRICS_HISTOGRAM_INIT(cell_latency_bounds),
+  METRICS_HISTOGRAM_INIT(cell_latency_bounds),
+  METRICS_HISTOGRAM_INIT(cell_latency_bounds),
+};
+
+/** Names of the cell latency stages, for the controller, the heartbeat
+ * and the MetricsPort. */
+static const char *cell_latency_stage_names[CELL_LATENCY_N_STAGES] = {
+  "circuitmux", "scheduler", "outbuf", "total",
+};
+
+/** Note that something spent <b>msec</b> milliseconds in the stage
+ * <b>stage</b> of relaying a cell. */
+void
+rep_hist_note_cell_latency(cell_latency_stage_t stage, uint32_t msec)
+{
+  tor_assert_nonfatal(stage < CELL_LATENCY_N_STAGES);
+  if (stage >= CELL_LATENCY_N_STAGES)
+    return;
+  metrics_histogram_observe(&cell_latency[stage], msec / 1000.0);
+}
+
+/** Return the number of observations of the cell latency stage
+ * <b>stage</b>. */
+uint64_t
+rep_hist_get_n_cell_latency(cell_latency_stage_t stage)
+{
+  tor_assert(stage < CELL_LATENCY_N_STAGES);
+  return metrics_histogram_get_count(&cell_latency[stage]);
+}
+
+/** Return a newly allocated string describing the cell latency
+ * histograms: one line per stage, with the number of observations and
+ * the mean, median, 90th, 99th and 99.9th percentiles in milliseconds. */
+char *
+rep_hist_format_cell_latency(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int i;
+
+  for (i = 0; i < CELL_LATENCY_N_STAGES; ++i) {
+    const metrics_histogram_t *h = &cell_latency[i];
+    const uint64_t n = metrics_histogram_get_count(h);
+    smartlist_add_asprintf(lines, "%s count="U64_FORMAT" mean=%.1f "
+                           "p50=%.1f p90=%.1f p99=%.1f p999=%.1f",
+                           cell_latency_stage_names[i], U64_PRINTF_ARG(n),
+                           n ? 1000.0 * h->sum / U64_TO_DBL(n) : 0.0,
+                           1000.0 * metrics_histogram_quantile(h, 0.5),
+                           1000.0 * metrics_histogram_quantile(h, 0.9),
+                           1000.0 * metrics_histogram_quantile(h, 0.99),
+                           1000.0 * metrics_histogram_quantile(h, 0.999));
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log a heartbeat message with the median and 99th percentile of each
+ * cell latency stage, if we have relayed any cells. */
+void
+rep_hist_log_cell_latency(void)
+{
+  smartlist_t *parts;
+  char *msg;
+  int i;
+
+  if (!metrics_histogram_get_count(&cell_latency[CELL_LATENCY_CIRCUITMUX]))
+    return;
+
+  parts = smartlist_new();
+  for (i = 0; i < CELL_LATENCY_N_STAGES; ++i) {
+    const metrics_histogram_t *h = &cell_latency[i];
+    smartlist_add_asprintf(parts, "%s %.1f/%.1f",
+                           cell_latency_stage_names[i],
+                           1000.0 * metrics_histogram_quantile(h, 0.5),
+                           1000.0 * metrics_histogram_quantile(h, 0.99));
+  }
+  msg = smartlist_join_strings(parts, ", ", 0, NULL);
+  log_notice(LD_HEARTBEAT, "Since startup, relayed cells have waited "
+             "(median/99th percentile, in msec): %s.", msg);
+
+  SMARTLIST_FOREACH(parts, char *, cp, tor_free(cp));
+  smartlist_free(parts);
+  tor_free(msg);
+}
+
+/** Register the cell latency histograms with the metrics subsystem. */
+void
+rep_hist_register_cell_latency_metrics(void)
+{
+  int i;
+  for (i = 0; i < CELL_LATENCY_N_STAGES; ++i) {
+    char *labels = NULL;
+    tor_asprintf(&labels, "stage=\"%s\"", cell_latency_stage_names[i]);
+    metrics_register_histogram(&cell_latency[i], "tor_cell_latency_seconds",
+                               "Time that relayed cells spent in each stage "
+                               "of the outbound path.", labels);
+    tor_free(labels);
+  }
+}
+
+/** Forget every cell latency observation. */
+void
+rep_hist_reset_cell_latency(void)
+{
+  int i;
+  for (i = 0; i < CELL_LATENCY_N_STAGES; ++i)
+    metrics_histogram_clear(&cell_latency[i]);
+}
+
 /** Free all storage held by the OR/link history caches, by the
  * bandwidth history arrays, by the port history, or by statistics . */
 void
@@ -3204,6 +3333,7 @@ rep_hist_free_all(void)
   }
   rep_hist_desc_stats_term();
   total_descriptor_downloads = 0;
+  rep_hist_reset_cell_latency();
 
   tor_assert_nonfatal(rephist_total_alloc == 0);
   tor_assert_nonfatal_once(rephist_total_num == 0);
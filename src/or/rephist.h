@@ -104,6 +104,31 @@ void rep_hist_note_negotiated_link_proto(unsigned link_proto,
                                          int started_here);
 void rep_hist_log_link_protocol_counts(void);
 
+/** The stages of the outbound path of a relayed cell whose latency we
+ * measure. */
+typedef enum cell_latency_stage_t {
+  /** From when the cell was queued on its circuit, to when the circuitmux
+   * picked it and wrote it to the channel. */
+  CELL_LATENCY_CIRCUITMUX = 0,
+  /** From when a channel became pending in the scheduler, to when the
+   * scheduler serviced it. */
+  CELL_LATENCY_SCHEDULER = 1,
+  /** From when the cell was added to the connection's outbuf, to when it
+   * was handed to TLS and the kernel. */
+  CELL_LATENCY_OUTBUF = 2,
+  /** From when the cell was queued on its circuit, to when it was handed
+   * to TLS and the kernel. */
+  CELL_LATENCY_TOTAL = 3,
+} cell_latency_stage_t;
+#define CELL_LATENCY_N_STAGES 4
+
+void rep_hist_note_cell_latency(cell_latency_stage_t stage, uint32_t msec);
+uint64_t rep_hist_get_n_cell_latency(cell_latency_stage_t stage);
+char *rep_hist_format_cell_latency(void);
+void rep_hist_log_cell_latency(void);
+void rep_hist_register_cell_latency_metrics(void);
+void rep_hist_reset_cell_latency(void);
+
 extern uint64_t rephist_total_alloc;
 extern uint32_t rephist_total_num;
 #ifdef TOR_UNIT_TESTS
@@ -17,12 +17,26 @@
  * malleable.)
  *
  * This module is used from rendservice.c.
+ *
+ * A replay cache made with replaycache_new() remembers when it last saw
+ * every digest, and forgets it exactly <b>horizon</b> seconds later, but it
+ * has to walk all of its entries to do so, and it can grow without bound.
+ * One made with replaycache_new_bucketed() keeps 64-bit fingerprints in a
+ * ring of hash sets, one for each interval of time, and forgets a whole
+ * interval at once by dropping its set; its memory use is bounded. The v3
+ * onion service code uses those.
  */
 
 #define REPLAYCACHE_PRIVATE
 
 #include "or/or.h"
 #include "or/replaycache.h"
+#include "siphash.h"
+
+/** Smallest fingerprint table that we allocate for a bucket. */
+#define REPLAYCACHE_BUCKET_MIN_CAPACITY 16
+
+static void replaycache_rotate(time_t present, replaycache_t *r);
 
 /** Free the replaycache r and all of its entries.
  */
@@ -35,6 +49,13 @@ replaycache_free_(replaycache_t *r)
   }
 
   if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  if (r->buckets) {
+    int i;
+    for (i = 0; i < r->n_buckets; ++i) {
+      tor_free(r->buckets[i].fps);
+    }
+    tor_free(r->buckets);
+  }
 
   tor_free(r);
 }
@@ -60,7 +81,7 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
+  r = tor_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
@@ -70,6 +91,188 @@ replaycache_new(time_t horizon, time_t interval)
   return r;
 }
 
+/** Allocate a new, empty bucketed replay detection cache, where horizon is
+ * the time for entries to age out, and n_buckets the number of intervals the
+ * horizon is split in. Entries are forgotten between horizon and about
+ * horizon / (n_buckets - 1) seconds later. A zero horizon means they are
+ * never forgotten; n_buckets is then ignored.
+ *
+ * The cache holds at most max_entries digests. When it's full, the oldest
+ * interval is forgotten early; if it only has one left, every digest is
+ * reported as a replay until room is made.
+ */
+replaycache_t *
+replaycache_new_bucketed(time_t horizon, int n_buckets, size_t max_entries)
+{
+  replaycache_t *r = NULL;
+
+  if (horizon < 0 || max_entries == 0) {
+    log_info(LD_BUG, "replaycache_new_bucketed() called with bad"
+        " parameters");
+    goto err;
+  }
+
+  if (horizon == 0 || n_buckets < 2) {
+    /* One bucket that never rotates. */
+    n_buckets = 1;
+  }
+
+  r = tor_malloc_zero(sizeof(*r));
+  r->horizon = horizon;
+  r->n_buckets = n_buckets;
+  r->buckets = tor_calloc(n_buckets, sizeof(replaycache_bucket_t));
+  if (horizon > 0) {
+    /* The n_buckets - 1 full intervals before the current one must cover
+     * the horizon. */
+    r->bucket_width = CEIL_DIV(horizon, n_buckets - 1);
+  }
+  r->max_entries = max_entries;
+
+ err:
+  return r;
+}
+
+/** Return true iff <b>r</b> is a bucketed replay cache that holds as many
+ * digests as it can. */
+int
+replaycache_is_full(const replaycache_t *r)
+{
+  tor_assert(r);
+  return r->buckets && r->n_entries >= r->max_entries;
+}
+
+/** Return the fingerprint of a buffer in a bucketed replay cache. */
+static inline uint64_t
+replaycache_fp(const void *data, size_t len)
+{
+  uint64_t fp = siphash24g(data, len);
+  /* Zero marks empty slots. */
+  return fp ? fp : 1;
+}
+
+/** Return true iff bucket <b>b</b> holds the fingerprint <b>fp</b>. */
+static int
+replaycache_bucket_contains(const replaycache_bucket_t *b, uint64_t fp)
+{
+  uint32_t mask, i;
+
+  if (b->n_entries == 0)
+    return 0;
+  mask = b->capacity - 1;
+  for (i = (uint32_t) fp & mask; b->fps[i] != 0; i = (i + 1) & mask) {
+    if (b->fps[i] == fp)
+      return 1;
+  }
+  return 0;
+}
+
+/** Store the fingerprint <b>fp</b>, which isn't in it already, in bucket
+ * <b>b</b>, whose table has room for it. */
+static void
+replaycache_bucket_insert(replaycache_bucket_t *b, uint64_t fp)
+{
+  uint32_t mask = b->capacity - 1, i;
+
+  for (i = (uint32_t) fp & mask; b->fps[i] != 0; i = (i + 1) & mask)
+    ;
+  b->fps[i] = fp;
+  ++b->n_entries;
+}
+
+/** Add the fingerprint <b>fp</b> to bucket <b>b</b> of <b>r</b>, growing
+ * its table if needed. Return 0 on success, or -1 if <b>r</b> is full. */
+static int
+replaycache_bucket_add(replaycache_t *r, replaycache_bucket_t *b,
+                       uint64_t fp)
+{
+  if (r->n_entries >= r->max_entries)
+    return -1;
+
+  /* Keep the table at most three quarters full. */
+  if (((uint64_t) b->n_entries + 1) * 4 > (uint64_t) b->capacity * 3) {
+    replaycache_bucket_t bigger;
+    uint32_t i;
+
+    memset(&bigger, 0, sizeof(bigger));
+    bigger.start = b->start;
+    bigger.capacity = b->capacity ? b->capacity * 2 :
+      REPLAYCACHE_BUCKET_MIN_CAPACITY;
+    bigger.fps = tor_calloc(bigger.capacity, sizeof(uint64_t));
+    for (i = 0; i < b->capacity; ++i) {
+      if (b->fps[i])
+        replaycache_bucket_insert(&bigger, b->fps[i]);
+    }
+    tor_free(b->fps);
+    *b = bigger;
+  }
+
+  replaycache_bucket_insert(b, fp);
+  ++r->n_entries;
+  return 0;
+}
+
+/** Forget everything in bucket <b>b</b> of <b>r</b>. */
+static void
+replaycache_bucket_clear(replaycache_t *r, replaycache_bucket_t *b)
+{
+  r->n_entries -= b->n_entries;
+  tor_free(b->fps);
+  b->capacity = 0;
+  b->n_entries = 0;
+}
+
+/** Implementation of replaycache_add_and_test_internal() for bucketed
+ * caches. The elapsed time is rounded up to the start of the interval in
+ * which we saw the digest. */
+static int
+replaycache_bucketed_add_and_test(time_t present, replaycache_t *r,
+                                  const void *data, size_t len,
+                                  time_t *elapsed)
+{
+  replaycache_bucket_t *cur;
+  uint64_t fp = replaycache_fp(data, len);
+  int i;
+
+  replaycache_rotate(present, r);
+  cur = &r->buckets[r->cur_bucket];
+
+  for (i = 0; i < r->n_buckets; ++i) {
+    const replaycache_bucket_t *b = &r->buckets[i];
+    if (!replaycache_bucket_contains(b, fp))
+      continue;
+    if (elapsed) {
+      /* We shouldn't really be seeing hits from the future, but... */
+      *elapsed = present >= b->start ? present - b->start : 0;
+    }
+    /* Seeing it again keeps it around, as with the unbucketed caches. If
+     * there's no room for it, it can age out. */
+    if (b != cur)
+      (void) replaycache_bucket_add(r, cur, fp);
+    return 1;
+  }
+
+  /* Not seen before. Make room for it by forgetting the oldest intervals if
+   * we need to. */
+  for (i = 1; i < r->n_buckets && replaycache_is_full(r); ++i) {
+    replaycache_bucket_t *oldest =
+      &r->buckets[(r->cur_bucket + i) % r->n_buckets];
+    replaycache_bucket_clear(r, oldest);
+  }
+  if (i > 1) {
+    static ratelim_t full_warning = RATELIM_INIT(600);
+    log_fn_ratelim(&full_warning, LOG_NOTICE, LD_REND,
+                   "Replay cache is full. Forgetting entries before they "
+                   "age out.");
+  }
+  if (replaycache_bucket_add(r, cur, fp) < 0) {
+    /* We can't tell whether it's a replay, so play it safe. */
+    if (elapsed)
+      *elapsed = 0;
+    return 1;
+  }
+  return 0;
+}
+
 /** See documentation for replaycache_add_and_test().
  */
 STATIC int
@@ -88,6 +291,11 @@ replaycache_add_and_test_internal(
     goto done;
   }
 
+  if (r->buckets) {
+    rv = replaycache_bucketed_add_and_test(present, r, data, len, elapsed);
+    goto done;
+  }
+
   /* compute digest */
   crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
 
@@ -143,6 +351,12 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   void *valp;
   time_t *access_time;
 
+  /* bucketed caches drop whole intervals at once, which is cheap */
+  if (r && r->buckets) {
+    replaycache_rotate(present, r);
+    return;
+  }
+
   /* sanity check */
   if (!r || !(r->digests_seen)) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
@@ -177,6 +391,43 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   if (present > r->scrubbed) r->scrubbed = present;
 }
 
+/** Make the current bucket of the bucketed replay cache <b>r</b> the one for
+ * the interval containing <b>present</b>, forgetting the buckets that aged
+ * out on the way. */
+static void
+replaycache_rotate(time_t present, replaycache_t *r)
+{
+  replaycache_bucket_t *cur = &r->buckets[r->cur_bucket];
+  time_t n_steps;
+
+  /* If we're never expiring, there is nothing to rotate. */
+  if (r->horizon == 0)
+    return;
+
+  if (cur->start == 0 || present - cur->start >=
+      (time_t) r->n_buckets * r->bucket_width) {
+    /* Everything aged out, or this is the first time: start afresh. */
+    int i;
+    for (i = 0; i < r->n_buckets; ++i) {
+      replaycache_bucket_clear(r, &r->buckets[i]);
+      r->buckets[i].start = 0;
+    }
+    cur->start = present;
+    return;
+  }
+
+  /* If the clock jumped backwards, n_steps is negative and we just keep
+   * adding to the current bucket. */
+  for (n_steps = (present - cur->start) / r->bucket_width; n_steps > 0;
+       --n_steps) {
+    time_t start = cur->start + r->bucket_width;
+    r->cur_bucket = (r->cur_bucket + 1) % r->n_buckets;
+    cur = &r->buckets[r->cur_bucket];
+    replaycache_bucket_clear(r, cur);
+    cur->start = start;
+  }
+}
+
 /** Test the buffer of length len point to by data against the replay cache r;
  * the digest of the buffer will be added to the cache at the current time,
  * and the function will return 1 if it was already seen within the cache's
@@ -13,6 +13,18 @@ typedef struct replaycache_s replaycache_t;
 
 #ifdef REPLAYCACHE_PRIVATE
 
+/* The digests first seen during one interval of a bucketed replay cache. */
+typedef struct replaycache_bucket_t {
+  /* Start of the interval. */
+  time_t start;
+  /* Open addressing table of fingerprints, with 0 marking empty slots. Its
+   * size is a power of two, or zero when the bucket is empty. */
+  uint64_t *fps;
+  uint32_t capacity;
+  /* Number of fingerprints in the table. */
+  uint32_t n_entries;
+} replaycache_bucket_t;
+
 struct replaycache_s {
   /* Scrub interval */
   time_t scrub_interval;
@@ -27,6 +39,19 @@ struct replaycache_s {
    * Digest map: keys are digests, values are times the digest was last seen
    */
   digest256map_t *digests_seen;
+
+  /*
+   * Bucketed caches only (digests_seen is NULL): a ring of n_buckets buckets
+   * of bucket_width seconds each. We add to the one at cur_bucket, and the
+   * one after it is the oldest.
+   */
+  replaycache_bucket_t *buckets;
+  int n_buckets;
+  int cur_bucket;
+  time_t bucket_width;
+  /* Most fingerprints we keep, and how many we have, in all buckets. */
+  size_t max_entries;
+  size_t n_entries;
 };
 
 #endif /* defined(REPLAYCACHE_PRIVATE) */
@@ -37,6 +62,9 @@ void replaycache_free_(replaycache_t *r);
 #define replaycache_free(r) \
   FREE_AND_NULL(replaycache_t, replaycache_free_, (r))
 replaycache_t * replaycache_new(time_t horizon, time_t interval);
+replaycache_t *replaycache_new_bucketed(time_t horizon, int n_buckets,
+                                        size_t max_entries);
+int replaycache_is_full(const replaycache_t *r);
 
 #ifdef REPLAYCACHE_PRIVATE
 
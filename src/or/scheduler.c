@@ -9,6 +9,8 @@
 #define SCHEDULER_KIST_PRIVATE
 #include "or/scheduler.h"
 #include "or/main.h"
+#include "or/rephist.h"
+#include "lib/trace/events.h"
 #include "common/buffers.h"
 #define TOR_CHANNEL_INTERNAL_
 #include "or/channeltls.h"
@@ -388,7 +390,24 @@ scheduler_set_channel_state(channel_t *chan, int new_state)
       chan->global_identifier,
       get_scheduler_state_string(chan->scheduler_state),
       get_scheduler_state_string(new_state));
+  tor_trace(scheduler, chan_state, chan->global_identifier,
+            chan->scheduler_state, new_state);
   chan->scheduler_state = new_state;
+  if (new_state == SCHED_CHAN_PENDING)
+    chan->sched_pending_since = monotime_coarse_get_stamp();
+}
+
+/** Called by the scheduler implementations when they take the pending
+ * channel <b>chan</b> off the pending list to service it: record how long
+ * it waited. */
+void
+scheduler_note_channel_serviced(const channel_t *chan)
+{
+  const uint32_t now = monotime_coarse_get_stamp();
+  const uint32_t msec = (uint32_t) monotime_coarse_stamp_units_to_approx_msec(
+                                      now - chan->sched_pending_since);
+  tor_trace(scheduler, chan_serviced, chan->global_identifier, msec);
+  rep_hist_note_cell_latency(CELL_LATENCY_SCHEDULER, msec);
 }
 
 /** Return the pending channel list. */
@@ -13,6 +13,7 @@
 #include "or/channeltls.h"
 #define SCHEDULER_PRIVATE_
 #include "or/scheduler.h"
+#include "lib/trace/events.h"
 
 #include "or/or_connection_st.h"
 
@@ -290,6 +291,8 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
+  tor_trace(scheduler, kist_limit, ent->chan->global_identifier, ent->cwnd,
+            ent->unacked, ent->notsent, ent->limit);
   return;
 
 #else /* !(defined(HAVE_KIST_SUPPORT)) */
@@ -451,6 +454,7 @@ MOCK_IMPL(void, channel_write_to_kernel, (channel_t *chan))
   log_debug(LD_SCHED, "Writing %lu bytes to kernel for chan %" PRIu64,
             (unsigned long)channel_outbuf_length(chan),
             chan->global_identifier);
+  tor_trace(scheduler, kist_write_to_kernel, chan->global_identifier);
   connection_handle_write(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn), 0);
 }
 
@@ -592,6 +596,7 @@ kist_scheduler_run(void)
        */
       continue;
     }
+    scheduler_note_channel_serviced(chan);
     outbuf_table_add(&outbuf_table, chan);
 
     /* if we have switched to a new channel, consider writing the previous
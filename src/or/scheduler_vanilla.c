@@ -67,6 +67,7 @@ vanilla_scheduler_run(void)
        */
       continue;
     }
+    scheduler_note_channel_serviced(chan);
 
     /* Figure out how many cells we can write */
     n_cells = channel_num_cells_writeable(chan);
@@ -15,6 +15,7 @@
 #define STATUS_PRIVATE
 
 #include "or/or.h"
+#include "common/profiler.h"
 #include "or/circuituse.h"
 #include "or/config.h"
 #include "or/status.h"
@@ -27,8 +28,10 @@
 #include "or/hibernate.h"
 #include "or/statefile.h"
 #include "or/hs_stats.h"
+#include "or/hs_cache.h"
 #include "or/hs_service.h"
 #include "or/dos.h"
+#include "or/onion.h"
 
 #include "or/routerinfo_st.h"
 
@@ -107,6 +110,13 @@ log_onion_service_stats(void)
              hs_stats_get_n_introduce2_v2_cells(),
              hs_stats_get_n_introduce2_v3_cells(),
              hs_stats_get_n_rendezvous_launches());
+  if (hs_stats_get_n_introduce2_dropped()) {
+    log_notice(LD_HEARTBEAT,
+               "Our onion service%s dropped %u v3 INTRODUCE2 cells because "
+               "they were arriving faster than we could process them.",
+               num_services == 1 ? "" : "s",
+               hs_stats_get_n_introduce2_dropped());
+  }
 }
 
 /** Log a "heartbeat" message describing Tor's status and history so that the
@@ -168,10 +178,17 @@ log_heartbeat(time_t now)
 
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
+    onion_queue_log_heartbeat();
     rep_hist_log_link_protocol_counts();
+    rep_hist_log_cell_latency();
     dos_log_heartbeat();
   }
 
+  if (dir_server_mode(options)) {
+    hs_cache_dir_log_heartbeat();
+  }
+  hs_cache_client_log_heartbeat();
+
   circuit_log_ancient_one_hop_circuits(1800);
 
   if (options->BridgeRelay) {
@@ -196,6 +213,13 @@ log_heartbeat(time_t now)
          U64_PRINTF_ARG(main_loop_idle_count));
   }
 
+  {
+    char *msg = profiler_format_heartbeat();
+    if (msg)
+      log_notice(LD_HEARTBEAT, "%s", msg);
+    tor_free(msg);
+  }
+
   /** Now, if we are an HS service, log some stats about our usage */
   log_onion_service_stats();
 
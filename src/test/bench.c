@@ -8,6 +8,7 @@
  * \brief Benchmarks for lower level Tor modules.
  **/
 
+#define TOR_CHANNEL_INTERNAL_
 #include "orconfig.h"
 
 #include "or/or.h"
@@ -25,9 +26,39 @@
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "or/consdiff.h"
+#include "or/geoip.h"
+#include "common/address_set.h"
+#include "or/policies.h"
+#include "or/replaycache.h"
+#include "or/routerlist.h"
+#include "or/routerparse.h"
+#include "siphash.h"
+
+#include "common/buffers.h"
+#include "common/compat_libevent.h"
+#include "or/channel.h"
+#include "or/channeltls.h"
+#include "or/circuitlist.h"
+#include "or/command.h"
+#include "or/connection.h"
+#include "or/connection_or.h"
+#include "or/scheduler.h"
 
 #include "or/cell_st.h"
 #include "or/or_circuit_st.h"
+#include "or/or_connection_st.h"
+
+#include <event2/event.h>
+#include <math.h>
+
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+DISABLE_GCC_WARNING(overlength-strings)
+/* We allow huge string constants in the benchmarks, as in the unit tests. */
+#endif
+#include "test_descriptors.inc"
+#ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
+ENABLE_GCC_WARNING(overlength-strings)
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -77,549 +108,2452 @@ perftime(void)
 #define NANOCOUNT(start,end,iters) \
   ( ((double)((end)-(start))) / (iters) )
 
-#define MICROCOUNT(start,end,iters) \
-  ( NANOCOUNT((start), (end), (iters)) / 1000.0 )
+/* The statistical harness.
+ *
+ * Each benchmark below runs its cases with bench_run_case(), which gives
+ * each case one warmup run and bench_n_reps timed runs, and reports the
+ * median time per operation, which outliers don't skew, along with its
+ * spread.  (bench_hashtable, which compares table designs at several
+ * sizes, still times a single run of each loop.)  We keep every case's
+ * result, so that we can write them all as JSON with --json, and compare
+ * them to a saved JSON file with --baseline. */
+
+/** A case for bench_run_case(): perform <b>iters</b> operations with
+ * <b>arg</b>, and return a value that depends on their results, so that
+ * the compiler can't optimize them away. */
+typedef uint64_t (*bench_case_fn)(void *arg, int iters);
+
+/** What we measured for one case of the statistical harness.  All times
+ * are in nsec per operation. */
+typedef struct bench_result_t {
+  char *name;
+  int n_samples;
+  /** Number of samples more than BENCH_OUTLIER_MADS scaled MADs from the
+   * median. */
+  int n_outliers;
+  double median;
+  /** Median absolute deviation from the median. */
+  double mad;
+  /** Mean of the samples that are not outliers. */
+  double mean;
+  double min;
+  double max;
+} bench_result_t;
+
+/** How many times we run each case after its warmup run. */
+static int bench_n_reps = 10;
+/** A list of bench_result_t for every case that we have run. */
+static smartlist_t *bench_results = NULL;
+/** Sum of the values that our cases return. */
+static volatile uint64_t bench_sink = 0;
+
+/** A sample is an outlier when it is further than this many scaled MADs
+ * from the median. */
+#define BENCH_OUTLIER_MADS 3.0
+/** Multiply a MAD by this to estimate the standard deviation of a normal
+ * distribution. */
+#define BENCH_MAD_SCALE 1.4826
+
+/** Helper for sorting doubles. */
+static int
+compare_doubles_(const void *a_, const void *b_)
+{
+  const double a = *(const double *)a_, b = *(const double *)b_;
+  return (a > b) - (a < b);
+}
+
+/** Return the median of the <b>n</b> sorted values in <b>v</b>. */
+static double
+sorted_median(const double *v, int n)
+{
+  tor_assert(n > 0);
+  if (n & 1)
+    return v[n/2];
+  return (v[n/2 - 1] + v[n/2]) / 2;
+}
 
-/** Run AES performance benchmarks. */
+/** Fill in the statistics of <b>result</b> from the <b>n</b> samples in
+ * <b>samples</b>, sorting them as a side effect. */
 static void
-bench_aes(void)
+bench_compute_stats(bench_result_t *result, double *samples, int n)
+{
+  double *devs = tor_calloc(n, sizeof(double));
+  double limit, sum = 0;
+  int i, n_kept = 0;
+
+  qsort(samples, n, sizeof(double), compare_doubles_);
+  result->n_samples = n;
+  result->median = sorted_median(samples, n);
+  result->min = samples[0];
+  result->max = samples[n-1];
+
+  for (i = 0; i < n; ++i)
+    devs[i] = fabs(samples[i] - result->median);
+  qsort(devs, n, sizeof(double), compare_doubles_);
+  result->mad = sorted_median(devs, n);
+  tor_free(devs);
+
+  limit = BENCH_OUTLIER_MADS * BENCH_MAD_SCALE * result->mad;
+  for (i = 0; i < n; ++i) {
+    if (result->mad > 0 && fabs(samples[i] - result->median) > limit)
+      continue;
+    sum += samples[i];
+    ++n_kept;
+  }
+  result->n_outliers = n - n_kept;
+  result->mean = sum / n_kept;
+}
+
+/** Run the case <b>fn</b> once to warm up, and then bench_n_reps times,
+ * timing <b>iters</b> operations each time.  Print the result, and save it
+ * under <b>name</b>. */
+static void
+bench_run_case(const char *name, bench_case_fn fn, void *arg, int iters)
 {
-  int len, i;
-  char *b1, *b2;
-  crypto_cipher_t *c;
+  double *samples = tor_calloc(bench_n_reps, sizeof(double));
+  bench_result_t *result = tor_malloc_zero(sizeof(bench_result_t));
   uint64_t start, end;
-  const int bytes_per_iter = (1<<24);
-  reset_perftime();
-  char key[CIPHER_KEY_LEN];
-  crypto_rand(key, sizeof(key));
-  c = crypto_cipher_new(key);
+  int i;
 
-  for (len = 1; len <= 8192; len *= 2) {
-    int iters = bytes_per_iter / len;
-    b1 = tor_malloc_zero(len);
-    b2 = tor_malloc_zero(len);
+  bench_sink += fn(arg, iters);
+  reset_perftime();
+  for (i = 0; i < bench_n_reps; ++i) {
     start = perftime();
-    for (i = 0; i < iters; ++i) {
-      crypto_cipher_encrypt(c, b1, b2, len);
-    }
+    bench_sink += fn(arg, iters);
     end = perftime();
-    tor_free(b1);
-    tor_free(b2);
-    printf("%d bytes: %.2f nsec per byte\n", len,
-           NANOCOUNT(start, end, iters*len));
+    samples[i] = NANOCOUNT(start, end, iters);
   }
-  crypto_cipher_free(c);
+
+  result->name = tor_strdup(name);
+  bench_compute_stats(result, samples, bench_n_reps);
+  tor_free(samples);
+
+  printf("%s: %.2f ns per op (MAD %.2f, mean %.2f, min %.2f, max %.2f, "
+         "%d/%d outliers)\n",
+         name, result->median, result->mad, result->mean, result->min,
+         result->max, result->n_outliers, result->n_samples);
+  if (!bench_results)
+    bench_results = smartlist_new();
+  smartlist_add(bench_results, result);
 }
 
+/** Release the storage held by <b>result</b>. */
 static void
-bench_onion_TAP(void)
+bench_result_free_(bench_result_t *result)
+{
+  if (!result)
+    return;
+  tor_free(result->name);
+  tor_free(result);
+}
+#define bench_result_free(r) \
+  FREE_AND_NULL(bench_result_t, bench_result_free_, (r))
+
+/** Write every result that we have to <b>fname</b> as JSON.  Each result
+ * goes on a line of its own, which is what bench_load_baseline() expects.
+ * Return 0 on success, -1 on failure. */
+static int
+bench_write_json(const char *fname)
+{
+  smartlist_t *lines = smartlist_new();
+  char *json;
+  int r;
+
+  smartlist_add_asprintf(lines, "{\n  \"tor_version\": \"%s\",\n"
+                         "  \"reps\": %d,\n  \"results\": [\n",
+                         VERSION, bench_n_reps);
+  if (bench_results) {
+    SMARTLIST_FOREACH_BEGIN(bench_results, const bench_result_t *, res) {
+      smartlist_add_asprintf(lines,
+               "    {\"name\": \"%s\", \"median_ns\": %.3f, "
+               "\"mad_ns\": %.3f, \"mean_ns\": %.3f, \"min_ns\": %.3f, "
+               "\"max_ns\": %.3f, \"samples\": %d, \"outliers\": %d}%s\n",
+               res->name, res->median, res->mad, res->mean, res->min,
+               res->max, res->n_samples, res->n_outliers,
+               res_sl_idx + 1 < res_sl_len ? "," : "");
+    } SMARTLIST_FOREACH_END(res);
+  }
+  smartlist_add_strdup(lines, "  ]\n}\n");
+
+  json = smartlist_join_strings(lines, "", 0, NULL);
+  r = write_str_to_file(fname, json, 0);
+  tor_free(json);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return r;
+}
+
+/** Return the number that follows <b>key</b> in <b>line</b>, or a negative
+ * number if there is none. */
+static double
+bench_json_get_number(const char *line, const char *key)
+{
+  const char *cp = strstr(line, key);
+  if (!cp)
+    return -1;
+  return strtod(cp + strlen(key), NULL);
+}
+
+/** Read the results in <b>fname</b>, which an earlier --json run wrote, and
+ * return them as a list of bench_result_t; or return NULL on failure. */
+static smartlist_t *
+bench_load_baseline(const char *fname)
+{
+  char *body = read_file_to_str(fname, 0, NULL);
+  smartlist_t *lines, *results;
+  if (!body)
+    return NULL;
+
+  lines = smartlist_new();
+  results = smartlist_new();
+  smartlist_split_string(lines, body, "\n",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    const char *name = strstr(line, "\"name\": \"");
+    const char *eos;
+    bench_result_t *res;
+    if (!name)
+      continue;
+    name += strlen("\"name\": \"");
+    eos = strchr(name, '"');
+    if (!eos)
+      continue;
+    res = tor_malloc_zero(sizeof(bench_result_t));
+    res->name = tor_strndup(name, eos - name);
+    res->median = bench_json_get_number(line, "\"median_ns\": ");
+    res->mad = bench_json_get_number(line, "\"mad_ns\": ");
+    if (res->median <= 0 || res->mad < 0) {
+      bench_result_free(res);
+      continue;
+    }
+    smartlist_add(results, res);
+  } SMARTLIST_FOREACH_END(line);
+
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(body);
+  return results;
+}
+
+/** Compare every result that we have to the one with the same name in
+ * <b>baseline</b>, and print what changed.  A case has regressed when its
+ * median is more than <b>threshold</b> percent slower than before, and the
+ * difference is bigger than the noise in the two runs.  Return the number
+ * of cases that regressed. */
+static int
+bench_compare_baseline(const smartlist_t *baseline, double threshold)
+{
+  int n_regressions = 0;
+
+  printf("===== comparison with baseline =====\n");
+  if (!bench_results)
+    return 0;
+  SMARTLIST_FOREACH_BEGIN(bench_results, const bench_result_t *, res) {
+    const bench_result_t *old = NULL;
+    double change, noise;
+    const char *verdict = "";
+    SMARTLIST_FOREACH(baseline, const bench_result_t *, b,
+                      if (!strcmp(b->name, res->name)) old = b);
+    if (!old) {
+      printf("%s: %.2f ns per op (not in baseline)\n",
+             res->name, res->median);
+      continue;
+    }
+    change = (res->median - old->median) / old->median * 100;
+    noise = 2 * BENCH_MAD_SCALE * (res->mad + old->mad);
+    if (fabs(res->median - old->median) > noise) {
+      if (change > threshold) {
+        verdict = "  REGRESSION";
+        ++n_regressions;
+      } else if (change < -threshold) {
+        verdict = "  improvement";
+      }
+    }
+    printf("%s: %.2f -> %.2f ns per op (%+.1f%%)%s\n", res->name,
+           old->median, res->median, change, verdict);
+  } SMARTLIST_FOREACH_END(res);
+  printf("%d regression(s) beyond %.1f%%\n", n_regressions, threshold);
+  return n_regressions;
+}
+
+/** Argument for the aes and cell_aes cases. */
+typedef struct bench_aes_arg_t {
+  crypto_cipher_t *cipher;
+  char *in;
+  char *out;
+  int len;
+} bench_aes_arg_t;
+
+/** Case for bench_aes: encrypt a buffer. */
+static uint64_t
+bench_aes_case(void *arg_, int iters)
 {
-  const int iters = 1<<9;
+  bench_aes_arg_t *arg = arg_;
   int i;
-  crypto_pk_t *key, *key2;
-  uint64_t start, end;
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_encrypt(arg->cipher, arg->out, arg->in, arg->len);
+  return (uint8_t)arg->out[0];
+}
+
+/** Run AES performance benchmarks. */
+static void
+bench_aes(void)
+{
+  char name[64];
+  char key[CIPHER_KEY_LEN];
+  const int bytes_per_iter = (1<<20);
+  bench_aes_arg_t arg;
+  int len;
+
+  crypto_rand(key, sizeof(key));
+  arg.cipher = crypto_cipher_new(key);
+
+  for (len = 1; len <= 8192; len *= 2) {
+    arg.in = tor_malloc_zero(len);
+    arg.out = tor_malloc_zero(len);
+    arg.len = len;
+    tor_snprintf(name, sizeof(name), "aes/encrypt(%d)", len);
+    bench_run_case(name, bench_aes_case, &arg, bytes_per_iter / len);
+    tor_free(arg.in);
+    tor_free(arg.out);
+  }
+  crypto_cipher_free(arg.cipher);
+}
+
+/** Argument for the onion_TAP cases. */
+typedef struct bench_tap_arg_t {
+  crypto_pk_t *key;
+  crypto_pk_t *key2;
+  crypto_dh_t *dh;
   char os[TAP_ONIONSKIN_CHALLENGE_LEN];
   char or[TAP_ONIONSKIN_REPLY_LEN];
-  crypto_dh_t *dh_out = NULL;
+} bench_tap_arg_t;
 
-  key = crypto_pk_new();
+/** Case for bench_onion_TAP: make the client's onionskin. */
+static uint64_t
+bench_onion_TAP_create_case(void *arg_, int iters)
+{
+  bench_tap_arg_t *arg = arg_;
+  char os[TAP_ONIONSKIN_CHALLENGE_LEN];
+  int i;
+  for (i = 0; i < iters; ++i) {
+    crypto_dh_t *dh = NULL;
+    onion_skin_TAP_create(arg->key, &dh, os);
+    crypto_dh_free(dh);
+  }
+  return (uint8_t)os[0];
+}
+
+/** Case for bench_onion_TAP: answer the onionskin with the right key first
+ * if <b>arg</b>->key2 is NULL, or the wrong key first otherwise. */
+static uint64_t
+bench_onion_TAP_server_case(void *arg_, int iters)
+{
+  bench_tap_arg_t *arg = arg_;
+  char key_out[CPATH_KEY_MATERIAL_LEN];
+  int i;
+  for (i = 0; i < iters; ++i) {
+    if (arg->key2)
+      onion_skin_TAP_server_handshake(arg->os, arg->key2, arg->key, arg->or,
+                                      key_out, sizeof(key_out));
+    else
+      onion_skin_TAP_server_handshake(arg->os, arg->key, NULL, arg->or,
+                                      key_out, sizeof(key_out));
+  }
+  return (uint8_t)key_out[0];
+}
+
+/** Case for bench_onion_TAP: finish the handshake at the client. */
+static uint64_t
+bench_onion_TAP_client_case(void *arg_, int iters)
+{
+  bench_tap_arg_t *arg = arg_;
+  char key_out[CPATH_KEY_MATERIAL_LEN];
+  int i;
+  for (i = 0; i < iters; ++i) {
+    crypto_dh_t *dh = crypto_dh_dup(arg->dh);
+    int s = onion_skin_TAP_client_handshake(dh, arg->or,
+                                            key_out, sizeof(key_out), NULL);
+    crypto_dh_free(dh);
+    tor_assert(s == 0);
+  }
+  return (uint8_t)key_out[0];
+}
+
+static void
+bench_onion_TAP(void)
+{
+  const int iters = 1<<6;
+  bench_tap_arg_t arg;
+  crypto_pk_t *key2;
+  char key_out[CPATH_KEY_MATERIAL_LEN];
+
+  memset(&arg, 0, sizeof(arg));
+  arg.key = crypto_pk_new();
   key2 = crypto_pk_new();
-  if (crypto_pk_generate_key_with_bits(key, 1024) < 0)
+  if (crypto_pk_generate_key_with_bits(arg.key, 1024) < 0)
     goto done;
   if (crypto_pk_generate_key_with_bits(key2, 1024) < 0)
     goto done;
 
-  reset_perftime();
-  start = perftime();
-  for (i = 0; i < iters; ++i) {
-    onion_skin_TAP_create(key, &dh_out, os);
-    crypto_dh_free(dh_out);
-  }
-  end = perftime();
-  printf("Client-side, part 1: %f usec.\n", NANOCOUNT(start, end, iters)/1e3);
+  bench_run_case("onion_TAP/client_create", bench_onion_TAP_create_case,
+                 &arg, iters);
 
-  onion_skin_TAP_create(key, &dh_out, os);
-  start = perftime();
+  onion_skin_TAP_create(arg.key, &arg.dh, arg.os);
+  onion_skin_TAP_server_handshake(arg.os, arg.key, NULL, arg.or,
+                                  key_out, sizeof(key_out));
+  bench_run_case("onion_TAP/server_right_key", bench_onion_TAP_server_case,
+                 &arg, iters);
+  arg.key2 = key2;
+  bench_run_case("onion_TAP/server_wrong_key", bench_onion_TAP_server_case,
+                 &arg, iters);
+  bench_run_case("onion_TAP/client_finish", bench_onion_TAP_client_case,
+                 &arg, iters);
+
+ done:
+  crypto_dh_free(arg.dh);
+  crypto_pk_free(arg.key);
+  crypto_pk_free(key2);
+}
+
+/** Argument for the onion_ntor cases. */
+typedef struct bench_ntor_arg_t {
+  curve25519_keypair_t keypair1, keypair2;
+  uint8_t nodeid[DIGEST_LEN];
+  di_digest256_map_t *keymap;
+  ntor_handshake_state_t *state;
+  uint8_t os[NTOR_ONIONSKIN_LEN];
+  uint8_t or[NTOR_REPLY_LEN];
+} bench_ntor_arg_t;
+
+/** Case for bench_onion_ntor: make the client's onionskin. */
+static uint64_t
+bench_onion_ntor_create_case(void *arg_, int iters)
+{
+  bench_ntor_arg_t *arg = arg_;
+  uint8_t os[NTOR_ONIONSKIN_LEN];
+  int i;
   for (i = 0; i < iters; ++i) {
-    char key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_TAP_server_handshake(os, key, NULL, or,
-                                    key_out, sizeof(key_out));
+    ntor_handshake_state_t *state = NULL;
+    onion_skin_ntor_create(arg->nodeid, &arg->keypair1.pubkey, &state, os);
+    ntor_handshake_state_free(state);
   }
-  end = perftime();
-  printf("Server-side, key guessed right: %f usec\n",
-         NANOCOUNT(start, end, iters)/1e3);
+  return os[0];
+}
 
-  start = perftime();
+/** Case for bench_onion_ntor: answer the onionskin. */
+static uint64_t
+bench_onion_ntor_server_case(void *arg_, int iters)
+{
+  bench_ntor_arg_t *arg = arg_;
+  uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+  int i;
   for (i = 0; i < iters; ++i) {
-    char key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_TAP_server_handshake(os, key2, key, or,
-                                    key_out, sizeof(key_out));
+    onion_skin_ntor_server_handshake(arg->os, arg->keymap, NULL, arg->nodeid,
+                                     arg->or, key_out, sizeof(key_out));
   }
-  end = perftime();
-  printf("Server-side, key guessed wrong: %f usec.\n",
-         NANOCOUNT(start, end, iters)/1e3);
+  return key_out[0];
+}
 
-  start = perftime();
+/** Case for bench_onion_ntor: finish the handshake at the client. */
+static uint64_t
+bench_onion_ntor_client_case(void *arg_, int iters)
+{
+  bench_ntor_arg_t *arg = arg_;
+  uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+  int i;
   for (i = 0; i < iters; ++i) {
-    crypto_dh_t *dh;
-    char key_out[CPATH_KEY_MATERIAL_LEN];
-    int s;
-    dh = crypto_dh_dup(dh_out);
-    s = onion_skin_TAP_client_handshake(dh, or, key_out, sizeof(key_out),
-                                        NULL);
-    crypto_dh_free(dh);
+    int s = onion_skin_ntor_client_handshake(arg->state, arg->or,
+                                             key_out, sizeof(key_out), NULL);
     tor_assert(s == 0);
   }
-  end = perftime();
-  printf("Client-side, part 2: %f usec.\n",
-         NANOCOUNT(start, end, iters)/1e3);
-
- done:
-  crypto_dh_free(dh_out);
-  crypto_pk_free(key);
-  crypto_pk_free(key2);
+  return key_out[0];
 }
 
 static void
-bench_onion_ntor_impl(void)
+bench_onion_ntor(void)
 {
   const int iters = 1<<10;
+  bench_ntor_arg_t arg;
+  char name[64];
+  int ed;
+
+  memset(&arg, 0, sizeof(arg));
+  curve25519_keypair_generate(&arg.keypair1, 0);
+  curve25519_keypair_generate(&arg.keypair2, 0);
+  dimap_add_entry(&arg.keymap, arg.keypair1.pubkey.public_key,
+                  &arg.keypair1);
+  dimap_add_entry(&arg.keymap, arg.keypair2.pubkey.public_key,
+                  &arg.keypair2);
+  crypto_rand((char *)arg.nodeid, sizeof(arg.nodeid));
+  onion_skin_ntor_create(arg.nodeid, &arg.keypair1.pubkey, &arg.state,
+                         arg.os);
+
+  /* Compare the plain basepoint multiply with the Ed25519-based one. */
+  for (ed = 0; ed <= 1; ++ed) {
+    curve25519_set_impl_params(ed);
+    tor_snprintf(name, sizeof(name), "onion_ntor/client_create(ed=%d)", ed);
+    bench_run_case(name, bench_onion_ntor_create_case, &arg, iters);
+    tor_snprintf(name, sizeof(name), "onion_ntor/server(ed=%d)", ed);
+    bench_run_case(name, bench_onion_ntor_server_case, &arg, iters);
+    tor_snprintf(name, sizeof(name), "onion_ntor/client_finish(ed=%d)", ed);
+    bench_run_case(name, bench_onion_ntor_client_case, &arg, iters);
+  }
+
+  ntor_handshake_state_free(arg.state);
+  dimap_free(arg.keymap, NULL);
+}
+
+/** Argument for the ed25519 cases. */
+typedef struct bench_ed25519_arg_t {
+  ed25519_keypair_t kp;
+  curve25519_keypair_t curve_kp;
+  ed25519_signature_t sig;
+} bench_ed25519_arg_t;
+
+/** A message for the ed25519 cases to sign and blind with. */
+static const uint8_t bench_ed25519_msg[] =
+  "but leaving, could not tell what they had heard";
+
+/** Case for bench_ed25519: compute a public key. */
+static uint64_t
+bench_ed25519_pubkey_case(void *arg_, int iters)
+{
+  bench_ed25519_arg_t *arg = arg_;
   int i;
-  curve25519_keypair_t keypair1, keypair2;
-  uint64_t start, end;
-  uint8_t os[NTOR_ONIONSKIN_LEN];
-  uint8_t or[NTOR_REPLY_LEN];
-  ntor_handshake_state_t *state = NULL;
-  uint8_t nodeid[DIGEST_LEN];
-  di_digest256_map_t *keymap = NULL;
+  for (i = 0; i < iters; ++i)
+    ed25519_public_key_generate(&arg->kp.pubkey, &arg->kp.seckey);
+  return arg->kp.pubkey.pubkey[0];
+}
+
+/** Case for bench_ed25519: sign a short message. */
+static uint64_t
+bench_ed25519_sign_case(void *arg_, int iters)
+{
+  bench_ed25519_arg_t *arg = arg_;
+  int i;
+  for (i = 0; i < iters; ++i)
+    ed25519_sign(&arg->sig, bench_ed25519_msg, sizeof(bench_ed25519_msg),
+                 &arg->kp);
+  return arg->sig.sig[0];
+}
+
+/** Case for bench_ed25519: check a signature. */
+static uint64_t
+bench_ed25519_verify_case(void *arg_, int iters)
+{
+  bench_ed25519_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    n += ed25519_checksig(&arg->sig, bench_ed25519_msg,
+                          sizeof(bench_ed25519_msg), &arg->kp.pubkey);
+  return n;
+}
+
+/** Case for bench_ed25519: convert a curve25519 public key. */
+static uint64_t
+bench_ed25519_convert_case(void *arg_, int iters)
+{
+  bench_ed25519_arg_t *arg = arg_;
+  ed25519_public_key_t pubkey;
+  int i;
+  for (i = 0; i < iters; ++i)
+    ed25519_public_key_from_curve25519_public_key(&pubkey,
+                                                  &arg->curve_kp.pubkey, 1);
+  return pubkey.pubkey[0];
+}
+
+/** Case for bench_ed25519: blind a public key. */
+static uint64_t
+bench_ed25519_blind_case(void *arg_, int iters)
+{
+  bench_ed25519_arg_t *arg = arg_;
+  ed25519_public_key_t pubkey;
+  int i;
+  for (i = 0; i < iters; ++i)
+    ed25519_public_blind(&pubkey, &arg->kp.pubkey, bench_ed25519_msg);
+  return pubkey.pubkey[0];
+}
+
+static void
+bench_ed25519(void)
+{
+  const int iters = 1<<12;
+  bench_ed25519_arg_t arg;
+  char name[64];
+  int donna;
+
+  ed25519_secret_key_generate(&arg.kp.seckey, 0);
+  ed25519_public_key_generate(&arg.kp.pubkey, &arg.kp.seckey);
+  curve25519_keypair_generate(&arg.curve_kp, 0);
+
+  for (donna = 0; donna <= 1; ++donna) {
+    ed25519_set_impl_params(donna);
+#define ED_CASE(label, fn) do {                                         \
+      tor_snprintf(name, sizeof(name), "ed25519/" label "(donna=%d)",   \
+                   donna);                                              \
+      bench_run_case(name, (fn), &arg, iters);                          \
+    } while (0)
+    ED_CASE("pubkey", bench_ed25519_pubkey_case);
+    ED_CASE("sign", bench_ed25519_sign_case);
+    ED_CASE("verify", bench_ed25519_verify_case);
+    ED_CASE("convert_from_curve25519", bench_ed25519_convert_case);
+    ED_CASE("blind", bench_ed25519_blind_case);
+#undef ED_CASE
+  }
+}
+
+/** Case for bench_cell_aes: encrypt a cell's payload in place. */
+static uint64_t
+bench_cell_aes_case(void *arg_, int iters)
+{
+  bench_aes_arg_t *arg = arg_;
+  int i;
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_crypt_inplace(arg->cipher, arg->in, arg->len);
+  return (uint8_t)arg->in[0];
+}
+
+static void
+bench_cell_aes(void)
+{
+  const int len = 509;
+  const int iters = (1<<14);
+  const int max_misalign = 15;
+  char *b = tor_malloc_zero(len+max_misalign);
+  char name[64];
+  char key[CIPHER_KEY_LEN];
+  bench_aes_arg_t arg;
+  int misalign;
+
+  crypto_rand(key, sizeof(key));
+  arg.cipher = crypto_cipher_new(key);
+  arg.len = len;
+
+  for (misalign = 0; misalign <= max_misalign; ++misalign) {
+    arg.in = b + misalign;
+    tor_snprintf(name, sizeof(name), "cell_aes/misalign(%d)", misalign);
+    bench_run_case(name, bench_cell_aes_case, &arg, iters);
+  }
+
+  crypto_cipher_free(arg.cipher);
+  tor_free(b);
+}
+
+/** Argument for the dmap cases. */
+typedef struct bench_dmap_arg_t {
+  /** Keys that we add. */
+  smartlist_t *in;
+  /** Keys that we add, followed by as many that we don't. */
+  smartlist_t *both;
+  digestmap_t *dm;
+  digestset_t *ds;
+} bench_dmap_arg_t;
+
+/** Case for bench_dmap: set keys in a digestmap. */
+static uint64_t
+bench_dmap_set_case(void *arg_, int iters)
+{
+  bench_dmap_arg_t *arg = arg_;
+  const int n = smartlist_len(arg->in);
+  int i;
+  for (i = 0; i < iters; ++i)
+    digestmap_set(arg->dm, smartlist_get(arg->in, i % n), (void*)1);
+  return digestmap_size(arg->dm);
+}
+
+/** Case for bench_dmap: look up keys, half of them absent, in a
+ * digestmap. */
+static uint64_t
+bench_dmap_get_case(void *arg_, int iters)
+{
+  bench_dmap_arg_t *arg = arg_;
+  const int n = smartlist_len(arg->both);
+  uint64_t hits = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    hits += !! digestmap_get(arg->dm, smartlist_get(arg->both, i % n));
+  return hits;
+}
+
+/** Case for bench_dmap: add keys to a digestset. */
+static uint64_t
+bench_dmap_set_add_case(void *arg_, int iters)
+{
+  bench_dmap_arg_t *arg = arg_;
+  const int n = smartlist_len(arg->in);
+  int i;
+  for (i = 0; i < iters; ++i)
+    digestset_add(arg->ds, smartlist_get(arg->in, i % n));
+  return 0;
+}
+
+/** Case for bench_dmap: look up keys, half of them absent, in a
+ * digestset. */
+static uint64_t
+bench_dmap_set_contains_case(void *arg_, int iters)
+{
+  bench_dmap_arg_t *arg = arg_;
+  const int n = smartlist_len(arg->both);
+  uint64_t hits = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    hits += digestset_contains(arg->ds, smartlist_get(arg->both, i % n));
+  return hits;
+}
+
+/** Run digestmap_t performance benchmarks. */
+static void
+bench_dmap(void)
+{
+  const int iters = 1<<22;
+  const int elts = 4000;
+  const int fpostests = 100000;
+  bench_dmap_arg_t arg;
+  char d[20];
+  int i, fp = 0;
+
+  arg.in = smartlist_new();
+  arg.both = smartlist_new();
+  arg.dm = digestmap_new();
+  arg.ds = digestset_new(elts);
+  for (i = 0; i < elts * 2; ++i) {
+    char *key;
+    crypto_rand(d, 20);
+    key = tor_memdup(d, 20);
+    if (i < elts)
+      smartlist_add(arg.in, key);
+    smartlist_add(arg.both, key);
+  }
+  printf("nbits=%d\n", arg.ds->mask+1);
+
+  bench_run_case("dmap/digestmap_set", bench_dmap_set_case, &arg, iters);
+  bench_run_case("dmap/digestmap_get", bench_dmap_get_case, &arg, iters);
+  bench_run_case("dmap/digestset_add", bench_dmap_set_add_case, &arg, iters);
+  bench_run_case("dmap/digestset_contains", bench_dmap_set_contains_case,
+                 &arg, iters);
+
+  for (i = 0; i < fpostests; ++i) {
+    crypto_rand(d, 20);
+    if (digestset_contains(arg.ds, d)) ++fp;
+  }
+  printf("False positive rate on digestset: %.2f%%\n",
+         (fp/(double)fpostests)*100);
+
+  digestmap_free(arg.dm, NULL);
+  digestset_free(arg.ds);
+  SMARTLIST_FOREACH(arg.both, char *, cp, tor_free(cp));
+  smartlist_free(arg.in);
+  smartlist_free(arg.both);
+}
+
+/* An element of the hash tables that we compare in bench_hashtable(). */
+typedef struct bench_ht_ent_t {
+  HT_ENTRY(bench_ht_ent_t) node;
+  char key[DIGEST_LEN];
+  void *val;
+} bench_ht_ent_t;
+typedef struct bench_oaht_ent_t {
+  char key[DIGEST_LEN];
+  void *val;
+} bench_oaht_ent_t;
+
+static inline unsigned
+bench_ht_ent_hash(const bench_ht_ent_t *ent)
+{
+  return (unsigned) siphash24g(ent->key, DIGEST_LEN);
+}
+static inline int
+bench_ht_ent_eq(const bench_ht_ent_t *a, const bench_ht_ent_t *b)
+{
+  return fast_memeq(a->key, b->key, DIGEST_LEN);
+}
+static inline unsigned
+bench_oaht_ent_hash(const bench_oaht_ent_t *ent)
+{
+  return (unsigned) siphash24g(ent->key, DIGEST_LEN);
+}
+static inline int
+bench_oaht_ent_eq(const bench_oaht_ent_t *a, const bench_oaht_ent_t *b)
+{
+  return fast_memeq(a->key, b->key, DIGEST_LEN);
+}
+
+static HT_HEAD(bench_ht, bench_ht_ent_t) bench_ht = HT_INITIALIZER();
+HT_PROTOTYPE(bench_ht, bench_ht_ent_t, node, bench_ht_ent_hash,
+             bench_ht_ent_eq)
+HT_GENERATE2(bench_ht, bench_ht_ent_t, node, bench_ht_ent_hash,
+             bench_ht_ent_eq, 0.6, tor_reallocarray_, tor_free_)
+
+static OAHT_HEAD(bench_oaht, bench_oaht_ent_t) bench_oaht =
+  OAHT_INITIALIZER();
+OAHT_PROTOTYPE(bench_oaht, bench_oaht_ent_t, bench_oaht_ent_hash,
+               bench_oaht_ent_eq)
+OAHT_GENERATE(bench_oaht, bench_oaht_ent_t, bench_oaht_ent_hash,
+              bench_oaht_ent_eq, 0.75, tor_reallocarray_, tor_free_)
+
+/** Compare the chained HT_ hash tables with the open-addressing OAHT_ ones,
+ * for insertions, lookups (half of them misses), and removals of digest
+ * keys.  The memory figures don't count malloc's own overhead for each
+ * HT_ element. */
+static void
+bench_hashtable(void)
+{
+  const int sizes[] = { 1000, 10000, 100000, 1000000 };
+  unsigned s;
+
+  reset_perftime();
+
+  for (s = 0; s < ARRAY_LENGTH(sizes); ++s) {
+    const int n = sizes[s];
+    const int iters = 2000000 / n + 1;
+    char *keys = tor_calloc(2 * n, DIGEST_LEN);
+    uint64_t start, pt2, pt3, end;
+    size_t ht_mem, oaht_mem;
+    int i, it, hits = 0;
 
-  curve25519_secret_key_generate(&keypair1.seckey, 0);
-  curve25519_public_key_generate(&keypair1.pubkey, &keypair1.seckey);
-  curve25519_secret_key_generate(&keypair2.seckey, 0);
-  curve25519_public_key_generate(&keypair2.pubkey, &keypair2.seckey);
-  dimap_add_entry(&keymap, keypair1.pubkey.public_key, &keypair1);
-  dimap_add_entry(&keymap, keypair2.pubkey.public_key, &keypair2);
-  crypto_rand((char *)nodeid, sizeof(nodeid));
+    crypto_rand(keys, 2 * n * DIGEST_LEN);
+
+    printf("%d entries:\n", n);
+
+    start = perftime();
+    ht_mem = 0;
+    for (it = 0; it < iters; ++it) {
+      for (i = 0; i < n; ++i) {
+        bench_ht_ent_t *ent = tor_malloc(sizeof(bench_ht_ent_t));
+        memcpy(ent->key, keys + i * DIGEST_LEN, DIGEST_LEN);
+        ent->val = ent;
+        HT_INSERT(bench_ht, &bench_ht, ent);
+      }
+      if (it == 0)
+        ht_mem = HT_MEM_USAGE(&bench_ht) + n * sizeof(bench_ht_ent_t);
+      if (it + 1 < iters) {
+        for (i = 0; i < n; ++i) {
+          bench_ht_ent_t search, *ent;
+          memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+          ent = HT_REMOVE(bench_ht, &bench_ht, &search);
+          tor_free(ent);
+        }
+      }
+    }
+    pt2 = perftime();
+    for (it = 0; it < iters; ++it) {
+      for (i = 0; i < 2 * n; ++i) {
+        bench_ht_ent_t search;
+        memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+        hits += HT_FIND(bench_ht, &bench_ht, &search) != NULL;
+      }
+    }
+    pt3 = perftime();
+    for (i = 0; i < n; ++i) {
+      bench_ht_ent_t search, *ent;
+      memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+      ent = HT_REMOVE(bench_ht, &bench_ht, &search);
+      tor_free(ent);
+    }
+    end = perftime();
+    HT_CLEAR(bench_ht, &bench_ht);
+    printf("  HT:   insert+remove %.2f ns, find %.2f ns, remove %.2f ns; "
+           "%.1f bytes per entry\n",
+           NANOCOUNT(start, pt2, iters * n), NANOCOUNT(pt2, pt3, iters*2*n),
+           NANOCOUNT(pt3, end, n), ((double)ht_mem) / n);
+
+    start = perftime();
+    oaht_mem = 0;
+    for (it = 0; it < iters; ++it) {
+      for (i = 0; i < n; ++i) {
+        bench_oaht_ent_t search, *ent;
+        int inserted;
+        memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+        search.val = NULL;
+        ent = OAHT_FIND_OR_INSERT(bench_oaht, &bench_oaht, &search,
+                                  &inserted);
+        tor_assert(ent);
+        ent->val = ent;
+      }
+      if (it == 0)
+        oaht_mem = OAHT_MEM_USAGE(bench_oaht, &bench_oaht);
+      if (it + 1 < iters) {
+        for (i = 0; i < n; ++i) {
+          bench_oaht_ent_t search;
+          memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+          OAHT_REMOVE(bench_oaht, &bench_oaht, &search, NULL);
+        }
+      }
+    }
+    pt2 = perftime();
+    for (it = 0; it < iters; ++it) {
+      for (i = 0; i < 2 * n; ++i) {
+        bench_oaht_ent_t search;
+        memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+        hits += OAHT_FIND(bench_oaht, &bench_oaht, &search) != NULL;
+      }
+    }
+    pt3 = perftime();
+    for (i = 0; i < n; ++i) {
+      bench_oaht_ent_t search;
+      memcpy(search.key, keys + i * DIGEST_LEN, DIGEST_LEN);
+      OAHT_REMOVE(bench_oaht, &bench_oaht, &search, NULL);
+    }
+    end = perftime();
+    OAHT_CLEAR(bench_oaht, &bench_oaht);
+    printf("  OAHT: insert+remove %.2f ns, find %.2f ns, remove %.2f ns; "
+           "%.1f bytes per entry\n",
+           NANOCOUNT(start, pt2, iters * n), NANOCOUNT(pt2, pt3, iters*2*n),
+           NANOCOUNT(pt3, end, n), ((double)oaht_mem) / n);
+
+    tor_free(keys);
+    /* We need to use this, or else the lookups get optimized out. */
+    printf("  Hits == %d\n", hits);
+  }
+}
+
+/** Argument for the siphash and digest cases. */
+typedef struct bench_hash_arg_t {
+  const char *buf;
+  int len;
+  digest_algorithm_t alg;
+} bench_hash_arg_t;
+
+/** Case for bench_siphash. */
+static uint64_t
+bench_siphash_case(void *arg_, int iters)
+{
+  const bench_hash_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    sum += siphash24g(arg->buf, arg->len);
+  return sum;
+}
+
+static void
+bench_siphash(void)
+{
+  char buf[128];
+  char name[64];
+  int lens[] = { 7, 8, 15, 16, 20, 32, 111, 128, -1 };
+  int i;
+  const int N = 100000;
+  bench_hash_arg_t arg;
+  crypto_rand(buf, sizeof(buf));
+
+  arg.buf = buf;
+  for (i = 0; lens[i] > 0; ++i) {
+    arg.len = lens[i];
+    tor_snprintf(name, sizeof(name), "siphash24g(%d)", lens[i]);
+    bench_run_case(name, bench_siphash_case, &arg, N);
+  }
+}
+
+/** Case for bench_digest. */
+static uint64_t
+bench_digest_case(void *arg_, int iters)
+{
+  const bench_hash_arg_t *arg = arg_;
+  char out[DIGEST512_LEN];
+  int i;
+  for (i = 0; i < iters; ++i) {
+    switch (arg->alg) {
+      case DIGEST_SHA1:
+        crypto_digest(out, arg->buf, arg->len);
+        break;
+      case DIGEST_SHA256:
+      case DIGEST_SHA3_256:
+        crypto_digest256(out, arg->buf, arg->len, arg->alg);
+        break;
+      case DIGEST_SHA512:
+      case DIGEST_SHA3_512:
+        crypto_digest512(out, arg->buf, arg->len, arg->alg);
+        break;
+      default:
+        tor_assert(0);
+    }
+  }
+  return (uint8_t)out[0];
+}
+
+static void
+bench_digest(void)
+{
+  char buf[8192];
+  char name[64];
+  const int lens[] = { 1, 16, 32, 64, 128, 512, 1024, 2048, -1 };
+  const int N = 30000;
+  bench_hash_arg_t arg;
+  crypto_rand(buf, sizeof(buf));
+
+  arg.buf = buf;
+  for (int alg = 0; alg < N_DIGEST_ALGORITHMS; alg++) {
+    for (int i = 0; lens[i] > 0; ++i) {
+      arg.alg = alg;
+      arg.len = lens[i];
+      tor_snprintf(name, sizeof(name), "%s(%d)",
+                   crypto_digest_algorithm_get_name(alg), lens[i]);
+      bench_run_case(name, bench_digest_case, &arg, N);
+    }
+  }
+}
+
+/** Argument for the cell_ops cases. */
+typedef struct bench_cell_ops_arg_t {
+  or_circuit_t *or_circ;
+  cell_t *cell;
+  cell_direction_t direction;
+} bench_cell_ops_arg_t;
+
+/** Case for bench_cell_ops: decrypt a cell at a relay. */
+static uint64_t
+bench_cell_ops_case(void *arg_, int iters)
+{
+  bench_cell_ops_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    char recognized = 0;
+    crypt_path_t *layer_hint = NULL;
+    relay_decrypt_cell(TO_CIRCUIT(arg->or_circ), arg->cell, arg->direction,
+                       &layer_hint, &recognized);
+    n += recognized;
+  }
+  return n;
+}
+
+static void
+bench_cell_ops(void)
+{
+  const int iters = 1<<16;
+  bench_cell_ops_arg_t arg;
+
+  /* benchmarks for cell ops at relay. */
+  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  cell_t *cell = tor_malloc(sizeof(cell_t));
+
+  crypto_rand((char*)cell->payload, sizeof(cell->payload));
+
+  /* Mock-up or_circuit_t */
+  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
+  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+
+  /* Initialize crypto */
+  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
+  crypto_rand(key1, sizeof(key1));
+  crypto_rand(key2, sizeof(key2));
+  or_circ->crypto.f_crypto = crypto_cipher_new(key1);
+  or_circ->crypto.b_crypto = crypto_cipher_new(key2);
+  or_circ->crypto.f_digest = crypto_digest_new();
+  or_circ->crypto.b_digest = crypto_digest_new();
+
+  arg.or_circ = or_circ;
+  arg.cell = cell;
+  arg.direction = CELL_DIRECTION_IN;
+  bench_run_case("cell_ops/inbound", bench_cell_ops_case, &arg, iters);
+  arg.direction = CELL_DIRECTION_OUT;
+  bench_run_case("cell_ops/outbound", bench_cell_ops_case, &arg, iters);
+
+  relay_crypto_clear(&or_circ->crypto);
+  tor_free(or_circ);
+  tor_free(cell);
+}
+
+/** Number of channels on each side of the relay in bench_relay_forward. */
+#define RF_N_CHANS 4
+/** Number of circuits on each inbound channel. */
+#define RF_CIRCS_PER_CHAN 16
+#define RF_N_CIRCS (RF_N_CHANS * RF_CIRCS_PER_CHAN)
+/** Number of cells that we write on each inbound channel before we let the
+ * relay process them. */
+#define RF_BATCH 32
+/** Number of cells that we relay on each circuit in each run. */
+#define RF_CELLS_PER_CIRC 1024
+#define RF_N_CELLS (RF_N_CIRCS * RF_CELLS_PER_CIRC)
+
+/** One side of a relay_forward connection: the connection that the relay
+ * uses, and the socket of the peer at the other end. */
+typedef struct rf_link_t {
+  or_connection_t *conn;
+  tor_socket_t peer;
+  /** Bytes that the peer has read, but not yet parsed into cells. */
+  buf_t *peer_buf;
+} rf_link_t;
+
+/** Wrap one end of a fresh socketpair in an open OR connection with a
+ * registered channel, as if it had finished its link handshake. */
+static void
+rf_link_init(rf_link_t *link)
+{
+  tor_socket_t fds[2];
+  channel_t *chan;
+  int r;
+
+  r = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  tor_assert(r == 0);
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+
+  link->conn = or_connection_new(CONN_TYPE_OR, AF_UNIX);
+  TO_CONN(link->conn)->s = fds[0];
+  TO_CONN(link->conn)->state = OR_CONN_STATE_OPEN;
+  link->conn->link_proto = MIN_LINK_PROTO_FOR_WIDE_CIRC_IDS;
+  link->conn->wide_circ_ids = 1;
+  link->peer = fds[1];
+  link->peer_buf = buf_new();
+
+  chan = channel_tls_handle_incoming(link->conn);
+  chan->wide_circ_ids = 1;
+  command_setup_channel(chan);
+  channel_change_state_open(chan);
+  /* Tell the scheduler that the channel can take cells. */
+  connection_or_flushed_some(link->conn);
+}
+
+/** Close the channel and the sockets of <b>link</b>, once its circuits are
+ * gone.  We leak the connection itself: freeing it needs the connection
+ * lists of the main loop, which we never set up. */
+static void
+rf_link_clear(rf_link_t *link)
+{
+  channel_tls_t *tlschan = link->conn->chan;
+
+  /* Detach the channel first, so that closing it doesn't try to close the
+   * connection through the main loop. */
+  tlschan->conn = NULL;
+  link->conn->chan = NULL;
+  channel_mark_for_close(TLS_CHAN_TO_BASE(tlschan));
+  tor_close_socket(TO_CONN(link->conn)->s);
+  TO_CONN(link->conn)->s = TOR_INVALID_SOCKET;
+  tor_close_socket(link->peer);
+  buf_free(link->peer_buf);
+}
+
+/** Helper for sorting latencies. */
+static int
+compare_int64_(const void *a_, const void *b_)
+{
+  const int64_t a = *(const int64_t *)a_, b = *(const int64_t *)b_;
+  return (a > b) - (a < b);
+}
+
+/** The relay, circuits and peers that bench_relay_forward uses for all of
+ * its runs. */
+typedef struct rf_state_t {
+  rf_link_t in[RF_N_CHANS];
+  rf_link_t out[RF_N_CHANS];
+  or_circuit_t *circs[RF_N_CIRCS];
+  struct event_base *base;
+  uint8_t payload[CELL_PAYLOAD_SIZE];
+  /** When we sent each cell of the current run, by circuit. */
+  monotime_t *sent_at;
+  /** The latency of each cell of the last run, in usec. */
+  int64_t *latency;
+  /** How many cells came out in the last run. */
+  int n_recv;
+  /** How long the last run took, in usec of wall time. */
+  int64_t wall_usec;
+} rf_state_t;
+
+/** Case for bench_relay_forward: relay <b>iters</b> cells, the same number
+ * on each circuit, and record their latencies. */
+static uint64_t
+bench_relay_forward_case(void *arg, int iters)
+{
+  rf_state_t *st = arg;
+  const int cells_per_circ = iters / RF_N_CIRCS;
+  const int n_cells = cells_per_circ * RF_N_CIRCS;
+  const size_t cell_size = get_cell_network_size(1);
+  int n_sent[RF_N_CIRCS], n_recv[RF_N_CIRCS], next_circ[RF_N_CHANS];
+  int total_sent = 0, total_recv = 0, n_idle_rounds = 0;
+  monotime_t start_wall, end_wall;
+  int i, j;
+
+  tor_assert(cells_per_circ <= RF_CELLS_PER_CIRC);
+  memset(n_sent, 0, sizeof(n_sent));
+  memset(n_recv, 0, sizeof(n_recv));
+  memset(next_circ, 0, sizeof(next_circ));
+  monotime_get(&start_wall);
+
+  while (total_recv < n_cells) {
+    int progress = 0;
+
+    /* The previous hops send a batch of cells on every inbound channel. */
+    for (i = 0; i < RF_N_CHANS; ++i) {
+      for (j = 0; j < RF_BATCH; ++j) {
+        const int k = i * RF_CIRCS_PER_CHAN + next_circ[i];
+        cell_t cell;
+        packed_cell_t packed;
+        next_circ[i] = (next_circ[i] + 1) % RF_CIRCS_PER_CHAN;
+        if (n_sent[k] == cells_per_circ)
+          continue;
+        memset(&cell, 0, sizeof(cell));
+        cell.circ_id = k + 1;
+        cell.command = CELL_RELAY;
+        memcpy(cell.payload, st->payload, sizeof(st->payload));
+        cell_pack(&packed, &cell, 1);
+        if (tor_socket_send(st->in[i].peer, packed.body, cell_size, 0) !=
+            (ssize_t)cell_size)
+          break;
+        monotime_get(&st->sent_at[k * RF_CELLS_PER_CIRC + n_sent[k]]);
+        ++n_sent[k];
+        ++total_sent;
+      }
+    }
+
+    /* The relay reads and relays them. */
+    for (i = 0; i < RF_N_CHANS; ++i) {
+      or_connection_t *conn = st->in[i].conn;
+      int eof = 0, err = 0;
+      if (buf_read_from_socket(conn->base_.inbuf, conn->base_.s, 1<<16,
+                               &eof, &err) > 0)
+        connection_or_process_inbuf(conn);
+    }
+    event_base_loop(st->base, EVLOOP_NONBLOCK);
+
+    /* The relay flushes its outbufs, and the next hops read the cells. */
+    for (i = 0; i < RF_N_CHANS; ++i) {
+      rf_link_t *out = &st->out[i];
+      connection_t *conn = TO_CONN(out->conn);
+      char body[CELL_MAX_NETWORK_SIZE];
+      int eof = 0, err = 0;
+      size_t len = buf_datalen(conn->outbuf);
+      if (len) {
+        int n = buf_flush_to_socket(conn->outbuf, conn->s, len,
+                                    &conn->outbuf_flushlen);
+        if (n > 0) {
+          connection_or_cell_latency_probe_flushed(out->conn, n);
+          connection_or_flushed_some(out->conn);
+        }
+      }
+      buf_read_from_socket(out->peer_buf, out->peer, 1<<16, &eof, &err);
+      while (buf_datalen(out->peer_buf) >= cell_size) {
+        monotime_t now;
+        uint32_t circ_id;
+        int k;
+        buf_get_bytes(out->peer_buf, body, cell_size);
+        circ_id = ntohl(get_uint32(body));
+        tor_assert(circ_id >= 1 && circ_id <= RF_N_CIRCS);
+        k = circ_id - 1;
+        tor_assert(n_recv[k] < n_sent[k]);
+        monotime_get(&now);
+        st->latency[total_recv++] =
+          monotime_diff_usec(&st->sent_at[k * RF_CELLS_PER_CIRC + n_recv[k]],
+                             &now);
+        ++n_recv[k];
+        progress = 1;
+      }
+    }
+
+    if (progress || total_sent < n_cells) {
+      n_idle_rounds = 0;
+    } else if (++n_idle_rounds > 1000) {
+      printf("Only %d of %d cells came out; giving up.\n",
+             total_recv, n_cells);
+      break;
+    }
+  }
+
+  monotime_get(&end_wall);
+  st->wall_usec = monotime_diff_usec(&start_wall, &end_wall);
+  st->n_recv = total_recv;
+  return total_recv;
+}
+
+/**
+ * Relay cells through the whole forwarding path of one relay, in this
+ * process: several inbound channels, each carrying several circuits that
+ * are spread over several outbound channels.  The peers write relay cells
+ * into socketpairs; the relay reads them from its inbuf, decrypts them,
+ * queues them on the circuitmux of the next channel, and lets the
+ * scheduler flush them to the outbuf; then we flush the outbuf to the
+ * socket with buf_flush_to_socket() and read the cells back at the next
+ * peer.
+ *
+ * The CPU time per cell includes the work of the peers.  There is no TLS
+ * on these connections; bench_aes and bench_cell_aes measure that part.
+ * We use the vanilla scheduler, since KIST writes to the kernel through
+ * TLS.  We report the throughput and the latencies of the last run.
+ */
+static void
+bench_relay_forward(void)
+{
+  rf_state_t *st = tor_malloc_zero(sizeof(rf_state_t));
+  tor_libevent_cfg cfg;
+  int i;
+
+  st->sent_at = tor_calloc(RF_N_CELLS, sizeof(monotime_t));
+  st->latency = tor_calloc(RF_N_CELLS, sizeof(int64_t));
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  st->base = tor_libevent_get_base();
+  if (!get_options()->SchedulerTypes_) {
+    int *type = tor_malloc_zero(sizeof(int));
+    *type = SCHEDULER_VANILLA;
+    get_options_mutable()->SchedulerTypes_ = smartlist_new();
+    smartlist_add(get_options_mutable()->SchedulerTypes_, type);
+  }
+  scheduler_init();
+  /* We never validated our options, so we have no queue limit yet. */
+  if (!get_options()->MaxMemInQueues)
+    get_options_mutable()->MaxMemInQueues = 1<<30;
+
+  for (i = 0; i < RF_N_CHANS; ++i) {
+    rf_link_init(&st->in[i]);
+    rf_link_init(&st->out[i]);
+  }
+
+  /* Circuit k comes in on channel k / RF_CIRCS_PER_CHAN, and leaves on
+   * channel k % RF_N_CHANS.  We use k+1 as its ID on both sides, so that
+   * we can tell which circuit each cell that we read back is on. */
+  for (i = 0; i < RF_N_CIRCS; ++i) {
+    char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
+    channel_t *p_chan =
+      TLS_CHAN_TO_BASE(st->in[i / RF_CIRCS_PER_CHAN].conn->chan);
+    channel_t *n_chan = TLS_CHAN_TO_BASE(st->out[i % RF_N_CHANS].conn->chan);
+    or_circuit_t *circ = or_circuit_new(i + 1, p_chan);
+
+    crypto_rand(key1, sizeof(key1));
+    crypto_rand(key2, sizeof(key2));
+    circ->crypto.f_crypto = crypto_cipher_new(key1);
+    circ->crypto.b_crypto = crypto_cipher_new(key2);
+    circ->crypto.f_digest = crypto_digest_new();
+    circ->crypto.b_digest = crypto_digest_new();
+    circuit_set_n_circid_chan(TO_CIRCUIT(circ), i + 1, n_chan);
+    st->circs[i] = circ;
+  }
+
+  /* The content doesn't matter, since we never recognize the cells. */
+  crypto_rand((char*)st->payload, sizeof(st->payload));
+
+  bench_run_case("relay_forward/cell", bench_relay_forward_case, st,
+                 RF_N_CELLS);
+
+  if (st->n_recv) {
+    const int n = st->n_recv;
+    qsort(st->latency, n, sizeof(int64_t), compare_int64_);
+    printf("%d cells on %d circuits over %d+%d channels\n",
+           n, RF_N_CIRCS, RF_N_CHANS, RF_N_CHANS);
+    printf("Throughput: %.0f cells/sec\n", n / (st->wall_usec / 1e6));
+    printf("Latency: p50 %.1f usec, p90 %.1f usec, p99 %.1f usec, "
+           "max %.1f usec\n",
+           (double)st->latency[n / 2],
+           (double)st->latency[(int)(n * 0.9)],
+           (double)st->latency[(int)(n * 0.99)],
+           (double)st->latency[n - 1]);
+  }
+
+  circuit_free_all();
+  for (i = 0; i < RF_N_CHANS; ++i) {
+    rf_link_clear(&st->in[i]);
+    rf_link_clear(&st->out[i]);
+  }
+  channel_free_all();
+  scheduler_free_all();
+  tor_free(st->sent_at);
+  tor_free(st->latency);
+  tor_free(st);
+}
+
+/** Case for bench_dh: do complete DH handshakes. */
+static uint64_t
+bench_dh_case(void *arg, int iters)
+{
+  uint64_t n = 0;
+  int i;
+  (void) arg;
+  for (i = 0; i < iters; ++i) {
+    char dh_pubkey_a[DH_BYTES], dh_pubkey_b[DH_BYTES];
+    char secret_a[DH_BYTES], secret_b[DH_BYTES];
+    ssize_t slen_a, slen_b;
+    crypto_dh_t *dh_a = crypto_dh_new(DH_TYPE_TLS);
+    crypto_dh_t *dh_b = crypto_dh_new(DH_TYPE_TLS);
+    crypto_dh_generate_public(dh_a);
+    crypto_dh_generate_public(dh_b);
+    crypto_dh_get_public(dh_a, dh_pubkey_a, sizeof(dh_pubkey_a));
+    crypto_dh_get_public(dh_b, dh_pubkey_b, sizeof(dh_pubkey_b));
+    slen_a = crypto_dh_compute_secret(LOG_NOTICE,
+                                      dh_a, dh_pubkey_b, sizeof(dh_pubkey_b),
+                                      secret_a, sizeof(secret_a));
+    slen_b = crypto_dh_compute_secret(LOG_NOTICE,
+                                      dh_b, dh_pubkey_a, sizeof(dh_pubkey_a),
+                                      secret_b, sizeof(secret_b));
+    tor_assert(slen_a == slen_b);
+    tor_assert(fast_memeq(secret_a, secret_b, slen_a));
+    crypto_dh_free(dh_a);
+    crypto_dh_free(dh_b);
+    n += (uint8_t)secret_a[0];
+  }
+  return n;
+}
+
+static void
+bench_dh(void)
+{
+  /* Complete handshakes, with 1024-bit public and private operations. */
+  bench_run_case("dh/handshake", bench_dh_case, NULL, 1<<6);
+}
+
+/** Case for bench_ecdh: do complete ECDH handshakes on the curve whose NID
+ * <b>arg</b> points to. */
+static uint64_t
+bench_ecdh_case(void *arg, int iters)
+{
+  const int nid = *(const int *)arg;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    char secret_a[DH_BYTES], secret_b[DH_BYTES];
+    ssize_t slen_a, slen_b;
+    EC_KEY *dh_a = EC_KEY_new_by_curve_name(nid);
+    EC_KEY *dh_b = EC_KEY_new_by_curve_name(nid);
+    tor_assert(dh_a && dh_b);
+
+    EC_KEY_generate_key(dh_a);
+    EC_KEY_generate_key(dh_b);
+    slen_a = ECDH_compute_key(secret_a, DH_BYTES,
+                              EC_KEY_get0_public_key(dh_b), dh_a,
+                              NULL);
+    slen_b = ECDH_compute_key(secret_b, DH_BYTES,
+                              EC_KEY_get0_public_key(dh_a), dh_b,
+                              NULL);
+
+    tor_assert(slen_a == slen_b);
+    tor_assert(fast_memeq(secret_a, secret_b, slen_a));
+    EC_KEY_free(dh_a);
+    EC_KEY_free(dh_b);
+    n += (uint8_t)secret_a[0];
+  }
+  return n;
+}
+
+static void
+bench_ecdh_impl(int nid, const char *name)
+{
+  EC_KEY *key = EC_KEY_new_by_curve_name(nid);
+  if (!key) {
+    puts("Skipping.  (No implementation?)");
+    return;
+  }
+  EC_KEY_free(key);
+  /* Complete handshakes, with 2 public and 2 private operations. */
+  bench_run_case(name, bench_ecdh_case, &nid, 1<<8);
+}
+
+static void
+bench_ecdh_p256(void)
+{
+  bench_ecdh_impl(NID_X9_62_prime256v1, "ecdh_p256/handshake");
+}
+
+static void
+bench_ecdh_p224(void)
+{
+  bench_ecdh_impl(NID_secp224r1, "ecdh_p224/handshake");
+}
+
+/** Write <b>n_entries</b> synthetic GeoIP ranges for <b>family</b> to a
+ * temporary file, and return its name. */
+static char *
+bench_geoip_write_file(sa_family_t family, int n_entries)
+{
+  smartlist_t *lines = smartlist_new();
+  const char *tmpdir = getenv("TMPDIR");
+  char *fname = NULL, *contents;
+  int i;
+
+  for (i = 0; i < n_entries; ++i) {
+    const char *cc = (i % 3) ? ((i % 3 == 1) ? "AB" : "XY") : "ZZ";
+    if (family == AF_INET) {
+      /* Spread the ranges over the whole address space, with gaps. */
+      uint32_t low = (uint32_t)(((uint64_t)i << 32) / n_entries);
+      uint32_t span = (uint32_t)(((uint64_t)1 << 32) / n_entries);
+      smartlist_add_asprintf(lines, "%u,%u,%s", low, low + span / 2, cc);
+    } else {
+      /* Pack the ranges densely into 2000::/4, like the real data. */
+      uint32_t hi32 = 0x20000000u + (uint32_t)(i * (0x10000000u / n_entries));
+      smartlist_add_asprintf(lines, "%x:%x::,%x:%x:ffff:ffff:ffff:ffff:"
+                             "ffff:ffff,%s", hi32 >> 16, hi32 & 0xffff,
+                             hi32 >> 16, hi32 & 0xffff, cc);
+    }
+  }
+  contents = smartlist_join_strings(lines, "\n", 1, NULL);
+  tor_asprintf(&fname, "%s/tor-bench-geoip%s-%d", tmpdir ? tmpdir : "/tmp",
+               family == AF_INET ? "" : "6", (int)getpid());
+  write_str_to_file(fname, contents, 0);
+  tor_free(contents);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return fname;
+}
+
+/** Argument for the geoip cases. */
+typedef struct bench_geoip_arg_t {
+  sa_family_t family;
+  const char *fname;
+  tor_addr_t *addrs;
+  int n_addrs;
+} bench_geoip_arg_t;
+
+/** Case for bench_geoip: load a GeoIP file. */
+static uint64_t
+bench_geoip_load_case(void *arg_, int iters)
+{
+  bench_geoip_arg_t *arg = arg_;
+  int i;
+  for (i = 0; i < iters; ++i)
+    geoip_load_file(arg->family, arg->fname);
+  return geoip_get_n_countries();
+}
+
+/** Case for bench_geoip: look up addresses. */
+static uint64_t
+bench_geoip_lookup_case(void *arg_, int iters)
+{
+  bench_geoip_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    n += geoip_get_country_by_addr(&arg->addrs[i % arg->n_addrs]);
+  return n;
+}
+
+/** Run GeoIP lookup benchmarks. */
+static void
+bench_geoip(void)
+{
+  const int n_ipv4 = 200000, n_ipv6 = 60000;
+  const int iters = 1<<20;
+  const int n_addrs = 4096;
+  tor_addr_t *addrs4 = tor_calloc(n_addrs, sizeof(tor_addr_t));
+  tor_addr_t *addrs6 = tor_calloc(n_addrs, sizeof(tor_addr_t));
+  char *fname4 = bench_geoip_write_file(AF_INET, n_ipv4);
+  char *fname6 = bench_geoip_write_file(AF_INET6, n_ipv6);
+  bench_geoip_arg_t arg4, arg6;
+  char name[64];
+  int i;
+
+  for (i = 0; i < n_addrs; ++i) {
+    uint8_t a[16];
+    tor_addr_from_ipv4h(&addrs4[i], (uint32_t)crypto_rand_uint64(UINT32_MAX));
+    crypto_rand((char*)a, sizeof(a));
+    a[0] = 0x20 | (a[0] & 0x0f);
+    tor_addr_from_ipv6_bytes(&addrs6[i], (const char*)a);
+  }
+  arg4.family = AF_INET;
+  arg4.fname = fname4;
+  arg4.addrs = addrs4;
+  arg4.n_addrs = n_addrs;
+  arg6.family = AF_INET6;
+  arg6.fname = fname6;
+  arg6.addrs = addrs6;
+  arg6.n_addrs = n_addrs;
+
+  tor_snprintf(name, sizeof(name), "geoip/load_ipv4(%d)", n_ipv4);
+  bench_run_case(name, bench_geoip_load_case, &arg4, 1);
+  tor_snprintf(name, sizeof(name), "geoip/load_ipv6(%d)", n_ipv6);
+  bench_run_case(name, bench_geoip_load_case, &arg6, 1);
+  bench_run_case("geoip/lookup_ipv4", bench_geoip_lookup_case, &arg4, iters);
+  bench_run_case("geoip/lookup_ipv6", bench_geoip_lookup_case, &arg6, iters);
+
+  unlink(fname4);
+  unlink(fname6);
+  tor_free(fname4);
+  tor_free(fname6);
+  tor_free(addrs4);
+  tor_free(addrs6);
+  geoip_free_all();
+}
+
+/** The Bloom filter that address_set_t used to be, for comparison. */
+typedef struct bench_bloom_t {
+  struct sipkey key[2];
+  int mask;
+  bitarray_t *ba;
+} bench_bloom_t;
+
+/** Helper for bench_address_set: add <b>addr</b> to <b>bloom</b>. */
+static void
+bench_bloom_add(bench_bloom_t *bloom, const tor_addr_t *addr)
+{
+  int i;
+  for (i = 0; i < 2; ++i) {
+    uint64_t h = tor_addr_keyed_hash(&bloom->key[i], addr);
+    bitarray_set(bloom->ba, ((uint32_t)(h >> 32)) & bloom->mask);
+    bitarray_set(bloom->ba, ((uint32_t)h) & bloom->mask);
+  }
+}
+
+/** Helper for bench_address_set: return true if <b>bloom</b> probably
+ * contains <b>addr</b>. */
+static int
+bench_bloom_contains(const bench_bloom_t *bloom, const tor_addr_t *addr)
+{
+  int i, matches = 0;
+  for (i = 0; i < 2; ++i) {
+    uint64_t h = tor_addr_keyed_hash(&bloom->key[i], addr);
+    matches += !! bitarray_is_set(bloom->ba, ((uint32_t)(h >> 32)) &
+                                  bloom->mask);
+    matches += !! bitarray_is_set(bloom->ba, ((uint32_t)h) & bloom->mask);
+  }
+  return matches == 4;
+}
+
+/** Helper for bench_address_set: fill <b>addrs</b> with <b>n</b> random
+ * addresses, half IPv4 and half IPv6. */
+static void
+bench_address_set_make_addrs(tor_addr_t *addrs, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (i & 1) {
+      uint8_t a[16];
+      crypto_rand((char*)a, sizeof(a));
+      tor_addr_from_ipv6_bytes(&addrs[i], (const char*)a);
+    } else {
+      tor_addr_from_ipv4h(&addrs[i],
+                          (uint32_t)crypto_rand_uint64(UINT32_MAX));
+    }
+  }
+}
+
+/** Argument for the address_set cases. */
+typedef struct bench_address_set_arg_t {
+  /** Addresses that we add. */
+  tor_addr_t *in;
+  /** Addresses that we don't. */
+  tor_addr_t *out;
+  int elts;
+  bench_bloom_t bloom;
+  address_set_t *set;
+} bench_address_set_arg_t;
+
+/** Case for bench_address_set: fill a new Bloom filter. */
+static uint64_t
+bench_address_set_bloom_add_case(void *arg_, int iters)
+{
+  bench_address_set_arg_t *arg = arg_;
+  bench_bloom_t bloom = arg->bloom;
+  int i;
+  bloom.ba = bitarray_init_zero(bloom.mask + 1);
+  for (i = 0; i < iters; ++i)
+    bench_bloom_add(&bloom, &arg->in[i % arg->elts]);
+  bitarray_free(bloom.ba);
+  return 0;
+}
+
+/** Case for bench_address_set: fill a new cuckoo filter. */
+static uint64_t
+bench_address_set_cuckoo_add_case(void *arg_, int iters)
+{
+  bench_address_set_arg_t *arg = arg_;
+  address_set_t *set = address_set_new(iters);
+  uint64_t n;
+  int i;
+  for (i = 0; i < iters; ++i)
+    address_set_add(set, &arg->in[i % arg->elts]);
+  n = address_set_get_n_items(set);
+  address_set_free(set);
+  return n;
+}
+
+/** Case for bench_address_set: look up addresses, half of them absent, in
+ * the Bloom filter. */
+static uint64_t
+bench_address_set_bloom_lookup_case(void *arg_, int iters)
+{
+  bench_address_set_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    const tor_addr_t *a = (i & 1) ? arg->out : arg->in;
+    n += bench_bloom_contains(&arg->bloom, &a[(i >> 1) % arg->elts]);
+  }
+  return n;
+}
+
+/** Case for bench_address_set: look up addresses, half of them absent, in
+ * the cuckoo filter. */
+static uint64_t
+bench_address_set_cuckoo_lookup_case(void *arg_, int iters)
+{
+  bench_address_set_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    const tor_addr_t *a = (i & 1) ? arg->out : arg->in;
+    n += address_set_probably_contains(arg->set, &a[(i >> 1) % arg->elts]);
+  }
+  return n;
+}
+
+/** Case for bench_address_set: remove an address from the full cuckoo
+ * filter, and add it back. */
+static uint64_t
+bench_address_set_cuckoo_remove_case(void *arg_, int iters)
+{
+  bench_address_set_arg_t *arg = arg_;
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    const tor_addr_t *a = &arg->in[i % arg->elts];
+    n += address_set_remove(arg->set, a);
+    address_set_add(arg->set, a);
+  }
+  return n;
+}
+
+/** Run address_set_t benchmarks, against the Bloom filter it replaced. */
+static void
+bench_address_set(void)
+{
+  /* About the number of relay addresses in a consensus. */
+  const int elts = 14000;
+  const int iters = 1<<22;
+  const int fpostests = 1000000;
+  tor_addr_t *fpos = tor_calloc(fpostests, sizeof(tor_addr_t));
+  bench_address_set_arg_t arg;
+  size_t bloom_bytes;
+  int i, fp;
+
+  arg.elts = elts;
+  arg.in = tor_calloc(elts, sizeof(tor_addr_t));
+  arg.out = tor_calloc(elts, sizeof(tor_addr_t));
+  bench_address_set_make_addrs(arg.in, elts);
+  bench_address_set_make_addrs(arg.out, elts);
+  bench_address_set_make_addrs(fpos, fpostests);
+
+  /* Sized the way address_set_new() used to do it. */
+  arg.bloom.mask = (1 << (tor_log2(elts) + 5)) - 1;
+  arg.bloom.ba = NULL;
+  crypto_rand((char*)arg.bloom.key, sizeof(arg.bloom.key));
+  bloom_bytes = sizeof(arg.bloom) + (arg.bloom.mask + 1) / 8;
+
+  bench_run_case("address_set/bloom_add", bench_address_set_bloom_add_case,
+                 &arg, elts);
+  bench_run_case("address_set/cuckoo_add", bench_address_set_cuckoo_add_case,
+                 &arg, elts);
+
+  arg.bloom.ba = bitarray_init_zero(arg.bloom.mask + 1);
+  arg.set = address_set_new(elts);
+  for (i = 0; i < elts; ++i) {
+    bench_bloom_add(&arg.bloom, &arg.in[i]);
+    address_set_add(arg.set, &arg.in[i]);
+  }
+  bench_run_case("address_set/bloom_lookup",
+                 bench_address_set_bloom_lookup_case, &arg, iters);
+  bench_run_case("address_set/cuckoo_lookup",
+                 bench_address_set_cuckoo_lookup_case, &arg, iters);
+  bench_run_case("address_set/cuckoo_remove_add",
+                 bench_address_set_cuckoo_remove_case, &arg, elts * 16);
+
+  fp = 0;
+  for (i = 0; i < fpostests; ++i)
+    fp += bench_bloom_contains(&arg.bloom, &fpos[i]);
+  printf("Bloom filter: %.2f bits per element, "
+         "false positive rate %.4f%%\n",
+         bloom_bytes * 8.0 / elts, (fp/(double)fpostests)*100);
+  fp = 0;
+  for (i = 0; i < fpostests; ++i)
+    fp += address_set_probably_contains(arg.set, &fpos[i]);
+  printf("Cuckoo filter: %.2f bits per element, "
+         "false positive rate %.4f%%\n",
+         address_set_get_allocation(arg.set) * 8.0 / elts,
+         (fp/(double)fpostests)*100);
+
+  bitarray_free(arg.bloom.ba);
+  address_set_free(arg.set);
+  tor_free(arg.in);
+  tor_free(arg.out);
+  tor_free(fpos);
+}
+
+/** Argument for the replaycache cases. */
+typedef struct bench_replaycache_arg_t {
+  /** Cells that we've never added, one after another. */
+  const char *cells;
+  size_t len;
+  int n;
+  /** True iff we're testing a bucketed cache. */
+  int bucketed;
+  /** A cache that holds all of <b>cells</b>. */
+  replaycache_t *full;
+} bench_replaycache_arg_t;
+
+/** Return a new replay cache of the kind that <b>arg</b> asks for. */
+static replaycache_t *
+bench_replaycache_new(const bench_replaycache_arg_t *arg)
+{
+  return arg->bucketed ? replaycache_new_bucketed(600, 5, arg->n) :
+    replaycache_new(600, 600);
+}
+
+/** Case for bench_replaycache: fill a new replay cache, and free it. */
+static uint64_t
+bench_replaycache_fill_case(void *arg_, int iters)
+{
+  bench_replaycache_arg_t *arg = arg_;
+  replaycache_t *r = bench_replaycache_new(arg);
+  uint64_t hits = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    hits += replaycache_add_and_test(r, arg->cells + (i % arg->n) * arg->len,
+                                     arg->len);
+  replaycache_free(r);
+  return hits;
+}
+
+/** Case for bench_replaycache: replay cells to a full replay cache. */
+static uint64_t
+bench_replaycache_replay_case(void *arg_, int iters)
+{
+  bench_replaycache_arg_t *arg = arg_;
+  uint64_t hits = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    hits += replaycache_add_and_test(arg->full,
+                                     arg->cells + (i % arg->n) * arg->len,
+                                     arg->len);
+  return hits;
+}
 
-  reset_perftime();
-  start = perftime();
-  for (i = 0; i < iters; ++i) {
-    onion_skin_ntor_create(nodeid, &keypair1.pubkey, &state, os);
-    ntor_handshake_state_free(state);
-    state = NULL;
+/** Run replaycache_t benchmarks: an INTRODUCE2 flood, with a plain and a
+ * bucketed replay cache. */
+static void
+bench_replaycache(void)
+{
+  const int n = 200000;
+  /* About the size of the ENCRYPTED section of an INTRODUCE2 cell. */
+  const size_t len = 400;
+  char *cells = tor_malloc(n * len);
+  bench_replaycache_arg_t arg;
+  int k, i;
+
+  crypto_rand(cells, n * len);
+  arg.cells = cells;
+  arg.len = len;
+  arg.n = n;
+
+  for (k = 0; k < 2; ++k) {
+    const char *kind = k ? "bucketed" : "plain";
+    char name[64];
+
+    arg.bucketed = k;
+    /* This includes the time to free the cache. */
+    tor_snprintf(name, sizeof(name), "replaycache/%s_fill", kind);
+    bench_run_case(name, bench_replaycache_fill_case, &arg, n);
+
+    arg.full = bench_replaycache_new(&arg);
+    for (i = 0; i < n; ++i)
+      replaycache_add_and_test(arg.full, cells + i * len, len);
+    tor_snprintf(name, sizeof(name), "replaycache/%s_replay", kind);
+    bench_run_case(name, bench_replaycache_replay_case, &arg, n);
+    replaycache_free(arg.full);
   }
-  end = perftime();
-  printf("Client-side, part 1: %f usec.\n", NANOCOUNT(start, end, iters)/1e3);
 
-  state = NULL;
-  onion_skin_ntor_create(nodeid, &keypair1.pubkey, &state, os);
-  start = perftime();
+  tor_free(cells);
+}
+
+/** Case for bench_buffers: add a cell's worth of bytes to a buffer, and
+ * take them back out. */
+static uint64_t
+bench_buffers_cell_case(void *arg, int iters)
+{
+  buf_t *buf = arg;
+  char cell[CELL_MAX_NETWORK_SIZE];
+  uint64_t sum = 0;
+  int i;
+  memset(cell, 0x5a, sizeof(cell));
   for (i = 0; i < iters; ++i) {
-    uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_ntor_server_handshake(os, keymap, NULL, nodeid, or,
-                                key_out, sizeof(key_out));
+    buf_add(buf, cell, sizeof(cell));
+    buf_get_bytes(buf, cell, sizeof(cell));
+    sum += (uint8_t)cell[0];
   }
-  end = perftime();
-  printf("Server-side: %f usec\n",
-         NANOCOUNT(start, end, iters)/1e3);
+  return sum;
+}
 
-  start = perftime();
+/** Case for bench_buffers: queue 64 cells on a buffer, and then drain
+ * them, the way a busy connection's outbuf does. */
+static uint64_t
+bench_buffers_queue_case(void *arg, int iters)
+{
+  buf_t *buf = arg;
+  char cell[CELL_MAX_NETWORK_SIZE];
+  uint64_t sum = 0;
+  int i, j;
+  memset(cell, 0x5a, sizeof(cell));
   for (i = 0; i < iters; ++i) {
-    uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
-    int s;
-    s = onion_skin_ntor_client_handshake(state, or, key_out, sizeof(key_out),
-                                         NULL);
-    tor_assert(s == 0);
+    for (j = 0; j < 64; ++j)
+      buf_add(buf, cell, sizeof(cell));
+    for (j = 0; j < 64; ++j) {
+      buf_get_bytes(buf, cell, sizeof(cell));
+      sum += (uint8_t)cell[0];
+    }
   }
-  end = perftime();
-  printf("Client-side, part 2: %f usec.\n",
-         NANOCOUNT(start, end, iters)/1e3);
-
-  ntor_handshake_state_free(state);
-  dimap_free(keymap, NULL);
+  return sum;
 }
 
-static void
-bench_onion_ntor(void)
+/** Case for bench_buffers: move 16 KB from one buffer to another. */
+static uint64_t
+bench_buffers_move_case(void *arg, int iters)
 {
-  int ed;
-
-  for (ed = 0; ed <= 1; ++ed) {
-    printf("Ed25519-based basepoint multiply = %s.\n",
-           (ed == 0) ? "disabled" : "enabled");
-    curve25519_set_impl_params(ed);
-    bench_onion_ntor_impl();
+  buf_t **bufs = arg;
+  char chunk[1024];
+  uint64_t sum = 0;
+  int i, j;
+  memset(chunk, 0x5a, sizeof(chunk));
+  for (i = 0; i < iters; ++i) {
+    size_t len = 16384;
+    for (j = 0; j < 16; ++j)
+      buf_add(bufs[0], chunk, sizeof(chunk));
+    buf_move_to_buf(bufs[1], bufs[0], &len);
+    sum += buf_datalen(bufs[1]);
+    buf_drain(bufs[1], buf_datalen(bufs[1]));
   }
+  return sum;
 }
 
-static void
-bench_ed25519_impl(void)
+/** Case for bench_buffers: add a line of HTTP headers to a buffer, and
+ * read it back with buf_get_line(). */
+static uint64_t
+bench_buffers_line_case(void *arg, int iters)
 {
-  uint64_t start, end;
-  const int iters = 1<<12;
+  static const char line[] =
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; rv:60.0) Gecko/20100101\r\n";
+  buf_t *buf = arg;
+  char out[256];
+  uint64_t sum = 0;
   int i;
-  const uint8_t msg[] = "but leaving, could not tell what they had heard";
-  ed25519_signature_t sig;
-  ed25519_keypair_t kp;
-  curve25519_keypair_t curve_kp;
-  ed25519_public_key_t pubkey_tmp;
-
-  ed25519_secret_key_generate(&kp.seckey, 0);
-  start = perftime();
   for (i = 0; i < iters; ++i) {
-    ed25519_public_key_generate(&kp.pubkey, &kp.seckey);
+    size_t len = sizeof(out);
+    buf_add(buf, line, strlen(line));
+    buf_get_line(buf, out, &len);
+    sum += len;
   }
-  end = perftime();
-  printf("Generate public key: %.2f usec\n",
-         MICROCOUNT(start, end, iters));
+  return sum;
+}
 
-  start = perftime();
-  for (i = 0; i < iters; ++i) {
-    ed25519_sign(&sig, msg, sizeof(msg), &kp);
-  }
-  end = perftime();
-  printf("Sign a short message: %.2f usec\n",
-         MICROCOUNT(start, end, iters));
+/** Run buf_t benchmarks. */
+static void
+bench_buffers(void)
+{
+  buf_t *bufs[2];
+  bufs[0] = buf_new();
+  bufs[1] = buf_new();
+
+  bench_run_case("buffers/add_get_cell", bench_buffers_cell_case, bufs[0],
+                 1000000);
+  bench_run_case("buffers/queue_64_cells", bench_buffers_queue_case, bufs[0],
+                 20000);
+  bench_run_case("buffers/move_16k", bench_buffers_move_case, bufs, 20000);
+  bench_run_case("buffers/get_line", bench_buffers_line_case, bufs[0],
+                 1000000);
+
+  buf_free(bufs[0]);
+  buf_free(bufs[1]);
+}
 
-  start = perftime();
+/** Number of keys in each map for bench_maps. */
+#define BENCH_MAPS_N_KEYS 10000
+
+/** Argument for the bench_maps cases. */
+typedef struct bench_maps_arg_t {
+  char **strkeys;
+  /** 2*BENCH_MAPS_N_KEYS keys: the first half are in the maps, and the
+   * second half are not. */
+  uint8_t *keys;
+  strmap_t *strmap;
+  digestmap_t *digestmap;
+  digest256map_t *digest256map;
+} bench_maps_arg_t;
+
+/** Case for bench_maps: look up a key in a strmap_t. */
+static uint64_t
+bench_maps_strmap_get_case(void *arg_, int iters)
+{
+  const bench_maps_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    sum += !! strmap_get(arg->strmap, arg->strkeys[i % BENCH_MAPS_N_KEYS]);
+  return sum;
+}
+
+/** Case for bench_maps: look up a key in a digestmap_t. */
+static uint64_t
+bench_maps_digestmap_get_case(void *arg_, int iters)
+{
+  const bench_maps_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
   for (i = 0; i < iters; ++i) {
-    ed25519_checksig(&sig, msg, sizeof(msg), &kp.pubkey);
+    const uint8_t *key = arg->keys + (i % BENCH_MAPS_N_KEYS)*DIGEST256_LEN;
+    sum += !! digestmap_get(arg->digestmap, (const char *)key);
   }
-  end = perftime();
-  printf("Verify signature: %.2f usec\n",
-         MICROCOUNT(start, end, iters));
+  return sum;
+}
 
-  curve25519_keypair_generate(&curve_kp, 0);
-  start = perftime();
+/** Case for bench_maps: look up a key in a digest256map_t. */
+static uint64_t
+bench_maps_digest256map_get_case(void *arg_, int iters)
+{
+  const bench_maps_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
   for (i = 0; i < iters; ++i) {
-    ed25519_public_key_from_curve25519_public_key(&pubkey_tmp,
-                                                  &curve_kp.pubkey, 1);
+    const uint8_t *key = arg->keys + (i % BENCH_MAPS_N_KEYS)*DIGEST256_LEN;
+    sum += !! digest256map_get(arg->digest256map, key);
   }
-  end = perftime();
-  printf("Convert public point from curve25519: %.2f usec\n",
-         MICROCOUNT(start, end, iters));
+  return sum;
+}
 
-  curve25519_keypair_generate(&curve_kp, 0);
-  start = perftime();
+/** Case for bench_maps: add a new key to a digestmap_t, and remove it. */
+static uint64_t
+bench_maps_digestmap_set_remove_case(void *arg_, int iters)
+{
+  const bench_maps_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
   for (i = 0; i < iters; ++i) {
-    ed25519_public_blind(&pubkey_tmp, &kp.pubkey, msg);
+    const uint8_t *key = arg->keys +
+      (BENCH_MAPS_N_KEYS + i % BENCH_MAPS_N_KEYS)*DIGEST256_LEN;
+    digestmap_set(arg->digestmap, (const char *)key, arg->keys);
+    sum += !! digestmap_remove(arg->digestmap, (const char *)key);
   }
-  end = perftime();
-  printf("Blind a public key: %.2f usec\n",
-         MICROCOUNT(start, end, iters));
+  return sum;
 }
 
+/** Run strmap_t, digestmap_t and digest256map_t benchmarks. */
 static void
-bench_ed25519(void)
+bench_maps(void)
 {
-  int donna;
+  bench_maps_arg_t arg;
+  int i;
 
-  for (donna = 0; donna <= 1; ++donna) {
-    printf("Ed25519-donna = %s.\n",
-           (donna == 0) ? "disabled" : "enabled");
-    ed25519_set_impl_params(donna);
-    bench_ed25519_impl();
+  arg.strkeys = tor_calloc(BENCH_MAPS_N_KEYS, sizeof(char *));
+  arg.keys = tor_malloc(2 * BENCH_MAPS_N_KEYS * DIGEST256_LEN);
+  crypto_rand((char *)arg.keys, 2 * BENCH_MAPS_N_KEYS * DIGEST256_LEN);
+  arg.strmap = strmap_new();
+  arg.digestmap = digestmap_new();
+  arg.digest256map = digest256map_new();
+  for (i = 0; i < BENCH_MAPS_N_KEYS; ++i) {
+    uint8_t *key = arg.keys + i*DIGEST256_LEN;
+    char hex[HEX_DIGEST_LEN+1];
+    base16_encode(hex, sizeof(hex), (const char *)key, DIGEST_LEN);
+    arg.strkeys[i] = tor_strdup(hex);
+    strmap_set(arg.strmap, hex, key);
+    digestmap_set(arg.digestmap, (const char *)key, key);
+    digest256map_set(arg.digest256map, key, key);
   }
+
+  bench_run_case("maps/strmap_get", bench_maps_strmap_get_case, &arg,
+                 1000000);
+  bench_run_case("maps/digestmap_get", bench_maps_digestmap_get_case, &arg,
+                 1000000);
+  bench_run_case("maps/digest256map_get", bench_maps_digest256map_get_case,
+                 &arg, 1000000);
+  bench_run_case("maps/digestmap_set_remove",
+                 bench_maps_digestmap_set_remove_case, &arg, 1000000);
+
+  strmap_free(arg.strmap, NULL);
+  digestmap_free(arg.digestmap, NULL);
+  digest256map_free(arg.digest256map, NULL);
+  for (i = 0; i < BENCH_MAPS_N_KEYS; ++i)
+    tor_free(arg.strkeys[i]);
+  tor_free(arg.strkeys);
+  tor_free(arg.keys);
 }
 
-static void
-bench_cell_aes(void)
+/** Number of addresses in each list for the bench_parse address cases. */
+#define BENCH_PARSE_N_ADDRS 256
+
+/** Case for bench_parse: parse an address with tor_addr_parse(). */
+static uint64_t
+bench_parse_addr_case(void *arg, int iters)
 {
-  uint64_t start, end;
-  const int len = 509;
-  const int iters = (1<<16);
-  const int max_misalign = 15;
-  char *b = tor_malloc(len+max_misalign);
-  crypto_cipher_t *c;
-  int i, misalign;
-  char key[CIPHER_KEY_LEN];
-  crypto_rand(key, sizeof(key));
-  c = crypto_cipher_new(key);
+  char **addrs = arg;
+  tor_addr_t addr;
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < iters; ++i)
+    sum += tor_addr_parse(&addr, addrs[i % BENCH_PARSE_N_ADDRS]);
+  return sum;
+}
 
-  reset_perftime();
-  for (misalign = 0; misalign <= max_misalign; ++misalign) {
-    start = perftime();
-    for (i = 0; i < iters; ++i) {
-      crypto_cipher_crypt_inplace(c, b+misalign, len);
-    }
-    end = perftime();
-    printf("%d bytes, misaligned by %d: %.2f nsec per byte\n", len, misalign,
-           NANOCOUNT(start, end, iters*len));
+/** A torrc for bench_parse. */
+static const char bench_torrc[] =
+  "# A relay's torrc\n"
+  "SocksPort 0\n"
+  "ORPort 9001\n"
+  "ORPort [2001:db8::1]:9001 NoAdvertise\n"
+  "DirPort 9030\n"
+  "Nickname BenchRelay\n"
+  "ContactInfo Bench Relay <bench AT example dot com>\n"
+  "RelayBandwidthRate 10 MBytes\n"
+  "RelayBandwidthBurst 20 MBytes\n"
+  "AccountingMax 4 TBytes\n"
+  "AccountingStart month 1 00:00\n"
+  "DataDirectory /var/lib/tor\n"
+  "Log notice file /var/log/tor/notices.log\n"
+  "ControlPort 9051\n"
+  "CookieAuthentication 1\n"
+  "ExitPolicy accept *:80\n"
+  "ExitPolicy accept *:443\n"
+  "ExitPolicy reject *:*\n"
+  "IPv6Exit 1\n"
+  "MyFamily $0123456789ABCDEF0123456789ABCDEF01234567,"
+  "$89ABCDEF0123456789ABCDEF0123456789ABCDEF\n"
+  "DisableDebuggerAttachment 0\n"
+  "NumCPUs 4\n";
+
+/** Case for bench_parse: split a torrc into lines. */
+static uint64_t
+bench_parse_torrc_case(void *arg, int iters)
+{
+  uint64_t sum = 0;
+  int i;
+  (void) arg;
+  for (i = 0; i < iters; ++i) {
+    config_line_t *lines = NULL;
+    sum += config_get_lines(bench_torrc, &lines, 0);
+    sum += !! lines;
+    config_free_lines(lines);
   }
+  return sum;
+}
 
-  crypto_cipher_free(c);
-  tor_free(b);
+/** Case for bench_parse: parse the router descriptors in TEST_DESCRIPTORS,
+ * checking their signatures. */
+static uint64_t
+bench_parse_routerdescs_case(void *arg, int iters)
+{
+  smartlist_t *routers = smartlist_new();
+  uint64_t sum = 0;
+  int i;
+  (void) arg;
+  for (i = 0; i < iters; ++i) {
+    const char *s = TEST_DESCRIPTORS;
+    router_parse_list_from_string(&s, NULL, routers, SAVED_NOWHERE,
+                                  0, 1, NULL, NULL);
+    sum += smartlist_len(routers);
+    SMARTLIST_FOREACH(routers, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(routers);
+  }
+  smartlist_free(routers);
+  return sum;
 }
 
-/** Run digestmap_t performance benchmarks. */
+/** Run parsing benchmarks. */
 static void
-bench_dmap(void)
+bench_parse(void)
 {
-  smartlist_t *sl = smartlist_new();
-  smartlist_t *sl2 = smartlist_new();
-  uint64_t start, end, pt2, pt3, pt4;
-  int iters = 8192;
-  const int elts = 4000;
-  const int fpostests = 100000;
-  char d[20];
-  int i,n=0, fp = 0;
-  digestmap_t *dm = digestmap_new();
-  digestset_t *ds = digestset_new(elts);
+  char **addrs4 = tor_calloc(BENCH_PARSE_N_ADDRS, sizeof(char *));
+  char **addrs6 = tor_calloc(BENCH_PARSE_N_ADDRS, sizeof(char *));
+  int i;
 
-  for (i = 0; i < elts; ++i) {
-    crypto_rand(d, 20);
-    smartlist_add(sl, tor_memdup(d, 20));
-  }
-  for (i = 0; i < elts; ++i) {
-    crypto_rand(d, 20);
-    smartlist_add(sl2, tor_memdup(d, 20));
+  for (i = 0; i < BENCH_PARSE_N_ADDRS; ++i) {
+    tor_addr_t addr;
+    uint8_t a[16];
+    tor_addr_from_ipv4h(&addr, (uint32_t)crypto_rand_uint64(UINT32_MAX));
+    addrs4[i] = tor_addr_to_str_dup(&addr);
+    crypto_rand((char *)a, sizeof(a));
+    tor_addr_from_ipv6_bytes(&addr, (const char *)a);
+    addrs6[i] = tor_addr_to_str_dup(&addr);
   }
-  printf("nbits=%d\n", ds->mask+1);
 
-  reset_perftime();
-
-  start = perftime();
-  for (i = 0; i < iters; ++i) {
-    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_set(dm, cp, (void*)1));
+  bench_run_case("parse/tor_addr_ipv4", bench_parse_addr_case, addrs4,
+                 1000000);
+  bench_run_case("parse/tor_addr_ipv6", bench_parse_addr_case, addrs6,
+                 1000000);
+  bench_run_case("parse/torrc", bench_parse_torrc_case, NULL, 20000);
+  bench_run_case("parse/router_descriptors", bench_parse_routerdescs_case,
+                 NULL, 200);
+
+  for (i = 0; i < BENCH_PARSE_N_ADDRS; ++i) {
+    tor_free(addrs4[i]);
+    tor_free(addrs6[i]);
   }
-  pt2 = perftime();
-  printf("digestmap_set: %.2f ns per element\n",
-         NANOCOUNT(start, pt2, iters*elts));
+  tor_free(addrs4);
+  tor_free(addrs6);
+}
 
-  for (i = 0; i < iters; ++i) {
-    SMARTLIST_FOREACH(sl, const char *, cp, digestmap_get(dm, cp));
-    SMARTLIST_FOREACH(sl2, const char *, cp, digestmap_get(dm, cp));
-  }
-  pt3 = perftime();
-  printf("digestmap_get: %.2f ns per element\n",
-         NANOCOUNT(pt2, pt3, iters*elts*2));
+/** Argument for the bench_compress cases. */
+typedef struct bench_compress_arg_t {
+  compress_method_t method;
+  const char *in;
+  size_t in_len;
+} bench_compress_arg_t;
 
+/** Case for bench_compress: compress a document. */
+static uint64_t
+bench_compress_case(void *arg_, int iters)
+{
+  const bench_compress_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
   for (i = 0; i < iters; ++i) {
-    SMARTLIST_FOREACH(sl, const char *, cp, digestset_add(ds, cp));
+    char *out = NULL;
+    size_t out_len = 0;
+    tor_compress(&out, &out_len, arg->in, arg->in_len, arg->method);
+    sum += out_len;
+    tor_free(out);
   }
-  pt4 = perftime();
-  printf("digestset_add: %.2f ns per element\n",
-         NANOCOUNT(pt3, pt4, iters*elts));
+  return sum;
+}
 
+/** Case for bench_compress: uncompress a document. */
+static uint64_t
+bench_uncompress_case(void *arg_, int iters)
+{
+  const bench_compress_arg_t *arg = arg_;
+  uint64_t sum = 0;
+  int i;
   for (i = 0; i < iters; ++i) {
-    SMARTLIST_FOREACH(sl, const char *, cp, n += digestset_contains(ds, cp));
-    SMARTLIST_FOREACH(sl2, const char *, cp, n += digestset_contains(ds, cp));
-  }
-  end = perftime();
-  printf("digestset_contains: %.2f ns per element.\n",
-         NANOCOUNT(pt4, end, iters*elts*2));
-  /* We need to use this, or else the whole loop gets optimized out. */
-  printf("Hits == %d\n", n);
-
-  for (i = 0; i < fpostests; ++i) {
-    crypto_rand(d, 20);
-    if (digestset_contains(ds, d)) ++fp;
+    char *out = NULL;
+    size_t out_len = 0;
+    tor_uncompress(&out, &out_len, arg->in, arg->in_len, arg->method,
+                   1, LOG_WARN);
+    sum += out_len;
+    tor_free(out);
   }
-  printf("False positive rate on digestset: %.2f%%\n",
-         (fp/(double)fpostests)*100);
-
-  digestmap_free(dm, NULL);
-  digestset_free(ds);
-  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
-  SMARTLIST_FOREACH(sl2, char *, cp, tor_free(cp));
-  smartlist_free(sl);
-  smartlist_free(sl2);
+  return sum;
 }
 
+/** Run compression benchmarks, with every method that we support, on a
+ * document that looks like a consensus. */
 static void
-bench_siphash(void)
+bench_compress(void)
 {
-  char buf[128];
-  int lens[] = { 7, 8, 15, 16, 20, 32, 111, 128, -1 };
-  int i, j;
-  uint64_t start, end;
-  const int N = 300000;
-  crypto_rand(buf, sizeof(buf));
+  smartlist_t *chunks = smartlist_new();
+  char *doc;
+  int i;
 
-  for (i = 0; lens[i] > 0; ++i) {
-    reset_perftime();
-    start = perftime();
-    for (j = 0; j < N; ++j) {
-      siphash24g(buf, lens[i]);
-    }
-    end = perftime();
-    printf("siphash24g(%d): %.2f ns per call\n",
-           lens[i], NANOCOUNT(start,end,N));
+  for (i = 0; i < 500; ++i) {
+    char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+    char digest[DIGEST_LEN], digest64[BASE64_DIGEST_LEN+1];
+    crypto_rand(id, sizeof(id));
+    crypto_rand(digest, sizeof(digest));
+    digest_to_base64(id64, id);
+    digest_to_base64(digest64, digest);
+    smartlist_add_asprintf(chunks,
+          "r relay%d %s %s 2018-06-01 00:00:00 10.%d.%d.%d 9001 0\n"
+          "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+          "v Tor 0.3.4.%d\n"
+          "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 "
+          "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+          "w Bandwidth=%d\n"
+          "p accept 80,443\n",
+          i, id64, digest64, i & 0xff, (i >> 8) & 0xff, i % 7, i % 10,
+          (int)crypto_rand_int(100000));
+  }
+  doc = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+
+  for (compress_method_t m = GZIP_METHOD; m < UNKNOWN_METHOD; ++m) {
+    bench_compress_arg_t arg;
+    char name[64];
+    char *compressed = NULL;
+    size_t compressed_len = 0;
+    /* LZMA is much slower than the rest. */
+    const int iters = (m == LZMA_METHOD) ? 5 : 50;
+
+    if (!tor_compress_supports_method(m))
+      continue;
+    arg.method = m;
+    arg.in = doc;
+    arg.in_len = strlen(doc);
+    tor_snprintf(name, sizeof(name), "compress/%s",
+                 compression_method_get_name(m));
+    bench_run_case(name, bench_compress_case, &arg, iters);
+
+    tor_compress(&compressed, &compressed_len, doc, strlen(doc), m);
+    arg.in = compressed;
+    arg.in_len = compressed_len;
+    tor_snprintf(name, sizeof(name), "uncompress/%s",
+                 compression_method_get_name(m));
+    bench_run_case(name, bench_uncompress_case, &arg, iters * 10);
+    tor_free(compressed);
   }
+
+  tor_free(doc);
 }
 
-static void
-bench_digest(void)
+/** The ports in a typical exit policy summary: those of the reduced exit
+ * policy. */
+static const char bench_short_policy[] =
+  "accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464-465,531,543-544,"
+  "554,563,587,636,706,749,853,873,902-904,981,989-995,1194,1220,1293,1500,"
+  "1533,1677,1723,1755,1863,2082-2083,2086-2087,2095-2096,2102-2104,3128,"
+  "3389,3690,4321,4643,5050,5190,5222-5223,5228,5900,6660-6669,6679,6697,"
+  "8000,8008,8074,8080,8082,8087-8088,8232-8233,8332-8333,8443,8888,9418,"
+  "9999-10000,11371,19294,19638,50002,64738";
+
+/** Number of addresses and ports for the bench_policy cases. */
+#define BENCH_POLICY_N_ADDRS 1024
+
+/** Argument for the bench_policy cases. */
+typedef struct bench_policy_arg_t {
+  tor_addr_t *addrs;
+  uint16_t *ports;
+  smartlist_t *policy;
+  short_policy_t *short_policy;
+} bench_policy_arg_t;
+
+/** Case for bench_policy: build the default exit policy, rejecting private
+ * addresses. */
+static uint64_t
+bench_policy_parse_case(void *arg, int iters)
 {
-  char buf[8192];
-  char out[DIGEST512_LEN];
-  const int lens[] = { 1, 16, 32, 64, 128, 512, 1024, 2048, -1 };
-  const int N = 300000;
-  uint64_t start, end;
-  crypto_rand(buf, sizeof(buf));
-
-  for (int alg = 0; alg < N_DIGEST_ALGORITHMS; alg++) {
-    for (int i = 0; lens[i] > 0; ++i) {
-      reset_perftime();
-      start = perftime();
-      for (int j = 0; j < N; ++j) {
-        switch (alg) {
-          case DIGEST_SHA1:
-            crypto_digest(out, buf, lens[i]);
-            break;
-          case DIGEST_SHA256:
-          case DIGEST_SHA3_256:
-            crypto_digest256(out, buf, lens[i], alg);
-            break;
-          case DIGEST_SHA512:
-          case DIGEST_SHA3_512:
-            crypto_digest512(out, buf, lens[i], alg);
-            break;
-          default:
-            tor_assert(0);
-        }
-      }
-      end = perftime();
-      printf("%s(%d): %.2f ns per call\n",
-             crypto_digest_algorithm_get_name(alg),
-             lens[i], NANOCOUNT(start,end,N));
-    }
+  uint64_t sum = 0;
+  int i;
+  (void) arg;
+  for (i = 0; i < iters; ++i) {
+    smartlist_t *policy = NULL;
+    policies_parse_exit_policy(NULL, &policy,
+                               EXIT_POLICY_IPV6_ENABLED |
+                               EXIT_POLICY_REJECT_PRIVATE |
+                               EXIT_POLICY_ADD_DEFAULT, NULL);
+    sum += smartlist_len(policy);
+    addr_policy_list_free(policy);
   }
+  return sum;
 }
 
-static void
-bench_cell_ops(void)
+/** Case for bench_policy: check an address and port against a full exit
+ * policy. */
+static uint64_t
+bench_policy_compare_case(void *arg_, int iters)
 {
-  const int iters = 1<<16;
+  const bench_policy_arg_t *arg = arg_;
+  uint64_t sum = 0;
   int i;
-
-  /* benchmarks for cell ops at relay. */
-  or_circuit_t *or_circ = tor_malloc_zero(sizeof(or_circuit_t));
-  cell_t *cell = tor_malloc(sizeof(cell_t));
-  int outbound;
-  uint64_t start, end;
-
-  crypto_rand((char*)cell->payload, sizeof(cell->payload));
-
-  /* Mock-up or_circuit_t */
-  or_circ->base_.magic = OR_CIRCUIT_MAGIC;
-  or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
-
-  /* Initialize crypto */
-  char key1[CIPHER_KEY_LEN], key2[CIPHER_KEY_LEN];
-  crypto_rand(key1, sizeof(key1));
-  crypto_rand(key2, sizeof(key2));
-  or_circ->crypto.f_crypto = crypto_cipher_new(key1);
-  or_circ->crypto.b_crypto = crypto_cipher_new(key2);
-  or_circ->crypto.f_digest = crypto_digest_new();
-  or_circ->crypto.b_digest = crypto_digest_new();
-
-  reset_perftime();
-
-  for (outbound = 0; outbound <= 1; ++outbound) {
-    cell_direction_t d = outbound ? CELL_DIRECTION_OUT : CELL_DIRECTION_IN;
-    start = perftime();
-    for (i = 0; i < iters; ++i) {
-      char recognized = 0;
-      crypt_path_t *layer_hint = NULL;
-      relay_decrypt_cell(TO_CIRCUIT(or_circ), cell, d,
-                         &layer_hint, &recognized);
-    }
-    end = perftime();
-    printf("%sbound cells: %.2f ns per cell. (%.2f ns per byte of payload)\n",
-           outbound?"Out":" In",
-           NANOCOUNT(start,end,iters),
-           NANOCOUNT(start,end,iters*CELL_PAYLOAD_SIZE));
+  for (i = 0; i < iters; ++i) {
+    const int j = i % BENCH_POLICY_N_ADDRS;
+    sum += compare_tor_addr_to_addr_policy(&arg->addrs[j], arg->ports[j],
+                                           arg->policy);
   }
-
-  relay_crypto_clear(&or_circ->crypto);
-  tor_free(or_circ);
-  tor_free(cell);
+  return sum;
 }
 
-static void
-bench_dh(void)
+/** Case for bench_policy: check an address and port against an exit policy
+ * summary, as a client does when it picks an exit. */
+static uint64_t
+bench_policy_compare_short_case(void *arg_, int iters)
 {
-  const int iters = 1<<10;
+  const bench_policy_arg_t *arg = arg_;
+  uint64_t sum = 0;
   int i;
-  uint64_t start, end;
-
-  reset_perftime();
-  start = perftime();
   for (i = 0; i < iters; ++i) {
-    char dh_pubkey_a[DH_BYTES], dh_pubkey_b[DH_BYTES];
-    char secret_a[DH_BYTES], secret_b[DH_BYTES];
-    ssize_t slen_a, slen_b;
-    crypto_dh_t *dh_a = crypto_dh_new(DH_TYPE_TLS);
-    crypto_dh_t *dh_b = crypto_dh_new(DH_TYPE_TLS);
-    crypto_dh_generate_public(dh_a);
-    crypto_dh_generate_public(dh_b);
-    crypto_dh_get_public(dh_a, dh_pubkey_a, sizeof(dh_pubkey_a));
-    crypto_dh_get_public(dh_b, dh_pubkey_b, sizeof(dh_pubkey_b));
-    slen_a = crypto_dh_compute_secret(LOG_NOTICE,
-                                      dh_a, dh_pubkey_b, sizeof(dh_pubkey_b),
-                                      secret_a, sizeof(secret_a));
-    slen_b = crypto_dh_compute_secret(LOG_NOTICE,
-                                      dh_b, dh_pubkey_a, sizeof(dh_pubkey_a),
-                                      secret_b, sizeof(secret_b));
-    tor_assert(slen_a == slen_b);
-    tor_assert(fast_memeq(secret_a, secret_b, slen_a));
-    crypto_dh_free(dh_a);
-    crypto_dh_free(dh_b);
+    const int j = i % BENCH_POLICY_N_ADDRS;
+    sum += compare_tor_addr_to_short_policy(&arg->addrs[j], arg->ports[j],
+                                            arg->short_policy);
   }
-  end = perftime();
-  printf("Complete DH handshakes (1024 bit, public and private ops):\n"
-         "      %f millisec each.\n", NANOCOUNT(start, end, iters)/1e6);
+  return sum;
 }
 
+/** Run exit policy benchmarks. */
 static void
-bench_ecdh_impl(int nid, const char *name)
+bench_policy(void)
 {
-  const int iters = 1<<10;
+  /* Mostly the ports that clients ask for, and some that they don't. */
+  static const uint16_t common_ports[] = { 80, 443, 443, 443, 22, 25, 6667,
+                                           8080, 9001, 5222 };
+  bench_policy_arg_t arg;
   int i;
-  uint64_t start, end;
 
-  reset_perftime();
-  start = perftime();
-  for (i = 0; i < iters; ++i) {
-    char secret_a[DH_BYTES], secret_b[DH_BYTES];
-    ssize_t slen_a, slen_b;
-    EC_KEY *dh_a = EC_KEY_new_by_curve_name(nid);
-    EC_KEY *dh_b = EC_KEY_new_by_curve_name(nid);
-    if (!dh_a || !dh_b) {
-      puts("Skipping.  (No implementation?)");
-      return;
-    }
+  arg.addrs = tor_calloc(BENCH_POLICY_N_ADDRS, sizeof(tor_addr_t));
+  arg.ports = tor_calloc(BENCH_POLICY_N_ADDRS, sizeof(uint16_t));
+  for (i = 0; i < BENCH_POLICY_N_ADDRS; ++i) {
+    tor_addr_from_ipv4h(&arg.addrs[i],
+                        (uint32_t)crypto_rand_uint64(UINT32_MAX));
+    arg.ports[i] = (i & 1) ? (uint16_t)(1 + crypto_rand_int(65535)) :
+      common_ports[i % ARRAY_LENGTH(common_ports)];
+  }
+  arg.policy = NULL;
+  policies_parse_exit_policy(NULL, &arg.policy,
+                             EXIT_POLICY_IPV6_ENABLED |
+                             EXIT_POLICY_REJECT_PRIVATE |
+                             EXIT_POLICY_ADD_DEFAULT, NULL);
+  arg.short_policy = parse_short_policy(bench_short_policy);
+  tor_assert(arg.short_policy);
+
+  bench_run_case("policy/parse_default", bench_policy_parse_case, NULL,
+                 2000);
+  bench_run_case("policy/compare", bench_policy_compare_case, &arg,
+                 1000000);
+  bench_run_case("policy/compare_short", bench_policy_compare_short_case,
+                 &arg, 1000000);
+
+  addr_policy_list_free(arg.policy);
+  short_policy_free(arg.short_policy);
+  tor_free(arg.addrs);
+  tor_free(arg.ports);
+}
 
-    EC_KEY_generate_key(dh_a);
-    EC_KEY_generate_key(dh_b);
-    slen_a = ECDH_compute_key(secret_a, DH_BYTES,
-                              EC_KEY_get0_public_key(dh_b), dh_a,
-                              NULL);
-    slen_b = ECDH_compute_key(secret_b, DH_BYTES,
-                              EC_KEY_get0_public_key(dh_a), dh_b,
-                              NULL);
+/** Argument for the bench_rand cases. */
+typedef struct bench_rand_arg_t {
+  size_t len;
+  int fast;
+} bench_rand_arg_t;
 
-    tor_assert(slen_a == slen_b);
-    tor_assert(fast_memeq(secret_a, secret_b, slen_a));
-    EC_KEY_free(dh_a);
-    EC_KEY_free(dh_b);
+/** Case for bench_rand: get <b>len</b> random bytes. */
+static uint64_t
+bench_rand_bytes_case(void *arg_, int iters)
+{
+  const bench_rand_arg_t *arg = arg_;
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  uint8_t buf[CELL_PAYLOAD_SIZE];
+  uint64_t sum = 0;
+  int i;
+  tor_assert(arg->len <= sizeof(buf));
+  for (i = 0; i < iters; ++i) {
+    if (arg->fast)
+      crypto_fast_rng_getbytes(rng, buf, arg->len);
+    else
+      crypto_rand((char *)buf, arg->len);
+    sum += buf[0];
   }
-  end = perftime();
-  printf("Complete ECDH %s handshakes (2 public and 2 private ops):\n"
-         "      %f millisec each.\n", name, NANOCOUNT(start, end, iters)/1e6);
+  return sum;
 }
 
-static void
-bench_ecdh_p256(void)
+/** Case for bench_rand: pick a random int below 1000, as we do for
+ * padding timeouts. */
+static uint64_t
+bench_rand_int_case(void *arg_, int iters)
 {
-  bench_ecdh_impl(NID_X9_62_prime256v1, "P-256");
+  const bench_rand_arg_t *arg = arg_;
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  uint64_t sum = 0;
+  int i;
+  for (i = 0; i < iters; ++i) {
+    if (arg->fast)
+      sum += crypto_fast_rng_get_uint(rng, 1000);
+    else
+      sum += crypto_rand_int(1000);
+  }
+  return sum;
 }
 
+/** Compare crypto_rand() with the per-thread fast generator. */
 static void
-bench_ecdh_p224(void)
+bench_rand(void)
 {
-  bench_ecdh_impl(NID_secp224r1, "P-224");
+  static const size_t lens[] = { 4, 16, CELL_PAYLOAD_SIZE };
+  bench_rand_arg_t arg;
+  char name[64];
+  unsigned i;
+
+  for (arg.fast = 0; arg.fast < 2; ++arg.fast) {
+    const char *which = arg.fast ? "fast_rng" : "crypto_rand";
+    for (i = 0; i < ARRAY_LENGTH(lens); ++i) {
+      arg.len = lens[i];
+      tor_snprintf(name, sizeof(name), "rand/%s_bytes(%d)", which,
+                   (int)lens[i]);
+      bench_run_case(name, bench_rand_bytes_case, &arg, 100000);
+    }
+    tor_snprintf(name, sizeof(name), "rand/%s_int", which);
+    bench_run_case(name, bench_rand_int_case, &arg, 100000);
+  }
 }
 
 typedef void (*bench_fn)(void);
@@ -634,6 +2568,7 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(hashtable),
   ENT(siphash),
   ENT(digest),
   ENT(aes),
@@ -643,9 +2578,19 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(relay_forward),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(geoip),
+  ENT(address_set),
+  ENT(replaycache),
+  ENT(buffers),
+  ENT(maps),
+  ENT(parse),
+  ENT(compress),
+  ENT(policy),
+  ENT(rand),
   {NULL,NULL,0}
 };
 
@@ -667,9 +2612,12 @@ int
 main(int argc, const char **argv)
 {
   int i;
-  int list=0, n_enabled=0;
+  int list=0, n_enabled=0, n_regressions=0;
   char *errmsg;
   or_options_t *options;
+  const char *json_fname = NULL;
+  smartlist_t *baseline = NULL;
+  double threshold = 5.0;
 
   tor_threads_init();
   tor_compress_init();
@@ -698,6 +2646,28 @@ main(int argc, const char **argv)
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--reps") && i + 1 < argc) {
+      int ok = 0;
+      bench_n_reps = (int)tor_parse_long(argv[++i], 10, 1, 100000, &ok, NULL);
+      if (!ok) {
+        printf("--reps needs a positive number\n");
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--json") && i + 1 < argc) {
+      json_fname = argv[++i];
+    } else if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+      baseline = bench_load_baseline(argv[++i]);
+      if (!baseline) {
+        printf("Couldn't read baseline from %s\n", argv[i]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+      int ok = 0;
+      threshold = tor_parse_double(argv[++i], 0, 1000, &ok, NULL);
+      if (!ok) {
+        printf("--threshold needs a percentage\n");
+        return 1;
+      }
     } else {
       benchmark_t *benchmark = find_benchmark(argv[i]);
       ++n_enabled;
@@ -739,6 +2709,21 @@ main(int argc, const char **argv)
     }
   }
 
-  return 0;
+  if (json_fname && bench_write_json(json_fname) < 0) {
+    printf("Couldn't write results to %s\n", json_fname);
+    return 1;
+  }
+  if (baseline) {
+    n_regressions = bench_compare_baseline(baseline, threshold);
+    SMARTLIST_FOREACH(baseline, bench_result_t *, r, bench_result_free(r));
+    smartlist_free(baseline);
+  }
+  if (bench_results) {
+    SMARTLIST_FOREACH(bench_results, bench_result_t *, r,
+                      bench_result_free(r));
+    smartlist_free(bench_results);
+  }
+
+  return n_regressions ? 2 : 0;
 }
 
@@ -29,6 +29,7 @@
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
 #define MAIN_PRIVATE
+#define ONION_PRIVATE
 #define STATEFILE_PRIVATE
 
 /*
@@ -42,6 +43,7 @@ double fabs(double x);
 #include "or/or.h"
 #include "lib/err/backtrace.h"
 #include "common/buffers.h"
+#include "or/channel.h"
 #include "or/circuitlist.h"
 #include "or/circuitstats.h"
 #include "lib/compress/compress.h"
@@ -356,6 +358,207 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Number of circuits that the onion queue tests saw marked for close. */
+static int onion_queue_n_marked = 0;
+
+static void
+mock_circuit_mark_for_close_count(circuit_t *circ, int reason, int line,
+                                  const char *file)
+{
+  (void)circ;
+  (void)reason;
+  (void)line;
+  (void)file;
+  ++onion_queue_n_marked;
+}
+
+static int
+mock_channel_get_addr_none(channel_t *chan, tor_addr_t *addr_out)
+{
+  (void)chan;
+  (void)addr_out;
+  return 0;
+}
+
+/** Queue an ntor create request for <b>circ</b>, and return what
+ * onion_pending_add() returns. */
+static int
+onion_queue_add_ntor(or_circuit_t *circ)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+  int r;
+
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  r = onion_pending_add(circ, create);
+  if (r < 0)
+    tor_free(create);
+  return r;
+}
+
+#define N_FAIR_CIRCS 52
+
+/** Run unit tests for the fair queueing of the onion queues. */
+static void
+test_onion_queue_fairness(void *arg)
+{
+  static const int expected[] = { 0, 4, 1, 5, 2, 3 };
+  channel_t *chan1 = tor_malloc_zero(sizeof(channel_t));
+  channel_t *chan2 = tor_malloc_zero(sizeof(channel_t));
+  or_circuit_t *circs[N_FAIR_CIRCS] = { NULL };
+  create_cell_t *onionskin = NULL;
+  int old_max_delay = get_options()->MaxOnionQueueDelay;
+  int i;
+  (void)arg;
+
+  MOCK(channel_get_addr_if_possible, mock_channel_get_addr_none);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_count);
+  onion_queue_n_marked = 0;
+
+  for (i = 0; i < N_FAIR_CIRCS; ++i)
+    circs[i] = or_circuit_new(0, NULL);
+  /* Make sure that the two channels get different flows. */
+  chan1->global_identifier = 1;
+  chan2->global_identifier = 2;
+  circs[0]->p_chan = chan1;
+  circs[1]->p_chan = chan2;
+  while (onion_queue_flow_idx(circs[0]) == onion_queue_flow_idx(circs[1]))
+    ++chan2->global_identifier;
+
+  /* Four requests from the first channel, then two from the second: the
+   * channels take turns. */
+  for (i = 0; i < 6; ++i) {
+    circs[i]->p_chan = i < 4 ? chan1 : chan2;
+    tt_int_op(0, OP_EQ, onion_queue_add_ntor(circs[i]));
+  }
+  tt_int_op(6, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  for (i = 0; i < 6; ++i) {
+    tt_ptr_op(circs[expected[i]], OP_EQ, onion_next_task(&onionskin));
+    tor_free(onionskin);
+  }
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+  tt_int_op(0, OP_EQ, onion_queue_n_marked);
+
+  /* Fill the queue from the first channel. When it's full, the first
+   * channel can't add any more, but the second one can take the place of
+   * the oldest request of the first one. */
+  get_options_mutable()->MaxOnionQueueDelay = 0;
+  for (i = 0; i < N_FAIR_CIRCS - 2; ++i) {
+    circs[i]->p_chan = chan1;
+    tt_int_op(0, OP_EQ, onion_queue_add_ntor(circs[i]));
+  }
+  circs[i]->p_chan = chan1;
+  tt_int_op(-1, OP_EQ, onion_queue_add_ntor(circs[i]));
+  ++i;
+  circs[i]->p_chan = chan2;
+  tt_int_op(0, OP_EQ, onion_queue_add_ntor(circs[i]));
+  tt_int_op(1, OP_EQ, onion_queue_n_marked);
+  tt_ptr_op(NULL, OP_EQ, circs[0]->onionqueue_entry);
+  tt_int_op(N_FAIR_CIRCS - 2, OP_EQ,
+            onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+  tt_ptr_op(circs[1], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_ptr_op(circs[N_FAIR_CIRCS - 1], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+
+ done:
+  get_options_mutable()->MaxOnionQueueDelay = old_max_delay;
+  clear_pending_onions();
+  for (i = 0; i < N_FAIR_CIRCS; ++i) {
+    if (circs[i]) {
+      circs[i]->p_chan = NULL;
+      circuit_free_(TO_CIRCUIT(circs[i]));
+    }
+  }
+  tor_free(chan1);
+  tor_free(chan2);
+  tor_free(onionskin);
+  UNMOCK(channel_get_addr_if_possible);
+  UNMOCK(circuit_mark_for_close_);
+}
+
+#undef N_FAIR_CIRCS
+
+#define N_CODEL_CIRCS 8
+
+/** Run unit tests for CoDel in the onion queues. */
+static void
+test_onion_queue_codel(void *arg)
+{
+  const uint64_t START_NSEC = ((uint64_t)1389288246) * 1000000000;
+  const uint64_t MSEC = 1000000;
+  or_circuit_t *circs[N_CODEL_CIRCS] = { NULL };
+  create_cell_t *onionskin = NULL;
+  onion_queue_stats_t before;
+  const onion_queue_stats_t *after;
+  int i;
+  (void)arg;
+
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_count);
+  onion_queue_n_marked = 0;
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(START_NSEC);
+  memcpy(&before, onion_queue_get_stats(ONION_HANDSHAKE_TYPE_NTOR),
+         sizeof(before));
+
+  for (i = 0; i < N_CODEL_CIRCS; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    tt_int_op(0, OP_EQ, onion_queue_add_ntor(circs[i]));
+  }
+
+  /* Under the target: nothing happens. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 50 * MSEC);
+  tt_ptr_op(circs[0], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+
+  /* Over the target, but not for a whole interval yet. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 200 * MSEC);
+  tt_ptr_op(circs[1], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(0, OP_EQ, onion_queue_n_marked);
+
+  /* Over the target for an interval: we drop one request, and won't drop
+   * another for an interval. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 1300 * MSEC);
+  tt_ptr_op(circs[3], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(1, OP_EQ, onion_queue_n_marked);
+  tt_ptr_op(circs[4], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(1, OP_EQ, onion_queue_n_marked);
+
+  /* Then we drop the next one, and the one after that comes sooner. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 2300 * MSEC);
+  tt_ptr_op(circs[6], OP_EQ, onion_next_task(&onionskin));
+  tor_free(onionskin);
+  tt_int_op(2, OP_EQ, onion_queue_n_marked);
+  monotime_coarse_set_mock_time_nsec(START_NSEC + 3007 * MSEC);
+  tt_ptr_op(NULL, OP_EQ, onion_next_task(&onionskin));
+  tt_int_op(3, OP_EQ, onion_queue_n_marked);
+
+  after = onion_queue_get_stats(ONION_HANDSHAKE_TYPE_NTOR);
+  tt_u64_op(after->n_processed - before.n_processed, OP_EQ, 5);
+  tt_u64_op(after->n_codel_dropped - before.n_codel_dropped, OP_EQ, 3);
+  /* 50 msec; 200 msec; 1300 msec twice; 2300 msec. */
+  tt_u64_op(after->delay_hist[6] - before.delay_hist[6], OP_EQ, 1);
+  tt_u64_op(after->delay_hist[8] - before.delay_hist[8], OP_EQ, 1);
+  tt_u64_op(after->delay_hist[11] - before.delay_hist[11], OP_EQ, 2);
+  tt_u64_op(after->delay_hist[12] - before.delay_hist[12], OP_EQ, 1);
+
+ done:
+  clear_pending_onions();
+  for (i = 0; i < N_CODEL_CIRCS; ++i) {
+    if (circs[i])
+      circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  tor_free(onionskin);
+  monotime_disable_test_mocking();
+  UNMOCK(circuit_mark_for_close_);
+}
+
+#undef N_CODEL_CIRCS
+
 static crypto_cipher_t *crypto_rand_aes_cipher = NULL;
 
 // Mock replacement for crypto_rand: Generates bytes from a provided AES_CTR
@@ -822,6 +1025,8 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  ENT(onion_queue_fairness),
+  ENT(onion_queue_codel),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
@@ -857,6 +1062,7 @@ struct testgroup_t testgroups[] = {
   { "conscache/", conscache_tests },
   { "consdiff/", consdiff_tests },
   { "consdiffmgr/", consdiffmgr_tests },
+  { "cpuworker/", cpuworker_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
@@ -887,6 +1093,7 @@ struct testgroup_t testgroups[] = {
   { "keypin/", keypin_tests },
   { "link-handshake/", link_handshake_tests },
   { "mainloop/", mainloop_tests },
+  { "metrics/", metrics_tests },
   { "nodelist/", nodelist_tests },
   { "oom/", oom_tests },
   { "oos/", oos_tests },
@@ -1,6 +1,8 @@
 /* Copyright (c) 2017-2018, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define NODELIST_PRIVATE
+
 #include "or/or.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "common/address_set.h"
@@ -84,6 +86,115 @@ test_contains(void *arg)
   address_set_free(set);
 }
 
+static void
+test_remove(void *arg)
+{
+  address_set_t *set = NULL;
+  tor_addr_t addr_v4, addr_v6;
+  uint32_t ipv4h;
+  int i;
+
+  (void) arg;
+
+  tor_addr_parse(&addr_v4, "42.42.42.42");
+  ipv4h = tor_addr_to_ipv4h(&addr_v4);
+  tor_addr_parse(&addr_v6, "1:2:3:4::");
+
+  set = address_set_new(1024);
+  tt_int_op(address_set_add(set, &addr_v6), OP_EQ, 0);
+  tt_int_op(address_set_add_ipv4h(set, ipv4h), OP_EQ, 0);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2);
+
+  tt_int_op(address_set_remove(set, &addr_v6), OP_EQ, 1);
+  tt_int_op(address_set_probably_contains(set, &addr_v6), OP_EQ, 0);
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 1);
+  /* It's gone, so we can't remove it again. */
+  tt_int_op(address_set_remove(set, &addr_v6), OP_EQ, 0);
+
+  /* An address added twice stays until it is removed twice. */
+  tt_int_op(address_set_add(set, &addr_v4), OP_EQ, 0);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2);
+  tt_int_op(address_set_remove_ipv4h(set, ipv4h), OP_EQ, 1);
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 1);
+  tt_int_op(address_set_remove_ipv4h(set, ipv4h), OP_EQ, 1);
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 0);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 0);
+  address_set_free(set);
+
+  /* Copies of an address share a slot, even past what one slot can count:
+   * far more of them than the 64 slots of the smallest set fit. */
+  set = address_set_new(1);
+  for (i = 0; i < 1000; ++i)
+    tt_int_op(address_set_add(set, &addr_v6), OP_EQ, 0);
+  tt_int_op(address_set_add(set, &addr_v4), OP_EQ, 0);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 1001);
+  for (i = 0; i < 999; ++i)
+    tt_int_op(address_set_remove(set, &addr_v6), OP_EQ, 1);
+  tt_int_op(address_set_probably_contains(set, &addr_v6), OP_EQ, 1);
+  tt_int_op(address_set_remove(set, &addr_v6), OP_EQ, 1);
+  tt_int_op(address_set_probably_contains(set, &addr_v6), OP_EQ, 0);
+  tt_int_op(address_set_remove(set, &addr_v6), OP_EQ, 0);
+  tt_int_op(address_set_probably_contains(set, &addr_v4), OP_EQ, 1);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 1);
+
+ done:
+  address_set_free(set);
+}
+
+static void
+test_full(void *arg)
+{
+  address_set_t *set = NULL;
+  tor_addr_t *addrs = NULL;
+  const int n = 4096;
+  int i, n_added = 0, n_fp = 0;
+
+  (void) arg;
+
+  /* The smallest set holds 64 fingerprints; fill it until it fails. */
+  set = address_set_new(1);
+  addrs = tor_calloc(n, sizeof(tor_addr_t));
+  for (i = 0; i < n; ++i)
+    tor_addr_from_ipv4h(&addrs[i], (uint32_t)i + 1);
+  for (i = 0; i < n; ++i) {
+    if (address_set_add(set, &addrs[i]) < 0)
+      break;
+    ++n_added;
+  }
+  tt_int_op(n_added, OP_LT, n);
+  /* 64 slots, and the one that was left without a slot, unless some
+   * addresses were unlucky enough to share a slot. */
+  tt_int_op(n_added, OP_LE, 70);
+  /* Everything that went in must still be there, even if it ended up
+   * without a slot. */
+  tt_int_op(address_set_get_n_items(set), OP_EQ, n_added);
+  for (i = 0; i < n_added; ++i)
+    tt_int_op(address_set_probably_contains(set, &addrs[i]), OP_EQ, 1);
+
+  /* Removing an address makes room again. */
+  tt_int_op(address_set_remove(set, &addrs[0]), OP_EQ, 1);
+  for (i = 1; i < n_added; ++i)
+    tt_int_op(address_set_probably_contains(set, &addrs[i]), OP_EQ, 1);
+  address_set_free(set);
+
+  /* A set that's big enough holds everything, with few false positives. */
+  set = address_set_new(n);
+  for (i = 0; i < n; ++i)
+    tt_int_op(address_set_add(set, &addrs[i]), OP_EQ, 0);
+  for (i = 0; i < n; ++i) {
+    tor_addr_t other;
+    tt_int_op(address_set_probably_contains(set, &addrs[i]), OP_EQ, 1);
+    tor_addr_from_ipv4h(&other, (uint32_t)(n + i + 1));
+    n_fp += address_set_probably_contains(set, &other);
+  }
+  /* The expected rate is about 8 in 65536. */
+  tt_int_op(n_fp, OP_LT, 16);
+
+ done:
+  address_set_free(set);
+  tor_free(addrs);
+}
+
 static void
 test_nodelist(void *arg)
 {
@@ -160,6 +271,15 @@ test_nodelist(void *arg)
   ret = nodelist_probably_contains_address(&dummy_addr);
   tt_int_op(ret, OP_EQ, 0);
 
+  /* Drop the rs from the consensus: its node goes away, and so do its
+   * addresses, without the set being rebuilt. */
+  smartlist_clear(dummy_ns->routerstatus_list);
+  nodelist_set_consensus(dummy_ns);
+  ret = nodelist_probably_contains_address(&addr_v4);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = nodelist_probably_contains_address(&addr_v6);
+  tt_int_op(ret, OP_EQ, 0);
+
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
   smartlist_clear(dummy_ns->routerstatus_list);
@@ -169,11 +289,112 @@ test_nodelist(void *arg)
   UNMOCK(get_estimated_address_per_node);
 }
 
+static void
+test_nodelist_shared_address(void *arg)
+{
+  const int n_nodes = 20;
+  int i;
+  const address_set_t *set;
+  microdesc_t *md = NULL;
+  tor_addr_t addr_v4, addr_v6, md_addr;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+  MOCK(get_estimated_address_per_node,
+       mock_get_estimated_address_per_node);
+
+  dummy_ns = tor_malloc_zero(sizeof(*dummy_ns));
+  dummy_ns->flavor = FLAV_MICRODESC;
+  dummy_ns->routerstatus_list = smartlist_new();
+
+  tor_addr_parse(&addr_v4, "42.42.42.42");
+  tor_addr_parse(&addr_v6, "1:2:3:4::");
+  tor_addr_parse(&md_addr, "5:6:7:8::");
+  addr_per_node = 2;
+
+  /* Many more nodes on one address than a pair of buckets has slots: they
+   * must all share one slot. */
+  for (i = 0; i < n_nodes; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(*rs));
+    crypto_rand(rs->identity_digest, sizeof(rs->identity_digest));
+    crypto_rand(rs->descriptor_digest, sizeof(rs->descriptor_digest));
+    rs->addr = tor_addr_to_ipv4h(&addr_v4);
+    tor_addr_copy(&rs->ipv6_addr, &addr_v6);
+    smartlist_add(dummy_ns->routerstatus_list, rs);
+  }
+  nodelist_set_consensus(dummy_ns);
+
+  set = nodelist_get_address_set();
+  tt_assert(set);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2 * n_nodes);
+  tt_int_op(nodelist_probably_contains_address(&addr_v4), OP_EQ, 1);
+  tt_int_op(nodelist_probably_contains_address(&addr_v6), OP_EQ, 1);
+
+  /* A microdescriptor with an address of its own adds it, and removing the
+   * microdescriptor takes it away again. */
+  md = tor_malloc_zero(sizeof(*md));
+  {
+    routerstatus_t *rs = smartlist_get(dummy_ns->routerstatus_list, 0);
+    memcpy(md->digest, rs->descriptor_digest, DIGEST256_LEN);
+  }
+  tor_addr_copy(&md->ipv6_addr, &md_addr);
+  md->ipv6_orport = 9001;
+  tt_assert(nodelist_add_microdesc(md));
+  tt_int_op(nodelist_probably_contains_address(&md_addr), OP_EQ, 1);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2 * n_nodes + 1);
+  nodelist_remove_microdesc(
+         ((routerstatus_t *)smartlist_get(dummy_ns->routerstatus_list, 0))
+           ->identity_digest, md);
+  tt_int_op(nodelist_probably_contains_address(&md_addr), OP_EQ, 0);
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2 * n_nodes);
+
+  /* Dropping all but one of the nodes keeps the addresses. */
+  while (smartlist_len(dummy_ns->routerstatus_list) > 1) {
+    routerstatus_t *rs = smartlist_pop_last(dummy_ns->routerstatus_list);
+    routerstatus_free(rs);
+  }
+  nodelist_set_consensus(dummy_ns);
+  set = nodelist_get_address_set();
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 2);
+  tt_int_op(nodelist_probably_contains_address(&addr_v4), OP_EQ, 1);
+  tt_int_op(nodelist_probably_contains_address(&addr_v6), OP_EQ, 1);
+
+  /* Dropping the last one removes them. */
+  SMARTLIST_FOREACH(dummy_ns->routerstatus_list, routerstatus_t *, rs,
+                    routerstatus_free(rs));
+  smartlist_clear(dummy_ns->routerstatus_list);
+  nodelist_set_consensus(dummy_ns);
+  set = nodelist_get_address_set();
+  tt_int_op(address_set_get_n_items(set), OP_EQ, 0);
+  tt_int_op(nodelist_probably_contains_address(&addr_v4), OP_EQ, 0);
+  tt_int_op(nodelist_probably_contains_address(&addr_v6), OP_EQ, 0);
+
+ done:
+  microdesc_free(md);
+  SMARTLIST_FOREACH(dummy_ns->routerstatus_list, routerstatus_t *, rs,
+                    routerstatus_free(rs));
+  smartlist_clear(dummy_ns->routerstatus_list);
+  networkstatus_vote_free(dummy_ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+  UNMOCK(get_estimated_address_per_node);
+}
+
 struct testcase_t address_set_tests[] = {
   { "contains", test_contains, TT_FORK,
     NULL, NULL },
+  { "remove", test_remove, TT_FORK,
+    NULL, NULL },
+  { "full", test_full, TT_FORK,
+    NULL, NULL },
   { "nodelist", test_nodelist, TT_FORK,
     NULL, NULL },
+  { "nodelist_shared_address", test_nodelist_shared_address, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -10,6 +10,7 @@
 #include "or/circuitbuild.h"
 #include "or/circuitlist.h"
 #include "or/circuitmux_ewma.h"
+#include "or/circuituse.h"
 #include "or/hs_circuitmap.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -180,6 +181,94 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+/** Test lookups of many circuits on one channel, which go through the
+ * channel's own circuit ID table. */
+static void
+test_clist_circid_table(void *arg)
+{
+#define N_CIRCS 300
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *circs[N_CIRCS];
+  int i;
+
+  (void) arg;
+
+  memset(circs, 0, sizeof(circs));
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+
+  for (i = 0; i < N_CIRCS; ++i) {
+    circs[i] = or_circuit_new(i * 7 + 1, ch1);
+    tt_assert(circs[i]);
+  }
+  /* The same IDs on another channel are other circuits. */
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch2), OP_EQ, NULL);
+  for (i = 0; i < N_CIRCS; ++i) {
+    tt_ptr_op(circuit_get_by_circid_channel(i * 7 + 1, ch1), OP_EQ,
+              TO_CIRCUIT(circs[i]));
+    tt_assert(! circuit_id_in_use_on_channel(i * 7 + 2, ch1));
+  }
+
+  /* Free every other circuit. */
+  for (i = 0; i < N_CIRCS; i += 2) {
+    circuit_free_(TO_CIRCUIT(circs[i]));
+    circs[i] = NULL;
+  }
+  for (i = 0; i < N_CIRCS; ++i) {
+    tt_ptr_op(circuit_get_by_circid_channel(i * 7 + 1, ch1), OP_EQ,
+              circs[i] ? TO_CIRCUIT(circs[i]) : NULL);
+  }
+
+  /* IDs pending a destroy are in use until the destroy is sent. */
+  channel_mark_circid_unusable(ch1, 1);
+  tt_int_op(circuit_id_in_use_on_channel(1, ch1), OP_EQ, 2);
+  tt_int_op(circuit_id_in_use_on_channel(8, ch1), OP_EQ, 1);
+  channel_mark_circid_usable(ch1, 1);
+  tt_int_op(circuit_id_in_use_on_channel(1, ch1), OP_EQ, 0);
+
+  /* Free almost all of the rest; the table shrinks as we go. */
+  for (i = 1; i < N_CIRCS - 2; i += 2) {
+    circuit_free_(TO_CIRCUIT(circs[i]));
+    circs[i] = NULL;
+  }
+  tt_ptr_op(circuit_get_by_circid_channel((N_CIRCS - 1) * 7 + 1, ch1), OP_EQ,
+            TO_CIRCUIT(circs[N_CIRCS - 1]));
+  tt_ptr_op(circuit_get_by_circid_channel(8, ch1), OP_EQ, NULL);
+
+  /* A channel's placeholders go away with it, so that a new channel at the
+   * same address doesn't find them in the global map only. */
+  channel_mark_circid_unusable(ch2, 5);
+  channel_mark_circid_unusable(ch2, 6);
+  tt_int_op(circuit_id_in_use_on_channel(5, ch2), OP_EQ, 2);
+  chan_circid_table_free(ch2->circid_table);
+  tt_int_op(circuit_id_in_use_on_channel(5, ch2), OP_EQ, 0);
+  channel_mark_circid_unusable(ch2, 5);
+  tt_int_op(circuit_id_in_use_on_channel(5, ch2), OP_EQ, 2);
+  channel_mark_circid_usable(ch2, 5);
+  tt_int_op(circuit_id_in_use_on_channel(5, ch2), OP_EQ, 0);
+  circs[0] = or_circuit_new(6, ch2);
+  tt_ptr_op(circuit_get_by_circid_channel(6, ch2), OP_EQ,
+            TO_CIRCUIT(circs[0]));
+
+ done:
+  for (i = 0; i < N_CIRCS; ++i) {
+    if (circs[i])
+      circuit_free_(TO_CIRCUIT(circs[i]));
+  }
+  chan_circid_table_free(ch1->circid_table);
+  chan_circid_table_free(ch2->circid_table);
+  tor_free(ch1->cmux);
+  tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+#undef N_CIRCS
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -462,12 +551,57 @@ test_hs_circuitmap_isolation(void *arg)
   circuit_free_(TO_CIRCUIT(circ4));
 }
 
+/** Test that origin circuits are kept in the list for their purpose. */
+static void
+test_purpose_lists(void *arg)
+{
+  origin_circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL;
+  smartlist_t *general, *hsdir;
+
+  (void)arg;
+
+  general = circuit_get_origin_circuits_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
+  hsdir = circuit_get_origin_circuits_by_purpose(CIRCUIT_PURPOSE_C_HSDIR_GET);
+
+  c1 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  c2 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  c3 = origin_circuit_init(CIRCUIT_PURPOSE_C_HSDIR_GET, 0);
+  tt_int_op(smartlist_len(general), OP_EQ, 2);
+  tt_assert(smartlist_contains(general, c1));
+  tt_assert(smartlist_contains(general, c2));
+  tt_int_op(smartlist_len(hsdir), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(hsdir, 0), OP_EQ, c3);
+
+  /* Changing the purpose of a circuit moves it to the other list. */
+  circuit_change_purpose(TO_CIRCUIT(c1), CIRCUIT_PURPOSE_C_HSDIR_GET);
+  tt_int_op(smartlist_len(general), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(general, 0), OP_EQ, c2);
+  tt_int_op(c2->purpose_list_idx, OP_EQ, 0);
+  tt_int_op(smartlist_len(hsdir), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(hsdir, 1), OP_EQ, c1);
+
+  /* Freeing a circuit removes it, and the other circuits keep the right
+   * index. */
+  circuit_free_(TO_CIRCUIT(c3));
+  c3 = NULL;
+  tt_int_op(smartlist_len(hsdir), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(hsdir, 0), OP_EQ, c1);
+  tt_int_op(c1->purpose_list_idx, OP_EQ, 0);
+
+ done:
+  circuit_free_(TO_CIRCUIT(c1));
+  circuit_free_(TO_CIRCUIT(c2));
+  circuit_free_(TO_CIRCUIT(c3));
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_table", test_clist_circid_table, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
     TT_FORK, NULL, NULL },
+  { "purpose_lists", test_purpose_lists, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "common/compat_libevent.h"
+#include "common/profiler.h"
 
 #include <event2/event.h>
 
@@ -179,12 +180,106 @@ test_compat_libevent_postloop_events(void *arg)
   periodic_timer_free(timed);
 }
 
+/* Mainloop event callback to count how many times it has run. */
+static void
+profiled_event_cb(mainloop_event_t *ev, void *arg)
+{
+  (void)ev;
+  int *ctr = arg;
+  ++*ctr;
+}
+
+static void
+test_compat_libevent_profiler(void *arg)
+{
+  (void)arg;
+  mainloop_event_t *ev = NULL, *other = NULL;
+  profiler_entry_t *ent, *other_ent;
+  char *entries = NULL, *heartbeat = NULL;
+  int counter = 0, other_counter = 0;
+  struct timeval ten_ms = { 0, 10 * 1000 };
+
+  tor_libevent_postfork();
+
+  /* Names are normalized. */
+  tt_ptr_op(profiler_entry_get(PROFILER_KIND_CONN, "OR read"), OP_EQ,
+            profiler_entry_get(PROFILER_KIND_CONN, "OR_read"));
+  tt_ptr_op(profiler_entry_get(PROFILER_KIND_CONN, "OR read"), OP_NE,
+            profiler_entry_get(PROFILER_KIND_EVENT, "OR read"));
+
+  /* Events are profiled under the name of their callback, unless we say
+   * otherwise. */
+  ev = mainloop_event_new(profiled_event_cb, &counter);
+  other = mainloop_event_new(profiled_event_cb, &other_counter);
+  other_ent = profiler_entry_get(PROFILER_KIND_PERIODIC, "other");
+  mainloop_event_set_profiler_entry(other, other_ent);
+
+  mainloop_event_schedule(ev, &ten_ms);
+  mainloop_event_activate(other);
+  while (counter < 1 || other_counter < 1) {
+    if (tor_libevent_run_event_loop(tor_libevent_get_base(), 1) == -1)
+      break;
+  }
+
+  ent = profiler_entry_get(PROFILER_KIND_EVENT, "profiled_event_cb");
+  tt_u64_op(profiler_entry_get_n_calls(ent), OP_EQ, 1);
+  tt_u64_op(profiler_entry_get_n_calls(other_ent), OP_EQ, 1);
+
+  /* Both events were due, so we measured their lag. */
+  entries = profiler_format_entries();
+  tt_assert(!strcmpstart(entries, "lag count=2 "));
+  tt_assert(strstr(entries, "\nevent/profiled_event_cb calls=1 "));
+  tt_assert(strstr(entries, "\nperiodic/other calls=1 "));
+  tt_ptr_op(strstr(entries, "conn/OR_read"), OP_EQ, NULL);
+
+  /* The heartbeat lists what ran since the last one. */
+  heartbeat = profiler_format_heartbeat();
+  tt_assert(heartbeat);
+  tt_assert(strstr(heartbeat, "event/profiled_event_cb (max "));
+  tt_assert(strstr(heartbeat, "Events ran up to "));
+  tor_free(heartbeat);
+  heartbeat = profiler_format_heartbeat();
+  tt_ptr_op(heartbeat, OP_EQ, NULL);
+
+  /* A cancelled event doesn't count as late. */
+  mainloop_event_activate(ev);
+  mainloop_event_cancel(ev);
+  mainloop_event_activate(other);
+  while (other_counter < 2) {
+    if (tor_libevent_run_event_loop(tor_libevent_get_base(), 1) == -1)
+      break;
+  }
+  tor_free(entries);
+  entries = profiler_format_entries();
+  tt_assert(!strcmpstart(entries, "lag count=3 "));
+  tt_int_op(counter, OP_EQ, 1);
+
+  /* Freeing everything forgets the measurements, but the entries that
+   * callbacks still point to stay valid. */
+  profiler_free_all();
+  tt_u64_op(profiler_entry_get_n_calls(other_ent), OP_EQ, 0);
+  tt_ptr_op(profiler_entry_get(PROFILER_KIND_PERIODIC, "other"), OP_EQ,
+            other_ent);
+  tor_free(entries);
+  entries = profiler_format_entries();
+  tt_assert(!strcmpstart(entries, "lag count=0 "));
+  tt_ptr_op(strchr(entries, '\n'), OP_EQ, NULL);
+
+ done:
+  mainloop_event_free(ev);
+  mainloop_event_free(other);
+  tor_free(entries);
+  tor_free(heartbeat);
+  profiler_free_all();
+}
+
 struct testcase_t compat_libevent_tests[] = {
   { "logging_callback", test_compat_libevent_logging_callback,
     TT_FORK, NULL, NULL },
   { "header_version", test_compat_libevent_header_version, 0, NULL, NULL },
   { "postloop_events", test_compat_libevent_postloop_events,
     TT_FORK, NULL, NULL },
+  { "profiler", test_compat_libevent_profiler, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
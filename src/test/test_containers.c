@@ -7,6 +7,7 @@
 #include "or/or.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "or/fp_pair.h"
+#include "common/hyperloglog.h"
 #include "test/test.h"
 
 /** Helper: return a tristate based on comparing the strings in *<b>a</b> and
@@ -663,6 +664,65 @@ test_container_digestset(void *arg)
   smartlist_free(included);
 }
 
+/** Helper: return a well-mixed 64-bit hash of <b>x</b>, so that the
+ * hyperloglog tests are deterministic. */
+static uint64_t
+hll_test_hash(uint64_t x)
+{
+  x += UINT64_C(0x9e3779b97f4a7c15);
+  x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+/** Run unit tests for hyperloglog unique-count sketches. */
+static void
+test_container_hyperloglog(void *arg)
+{
+  hyperloglog_t *a = NULL, *b = NULL;
+  uint64_t i, est;
+  (void)arg;
+
+  tt_int_op(hyperloglog_size(11), OP_GE, 2048);
+
+  a = hyperloglog_new(11);
+  b = hyperloglog_new(11);
+  tt_assert(a);
+  tt_u64_op(hyperloglog_estimate(a), OP_EQ, 0);
+
+  /* Small counts are exact, or nearly so. */
+  for (i = 0; i < 10; ++i)
+    hyperloglog_add_hash(a, hll_test_hash(i));
+  tt_u64_op(hyperloglog_estimate(a), OP_EQ, 10);
+
+  /* Adding the same items again doesn't change anything. */
+  for (i = 0; i < 10; ++i)
+    hyperloglog_add_hash(a, hll_test_hash(i));
+  tt_u64_op(hyperloglog_estimate(a), OP_EQ, 10);
+
+  /* Large counts are within a few standard errors (about 2.3% each). */
+  for (i = 0; i < 100000; ++i)
+    hyperloglog_add_hash(a, hll_test_hash(i));
+  est = hyperloglog_estimate(a);
+  tt_u64_op(est, OP_GT, 90000);
+  tt_u64_op(est, OP_LT, 110000);
+
+  /* Merging gives the count of the union. */
+  for (i = 50000; i < 150000; ++i)
+    hyperloglog_add_hash(b, hll_test_hash(i));
+  hyperloglog_merge(b, a);
+  est = hyperloglog_estimate(b);
+  tt_u64_op(est, OP_GT, 135000);
+  tt_u64_op(est, OP_LT, 165000);
+
+  hyperloglog_clear(b);
+  tt_u64_op(hyperloglog_estimate(b), OP_EQ, 0);
+
+ done:
+  hyperloglog_free(a);
+  hyperloglog_free(b);
+}
+
 typedef struct pq_entry_t {
   const char *val;
   int idx;
@@ -883,6 +943,79 @@ test_container_strmap(void *arg)
   tor_free(v105);
 }
 
+/** Run digestmap_t through many insertions and removals, so that its
+ * table has to grow and reuse the slots of removed entries. */
+static void
+test_container_digestmap_churn(void *arg)
+{
+#define KEY(i) (keys + (i) * DIGEST_LEN)
+  digestmap_t *map = digestmap_new();
+  const int N = 2000;
+  char *keys = tor_calloc(N, DIGEST_LEN);
+  char *present = tor_malloc_zero(N);
+  digestmap_iter_t *iter;
+  int i, round, n_present = 0;
+  (void)arg;
+
+  for (i = 0; i < N; ++i) {
+    crypto_rand(KEY(i), DIGEST_LEN);
+  }
+
+  for (round = 0; round < 5; ++round) {
+    for (i = 0; i < N; ++i) {
+      int k = crypto_rand_int(N);
+      if (present[k]) {
+        tt_ptr_op(digestmap_remove(map, KEY(k)), OP_EQ, KEY(k));
+        present[k] = 0;
+        --n_present;
+      } else {
+        tt_ptr_op(digestmap_set(map, KEY(k), KEY(k)), OP_EQ, NULL);
+        present[k] = 1;
+        ++n_present;
+      }
+    }
+    digestmap_assert_ok(map);
+    tt_int_op(digestmap_size(map), OP_EQ, n_present);
+    for (i = 0; i < N; ++i) {
+      tt_ptr_op(digestmap_get(map, KEY(i)), OP_EQ,
+                present[i] ? KEY(i) : NULL);
+    }
+  }
+
+  /* Remove every other entry while iterating; each remaining entry must
+   * be visited exactly once. */
+  for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter); ) {
+    const char *k;
+    void *v;
+    int idx;
+    digestmap_iter_get(iter, &k, &v);
+    tt_mem_op(k, OP_EQ, v, DIGEST_LEN);
+    idx = (int)(((char*)v - keys) / DIGEST_LEN);
+    tt_int_op(present[idx], OP_EQ, 1);
+    present[idx] = 2;
+    if (idx & 1) {
+      iter = digestmap_iter_next_rmv(map, iter);
+      present[idx] = 0;
+      --n_present;
+    } else {
+      iter = digestmap_iter_next(map, iter);
+    }
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, n_present);
+  for (i = 0; i < N; ++i) {
+    tt_int_op(present[i], OP_NE, 1);
+    tt_ptr_op(digestmap_get(map, KEY(i)), OP_EQ,
+              present[i] ? KEY(i) : NULL);
+  }
+
+ done:
+  digestmap_free(map, NULL);
+  tor_free(keys);
+  tor_free(present);
+#undef KEY
+}
+
 static void
 test_container_smartlist_remove(void *arg)
 {
@@ -1285,7 +1418,9 @@ struct testcase_t container_tests[] = {
   CONTAINER(smartlist_ints_eq, 0),
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
+  CONTAINER(hyperloglog, 0),
   CONTAINER_LEGACY(strmap),
+  CONTAINER(digestmap_churn, 0),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
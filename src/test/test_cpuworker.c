@@ -0,0 +1,235 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CPUWORKER_PRIVATE
+
+#include "or/or.h"
+#include "common/compat_libevent.h"
+#include "common/workqueue.h"
+#include "lib/crypt_ops/crypto_rand.h"
+#include "or/circuitbuild.h"
+#include "or/config.h"
+#include "or/cpuworker.h"
+#include "or/onion.h"
+#include "or/onion_fast.h"
+#include "or/router.h"
+
+#include "or/channel.h"
+#include "or/or_circuit_st.h"
+
+#include "test/test.h"
+
+/* Work functions that keep every worker thread busy until we let them go,
+ * so that the batches we queue stay on the threadpool without starting. */
+static tor_mutex_t blocker_lock;
+static tor_cond_t blocker_cond;
+static int n_blockers_running = 0;
+static int blockers_released = 0;
+
+static workqueue_reply_t
+blocker_threadfn(void *state, void *arg)
+{
+  (void) state;
+  (void) arg;
+  tor_mutex_acquire(&blocker_lock);
+  ++n_blockers_running;
+  tor_cond_signal_all(&blocker_cond);
+  while (!blockers_released)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+blocker_replyfn(void *arg)
+{
+  (void) arg;
+}
+
+/* Start one blocker on each of the <b>n</b> worker threads, and wait until
+ * all of them are running. */
+static void
+block_workers(int n)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    cpuworker_queue_work(WQ_PRI_HIGH, blocker_threadfn, blocker_replyfn,
+                         NULL);
+  }
+  tor_mutex_acquire(&blocker_lock);
+  while (n_blockers_running < n)
+    tor_cond_wait(&blocker_cond, &blocker_lock, NULL);
+  tor_mutex_release(&blocker_lock);
+}
+
+static void
+release_workers(void)
+{
+  tor_mutex_acquire(&blocker_lock);
+  blockers_released = 1;
+  tor_cond_signal_all(&blocker_cond);
+  tor_mutex_release(&blocker_lock);
+}
+
+/* Circuits that got an answer, in order. */
+static smartlist_t *answered = NULL;
+
+static int
+mock_onionskin_answer(or_circuit_t *circ,
+                      const created_cell_t *created_cell,
+                      const char *keys, size_t keys_len,
+                      const uint8_t *rend_circ_nonce)
+{
+  (void) created_cell;
+  (void) keys;
+  (void) keys_len;
+  (void) rend_circ_nonce;
+  smartlist_add(answered, circ);
+  return 0;
+}
+
+/* Return a new CREATE_FAST onionskin. */
+static create_cell_t *
+new_onionskin(void)
+{
+  uint8_t onionskin[CREATE_FAST_LEN];
+  create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+  crypto_rand((char *) onionskin, sizeof(onionskin));
+  create_cell_init(cc, CELL_CREATE_FAST, ONION_HANDSHAKE_TYPE_FAST,
+                   CREATE_FAST_LEN, onionskin);
+  return cc;
+}
+
+/* Handle replies until <b>n</b> circuits have been answered, or until we
+ * give up. */
+static void
+wait_for_answers(int n)
+{
+  replyqueue_t *rq = threadpool_get_replyqueue(cpuworker_get_threadpool());
+  int i;
+  for (i = 0; i < 5000 && smartlist_len(answered) < n; ++i) {
+    replyqueue_process(rq);
+    tor_sleep_msec(1);
+  }
+}
+
+#define N_CIRCS 12
+
+static void
+test_cpuworker_batches(void *arg)
+{
+  or_circuit_t *circs[N_CIRCS];
+  channel_t *chan = NULL;
+  workqueue_entry_t *batch_entry;
+  int i;
+
+  (void) arg;
+  memset(circs, 0, sizeof(circs));
+  tor_mutex_init(&blocker_lock);
+  tor_cond_init(&blocker_cond);
+  answered = smartlist_new();
+  MOCK(onionskin_answer, mock_onionskin_answer);
+
+  /* The worker threads copy our onion keys, which need a lock. */
+  tt_int_op(init_keys_client(), OP_EQ, 0);
+  /* Two worker threads. */
+  get_options_mutable()->NumCPUs = 1;
+  cpu_init();
+  chan = tor_malloc_zero(sizeof(channel_t));
+  for (i = 0; i < N_CIRCS; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(or_circuit_t));
+    circs[i]->base_.magic = OR_CIRCUIT_MAGIC;
+    circs[i]->p_chan = chan;
+  }
+#define ASSIGN(i)                                                       \
+  tt_int_op(assign_onionskin_to_cpuworker(circs[i], new_onionskin()),   \
+            OP_EQ, 0)
+
+  block_workers(2);
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 0);
+
+  /* Nothing is waiting for a worker, so the first onionskin goes alone. */
+  ASSIGN(0);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_NE, NULL);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 0);
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 1);
+
+  /* Now the workers are busy, so the next ones wait in the open batch,
+   * until there are CPUWORKER_BATCH_MAX of them. */
+  for (i = 1; i < 8; ++i) {
+    ASSIGN(i);
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, NULL);
+    tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, i);
+  }
+  ASSIGN(8);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 0);
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 2);
+  batch_entry = circs[1]->workqueue_entry;
+  tt_ptr_op(batch_entry, OP_NE, NULL);
+  tt_ptr_op(batch_entry, OP_NE, circs[0]->workqueue_entry);
+  for (i = 2; i <= 8; ++i)
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, batch_entry);
+
+  /* Cancelling a circuit in the open batch just drops it. */
+  ASSIGN(9);
+  ASSIGN(10);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 2);
+  cpuworker_cancel_circ_handshake(circs[9]);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 1);
+
+  /* The postloop event queues what's left of the open batch. */
+  tt_int_op(tor_libevent_run_event_loop(tor_libevent_get_base(), 1),
+            OP_EQ, 0);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 0);
+  tt_ptr_op(circs[10]->workqueue_entry, OP_NE, NULL);
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 3);
+
+  /* Cancelling a circuit in a queued batch takes it out, and queues the
+   * others again. */
+  cpuworker_cancel_circ_handshake(circs[3]);
+  tt_ptr_op(circs[3]->workqueue_entry, OP_EQ, NULL);
+  batch_entry = circs[1]->workqueue_entry;
+  tt_ptr_op(batch_entry, OP_NE, NULL);
+  for (i = 2; i <= 8; ++i) {
+    if (i != 3)
+      tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, batch_entry);
+  }
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 3);
+
+  /* This one stays in the open batch, since we won't run the loop. */
+  ASSIGN(11);
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 1);
+
+  /* Every queued circuit but the cancelled one gets its answer. */
+  release_workers();
+  wait_for_answers(N_CIRCS - 3);
+  tt_int_op(smartlist_len(answered), OP_EQ, N_CIRCS - 3);
+  tt_assert(! smartlist_contains(answered, circs[3]));
+  tt_assert(! smartlist_contains(answered, circs[9]));
+  tt_assert(! smartlist_contains(answered, circs[11]));
+  for (i = 0; i <= 10; ++i) {
+    if (i != 3 && i != 9) {
+      tt_assert(smartlist_contains(answered, circs[i]));
+      tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, NULL);
+    }
+  }
+  tt_int_op(threadpool_get_n_queued(cpuworker_get_threadpool()), OP_EQ, 0);
+
+  /* The open batch goes away when we free everything. */
+  cpuworker_free_all();
+  tt_int_op(cpuworker_get_open_batch_len(), OP_EQ, 0);
+
+#undef ASSIGN
+ done:
+  release_workers();
+  UNMOCK(onionskin_answer);
+  smartlist_free(answered);
+  for (i = 0; i < N_CIRCS; ++i)
+    tor_free(circs[i]);
+  tor_free(chan);
+}
+
+struct testcase_t cpuworker_tests[] = {
+  { "batches", test_cpuworker_batches, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
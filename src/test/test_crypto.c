@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #define CRYPTO_CURVE25519_PRIVATE
 #define CRYPTO_RAND_PRIVATE
+#define CRYPTO_RAND_FAST_PRIVATE
 #include "or/or.h"
 #include "test/test.h"
 #include "lib/crypt_ops/aes.h"
@@ -16,6 +17,13 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "ed25519_vectors.inc"
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 /** Run unit tests for Diffie-Hellman functionality. */
 static void
 test_crypto_dh(void *arg)
@@ -276,6 +284,123 @@ test_crypto_rng_range(void *arg)
   ;
 }
 
+static void
+test_crypto_rng_fast(void *arg)
+{
+  uint8_t seed[48], other_seed[48];
+  uint8_t a[10000], b[10000];
+  crypto_fast_rng_t *rng1 = NULL, *rng2 = NULL;
+  int got_smallest = 0, got_largest = 0;
+  size_t off;
+  int i;
+  (void)arg;
+
+  memset(seed, 0x11, sizeof(seed));
+  memcpy(other_seed, seed, sizeof(seed));
+  other_seed[0] ^= 1;
+
+  /* The same seed gives the same output, however we ask for it, and across
+   * refills. */
+  rng1 = crypto_fast_rng_new_from_seed(seed);
+  rng2 = crypto_fast_rng_new_from_seed(seed);
+  crypto_fast_rng_getbytes(rng1, a, sizeof(a));
+  for (off = 0; off < sizeof(b); off += 7)
+    crypto_fast_rng_getbytes(rng2, b + off, MIN(7, sizeof(b) - off));
+  tt_mem_op(a, OP_EQ, b, sizeof(a));
+  tt_assert(! tor_mem_is_zero((char*)a, sizeof(a)));
+  tt_mem_op(a, OP_NE, a + 4096, 64);
+  crypto_fast_rng_free(rng2);
+
+  /* A different seed doesn't. */
+  rng2 = crypto_fast_rng_new_from_seed(other_seed);
+  crypto_fast_rng_getbytes(rng2, b, sizeof(b));
+  tt_mem_op(a, OP_NE, b, 64);
+  crypto_fast_rng_free(rng2);
+
+  /* After a fork, we reseed from crypto_rand(). */
+  rng2 = crypto_fast_rng_new_from_seed(seed);
+  crypto_fast_rng_free(rng1);
+  rng1 = crypto_fast_rng_new_from_seed(seed);
+  crypto_fast_rng_note_fork();
+  crypto_fast_rng_getbytes(rng1, a, 64);
+  crypto_fast_rng_getbytes(rng2, b, 64);
+  tt_mem_op(a, OP_NE, b, 64);
+
+  for (i = 0; i < 1000; ++i) {
+    unsigned x = crypto_fast_rng_uint_range(rng1, 5, 9);
+    tt_uint_op(x, OP_GE, 5);
+    tt_uint_op(x, OP_LT, 9);
+    if (x == 5)
+      got_smallest = 1;
+    if (x == 8)
+      got_largest = 1;
+  }
+  /* These fail with probability 1/10^603. */
+  tt_assert(got_smallest);
+  tt_assert(got_largest);
+
+  got_smallest = got_largest = 0;
+  for (i = 0; i < 1000; ++i) {
+    uint64_t x = crypto_fast_rng_get_uint64(rng1, 10);
+    double d = crypto_fast_rng_get_double(rng1);
+    tt_u64_op(x, OP_LT, 10);
+    tt_double_op(d, OP_GE, 0.0);
+    tt_double_op(d, OP_LT, 1.0);
+    if (x == 0)
+      got_smallest = 1;
+    if (x == 9)
+      got_largest = 1;
+  }
+  tt_assert(got_smallest);
+  tt_assert(got_largest);
+
+  /* Each thread keeps its generator until we destroy it. */
+  tt_ptr_op(get_thread_fast_rng(), OP_EQ, get_thread_fast_rng());
+  destroy_thread_fast_rng();
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), a, 16);
+
+ done:
+  crypto_fast_rng_free(rng1);
+  crypto_fast_rng_free(rng2);
+}
+
+#ifndef _WIN32
+static void
+test_crypto_rng_fast_fork(void *arg)
+{
+  uint8_t mine[32], theirs[32];
+  int fds[2] = { -1, -1 };
+  pid_t pid;
+  (void)arg;
+
+  /* Make sure that we have a generator before we fork. */
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), mine, 1);
+
+  tt_int_op(pipe(fds), OP_EQ, 0);
+  pid = fork();
+  tt_int_op(pid, OP_GE, 0);
+  if (pid == 0) {
+    crypto_fast_rng_getbytes(get_thread_fast_rng(), theirs, sizeof(theirs));
+    if (write_all(fds[1], (char*)theirs, sizeof(theirs), 0) !=
+        sizeof(theirs))
+      _exit(1);
+    _exit(0);
+  }
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), mine, sizeof(mine));
+  tt_int_op(read_all(fds[0], (char*)theirs, sizeof(theirs), 0), OP_EQ,
+            sizeof(theirs));
+  waitpid(pid, NULL, 0);
+  /* The child must not have handed out the bytes that we did. */
+  tt_mem_op(mine, OP_NE, theirs, sizeof(mine));
+
+ done:
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+}
+#endif /* !defined(_WIN32) */
+
 static void
 test_crypto_rng_strongest(void *arg)
 {
@@ -3007,6 +3132,10 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(formats),
   CRYPTO_LEGACY(rng),
   { "rng_range", test_crypto_rng_range, 0, NULL, NULL },
+  { "rng_fast", test_crypto_rng_fast, TT_FORK, NULL, NULL },
+#ifndef _WIN32
+  { "rng_fast_fork", test_crypto_rng_fast_fork, TT_FORK, NULL, NULL },
+#endif
   { "rng_strongest", test_crypto_rng_strongest, TT_FORK, NULL, NULL },
   { "rng_strongest_nosyscall", test_crypto_rng_strongest, TT_FORK,
     &passthrough_setup, (void*)"nosyscall" },
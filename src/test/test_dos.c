@@ -8,6 +8,7 @@
 #include "or/or.h"
 #include "or/dos.h"
 #include "or/circuitlist.h"
+#include "or/config.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "or/geoip.h"
 #include "or/channel.h"
@@ -219,11 +220,9 @@ test_dos_bucket_refill(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, addr, NULL, now);
   dos_new_client_conn(&or_conn);
 
-  /* Fetch this client from the geoip cache and get its DoS structs */
-  clientmap_entry_t *entry = geoip_lookup_client(addr, NULL,
-                                                 GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  dos_client_stats_t* dos_stats = &entry->dos_stats;
+  /* Fetch this client from the DoS state table and get its DoS structs */
+  dos_client_stats_t* dos_stats = dos_state_lookup(addr);
+  tt_assert(dos_stats);
   /* Check that the circuit bucket is still uninitialized */
   tt_uint_op(dos_stats->cc_stats.circuit_bucket, OP_EQ, 0);
 
@@ -422,7 +421,7 @@ test_dos_bucket_refill(void *arg)
 static void
 test_known_relay(void *arg)
 {
-  clientmap_entry_t *entry = NULL;
+  dos_client_stats_t *entry = NULL;
   routerstatus_t *rs = NULL; microdesc_t *md = NULL; routerinfo_t *ri = NULL;
 
   (void) arg;
@@ -465,10 +464,9 @@ test_known_relay(void *arg)
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  /* We should have a count of 0. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 0);
+  entry = dos_state_lookup(&or_conn.real_addr);
+  /* We shouldn't be tracking it at all. */
+  tt_ptr_op(entry, OP_EQ, NULL);
 
   /* To make sure that his is working properly, make a unknown client
    * connection and see if we do get it. */
@@ -476,10 +474,10 @@ test_known_relay(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &or_conn.real_addr, NULL, 0);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
+  entry = dos_state_lookup(&or_conn.real_addr);
   tt_assert(entry);
   /* We should have a count of 2. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 2);
+  tt_uint_op(entry->concurrent_count, OP_EQ, 2);
 
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
@@ -492,12 +490,166 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/** Test that the DoS subsystem counts the addresses of a prefix as one
+ * client. */
+static void
+test_dos_prefix_aggregation(void *arg)
+{
+  or_connection_t or_conn;
+  dos_client_stats_t *stats;
+  uint32_t max_concurrent_conns, i;
+  char buf[TOR_ADDR_BUF_LEN];
+
+  (void) arg;
+
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  memset(&or_conn, 0, sizeof(or_conn));
+
+  /* With the default prefix lengths, every IPv4 address is on its own... */
+  dos_init();
+  max_concurrent_conns = get_param_conn_max_concurrent_count(NULL);
+  tor_addr_parse(&or_conn.real_addr, "18.0.0.1");
+  dos_new_client_conn(&or_conn);
+  tor_addr_parse(&or_conn.real_addr, "18.0.0.2");
+  dos_new_client_conn(&or_conn);
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 2);
+  stats = dos_state_lookup(&or_conn.real_addr);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+
+  /* ... but a whole IPv6 /64 is a single client. Spreading connections over
+   * it doesn't get around the connection limit. */
+  for (i = 0; i <= max_concurrent_conns; i++) {
+    tor_snprintf(buf, sizeof(buf), "2001:db8::%x:%x", i >> 16, i & 0xffff);
+    tt_int_op(AF_INET6, OP_EQ, tor_addr_parse(&or_conn.real_addr, buf));
+    dos_new_client_conn(&or_conn);
+  }
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 3);
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(&or_conn.real_addr));
+  tor_addr_parse(&or_conn.real_addr, "2001:db8::1:2:3:4");
+  tt_int_op(DOS_CONN_DEFENSE_CLOSE, OP_EQ,
+            dos_conn_addr_get_defense_type(&or_conn.real_addr));
+  /* Another /64 isn't affected. */
+  tor_addr_parse(&or_conn.real_addr, "2001:db8:0:1::1");
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(&or_conn.real_addr));
+
+  /* Closing a connection from any address of the prefix counts for all of
+   * them. */
+  tor_addr_parse(&or_conn.real_addr, "2001:db8::ffff");
+  or_conn.tracked_for_dos_mitigation = 1;
+  dos_close_client_conn(&or_conn);
+  tt_int_op(DOS_CONN_DEFENSE_NONE, OP_EQ,
+            dos_conn_addr_get_defense_type(&or_conn.real_addr));
+
+  /* Aggregating IPv4 addresses works the same way. */
+  get_options_mutable()->DoSIPv4PrefixLength = 24;
+  dos_init();
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 0);
+  tor_addr_parse(&or_conn.real_addr, "18.0.0.1");
+  dos_new_client_conn(&or_conn);
+  tor_addr_parse(&or_conn.real_addr, "18.0.0.200");
+  dos_new_client_conn(&or_conn);
+  tor_addr_parse(&or_conn.real_addr, "18.0.1.1");
+  dos_new_client_conn(&or_conn);
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 2);
+  stats = dos_state_lookup(&or_conn.real_addr);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+  tor_addr_parse(&or_conn.real_addr, "18.0.0.99");
+  stats = dos_state_lookup(&or_conn.real_addr);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 2);
+
+ done:
+  dos_free_all();
+  UNMOCK(get_param_conn_enabled);
+}
+
+/** Test that the DoS state table stays within its size limit, and forgets
+ * idle prefixes to make room. */
+static void
+test_dos_state_table_limit(void *arg)
+{
+  or_connection_t or_conn;
+  dos_client_stats_t *stats;
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  uint32_t i;
+
+  (void) arg;
+
+  MOCK(get_param_cc_enabled, mock_enable_dos_protection);
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  memset(&or_conn, 0, sizeof(or_conn));
+  get_options_mutable()->DoSMaxTrackedPrefixes = 1000;
+  update_approx_time(now);
+  dos_init();
+  tt_uint_op(get_param_max_tracked_prefixes(NULL), OP_EQ, 1000);
+
+  /* Fill the table with busy prefixes. */
+  for (i = 0; i < 1000; i++) {
+    tor_addr_from_ipv4h(&or_conn.real_addr, 0x12000000 + i);
+    dos_new_client_conn(&or_conn);
+    tt_assert(dos_state_lookup(&or_conn.real_addr));
+  }
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 1000);
+
+  /* There is no room for a new one. */
+  tor_addr_from_ipv4h(&or_conn.real_addr, 0x13000000);
+  setup_full_capture_of_logs(LOG_NOTICE);
+  dos_new_client_conn(&or_conn);
+  expect_single_log_msg_containing("which is the maximum");
+  teardown_capture_of_logs();
+  tt_ptr_op(dos_state_lookup(&or_conn.real_addr), OP_EQ, NULL);
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 1000);
+
+  /* Close the connection of every prefix, but have half of them use up
+   * their circuit bucket so that they aren't idle. */
+  for (i = 0; i < 1000; i++) {
+    tor_addr_from_ipv4h(&or_conn.real_addr, 0x12000000 + i);
+    stats = dos_state_lookup(&or_conn.real_addr);
+    tt_assert(stats);
+    if (i & 1) {
+      cc_stats_refill_bucket(&stats->cc_stats, &or_conn.real_addr);
+      stats->cc_stats.circuit_bucket = 0;
+    }
+    stats->concurrent_count = 0;
+  }
+
+  /* Idle prefixes are forgotten to make room, but only once a second. */
+  tor_addr_from_ipv4h(&or_conn.real_addr, 0x13000001);
+  dos_new_client_conn(&or_conn);
+  tt_ptr_op(dos_state_lookup(&or_conn.real_addr), OP_EQ, NULL);
+  update_approx_time(++now);
+  dos_new_client_conn(&or_conn);
+  tt_assert(dos_state_lookup(&or_conn.real_addr));
+  tt_uint_op(dos_state_n_entries(), OP_EQ, 501);
+  for (i = 0; i < 1000; i++) {
+    tor_addr_from_ipv4h(&or_conn.real_addr, 0x12000000 + i);
+    stats = dos_state_lookup(&or_conn.real_addr);
+    if (i & 1) {
+      tt_assert(stats);
+    } else {
+      tt_ptr_op(stats, OP_EQ, NULL);
+    }
+  }
+
+ done:
+  teardown_capture_of_logs();
+  dos_free_all();
+  UNMOCK(get_param_cc_enabled);
+  UNMOCK(get_param_conn_enabled);
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "prefix_aggregation", test_dos_prefix_aggregation, TT_FORK, NULL, NULL },
+  { "state_table_limit", test_dos_state_table_limit, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -379,6 +379,83 @@ test_geoip_with_pt(void *arg)
   tor_free(s);
 }
 
+/** Run unit tests for counting clients with sketches instead of
+ * remembering their addresses. */
+static void
+test_geoip_sketch(void *arg)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  char *s = NULL;
+  const char *cp;
+  int i, n_clients;
+  tor_addr_t addr;
+  struct in6_addr in6;
+
+  (void)arg;
+  get_options_mutable()->BridgeRelay = 1;
+  get_options_mutable()->BridgeRecordUsageByCountry = 1;
+  get_options_mutable()->SketchClientStatistics = 1;
+
+  memset(&in6, 0, sizeof(in6));
+  geoip_bridge_stats_init(now - 86400);
+
+  /* No clients seen yet. */
+  s = geoip_get_transport_history();
+  tt_ptr_op(s, OP_EQ, NULL);
+
+  /* 500 clients without a pluggable transport, 500 with "alpha", and
+   * another 500 that are seen with both, each of them twice. */
+  for (i = 0; i < 3000; ++i) {
+    int n = i % 1500;
+    SET_TEST_ADDRESS(n);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr,
+                           n < 500 ? NULL : "alpha", now - 7200);
+    if (n >= 1000)
+      geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now - 7200);
+  }
+
+  s = geoip_get_transport_history();
+  tt_assert(s);
+  tt_assert(!strcmpstart(s, "<OR>="));
+  tt_int_op(atoi(s + strlen("<OR>=")), OP_GT, 900);
+  tt_int_op(atoi(s + strlen("<OR>=")), OP_LT, 1100);
+  cp = strstr(s, ",alpha=");
+  tt_assert(cp);
+  tt_int_op(atoi(cp + strlen(",alpha=")), OP_GT, 900);
+  tt_int_op(atoi(cp + strlen(",alpha=")), OP_LT, 1100);
+  tor_free(s);
+
+  /* Every client shows up in the heartbeat once per transport. */
+  s = format_client_stats_heartbeat(now);
+  tt_assert(s);
+  cp = strstr(s, "I have seen ");
+  tt_assert(cp);
+  n_clients = atoi(cp + strlen("I have seen "));
+  tt_int_op(n_clients, OP_GT, 1800);
+  tt_int_op(n_clients, OP_LT, 2200);
+  tor_free(s);
+
+  /* ... but only while they are recent enough. */
+  s = format_client_stats_heartbeat(now + 6 * 3600);
+  tt_assert(s);
+  tt_assert(strstr(s, "I have seen 0 unique clients."));
+  tor_free(s);
+
+  /* The bridge stats say that their counts are estimates. */
+  s = geoip_format_bridge_stats(now);
+  tt_assert(s);
+  tt_assert(strstr(s, "\nbridge-ips-estimate-error 2.30%\n"));
+  tor_free(s);
+
+  /* Stop collecting bridge statistics. */
+  geoip_bridge_stats_term();
+  s = geoip_get_transport_history();
+  tt_ptr_op(s, OP_EQ, NULL);
+
+ done:
+  tor_free(s);
+}
+
 #undef SET_TEST_ADDRESS
 #undef SET_TEST_IPV6
 #undef CHECK_COUNTRY
@@ -561,6 +638,231 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+/** Check that lookups through the IPv4 direct index and the IPv6 prefix trie
+ * agree with the ranges we added, including ranges that span several index
+ * buckets and prefixes dense enough to need several trie levels. */
+static void
+test_geoip_index(void *arg)
+{
+  char line[128];
+  struct in6_addr in6;
+  int i;
+
+  (void)arg;
+
+  /* A range that spans many /16 buckets, added out of order. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("16777216,33554431,AB", AF_INET));
+  /* Many small ranges packed into a single /16, ending at its last address
+   * so that a range boundary coincides with a bucket boundary. */
+  for (i = 0; i < 256; ++i) {
+    uint32_t low = 0x0a000000 + i * 256;
+    tor_snprintf(line, sizeof(line), "%u,%u,%s", low + 16, low + 255,
+                 (i & 1) ? "XY" : "ZZ");
+    tt_int_op(0,OP_EQ, geoip_parse_entry(line, AF_INET));
+  }
+  tt_int_op(0,OP_EQ, geoip_parse_entry("4294967040,4294967295,AB", AF_INET));
+  /* An overlapping range is ignored. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("16777300,16777400,XY", AF_INET));
+
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(16777216)));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(16777350)));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x01800000)));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(33554431)));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(33554432));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0x0a000000));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0x0a00050f));
+  tt_str_op("xy",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a000510)));
+  tt_str_op("zz",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a0006ff)));
+  tt_str_op("xy",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a00ffff)));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0x0a010000));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0xffffffff)));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0));
+
+  /* Adding an entry after a lookup makes us rebuild the index. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("0,255,XY", AF_INET));
+  tt_str_op("xy",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0)));
+
+  /* Many adjacent /48s in one /32, added in reverse order, force the trie
+   * to split the /32 over several levels. */
+  for (i = 255; i >= 0; --i) {
+    tor_snprintf(line, sizeof(line), "2001:db8:%x::,2001:db8:%x:ffff:"
+                 "ffff:ffff:ffff:ffff,%s", i * 16, i * 16,
+                 (i & 1) ? "XY" : "ZZ");
+    tt_int_op(0,OP_EQ, geoip_parse_entry(line, AF_INET6));
+  }
+  tt_int_op(0,OP_EQ, geoip_parse_entry("2a00::,2a0f:ffff:ffff:ffff:ffff:"
+                                       "ffff:ffff:ffff,AB", AF_INET6));
+
+  for (i = 0; i < 256; ++i) {
+    tor_snprintf(line, sizeof(line), "2001:db8:%x::1", i * 16);
+    tt_int_op(1,OP_EQ, tor_inet_pton(AF_INET6, line, &in6));
+    tt_str_op((i & 1) ? "xy" : "zz",OP_EQ,
+              geoip_get_country_name(geoip_get_country_by_ipv6(&in6)));
+    tor_snprintf(line, sizeof(line), "2001:db8:%x::1", i * 16 + 1);
+    tt_int_op(1,OP_EQ, tor_inet_pton(AF_INET6, line, &in6));
+    tt_int_op(0,OP_EQ, geoip_get_country_by_ipv6(&in6));
+  }
+  tt_int_op(1,OP_EQ, tor_inet_pton(AF_INET6, "2a07:1234::5", &in6));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv6(&in6)));
+  tt_int_op(1,OP_EQ, tor_inet_pton(AF_INET6, "2a10::", &in6));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv6(&in6));
+  tt_int_op(1,OP_EQ, tor_inet_pton(AF_INET6, "::", &in6));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv6(&in6));
+
+ done:
+  clear_geoip_db();
+}
+
+/** Write a compiled GeoIP database for <b>family</b> to <b>fname</b>, with
+ * the given countries, ranges and index, in the format described at
+ * geoip_load_compiled_file(). Return 0 on success. */
+static int
+write_compiled_geoip(const char *fname, int family, const char *countries,
+                     const void *entries, size_t entries_len,
+                     uint32_t n_entries, const void *index_data,
+                     size_t index_len, uint32_t n_index)
+{
+  size_t countries_len = (strlen(countries) + 3) & ~(size_t)3;
+  size_t len = 64 + countries_len + entries_len + index_len;
+  char *buf = tor_malloc_zero(len);
+  int r;
+
+  memcpy(buf, "TORGEOIP", 8);
+  set_uint32(buf + 8, 0x01020304);
+  set_uint32(buf + 12, 1);
+  set_uint32(buf + 16, family);
+  set_uint32(buf + 20, (uint32_t)strlen(countries) / 2);
+  set_uint32(buf + 24, n_entries);
+  set_uint32(buf + 28, n_index);
+  memset(buf + 32, 'x', DIGEST_LEN);
+  memcpy(buf + 64, countries, strlen(countries));
+  memcpy(buf + 64 + countries_len, entries, entries_len);
+  memcpy(buf + 64 + countries_len + entries_len, index_data, index_len);
+  r = write_bytes_to_file(fname, buf, len, 1);
+  tor_free(buf);
+  return r;
+}
+
+static void
+test_geoip_load_compiled(void *arg)
+{
+  uint32_t entries4[2][3] = {
+    { 16777216, 33554431, 1 },
+    { 0x0a000000, 0x0a0000ff, 0 },
+  };
+  uint32_t *index4 = tor_calloc(65537, sizeof(uint32_t));
+  uint8_t entry6[36];
+  uint32_t node6[32];
+  struct in6_addr in6;
+  const char *fname = get_fname("geoip_compiled");
+  const char *fname6 = get_fname("geoip6_compiled");
+  int i;
+
+  (void)arg;
+
+  /* A direct index for the two IPv4 ranges above. */
+  for (i = 0; i < 65537; ++i)
+    index4[i] = (i <= 0x01ff) ? 0 : (i <= 0x0a00) ? 1 : 2;
+
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname, 4, "xyab",
+                                           entries4, sizeof(entries4), 2,
+                                           index4, 65537*4, 65537));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(16777300)));
+  tt_str_op("xy",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a000010)));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0x0a000100));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(0));
+  tt_str_op("7878787878787878787878787878787878787878", OP_EQ,
+            geoip_db_digest(AF_INET));
+
+  /* We can still add entries to a table that came from a compiled file. */
+  tt_int_op(0, OP_EQ, geoip_parse_entry("0,255,ZZ", AF_INET));
+  tt_str_op("zz",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0)));
+  tt_str_op("ab",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(16777300)));
+  tt_str_op("xy",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a000010)));
+
+  /* A database with a broken index is rejected, and the old table stays. */
+  index4[65536] = 5;
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname, 4, "xyab",
+                                           entries4, sizeof(entries4), 2,
+                                           index4, 65537*4, 65537));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_str_op("zz",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0)));
+
+  /* So is a truncated one. */
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname, 4, "xyab",
+                                           entries4, sizeof(entries4), 2,
+                                           index4, 65536*4, 65537));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname));
+
+  /* Country codes may contain digits, as the legacy "a1" and "o1" do, but
+   * nothing else. */
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname, 4, "x-ab",
+                                           entries4, sizeof(entries4), 2,
+                                           index4, 65537*4, 65537));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname));
+  index4[65536] = 2;
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname, 4, "a1ab",
+                                           entries4, sizeof(entries4), 2,
+                                           index4, 65537*4, 65537));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_str_op("a1",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv4(0x0a000010)));
+
+  /* An IPv6 database with a single trie node, covering 2001:db8::/32. */
+  memset(entry6, 0, sizeof(entry6));
+  tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, "2001:db8::", entry6));
+  tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6,
+                          "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff",
+                          entry6 + 16));
+  set_uint32(entry6 + 32, 0);
+  for (i = 0; i < 16; ++i) {
+    node6[i] = (i <= 2) ? 0 : 1;
+    node6[16 + i] = (i == 2) ? 1 : 0;
+  }
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname6, 6, "zz",
+                                           entry6, sizeof(entry6), 1,
+                                           node6, sizeof(node6), 1));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET6, fname6));
+  tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, "2001:db8::1", &in6));
+  tt_str_op("zz",OP_EQ, geoip_get_country_name(
+                          geoip_get_country_by_ipv6(&in6)));
+  tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, "2001:db9::1", &in6));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv6(&in6));
+  tt_int_op(1, OP_EQ, tor_inet_pton(AF_INET6, "3001:db8::1", &in6));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv6(&in6));
+
+  /* A trie node may not point at itself. */
+  node6[16 + 3] = (1u<<31) | 0;
+  tt_int_op(0, OP_EQ, write_compiled_geoip(fname6, 6, "zz",
+                                           entry6, sizeof(entry6), 1,
+                                           node6, sizeof(node6), 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname6));
+
+  /* And an IPv4 database is not an IPv6 database. */
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname));
+
+ done:
+  tor_free(index4);
+  geoip_free_all();
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -569,9 +871,12 @@ test_geoip_load_2nd_file(void *arg)
 struct testcase_t geoip_tests[] = {
   { "geoip", test_geoip, TT_FORK, NULL, NULL },
   { "geoip_with_pt", test_geoip_with_pt, TT_FORK, NULL, NULL },
+  { "sketch", test_geoip_sketch, TT_FORK, NULL, NULL },
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "index", test_geoip_index, TT_FORK, NULL, NULL },
+  { "load_compiled", test_geoip_load_compiled, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
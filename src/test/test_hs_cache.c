@@ -13,6 +13,7 @@
 #include "trunnel/ed25519_cert.h"
 #include "or/hs_cache.h"
 #include "or/rendcache.h"
+#include "or/config.h"
 #include "or/directory.h"
 #include "or/networkstatus.h"
 #include "or/connection.h"
@@ -546,6 +547,239 @@ test_client_cache(void *arg)
   }
 }
 
+/** Test that we don't decrypt descriptors that wouldn't change the client
+ * cache. */
+static void
+test_client_cache_skip_decode(void *arg)
+{
+  int retval;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+  char *desc_str = NULL, *old_desc_str = NULL, *new_desc_str = NULL;
+  const hs_cache_client_stats_t *stats = hs_cache_get_client_stats();
+  const hs_descriptor_t *cached_desc;
+  uint64_t rev;
+
+  (void) arg;
+
+  init_test();
+
+  MOCK(networkstatus_get_live_consensus,
+       mock_networkstatus_get_live_consensus);
+  parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                           &mock_ns.valid_after);
+  parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                           &mock_ns.fresh_until);
+  parse_rfc1123_time("Sat, 26 Oct 1985 16:00:00 UTC",
+                           &mock_ns.valid_until);
+
+  retval = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(retval, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  tt_assert(desc);
+  rev = desc->plaintext_data.revision_counter;
+  tt_u64_op(rev, OP_GT, 0);
+  retval = hs_desc_encode_descriptor(desc, &signing_kp, &desc_str);
+  tt_int_op(retval, OP_EQ, 0);
+  desc->plaintext_data.revision_counter = rev - 1;
+  retval = hs_desc_encode_descriptor(desc, &signing_kp, &old_desc_str);
+  tt_int_op(retval, OP_EQ, 0);
+  desc->plaintext_data.revision_counter = rev + 1;
+  retval = hs_desc_encode_descriptor(desc, &signing_kp, &new_desc_str);
+  tt_int_op(retval, OP_EQ, 0);
+
+  retval = hs_cache_store_as_client(desc_str, &signing_kp.pubkey);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_u64_op(stats->n_decoded, OP_EQ, 1);
+  tt_u64_op(stats->n_decode_skipped, OP_EQ, 0);
+
+  /* The same descriptor again: nothing to decrypt. */
+  retval = hs_cache_store_as_client(desc_str, &signing_kp.pubkey);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_u64_op(stats->n_decoded, OP_EQ, 1);
+  tt_u64_op(stats->n_decode_skipped, OP_EQ, 1);
+
+  /* An older descriptor: nothing to decrypt either. */
+  retval = hs_cache_store_as_client(old_desc_str, &signing_kp.pubkey);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_u64_op(stats->n_decoded, OP_EQ, 1);
+  tt_u64_op(stats->n_decode_skipped, OP_EQ, 2);
+  cached_desc = hs_cache_lookup_as_client(&signing_kp.pubkey);
+  tt_assert(cached_desc);
+  tt_u64_op(cached_desc->plaintext_data.revision_counter, OP_EQ, rev);
+
+  /* A newer one replaces it. */
+  retval = hs_cache_store_as_client(new_desc_str, &signing_kp.pubkey);
+  tt_int_op(retval, OP_EQ, 0);
+  tt_u64_op(stats->n_decoded, OP_EQ, 2);
+  tt_u64_op(stats->n_decode_skipped, OP_EQ, 2);
+  cached_desc = hs_cache_lookup_as_client(&signing_kp.pubkey);
+  tt_assert(cached_desc);
+  tt_u64_op(cached_desc->plaintext_data.revision_counter, OP_EQ, rev + 1);
+  tt_str_op(hs_cache_lookup_encoded_as_client(&signing_kp.pubkey), OP_EQ,
+            new_desc_str);
+
+ done:
+  UNMOCK(networkstatus_get_live_consensus);
+  hs_descriptor_free(desc);
+  tor_free(desc_str);
+  tor_free(old_desc_str);
+  tor_free(new_desc_str);
+  hs_cache_free_all();
+}
+
+/* Build a descriptor signed with a new key and return it encoded. */
+static char *
+helper_build_encoded_desc(hs_descriptor_t **desc_out)
+{
+  int ret;
+  char *desc_str = NULL;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  tt_assert(desc);
+  ret = hs_desc_encode_descriptor(desc, &signing_kp, &desc_str);
+  tt_int_op(ret, OP_EQ, 0);
+  *desc_out = desc;
+  return desc_str;
+
+ done:
+  hs_descriptor_free(desc);
+  return NULL;
+}
+
+static void
+test_dir_lru_eviction(void *arg)
+{
+  int ret;
+  char *desc1_str = NULL, *desc2_str = NULL, *desc3_str = NULL;
+  hs_descriptor_t *desc1 = NULL, *desc2 = NULL, *desc3 = NULL;
+  const hs_cache_dir_stats_t *stats = hs_cache_get_dir_stats();
+  const char *desc_out;
+  size_t two_entries;
+
+  (void) arg;
+
+  init_test();
+  get_options_mutable()->MaxMemInHSDirCache = UINT32_MAX;
+
+  desc1_str = helper_build_encoded_desc(&desc1);
+  desc2_str = helper_build_encoded_desc(&desc2);
+  desc3_str = helper_build_encoded_desc(&desc3);
+  tt_assert(desc1_str && desc2_str && desc3_str);
+
+  ret = hs_cache_store_as_dir(desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = hs_cache_store_as_dir(desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(stats->n_entries, OP_EQ, 2);
+  two_entries = stats->n_bytes;
+
+  /* Looking up the first descriptor makes the second one the least recently
+   * used. */
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_str_op(desc_out, OP_EQ, desc1_str);
+  tt_u64_op(stats->n_hits, OP_EQ, 1);
+
+  /* Leave room for two descriptors only. The third one evicts the second. */
+  get_options_mutable()->MaxMemInHSDirCache = two_entries + two_entries / 4;
+  ret = hs_cache_store_as_dir(desc3_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(stats->n_entries, OP_EQ, 2);
+  tt_u64_op(stats->n_evicted, OP_EQ, 1);
+  tt_u64_op(stats->n_bytes, OP_LE, two_entries + two_entries / 4);
+
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc2), NULL);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(stats->n_misses, OP_EQ, 1);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc3), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_u64_op(stats->n_hits, OP_EQ, 3);
+
+  /* A descriptor bigger than the whole cache is still kept on its own. */
+  get_options_mutable()->MaxMemInHSDirCache = 1;
+  ret = hs_cache_store_as_dir(desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(stats->n_entries, OP_EQ, 1);
+  tt_u64_op(stats->n_evicted, OP_EQ, 3);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc2), NULL);
+  tt_int_op(ret, OP_EQ, 1);
+
+  /* ... until the next cleanup. */
+  hs_cache_clean_as_dir(time(NULL));
+  tt_u64_op(stats->n_entries, OP_EQ, 0);
+  tt_u64_op(stats->n_bytes, OP_EQ, 0);
+  tt_u64_op(stats->n_evicted, OP_EQ, 4);
+  tt_u64_op(stats->n_expired, OP_EQ, 0);
+
+ done:
+  hs_descriptor_free(desc1);
+  hs_descriptor_free(desc2);
+  hs_descriptor_free(desc3);
+  tor_free(desc1_str);
+  tor_free(desc2_str);
+  tor_free(desc3_str);
+  hs_cache_free_all();
+}
+
+static void
+test_dir_compression(void *arg)
+{
+  int ret;
+  char *desc1_str = NULL, *desc2_str = NULL;
+  hs_descriptor_t *desc1 = NULL, *desc2 = NULL;
+  const hs_cache_dir_stats_t *stats = hs_cache_get_dir_stats();
+  const char *desc_out;
+  size_t compressed_size, plain_size;
+
+  (void) arg;
+
+  init_test();
+  get_options_mutable()->MaxMemInHSDirCache = UINT32_MAX;
+
+  desc1_str = helper_build_encoded_desc(&desc1);
+  desc2_str = helper_build_encoded_desc(&desc2);
+  tt_assert(desc1_str && desc2_str);
+  tt_int_op(strlen(desc1_str), OP_EQ, strlen(desc2_str));
+
+  get_options_mutable()->HSDirCacheCompression = 1;
+  ret = hs_cache_store_as_dir(desc1_str);
+  tt_int_op(ret, OP_EQ, 0);
+  compressed_size = stats->n_bytes;
+
+  get_options_mutable()->HSDirCacheCompression = 0;
+  ret = hs_cache_store_as_dir(desc2_str);
+  tt_int_op(ret, OP_EQ, 0);
+  plain_size = stats->n_bytes - compressed_size;
+  tt_u64_op(compressed_size, OP_LT, plain_size);
+
+  /* Both come back the way they were stored. */
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc1), &desc_out);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_str_op(desc_out, OP_EQ, desc1_str);
+  ret = hs_cache_lookup_as_dir(3, helper_get_hsdir_query(desc2), &desc_out);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_str_op(desc_out, OP_EQ, desc2_str);
+
+  /* Removing them gives back all the memory. */
+  cache_clean_v3_as_dir(time(NULL), time(NULL) + 100);
+  tt_u64_op(stats->n_entries, OP_EQ, 0);
+  tt_u64_op(stats->n_bytes, OP_EQ, 0);
+
+ done:
+  hs_descriptor_free(desc1);
+  hs_descriptor_free(desc2);
+  tor_free(desc1_str);
+  tor_free(desc2_str);
+  hs_cache_free_all();
+}
+
 struct testcase_t hs_cache[] = {
   /* Encoding tests. */
   { "directory", test_directory, TT_FORK,
@@ -558,6 +792,12 @@ struct testcase_t hs_cache[] = {
     NULL, NULL },
   { "client_cache", test_client_cache, TT_FORK,
     NULL, NULL },
+  { "client_cache_skip_decode", test_client_cache_skip_decode, TT_FORK,
+    NULL, NULL },
+  { "dir_lru_eviction", test_dir_lru_eviction, TT_FORK,
+    NULL, NULL },
+  { "dir_compression", test_dir_compression, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
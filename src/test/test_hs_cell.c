@@ -6,6 +6,7 @@
  * \brief Test hidden service cell functionality.
  */
 
+#define CIRCUITLIST_PRIVATE
 #define HS_INTROPOINT_PRIVATE
 #define HS_SERVICE_PRIVATE
 
@@ -15,11 +16,17 @@
 
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
+#include "or/circuitlist.h"
+#include "or/config.h"
 #include "or/hs_cell.h"
 #include "or/hs_intropoint.h"
 #include "or/hs_service.h"
+#include "or/replaycache.h"
+
+#include "or/origin_circuit_st.h"
 
 /* Trunnel. */
+#include "trunnel/ed25519_cert.h"
 #include "trunnel/hs/cell_establish_intro.h"
 
 /** We simulate the creation of an outgoing ESTABLISH_INTRO cell, and then we
@@ -120,11 +127,134 @@ test_gen_establish_intro_cell_bad(void *arg)
   UNMOCK(ed25519_sign_prefixed);
 }
 
+/** Build an INTRODUCE1 cell as a client would, then parse it as an
+ * INTRODUCE2 cell in the two stages that a service uses. */
+static void
+test_introduce2_check_and_decrypt(void *arg)
+{
+  ssize_t cell_len, enc_len;
+  uint8_t payload[RELAY_PAYLOAD_SIZE];
+  uint8_t subcredential[DIGEST256_LEN];
+  uint8_t rendezvous_cookie[REND_COOKIE_LEN];
+  curve25519_keypair_t onion_kp, client_kp;
+  hs_cell_introduce1_data_t intro1;
+  hs_cell_introduce2_data_t intro2;
+  hs_service_t *service = NULL;
+  hs_service_intro_point_t *ip = NULL;
+  origin_circuit_t *circ = NULL;
+  replaycache_t *replay_cache = NULL;
+  link_specifier_t *lspec;
+
+  (void) arg;
+
+  memset(&intro2, 0, sizeof(intro2));
+  service = hs_service_new(get_options());
+  strlcpy(service->onion_address, "dummy", sizeof(service->onion_address));
+  ip = service_intro_point_new(NULL, 0);
+  circ = origin_circuit_new();
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_S_INTRO;
+
+  crypto_rand((char *) subcredential, sizeof(subcredential));
+  crypto_rand((char *) rendezvous_cookie, sizeof(rendezvous_cookie));
+  curve25519_keypair_generate(&onion_kp, 0);
+  curve25519_keypair_generate(&client_kp, 0);
+
+  /* The client side. */
+  memset(&intro1, 0, sizeof(intro1));
+  intro1.auth_pk = &ip->auth_key_kp.pubkey;
+  intro1.enc_pk = &ip->enc_key_kp.pubkey;
+  intro1.subcredential = subcredential;
+  intro1.onion_pk = &onion_kp.pubkey;
+  intro1.rendezvous_cookie = rendezvous_cookie;
+  intro1.client_kp = &client_kp;
+  intro1.link_specifiers = smartlist_new();
+  lspec = link_specifier_new();
+  link_specifier_set_ls_type(lspec, LS_IPV4);
+  link_specifier_set_ls_len(lspec, 6);
+  link_specifier_set_un_ipv4_addr(lspec, 0x7f000001);
+  link_specifier_set_un_ipv4_port(lspec, 9001);
+  /* The cell takes ownership of the link specifiers. */
+  smartlist_add(intro1.link_specifiers, lspec);
+  cell_len = hs_cell_build_introduce1(&intro1, payload);
+  smartlist_free(intro1.link_specifiers);
+  tt_i64_op(cell_len, OP_GT, 0);
+
+  /* The service side: the main thread stage. */
+  intro2.auth_pk = &ip->auth_key_kp.pubkey;
+  intro2.enc_kp = &ip->enc_key_kp;
+  intro2.subcredential = subcredential;
+  intro2.payload = payload;
+  intro2.payload_len = cell_len;
+  intro2.link_specifiers = smartlist_new();
+  enc_len = hs_cell_check_introduce2(&intro2, circ, service);
+  tt_i64_op(enc_len, OP_GT, CURVE25519_PUBKEY_LEN + DIGEST256_LEN);
+  tt_i64_op(enc_len, OP_LT, cell_len);
+  /* It doesn't use the replay cache, so the same cell passes again. */
+  tt_i64_op(hs_cell_check_introduce2(&intro2, circ, service), OP_EQ,
+            enc_len);
+
+  /* The worker thread stage. */
+  tt_int_op(hs_cell_decrypt_introduce2(&intro2, enc_len), OP_EQ, 0);
+  tt_mem_op(intro2.rendezvous_cookie, OP_EQ, rendezvous_cookie,
+            sizeof(rendezvous_cookie));
+  tt_mem_op(intro2.onion_pk.public_key, OP_EQ, onion_kp.pubkey.public_key,
+            CURVE25519_PUBKEY_LEN);
+  tt_mem_op(intro2.client_pk.public_key, OP_EQ, client_kp.pubkey.public_key,
+            CURVE25519_PUBKEY_LEN);
+  tt_int_op(smartlist_len(intro2.link_specifiers), OP_EQ, 1);
+  SMARTLIST_FOREACH(intro2.link_specifiers, link_specifier_t *, ls,
+                    link_specifier_free(ls));
+  smartlist_clear(intro2.link_specifiers);
+
+  /* Back on the main thread, we check for a replay once the cell has
+   * authenticated. */
+  tt_int_op(hs_cell_introduce2_is_replay(ip->replay_cache, &intro2, enc_len),
+            OP_EQ, 0);
+  tt_int_op(hs_cell_introduce2_is_replay(ip->replay_cache, &intro2, enc_len),
+            OP_EQ, 1);
+
+  /* A bad MAC at the end of the cell. */
+  payload[cell_len - 1] ^= 1;
+  tt_int_op(hs_cell_decrypt_introduce2(&intro2, enc_len), OP_EQ, -1);
+  tt_int_op(smartlist_len(intro2.link_specifiers), OP_EQ, 0);
+
+  /* Cells that don't authenticate never reach the replay cache, so junk
+   * can't fill it up. */
+  replay_cache = replaycache_new_bucketed(0, 1, 1);
+  intro2.replay_cache = replay_cache;
+  tt_int_op(hs_cell_parse_introduce2(&intro2, circ, service), OP_EQ, -1);
+  tt_int_op(hs_cell_parse_introduce2(&intro2, circ, service), OP_EQ, -1);
+  tt_int_op(replaycache_is_full(replay_cache), OP_EQ, 0);
+
+  /* A valid cell goes in, and is a replay the second time. */
+  payload[cell_len - 1] ^= 1;
+  tt_int_op(hs_cell_parse_introduce2(&intro2, circ, service), OP_EQ, 0);
+  tt_int_op(replaycache_is_full(replay_cache), OP_EQ, 1);
+  SMARTLIST_FOREACH(intro2.link_specifiers, link_specifier_t *, ls,
+                    link_specifier_free(ls));
+  smartlist_clear(intro2.link_specifiers);
+  tt_int_op(hs_cell_parse_introduce2(&intro2, circ, service), OP_EQ, -1);
+
+ done:
+  if (intro2.link_specifiers) {
+    SMARTLIST_FOREACH(intro2.link_specifiers, link_specifier_t *, ls,
+                      link_specifier_free(ls));
+    smartlist_free(intro2.link_specifiers);
+  }
+  if (circ)
+    circuit_free_(TO_CIRCUIT(circ));
+  service_intro_point_free(ip);
+  hs_service_free(service);
+  replaycache_free(replay_cache);
+}
+
 struct testcase_t hs_cell_tests[] = {
   { "gen_establish_intro_cell", test_gen_establish_intro_cell, TT_FORK,
     NULL, NULL },
   { "gen_establish_intro_cell_bad", test_gen_establish_intro_cell_bad, TT_FORK,
     NULL, NULL },
+  { "introduce2_check_and_decrypt", test_introduce2_check_and_decrypt,
+    TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -299,6 +299,44 @@ test_encode_descriptor(void *arg)
   tor_free(encoded);
 }
 
+/* Test that an encoding can be finished after the descriptor is gone. */
+static void
+test_encoding_finish(void *arg)
+{
+  int ret;
+  char *encoded = NULL;
+  ed25519_keypair_t signing_kp;
+  hs_descriptor_t *desc = NULL;
+  hs_descriptor_t *decoded = NULL;
+  hs_desc_encoding_t *enc = NULL;
+  uint8_t subcredential[DIGEST256_LEN];
+
+  (void) arg;
+
+  ret = ed25519_keypair_generate(&signing_kp, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  desc = hs_helper_build_hs_desc_with_ip(&signing_kp);
+  memcpy(subcredential, desc->subcredential, sizeof(subcredential));
+
+  enc = hs_desc_encoding_new(desc, &signing_kp);
+  tt_assert(enc);
+  hs_descriptor_free(desc);
+  memset(&signing_kp, 0, sizeof(signing_kp));
+
+  ret = hs_desc_encoding_finish(enc, &encoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_assert(encoded);
+  ret = hs_desc_decode_descriptor(encoded, subcredential, &decoded);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_int_op(smartlist_len(decoded->encrypted_data.intro_points), OP_GT, 0);
+
+ done:
+  hs_descriptor_free(desc);
+  hs_descriptor_free(decoded);
+  hs_desc_encoding_free(enc);
+  tor_free(encoded);
+}
+
 static void
 test_decode_descriptor(void *arg)
 {
@@ -870,6 +908,8 @@ struct testcase_t hs_descriptor[] = {
     NULL, NULL },
 
   /* Decoding tests. */
+  { "encoding_finish", test_encoding_finish, TT_FORK,
+    NULL, NULL },
   { "decode_descriptor", test_decode_descriptor, TT_FORK,
     NULL, NULL },
   { "encrypted_data_len", test_encrypted_data_len, TT_FORK,
@@ -46,6 +46,7 @@
 #include "or/hs_ntor.h"
 #include "or/hs_circuit.h"
 #include "or/hs_service.h"
+#include "or/hs_stats.h"
 #include "or/hs_client.h"
 #include "or/main.h"
 #include "or/rendservice.h"
@@ -953,6 +954,73 @@ test_introduce2(void *arg)
   UNMOCK(circuit_mark_for_close_);
 }
 
+/** Helper for test_introduce2_queue: return a new queue job for a cell
+ * received on the intro point with the given auth key byte. */
+static intro2_job_t *
+helper_new_intro2_job(uint8_t ip_byte)
+{
+  intro2_job_t *job = tor_malloc_zero(sizeof(*job));
+  memset(job->intro_auth_pk.pubkey, ip_byte, sizeof(job->intro_auth_pk));
+  return job;
+}
+
+/** Test the queue of INTRODUCE2 cells waiting for the worker threads. */
+static void
+test_introduce2_queue(void *arg)
+{
+  intro2_job_t *job, *a1, *a2, *b1;
+  uint64_t now = 1000000;
+  int i;
+
+  (void) arg;
+
+  /* Two cells from intro point A, then one from B. B's cell comes before
+   * A's second one, since fewer of its cells were waiting. */
+  a1 = helper_new_intro2_job('a');
+  a2 = helper_new_intro2_job('a');
+  b1 = helper_new_intro2_job('b');
+  tt_int_op(intro2_queue_add(a1, now), OP_EQ, 0);
+  tt_int_op(intro2_queue_add(a2, now), OP_EQ, 0);
+  tt_int_op(intro2_queue_add(b1, now), OP_EQ, 0);
+  job = intro2_queue_next(now);
+  tt_ptr_op(job, OP_EQ, a1);
+  intro2_job_free(job);
+  job = intro2_queue_next(now);
+  tt_ptr_op(job, OP_EQ, b1);
+  intro2_job_free(job);
+  job = intro2_queue_next(now);
+  tt_ptr_op(job, OP_EQ, a2);
+  intro2_job_free(job);
+  tt_ptr_op(intro2_queue_next(now), OP_EQ, NULL);
+
+  /* Cells that waited too long are dropped. */
+  tt_int_op(intro2_queue_add(helper_new_intro2_job('a'), now), OP_EQ, 0);
+  tt_ptr_op(intro2_queue_next(now + 60*1000), OP_EQ, NULL);
+  tt_int_op(hs_stats_get_n_introduce2_dropped(), OP_EQ, 1);
+
+  /* Flood the queue through intro point A. */
+  for (i = 0; i < 1024; i++) {
+    tt_int_op(intro2_queue_add(helper_new_intro2_job('a'), now), OP_EQ, 0);
+  }
+  /* Once it's full, more cells from A are dropped... */
+  tt_int_op(intro2_queue_add(helper_new_intro2_job('a'), now), OP_EQ, -1);
+  tt_int_op(hs_stats_get_n_introduce2_dropped(), OP_EQ, 2);
+  /* ... but a cell from B makes room for itself by dropping A's last one,
+   * and is the second one to get processed. */
+  b1 = helper_new_intro2_job('b');
+  tt_int_op(intro2_queue_add(b1, now), OP_EQ, 0);
+  tt_int_op(hs_stats_get_n_introduce2_dropped(), OP_EQ, 3);
+  job = intro2_queue_next(now);
+  tt_ptr_op(job, OP_NE, b1);
+  intro2_job_free(job);
+  job = intro2_queue_next(now);
+  tt_ptr_op(job, OP_EQ, b1);
+  intro2_job_free(job);
+
+ done:
+  hs_free_all();
+}
+
 /** Test basic hidden service housekeeping operations (maintaining intro
  *  points, etc) */
 static void
@@ -1414,6 +1482,133 @@ test_upload_descriptors(void *arg)
   UNMOCK(get_or_state);
 }
 
+/* Test that encoded descriptors are cached until they change, and that
+ * encoding jobs from the worker threads are handled properly. */
+static void
+test_encode_descriptors(void *arg)
+{
+  int ret;
+  time_t now = time(NULL);
+  hs_service_t *service;
+  hs_service_descriptor_t *desc;
+  desc_encode_job_t *job;
+  const char *encoded;
+  char *lookup = NULL;
+  uint64_t rev_counter;
+
+  (void) arg;
+
+  hs_init();
+  MOCK(get_or_state,
+       get_or_state_replacement);
+  MOCK(networkstatus_get_live_consensus,
+       mock_networkstatus_get_live_consensus);
+
+  dummy_state = tor_malloc_zero(sizeof(or_state_t));
+
+  ret = parse_rfc1123_time("Sat, 26 Oct 1985 13:00:00 UTC",
+                           &mock_ns.valid_after);
+  tt_int_op(ret, OP_EQ, 0);
+  ret = parse_rfc1123_time("Sat, 26 Oct 1985 14:00:00 UTC",
+                           &mock_ns.fresh_until);
+  tt_int_op(ret, OP_EQ, 0);
+
+  service = hs_service_new(get_options());
+  tt_assert(service);
+  service->config.version = HS_VERSION_THREE;
+  ed25519_secret_key_generate(&service->keys.identity_sk, 0);
+  ed25519_public_key_generate(&service->keys.identity_pk,
+                              &service->keys.identity_sk);
+  ret = register_service(get_hs_service_map(), service);
+  tt_int_op(ret, OP_EQ, 0);
+  /* The descriptor isn't encoded until we want to upload it. */
+  build_all_descriptors(now);
+  desc = service->desc_current;
+  tt_assert(desc);
+  tt_ptr_op(desc->encoded_desc, OP_EQ, NULL);
+  tt_ptr_op(desc->encode_job, OP_EQ, NULL);
+
+  /* The same encoding is used until the descriptor changes. */
+  encoded = service_desc_get_encoded(desc);
+  tt_ptr_op(encoded, OP_EQ, desc->encoded_desc);
+  tt_ptr_op(service_desc_get_encoded(desc), OP_EQ, encoded);
+  lookup = hs_service_lookup_current_desc(&service->keys.identity_pk);
+  tt_str_op(lookup, OP_EQ, encoded);
+  tor_free(lookup);
+
+  rev_counter = desc->desc->plaintext_data.revision_counter;
+  desc->desc->plaintext_data.revision_counter = rev_counter + 1;
+  service_desc_invalidate_encoding(desc);
+  tt_ptr_op(desc->encoded_desc, OP_EQ, NULL);
+  encoded = service_desc_get_encoded(desc);
+  tt_assert(encoded);
+  {
+    hs_descriptor_t *decoded = NULL;
+    ret = hs_desc_decode_descriptor(encoded, desc->desc->subcredential,
+                                    &decoded);
+    tt_int_op(ret, OP_EQ, 0);
+    tt_u64_op(decoded->plaintext_data.revision_counter, OP_EQ,
+              rev_counter + 1);
+    hs_descriptor_free(decoded);
+  }
+
+  /* No HSDirs in the consensus, but the upload cycle goes on. */
+  mock_ns.routerstatus_list = smartlist_new();
+  setup_full_capture_of_logs(LOG_INFO);
+
+  /* Once a worker thread has encoded the descriptor, it is uploaded, and
+   * the revision counter bump makes us forget the encoding. */
+  service_desc_invalidate_encoding(desc);
+  job = desc_encode_job_new(service, desc);
+  tt_assert(job);
+  tt_ptr_op(desc->encode_job, OP_EQ, job);
+  ret = hs_desc_encoding_finish(job->encoding, &job->encoded_desc);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(desc->next_upload_time, OP_EQ, 0);
+  desc_encode_job_replyfn(job);
+  tt_ptr_op(desc->encode_job, OP_EQ, NULL);
+  tt_u64_op(desc->next_upload_time, OP_GT, 0);
+  tt_ptr_op(desc->encoded_desc, OP_EQ, NULL);
+
+  /* ... unless the descriptor changed in the meantime. */
+  desc->next_upload_time = 0;
+  job = desc_encode_job_new(service, desc);
+  tt_assert(job);
+  service_desc_invalidate_encoding(desc);
+  tt_ptr_op(job->desc, OP_EQ, NULL);
+  tt_ptr_op(desc->encode_job, OP_EQ, NULL);
+  ret = hs_desc_encoding_finish(job->encoding, &job->encoded_desc);
+  tt_int_op(ret, OP_EQ, 0);
+  desc_encode_job_replyfn(job);
+  tt_u64_op(desc->next_upload_time, OP_EQ, 0);
+  tt_ptr_op(desc->encoded_desc, OP_EQ, NULL);
+
+  /* If the worker thread failed, we say so, and encode it ourselves. */
+  job = desc_encode_job_new(service, desc);
+  tt_assert(job);
+  mock_clean_saved_logs();
+  desc_encode_job_replyfn(job);
+  expect_log_msg_containing("A worker thread couldn't encode a service "
+                            "descriptor.");
+  tt_u64_op(desc->next_upload_time, OP_GT, 0);
+  teardown_capture_of_logs();
+
+  /* A job outlives its descriptor. */
+  job = desc_encode_job_new(service, desc);
+  tt_assert(job);
+  service_descriptor_free(service->desc_current);
+  tt_ptr_op(job->desc, OP_EQ, NULL);
+  desc_encode_job_replyfn(job);
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(mock_ns.routerstatus_list);
+  tor_free(lookup);
+  hs_free_all();
+  UNMOCK(get_or_state);
+  UNMOCK(networkstatus_get_live_consensus);
+}
+
 /** Test the functions that save and load HS revision counters to state. */
 static void
 test_revision_counter_state(void *arg)
@@ -1619,6 +1814,8 @@ struct testcase_t hs_service_tests[] = {
     NULL, NULL },
   { "introduce2", test_introduce2, TT_FORK,
     NULL, NULL },
+  { "introduce2_queue", test_introduce2_queue, TT_FORK,
+    NULL, NULL },
   { "service_event", test_service_event, TT_FORK,
     NULL, NULL },
   { "rotate_descriptors", test_rotate_descriptors, TT_FORK,
@@ -1627,6 +1824,8 @@ struct testcase_t hs_service_tests[] = {
     NULL, NULL },
   { "upload_descriptors", test_upload_descriptors, TT_FORK,
     NULL, NULL },
+  { "encode_descriptors", test_encode_descriptors, TT_FORK,
+    NULL, NULL },
   { "revision_counter_state", test_revision_counter_state, TT_FORK,
     NULL, NULL },
   { "rendezvous1_parsing", test_rendezvous1_parsing, TT_FORK,
@@ -128,6 +128,69 @@ test_sigsafe_err(void *arg)
   smartlist_free(lines);
 }
 
+static void
+test_async(void *arg)
+{
+  const char *fn = get_fname("async_log");
+  char *content = NULL;
+  log_severity_list_t include_info;
+  smartlist_t *lines = smartlist_new();
+  int i, n_seen = 0, last = -1;
+  (void)arg;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &include_info);
+
+  init_logging(1);
+  mark_logs_temp();
+  tt_int_op(0, OP_EQ, add_file_log(&include_info, fn, 0));
+  close_temp_logs();
+  tt_int_op(0, OP_EQ, logs_set_async(1));
+
+  /* Every message is either written, in order, or counted as dropped. */
+  for (i = 0; i < 2000; ++i)
+    log_info(LD_GENERAL, "Async message %d", i);
+  logs_flush_async();
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(content, OP_NE, NULL);
+  tor_split_lines(lines, content, (int)strlen(content));
+  SMARTLIST_FOREACH_BEGIN(lines, const char *, line) {
+    const char *cp = strstr(line, "Async message ");
+    if (cp) {
+      int n = atoi(cp + strlen("Async message "));
+      tt_int_op(n, OP_GT, last);
+      last = n;
+      ++n_seen;
+    }
+  } SMARTLIST_FOREACH_END(line);
+  tt_int_op(n_seen + (int)logs_get_n_async_dropped(), OP_EQ, 2000);
+  smartlist_clear(lines);
+  tor_free(content);
+
+  /* Errors don't wait for the writer thread. */
+  log_err(LD_GENERAL, "Written right away.");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(content, OP_NE, NULL);
+  tt_assert(strstr(content, "Written right away."));
+  tor_free(content);
+
+  /* Turning async logging off writes whatever is left, before anything
+   * that we log afterwards. */
+  log_info(LD_GENERAL, "Last async message.");
+  tt_int_op(0, OP_EQ, logs_set_async(0));
+  log_info(LD_GENERAL, "First direct message.");
+  content = read_file_to_str(fn, 0, NULL);
+  tt_ptr_op(content, OP_NE, NULL);
+  tt_assert(strstr(content, "Last async message."));
+  tt_assert(strstr(content, "First direct message."));
+  tt_assert(strstr(content, "Last async message.") <
+            strstr(content, "First direct message."));
+
+ done:
+  logs_set_async(0);
+  tor_free(content);
+  smartlist_free(lines);
+}
+
 static void
 test_ratelim(void *arg)
 {
@@ -169,5 +232,6 @@ struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
   { "ratelim", test_ratelim, 0, NULL, NULL },
+  { "async", test_async, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -0,0 +1,316 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONNECTION_PRIVATE
+#define METRICSPORT_PRIVATE
+
+#include "or/or.h"
+#include "common/buffers.h"
+#include "common/metrics.h"
+#include "or/connection.h"
+#include "or/connection_or.h"
+#include "or/metricsport.h"
+#include "or/rephist.h"
+
+#include "or/or_connection_st.h"
+
+#include "test/test.h"
+
+static const double test_bounds[] = { 0.5, 1.0, 2.0 };
+
+static uint64_t
+get_forty_two(const void *arg)
+{
+  (void) arg;
+  return 42;
+}
+
+static void
+test_metrics_histogram(void *arg)
+{
+  metrics_histogram_t h = METRICS_HISTOGRAM_INIT(test_bounds);
+  (void) arg;
+
+  tt_int_op(h.n_bounds, OP_EQ, 3);
+  metrics_histogram_observe(&h, 0.0);
+  metrics_histogram_observe(&h, 0.5);
+  metrics_histogram_observe(&h, 0.75);
+  metrics_histogram_observe(&h, 2.0);
+  metrics_histogram_observe(&h, 100.0);
+  /* Bounds are inclusive: 0.5 goes in the first bucket. */
+  tt_u64_op(h.counts[0], OP_EQ, 2);
+  tt_u64_op(h.counts[1], OP_EQ, 1);
+  tt_u64_op(h.counts[2], OP_EQ, 1);
+  tt_u64_op(h.counts[3], OP_EQ, 1);
+  tt_u64_op(metrics_histogram_get_count(&h), OP_EQ, 5);
+  tt_double_eq(h.sum, 103.25);
+
+  metrics_histogram_clear(&h);
+  tt_u64_op(metrics_histogram_get_count(&h), OP_EQ, 0);
+  tt_double_eq(h.sum, 0.0);
+
+ done:
+  ;
+}
+
+static void
+test_metrics_histogram_quantile(void *arg)
+{
+  metrics_histogram_t h = METRICS_HISTOGRAM_INIT(test_bounds);
+  int i;
+  (void) arg;
+
+  tt_double_eq(metrics_histogram_quantile(&h, 0.5), 0.0);
+
+  /* Ten observations in (0.5, 1], ten in (1, 2]. */
+  for (i = 0; i < 10; ++i) {
+    metrics_histogram_observe(&h, 0.75);
+    metrics_histogram_observe(&h, 1.5);
+  }
+  tt_double_eq(metrics_histogram_quantile(&h, 0.25), 0.75);
+  tt_double_eq(metrics_histogram_quantile(&h, 0.5), 1.0);
+  tt_double_eq(metrics_histogram_quantile(&h, 0.75), 1.5);
+  tt_double_eq(metrics_histogram_quantile(&h, 1.0), 2.0);
+  tt_double_eq(metrics_histogram_quantile(&h, 7.0), 2.0);
+
+  /* Anything in the "+Inf" bucket is reported as the largest bound. */
+  for (i = 0; i < 20; ++i)
+    metrics_histogram_observe(&h, 50.0);
+  tt_double_eq(metrics_histogram_quantile(&h, 0.9), 2.0);
+
+ done:
+  ;
+}
+
+static void
+test_metrics_format(void *arg)
+{
+  metrics_counter_t c1 = { 0 }, c2 = { 0 };
+  metrics_gauge_t g = { 0 };
+  metrics_histogram_t h = METRICS_HISTOGRAM_INIT(test_bounds);
+  uint32_t u32 = 7;
+  smartlist_t *lst = NULL;
+  char *out = NULL;
+  (void) arg;
+
+  out = metrics_format_prometheus();
+  tt_str_op(out, OP_EQ, "");
+  tor_free(out);
+
+  /* Register the members of the "test_total" family apart, to make sure
+   * that they come out together. */
+  metrics_register_counter(&c1, "test_total", "A counter.", "a=\"1\"");
+  metrics_register_gauge(&g, "test_gauge", "A gauge.", NULL);
+  metrics_register_counter(&c2, "test_total", "A counter.", "a=\"2\"");
+  metrics_register_histogram(&h, "test_seconds", "A histogram.",
+                             "b=\"x\"");
+  metrics_register_counter_fn(get_forty_two, NULL, "test_fn_total",
+                              "A counter with a getter.", NULL);
+  metrics_register_gauge_fn(metrics_read_u32, &u32, "test_u32",
+                            "A gauge with a getter.", NULL);
+  tt_int_op(metrics_get_n_registered(), OP_EQ, 6);
+
+  metrics_counter_add(&c1, 10);
+  metrics_counter_inc(&c2);
+  metrics_gauge_set(&g, 5);
+  metrics_gauge_add(&g, -8);
+  metrics_histogram_observe(&h, 0.25);
+  metrics_histogram_observe(&h, 1.5);
+  metrics_histogram_observe(&h, 3.0);
+
+  out = metrics_format_prometheus();
+  tt_str_op(out, OP_EQ,
+            "# HELP test_fn_total A counter with a getter.\n"
+            "# TYPE test_fn_total counter\n"
+            "test_fn_total 42\n"
+            "# HELP test_gauge A gauge.\n"
+            "# TYPE test_gauge gauge\n"
+            "test_gauge -3\n"
+            "# HELP test_seconds A histogram.\n"
+            "# TYPE test_seconds histogram\n"
+            "test_seconds_bucket{b=\"x\",le=\"0.5\"} 1\n"
+            "test_seconds_bucket{b=\"x\",le=\"1\"} 1\n"
+            "test_seconds_bucket{b=\"x\",le=\"2\"} 2\n"
+            "test_seconds_bucket{b=\"x\",le=\"+Inf\"} 3\n"
+            "test_seconds_sum{b=\"x\"} 4.75\n"
+            "test_seconds_count{b=\"x\"} 3\n"
+            "# HELP test_total A counter.\n"
+            "# TYPE test_total counter\n"
+            "test_total{a=\"1\"} 10\n"
+            "test_total{a=\"2\"} 1\n"
+            "# HELP test_u32 A gauge with a getter.\n"
+            "# TYPE test_u32 gauge\n"
+            "test_u32 7\n");
+  tor_free(out);
+
+  metrics_free_all();
+  tt_int_op(metrics_get_n_registered(), OP_EQ, 0);
+
+  /* A list that doesn't exist yet counts as empty. */
+  tt_u64_op(metrics_read_smartlist_len(&lst), OP_EQ, 0);
+  lst = smartlist_new();
+  smartlist_add(lst, &c1);
+  smartlist_add(lst, &c2);
+  tt_u64_op(metrics_read_smartlist_len(&lst), OP_EQ, 2);
+
+ done:
+  metrics_free_all();
+  smartlist_free(lst);
+  tor_free(out);
+}
+
+static void
+test_metrics_histogram_no_labels(void *arg)
+{
+  metrics_histogram_t h = METRICS_HISTOGRAM_INIT(test_bounds);
+  char *out = NULL;
+  (void) arg;
+
+  metrics_register_histogram(&h, "test_seconds", "A histogram.", NULL);
+  metrics_histogram_observe(&h, 1.0);
+  out = metrics_format_prometheus();
+  tt_str_op(out, OP_EQ,
+            "# HELP test_seconds A histogram.\n"
+            "# TYPE test_seconds histogram\n"
+            "test_seconds_bucket{le=\"0.5\"} 0\n"
+            "test_seconds_bucket{le=\"1\"} 1\n"
+            "test_seconds_bucket{le=\"2\"} 1\n"
+            "test_seconds_bucket{le=\"+Inf\"} 1\n"
+            "test_seconds_sum 1\n"
+            "test_seconds_count 1\n");
+
+ done:
+  metrics_free_all();
+  tor_free(out);
+}
+
+static void
+test_metrics_cell_latency(void *arg)
+{
+  or_connection_t *orconn = NULL;
+  char *out = NULL;
+  char body[1000];
+  (void) arg;
+
+  rep_hist_reset_cell_latency();
+  rep_hist_note_cell_latency(CELL_LATENCY_CIRCUITMUX, 3);
+  rep_hist_note_cell_latency(CELL_LATENCY_CIRCUITMUX, 3);
+  rep_hist_note_cell_latency(CELL_LATENCY_SCHEDULER, 0);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_CIRCUITMUX), OP_EQ, 2);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_SCHEDULER), OP_EQ, 1);
+
+  out = rep_hist_format_cell_latency();
+  tt_str_op(out, OP_EQ,
+            "circuitmux count=2 mean=3.0 p50=2.5 p90=2.9 p99=3.0 p999=3.0\n"
+            "scheduler count=1 mean=0.0 p50=0.5 p90=0.9 p99=1.0 p999=1.0\n"
+            "outbuf count=0 mean=0.0 p50=0.0 p90=0.0 p99=0.0 p999=0.0\n"
+            "total count=0 mean=0.0 p50=0.0 p90=0.0 p99=0.0 p999=0.0");
+  tor_free(out);
+
+  /* Follow a cell through an outbuf that already holds some data. */
+  orconn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  memset(body, 0, sizeof(body));
+  buf_add(TO_CONN(orconn)->outbuf, body, sizeof(body));
+  connection_or_cell_latency_probe_start(orconn, monotime_coarse_get_stamp());
+  tt_u64_op(orconn->cell_latency_probe_bytes, OP_EQ, sizeof(body));
+  /* Only one cell is followed at a time. */
+  buf_add(TO_CONN(orconn)->outbuf, body, sizeof(body));
+  connection_or_cell_latency_probe_start(orconn, 0);
+  tt_u64_op(orconn->cell_latency_probe_bytes, OP_EQ, sizeof(body));
+
+  connection_or_cell_latency_probe_flushed(orconn, 600);
+  tt_u64_op(orconn->cell_latency_probe_bytes, OP_EQ, 400);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_OUTBUF), OP_EQ, 0);
+  connection_or_cell_latency_probe_flushed(orconn, 600);
+  tt_u64_op(orconn->cell_latency_probe_bytes, OP_EQ, 0);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_OUTBUF), OP_EQ, 1);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_TOTAL), OP_EQ, 1);
+  connection_or_cell_latency_probe_flushed(orconn, 600);
+  tt_u64_op(rep_hist_get_n_cell_latency(CELL_LATENCY_OUTBUF), OP_EQ, 1);
+
+ done:
+  if (orconn)
+    connection_free_minimal(TO_CONN(orconn));
+  rep_hist_reset_cell_latency();
+  tor_free(out);
+}
+
+static void
+test_metrics_port_request(void *arg)
+{
+  metrics_counter_t c = { 0 };
+  char *reply = NULL;
+  (void) arg;
+
+  metrics_register_counter(&c, "test_total", "A counter.", NULL);
+  metrics_counter_add(&c, 3);
+
+  tt_int_op(metricsport_handle_request("GET /metrics HTTP/1.0\r\n\r\n",
+                                       &reply), OP_EQ, 200);
+  tt_assert(!strcmpstart(reply, "HTTP/1.0 200 OK\r\n"));
+  tt_assert(strstr(reply, "\r\nContent-Type: text/plain; version=0.0.4"));
+  tt_assert(strstr(reply, "\r\n\r\n# HELP test_total A counter.\n"
+                   "# TYPE test_total counter\ntest_total 3\n"));
+  tor_free(reply);
+
+  tt_int_op(metricsport_handle_request("GET /metrics HTTP/1.1\r\n"
+                                       "Host: localhost\r\n\r\n",
+                                       &reply), OP_EQ, 200);
+  tor_free(reply);
+
+  tt_int_op(metricsport_handle_request("GET / HTTP/1.0\r\n\r\n",
+                                       &reply), OP_EQ, 404);
+  tt_assert(!strcmpstart(reply, "HTTP/1.0 404 Not Found\r\n"));
+  tt_assert(strstr(reply, "\r\nContent-Length: 14\r\n"));
+  tor_free(reply);
+
+  tt_int_op(metricsport_handle_request("POST /metrics HTTP/1.0\r\n\r\n",
+                                       &reply), OP_EQ, 405);
+  tor_free(reply);
+
+  tt_int_op(metricsport_handle_request("HELLO\r\n\r\n", &reply), OP_EQ, 400);
+  tor_free(reply);
+
+ done:
+  metrics_free_all();
+  tor_free(reply);
+}
+
+static void
+test_metrics_port_init(void *arg)
+{
+  char *out = NULL;
+  (void) arg;
+
+  /* Every module's metrics can be registered and formatted before any of
+   * those modules have been initialized. */
+  metricsport_init();
+  tt_int_op(metrics_get_n_registered(), OP_GT, 0);
+  out = metrics_format_prometheus();
+  tt_assert(strstr(out, "\ntor_circuits 0\n"));
+  tt_assert(strstr(out, "\ntor_onion_queue_pending{type=\"ntor\"} 0\n"));
+  tt_assert(strstr(out, "\ntor_onion_queue_dropped_total{type=\"tap\","
+                   "reason=\"codel\"} 0\n"));
+  tt_assert(strstr(out, "\ntor_cpuworker_onionskin_seconds_bucket{"
+                   "type=\"fast\",le=\"+Inf\"} 0\n"));
+  tt_assert(strstr(out, "\ntor_cell_latency_seconds_count{"
+                   "stage=\"outbuf\"} 0\n"));
+
+ done:
+  metricsport_free_all();
+  tor_free(out);
+}
+
+#define T(name, flags) \
+  { #name, test_metrics_ ## name, (flags), NULL, NULL }
+
+struct testcase_t metrics_tests[] = {
+  T(histogram, 0),
+  T(histogram_quantile, 0),
+  T(format, TT_FORK),
+  T(histogram_no_labels, TT_FORK),
+  T(cell_latency, TT_FORK),
+  T(port_request, TT_FORK),
+  T(port_init, TT_FORK),
+  END_OF_TESTCASES
+};
@@ -1322,6 +1322,54 @@ test_options_validate__token_bucket(void *ignored)
   tor_free(msg);
 }
 
+static void
+test_options_validate__dos_prefixes(void *ignored)
+{
+  (void)ignored;
+  int ret;
+  char *msg;
+  options_test_data_t *tdata = get_options_test_data(
+                                            TEST_OPTIONS_DEFAULT_VALUES
+                                            "DoSIPv4PrefixLength 24\n"
+                                            "DoSIPv6PrefixLength 48\n"
+                                            "DoSMaxTrackedPrefixes 1000\n");
+
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, 0);
+  tor_free(msg);
+
+  tdata->opt->DoSIPv4PrefixLength = 33;
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, -1);
+  tt_str_op(msg, OP_EQ,
+            "DoSIPv4PrefixLength must be between 0 and 32 inclusive.");
+  tor_free(msg);
+  tdata->opt->DoSIPv4PrefixLength = 32;
+
+  tdata->opt->DoSIPv6PrefixLength = 129;
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, -1);
+  tt_str_op(msg, OP_EQ,
+            "DoSIPv6PrefixLength must be between 0 and 128 inclusive.");
+  tor_free(msg);
+  tdata->opt->DoSIPv6PrefixLength = 128;
+
+  tdata->opt->DoSMaxTrackedPrefixes = (1 << 28) + 1;
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, -1);
+  tt_str_op(msg, OP_EQ, "DoSMaxTrackedPrefixes must be between 0 and "
+            "268435456, but was set to 268435457");
+  tor_free(msg);
+  tdata->opt->DoSMaxTrackedPrefixes = 1 << 28;
+
+  ret = options_validate(tdata->old_opt, tdata->opt, tdata->def_opt, 0, &msg);
+  tt_int_op(ret, OP_EQ, 0);
+
+ done:
+  free_options_test_data(tdata);
+  tor_free(msg);
+}
+
 static void
 test_options_validate__recommended_packages(void *ignored)
 {
@@ -4204,6 +4252,7 @@ struct testcase_t options_tests[] = {
   LOCAL_VALIDATE_TEST(exclude_nodes),
   LOCAL_VALIDATE_TEST(node_families),
   LOCAL_VALIDATE_TEST(token_bucket),
+  LOCAL_VALIDATE_TEST(dos_prefixes),
   LOCAL_VALIDATE_TEST(recommended_packages),
   LOCAL_VALIDATE_TEST(fetch_dir),
   LOCAL_VALIDATE_TEST(conn_limit),
@@ -7,6 +7,7 @@
 #include "or/or.h"
 #include "or/replaycache.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
 static const char *test_buffer =
   "Lorem ipsum dolor sit amet, consectetur adipisici elit, sed do eiusmod"
@@ -371,6 +372,132 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_bucketed(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result;
+  time_t elapsed = -1;
+
+  (void)arg;
+  /* Bad parameters */
+  r = replaycache_new_bucketed(-600, 4, 100);
+  tt_ptr_op(r, OP_EQ, NULL);
+  r = replaycache_new_bucketed(600, 4, 0);
+  tt_ptr_op(r, OP_EQ, NULL);
+
+  /* Four buckets of 200 seconds cover a 600 second horizon. */
+  r = replaycache_new_bucketed(600, 4, 100);
+  tt_ptr_op(r, OP_NE, NULL);
+  tt_ptr_op(r->digests_seen, OP_EQ, NULL);
+  tt_int_op(r->bucket_width, OP_EQ, 200);
+
+  result =
+    replaycache_add_and_test_internal(1200, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result, OP_EQ, 0);
+  tt_int_op(elapsed, OP_EQ, -1);
+  result =
+    replaycache_add_and_test_internal(1250, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result, OP_EQ, 0);
+  tt_int_op(r->n_entries, OP_EQ, 2);
+
+  /* Hits are reported with the time since the start of their interval. */
+  result =
+    replaycache_add_and_test_internal(1300, r, test_buffer_2,
+        strlen(test_buffer_2), &elapsed);
+  tt_int_op(result, OP_EQ, 1);
+  tt_int_op(elapsed, OP_EQ, 100);
+
+  /* Still there after the horizon, until its interval is dropped. */
+  result =
+    replaycache_add_and_test_internal(1850, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result, OP_EQ, 1);
+  tt_int_op(r->n_entries, OP_EQ, 3);
+  /* Scrubbing just drops intervals. The first one is gone at 2000, but the
+   * hit above put test_buffer in the current one. */
+  replaycache_scrub_if_needed_internal(2000, r);
+  tt_int_op(r->n_entries, OP_EQ, 1);
+  result =
+    replaycache_add_and_test_internal(2000, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result, OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(2000, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result, OP_EQ, 1);
+
+  /* Everything ages out after a long time. */
+  replaycache_scrub_if_needed_internal(10000, r);
+  tt_int_op(r->n_entries, OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(10000, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result, OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+}
+
+static void
+test_replaycache_bucketed_full(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result, i;
+  char buf[32];
+
+  (void)arg;
+  /* A cache that never expires fills up, and then reports replays. */
+  r = replaycache_new_bucketed(0, 4, 100);
+  tt_ptr_op(r, OP_NE, NULL);
+  tt_int_op(r->n_buckets, OP_EQ, 1);
+  for (i = 0; i < 100; ++i) {
+    tor_snprintf(buf, sizeof(buf), "cell %d", i);
+    result = replaycache_add_and_test_internal(1200 + i * 1000, r, buf,
+                                               strlen(buf), NULL);
+    tt_int_op(result, OP_EQ, 0);
+  }
+  tt_assert(replaycache_is_full(r));
+  result = replaycache_add_and_test_internal(200000, r, "cell 0",
+                                             strlen("cell 0"), NULL);
+  tt_int_op(result, OP_EQ, 1);
+  result = replaycache_add_and_test_internal(200000, r, "new cell",
+                                             strlen("new cell"), NULL);
+  tt_int_op(result, OP_EQ, 1);
+  replaycache_free(r);
+
+  /* One that expires forgets its oldest interval to make room. */
+  r = replaycache_new_bucketed(600, 4, 100);
+  tt_ptr_op(r, OP_NE, NULL);
+  for (i = 0; i < 100; ++i) {
+    tor_snprintf(buf, sizeof(buf), "cell %d", i);
+    result = replaycache_add_and_test_internal(1200 + i * 4, r, buf,
+                                               strlen(buf), NULL);
+    tt_int_op(result, OP_EQ, 0);
+  }
+  tt_assert(replaycache_is_full(r));
+  setup_full_capture_of_logs(LOG_NOTICE);
+  result = replaycache_add_and_test_internal(1600, r, "new cell",
+                                             strlen("new cell"), NULL);
+  expect_single_log_msg_containing("Replay cache is full");
+  teardown_capture_of_logs();
+  tt_int_op(result, OP_EQ, 0);
+  /* The first 200 seconds are gone, the rest is still there. */
+  tt_int_op(r->n_entries, OP_EQ, 51);
+  result = replaycache_add_and_test_internal(1600, r, "cell 0",
+                                             strlen("cell 0"), NULL);
+  tt_int_op(result, OP_EQ, 0);
+  result = replaycache_add_and_test_internal(1600, r, "cell 99",
+                                             strlen("cell 99"), NULL);
+  tt_int_op(result, OP_EQ, 1);
+
+ done:
+  teardown_capture_of_logs();
+  if (r) replaycache_free(r);
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +513,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(bucketed),
+  REPLAYCACHE_LEGACY(bucketed_full),
   END_OF_TESTCASES
 };
 
@@ -10,6 +10,7 @@
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "common/compat_libevent.h"
+#include "common/compat_time.h"
 
 #include <stdio.h>
 
@@ -159,6 +160,8 @@ static int n_sent = 0;
 static int rsa_sent = 0;
 static int ecdh_sent = 0;
 static int n_received_previously = 0;
+/* When we queued the first work, and when we got the last reply. */
+static monotime_t start_time, end_time;
 static int n_received = 0;
 static int no_shutdown = 0;
 
@@ -301,6 +304,7 @@ replysock_readable_cb(threadpool_t *tp)
       n_received+n_successful_cancel == n_sent &&
       n_sent >= opt_n_items) {
     shutting_down = 1;
+    monotime_get(&end_time);
     threadpool_queue_update(tp, NULL,
                              workqueue_do_shutdown, NULL, NULL);
     // Anything we add after starting the shutdown must not be executed.
@@ -386,6 +390,7 @@ main(int argc, char **argv)
   }
 
   init_logging(1);
+  monotime_init();
   network_init();
   if (crypto_global_init(1, NULL, NULL) < 0) {
     printf("Couldn't initialize crypto subsystem; exiting.\n");
@@ -423,6 +428,7 @@ main(int argc, char **argv)
   handled_len = opt_n_items;
 #endif /* defined(TRACK_RESPONSES) */
 
+  monotime_get(&start_time);
   for (i = 0; i < opt_n_inflight; ++i) {
     if (! add_work(tp)) {
       puts("Couldn't add work.");
@@ -446,6 +452,10 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    int64_t usec = monotime_diff_usec(&start_time, &end_time);
+    printf("%d items in %.1f msec with %d threads (%.0f items/sec)\n",
+           n_received, usec / 1000.0, opt_n_threads,
+           usec > 0 ? n_received * 1e6 / usec : 0.0);
     puts("OK");
     return 0;
   }
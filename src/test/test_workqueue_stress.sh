@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Keep many threads busy with bursts of work, cancelling some of it, so that
+# the workers have to steal work from each other.
+${builddir:-.}/src/test/test_workqueue \
+	   -T 16 -N 20000 -I 2000 -L 500 -C 20
@@ -0,0 +1,979 @@
+/* Copyright (c) 2018, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file tor-loadgen.c
+ * \brief Generate circuit and stream load against a local Tor, and report
+ * how it coped.
+ *
+ * tor-loadgen is meant for private test networks, such as the ones that
+ * chutney builds.  It does two kinds of work at once:
+ *
+ * <ul>
+ *   <li>On the ControlPort, it asks Tor to build circuits with
+ *   EXTENDCIRCUIT, keeping a fixed number of builds in flight, and measures
+ *   how long each one takes to become BUILT.
+ *   <li>On the SocksPort, a fixed number of worker threads open SOCKS5
+ *   streams to a target, one after the other.  We measure how long each
+ *   stream takes to attach (from connect() to the SOCKS reply), and, if
+ *   asked, fetch a URL over it to measure throughput.
+ * </ul>
+ *
+ * When everything is done, we print a report of the distribution of each
+ * measurement.  Every socket is blocking: each stream worker and the
+ * controller have a thread of their own.  So that a stalled Tor can't hang
+ * us, every socket gives up on a read or write that makes no progress for
+ * a while, and we count whatever was waiting on it as a failure.
+ **/
+
+#include "orconfig.h"
+#include "common/compat.h"
+#include "common/compat_threads.h"
+#include "common/util.h"
+#include "common/util_format.h"
+#include "common/address.h"
+#include "common/container.h"
+#include "common/torlog.h"
+#include "common/sandbox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+
+/** Longest control reply line that we accept. */
+#define MAX_CONTROL_LINE_LEN 4096
+/** Length of a control auth cookie. */
+#define AUTH_COOKIE_LEN 32
+/** Default for how many seconds a socket may wait for a read or write. */
+#define DEFAULT_IO_TIMEOUT 60
+
+static void usage(void) ATTR_NORETURN;
+
+/** What the user asked us to do. */
+typedef struct loadgen_options_t {
+  tor_addr_t socks_addr;
+  uint16_t socks_port;
+  tor_addr_t control_addr;
+  uint16_t control_port;
+  /** True iff we have a ControlPort, and so can build circuits. */
+  int have_control_port;
+  /** Auth cookie file and password for the ControlPort; both optional. */
+  const char *cookie_file;
+  const char *password;
+
+  /** Where our streams go, and what we fetch there, if anything. */
+  const char *target_host;
+  uint16_t target_port;
+  const char *http_path;
+  /** Number of streams to open, and how many at a time. */
+  int n_streams;
+  int stream_concurrency;
+  /** If true, give each stream its own SOCKS username, so that Tor puts
+   * each one on a circuit of its own. */
+  int isolate_streams;
+
+  /** Number of circuits to build, and how many to keep in flight. */
+  int n_circuits;
+  int circuit_concurrency;
+  /** Path to give to EXTENDCIRCUIT, or NULL to let Tor pick one. */
+  const char *circuit_path;
+  /** If true, leave the circuits that we built open. */
+  int keep_circuits;
+
+  /** How many seconds a read or write on any socket may wait before we
+   * give up on it. */
+  int io_timeout;
+} loadgen_options_t;
+
+/** The outcome of one stream. */
+typedef struct stream_result_t {
+  int attached;
+  /** True iff a read or write on this stream timed out.  Such a stream
+   * counts as a failure even if it attached. */
+  int timed_out;
+  /** From connect() to the SOCKS reply. */
+  double attach_msec;
+  /** Bytes that we read after the SOCKS reply, and how long it took. */
+  uint64_t n_bytes;
+  double transfer_msec;
+} stream_result_t;
+
+static loadgen_options_t options;
+
+/** Protects everything below. */
+static tor_mutex_t *loadgen_mutex;
+/** Signalled whenever a thread finishes. */
+static tor_cond_t *loadgen_cond;
+/** Number of threads that are still running. */
+static int n_threads_running = 0;
+/** Index of the next stream that a worker should open. */
+static int next_stream = 0;
+/** One entry per stream. */
+static stream_result_t *stream_results;
+/** How long each circuit that became BUILT took, in msec. */
+static double *circuit_build_msec;
+static int n_circuits_built = 0;
+/** Number of circuits that failed, including those that timed out. */
+static int n_circuits_failed = 0;
+static int n_circuits_timed_out = 0;
+/** Set if the controller thread gave up. */
+static int control_failed = 0;
+
+#define log_sock_error(act, _s)                                         \
+  STMT_BEGIN log_fn(LOG_WARN, LD_NET, "Error while %s: %s", act,        \
+              tor_socket_strerror(tor_socket_errno(_s))); STMT_END
+
+/** Log the error from the last read or write on <b>s</b>, which we were
+ * doing for <b>act</b>.  Return -2 if it timed out, and -1 otherwise. */
+static int
+loadgen_io_error(tor_socket_t s, const char *act)
+{
+  const int e = tor_socket_errno(s);
+  (void) s; /* Unused where tor_socket_errno() is just errno. */
+  if (ERRNO_IS_EAGAIN(e)) {
+    log_info(LD_NET, "Timed out while %s.", act);
+    return -2;
+  }
+  log_warn(LD_NET, "Error while %s: %s", act, tor_socket_strerror(e));
+  return -1;
+}
+
+/** Make every read and write on <b>s</b> give up after
+ * options.io_timeout seconds without progress.  Return 0 on success, -1 on
+ * failure. */
+static int
+set_socket_timeouts(tor_socket_t s)
+{
+#ifdef _WIN32
+  DWORD tv = options.io_timeout * 1000;
+#else
+  struct timeval tv;
+  tv.tv_sec = options.io_timeout;
+  tv.tv_usec = 0;
+#endif /* defined(_WIN32) */
+  if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tv,
+                 sizeof(tv)) < 0 ||
+      setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const void *)&tv,
+                 sizeof(tv)) < 0) {
+    log_sock_error("setting socket timeouts", s);
+    return -1;
+  }
+  return 0;
+}
+
+/** Open a blocking TCP connection to <b>addr</b>:<b>port</b>, with our
+ * timeouts.  Return the socket, or TOR_INVALID_SOCKET on failure. */
+static tor_socket_t
+loadgen_connect(const tor_addr_t *addr, uint16_t port)
+{
+  struct sockaddr_storage ss;
+  socklen_t len;
+  tor_socket_t s;
+
+  len = tor_addr_to_sockaddr(addr, port, (struct sockaddr*)&ss, sizeof(ss));
+  s = tor_open_socket(tor_addr_family(addr), SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(s)) {
+    log_sock_error("creating socket", -1);
+    return TOR_INVALID_SOCKET;
+  }
+  if (set_socket_timeouts(s) < 0) {
+    tor_close_socket(s);
+    return TOR_INVALID_SOCKET;
+  }
+  if (connect(s, (struct sockaddr*)&ss, len)) {
+    log_sock_error("connecting", s);
+    tor_close_socket(s);
+    return TOR_INVALID_SOCKET;
+  }
+  return s;
+}
+
+/** Return the number of msec between <b>start</b> and <b>end</b>. */
+static double
+msec_between(const monotime_t *start, const monotime_t *end)
+{
+  return monotime_diff_usec(start, end) / 1000.0;
+}
+
+/** Negotiate SOCKS5 on <b>s</b>, and ask Tor to connect us to the target.
+ * If <b>username</b> is set, authenticate with it, so that Tor isolates
+ * our stream from streams with other usernames.  Return 0 once the stream
+ * is attached, -2 if a read or write timed out, and -1 on other
+ * failures. */
+static int
+socks5_connect(tor_socket_t s, const char *username)
+{
+  char buf[512];
+  size_t hostlen = strlen(options.target_host);
+  size_t len;
+
+  if (hostlen > UINT8_MAX) {
+    log_warn(LD_GENERAL, "Target hostname is too long.");
+    return -1;
+  }
+
+  /* Method negotiation. */
+  if (write_all(s, username ? "\x05\x01\x02" : "\x05\x01\x00", 3, 1) != 3 ||
+      read_all(s, buf, 2, 1) != 2) {
+    return loadgen_io_error(s, "negotiating SOCKS5 method");
+  }
+  if (buf[0] != 5 || buf[1] != (username ? 2 : 0)) {
+    log_warn(LD_NET, "Tor refused our SOCKS5 method.");
+    return -1;
+  }
+  if (username) {
+    /* RFC 1929 username/password; the password doesn't matter. */
+    const size_t ulen = strlen(username);
+    tor_assert(ulen <= UINT8_MAX);
+    buf[0] = 1;
+    buf[1] = (char)ulen;
+    memcpy(buf+2, username, ulen);
+    buf[2+ulen] = 1;
+    buf[3+ulen] = 'x';
+    if (write_all(s, buf, 4+ulen, 1) != (ssize_t)(4+ulen) ||
+        read_all(s, buf, 2, 1) != 2) {
+      return loadgen_io_error(s, "authenticating to SOCKS5");
+    }
+    if (buf[1] != 0) {
+      log_warn(LD_NET, "SOCKS5 authentication failed.");
+      return -1;
+    }
+  }
+
+  /* CONNECT to the target by hostname. */
+  buf[0] = 5;
+  buf[1] = 1; /* CONNECT */
+  buf[2] = 0;
+  buf[3] = 3; /* hostname */
+  buf[4] = (char)hostlen;
+  memcpy(buf+5, options.target_host, hostlen);
+  set_uint16(buf+5+hostlen, htons(options.target_port));
+  len = 7 + hostlen;
+  if (write_all(s, buf, len, 1) != (ssize_t)len) {
+    return loadgen_io_error(s, "sending SOCKS5 request");
+  }
+
+  /* Read the reply, and skip the bound address. */
+  if (read_all(s, buf, 4, 1) != 4) {
+    return loadgen_io_error(s, "reading SOCKS5 reply");
+  }
+  if (buf[0] != 5 || buf[1] != 0) {
+    log_info(LD_NET, "SOCKS5 request failed with status %u.",
+             (unsigned)(uint8_t)buf[1]);
+    return -1;
+  }
+  switch (buf[3]) {
+    case 1: len = 4 + 2; break;
+    case 4: len = 16 + 2; break;
+    case 3:
+      if (read_all(s, buf, 1, 1) != 1)
+        return loadgen_io_error(s, "reading SOCKS5 reply address");
+      len = (uint8_t)buf[0] + 2;
+      break;
+    default:
+      log_warn(LD_NET, "Unrecognized address type in SOCKS5 reply.");
+      return -1;
+  }
+  if (read_all(s, buf, len, 1) != (ssize_t)len) {
+    return loadgen_io_error(s, "reading SOCKS5 reply address");
+  }
+  return 0;
+}
+
+/** Open stream number <b>idx</b>, and record how it went in
+ * <b>result</b>. */
+static void
+run_one_stream(int idx, stream_result_t *result)
+{
+  monotime_t start, attached, end;
+  char username[32];
+  tor_socket_t s;
+  int r;
+
+  memset(result, 0, sizeof(*result));
+  monotime_get(&start);
+  s = loadgen_connect(&options.socks_addr, options.socks_port);
+  if (!SOCKET_OK(s))
+    return;
+
+  tor_snprintf(username, sizeof(username), "loadgen-%d", idx);
+  r = socks5_connect(s, options.isolate_streams ? username : NULL);
+  if (r < 0) {
+    result->timed_out = (r == -2);
+    goto done;
+  }
+  monotime_get(&attached);
+  result->attached = 1;
+  result->attach_msec = msec_between(&start, &attached);
+
+  if (options.http_path) {
+    char *request = NULL;
+    char buf[16384];
+    ssize_t n;
+    tor_asprintf(&request, "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                 options.http_path, options.target_host);
+    n = write_all(s, request, strlen(request), 1);
+    if (n == (ssize_t)strlen(request)) {
+      while ((n = tor_socket_recv(s, buf, sizeof(buf), 0)) > 0)
+        result->n_bytes += n;
+    }
+    if (n < 0 && loadgen_io_error(s, "fetching from the target") == -2)
+      result->timed_out = 1;
+    tor_free(request);
+    monotime_get(&end);
+    result->transfer_msec = msec_between(&attached, &end);
+  }
+
+ done:
+  tor_close_socket(s);
+}
+
+/** Thread body: open streams until we have opened enough of them. */
+static void
+stream_worker_main(void *arg)
+{
+  (void) arg;
+  for (;;) {
+    stream_result_t result;
+    int idx;
+
+    tor_mutex_acquire(loadgen_mutex);
+    idx = next_stream++;
+    tor_mutex_release(loadgen_mutex);
+    if (idx >= options.n_streams)
+      break;
+
+    run_one_stream(idx, &result);
+
+    tor_mutex_acquire(loadgen_mutex);
+    stream_results[idx] = result;
+    tor_mutex_release(loadgen_mutex);
+  }
+
+  tor_mutex_acquire(loadgen_mutex);
+  --n_threads_running;
+  tor_cond_signal_all(loadgen_cond);
+  tor_mutex_release(loadgen_mutex);
+}
+
+/** A command that we have sent on the ControlPort, and whose reply we are
+ * waiting for.  Tor answers commands in order. */
+typedef struct pending_command_t {
+  /** True for EXTENDCIRCUIT, false for anything else. */
+  int is_extend;
+  monotime_t sent;
+} pending_command_t;
+
+/** A circuit that we have asked for, and that isn't BUILT yet. */
+typedef struct pending_circuit_t {
+  char id[32];
+  monotime_t sent;
+} pending_circuit_t;
+
+/** State of the controller thread. */
+typedef struct control_state_t {
+  tor_socket_t s;
+  /** Data that we have read from the ControlPort, but not handled yet. */
+  char inbuf[MAX_CONTROL_LINE_LEN];
+  size_t inbuf_len;
+  /** List of pending_command_t, oldest first. */
+  smartlist_t *commands;
+  /** List of pending_circuit_t. */
+  smartlist_t *circuits;
+  /** True iff a read or write on the ControlPort timed out. */
+  int timed_out;
+} control_state_t;
+
+/** Send <b>command</b> on the ControlPort, and remember that we are
+ * waiting for its reply.  Return 0 on success, -1 on failure. */
+static int
+control_send(control_state_t *st, const char *command, int is_extend)
+{
+  pending_command_t *cmd;
+  const size_t len = strlen(command);
+
+  log_debug(LD_CONTROL, "Sending: %s", command);
+  if (write_all(st->s, command, len, 1) != (ssize_t)len ||
+      write_all(st->s, "\r\n", 2, 1) != 2) {
+    if (loadgen_io_error(st->s, "writing to the ControlPort") == -2)
+      st->timed_out = 1;
+    return -1;
+  }
+  cmd = tor_malloc_zero(sizeof(pending_command_t));
+  cmd->is_extend = is_extend;
+  monotime_get(&cmd->sent);
+  smartlist_add(st->commands, cmd);
+  return 0;
+}
+
+/** Read one line from the ControlPort into <b>line</b>, without its line
+ * ending.  Return 0 on success, -1 on failure. */
+static int
+control_read_line(control_state_t *st, char *line, size_t linelen)
+{
+  for (;;) {
+    char *eol = memchr(st->inbuf, '\n', st->inbuf_len);
+    ssize_t n;
+    if (eol) {
+      size_t len = eol - st->inbuf;
+      const size_t consumed = len + 1;
+      if (len && st->inbuf[len-1] == '\r')
+        --len;
+      if (len >= linelen) {
+        log_warn(LD_CONTROL, "Reply line from the ControlPort is too long.");
+        return -1;
+      }
+      memcpy(line, st->inbuf, len);
+      line[len] = '\0';
+      st->inbuf_len -= consumed;
+      memmove(st->inbuf, st->inbuf + consumed, st->inbuf_len);
+      log_debug(LD_CONTROL, "Received: %s", line);
+      return 0;
+    }
+    if (st->inbuf_len == sizeof(st->inbuf)) {
+      log_warn(LD_CONTROL, "Reply line from the ControlPort is too long.");
+      return -1;
+    }
+    n = tor_socket_recv(st->s, st->inbuf + st->inbuf_len,
+                        sizeof(st->inbuf) - st->inbuf_len, 0);
+    if (n < 0) {
+      if (loadgen_io_error(st->s, "reading from the ControlPort") == -2)
+        st->timed_out = 1;
+      return -1;
+    } else if (n == 0) {
+      log_warn(LD_CONTROL, "Lost our ControlPort connection.");
+      return -1;
+    }
+    st->inbuf_len += n;
+  }
+}
+
+/** Send <b>command</b>, and wait for its reply, which must be "250 OK".
+ * Only use this before we have other commands in flight.  Return 0 on
+ * success, -1 on failure. */
+static int
+control_command_ok(control_state_t *st, const char *command)
+{
+  char line[MAX_CONTROL_LINE_LEN];
+  pending_command_t *cmd;
+
+  if (control_send(st, command, 0) < 0 ||
+      control_read_line(st, line, sizeof(line)) < 0)
+    return -1;
+  cmd = smartlist_pop_last(st->commands);
+  tor_free(cmd);
+  if (strcmp(line, "250 OK")) {
+    log_warn(LD_CONTROL, "Tor didn't accept our command: %s", line);
+    return -1;
+  }
+  return 0;
+}
+
+/** Authenticate on the ControlPort, with the cookie or password that we
+ * were given, or with nothing.  Return 0 on success, -1 on failure. */
+static int
+control_authenticate(control_state_t *st)
+{
+  char *command = NULL;
+  int r;
+
+  if (options.cookie_file) {
+    struct stat st_cookie;
+    char hex[AUTH_COOKIE_LEN*2+1];
+    char *cookie = read_file_to_str(options.cookie_file, RFTS_BIN,
+                                    &st_cookie);
+    if (!cookie || st_cookie.st_size != AUTH_COOKIE_LEN) {
+      log_warn(LD_CONTROL, "Couldn't read a %d-byte cookie from %s.",
+               AUTH_COOKIE_LEN, options.cookie_file);
+      tor_free(cookie);
+      return -1;
+    }
+    base16_encode(hex, sizeof(hex), cookie, AUTH_COOKIE_LEN);
+    tor_free(cookie);
+    tor_asprintf(&command, "AUTHENTICATE %s", hex);
+  } else if (options.password) {
+    char *quoted = esc_for_log(options.password);
+    tor_asprintf(&command, "AUTHENTICATE %s", quoted);
+    tor_free(quoted);
+  } else {
+    command = tor_strdup("AUTHENTICATE");
+  }
+
+  r = control_command_ok(st, command);
+  tor_free(command);
+  return r;
+}
+
+/** Return the circuit with ID <b>id</b> in <b>st</b>, or NULL. */
+static pending_circuit_t *
+control_find_circuit(control_state_t *st, const char *id)
+{
+  SMARTLIST_FOREACH(st->circuits, pending_circuit_t *, circ,
+                    if (!strcmp(circ->id, id)) return circ);
+  return NULL;
+}
+
+/** Handle a reply line from the ControlPort.  Return 0 on success, -1 on
+ * failure. */
+static int
+control_handle_line(control_state_t *st, const char *line)
+{
+  if (!strcmpstart(line, "650 CIRC ")) {
+    char id[32], status[32];
+    pending_circuit_t *circ;
+    monotime_t now;
+
+    if (sscanf(line, "650 CIRC %31s %31s", id, status) != 2)
+      return 0;
+    circ = control_find_circuit(st, id);
+    if (!circ)
+      return 0;
+    monotime_get(&now);
+    tor_mutex_acquire(loadgen_mutex);
+    if (!strcmp(status, "BUILT")) {
+      circuit_build_msec[n_circuits_built++] = msec_between(&circ->sent,
+                                                            &now);
+    } else if (!strcmp(status, "FAILED") || !strcmp(status, "CLOSED")) {
+      ++n_circuits_failed;
+    } else {
+      tor_mutex_release(loadgen_mutex);
+      return 0;
+    }
+    tor_mutex_release(loadgen_mutex);
+
+    smartlist_remove(st->circuits, circ);
+    if (!strcmp(status, "BUILT") && !options.keep_circuits) {
+      char *command = NULL;
+      tor_asprintf(&command, "CLOSECIRCUIT %s", circ->id);
+      if (control_send(st, command, 0) < 0) {
+        tor_free(command);
+        tor_free(circ);
+        return -1;
+      }
+      tor_free(command);
+    }
+    tor_free(circ);
+    return 0;
+  } else if (strlen(line) >= 4 && line[3] == ' ' &&
+             strcmpstart(line, "650")) {
+    /* The final line of a reply to our oldest command. */
+    pending_command_t *cmd;
+    if (!smartlist_len(st->commands)) {
+      log_warn(LD_CONTROL, "Unexpected reply: %s", line);
+      return -1;
+    }
+    cmd = smartlist_get(st->commands, 0);
+    smartlist_del_keeporder(st->commands, 0);
+    if (cmd->is_extend) {
+      if (!strcmpstart(line, "250 EXTENDED ")) {
+        pending_circuit_t *circ = tor_malloc_zero(sizeof(pending_circuit_t));
+        strlcpy(circ->id, line + strlen("250 EXTENDED "), sizeof(circ->id));
+        circ->sent = cmd->sent;
+        smartlist_add(st->circuits, circ);
+      } else {
+        log_info(LD_CONTROL, "EXTENDCIRCUIT failed: %s", line);
+        tor_mutex_acquire(loadgen_mutex);
+        ++n_circuits_failed;
+        tor_mutex_release(loadgen_mutex);
+      }
+    }
+    tor_free(cmd);
+  }
+  return 0;
+}
+
+/** Return the number of EXTENDCIRCUIT commands and circuits that we are
+ * still waiting for. */
+static int
+control_n_in_flight(const control_state_t *st)
+{
+  int n = smartlist_len(st->circuits);
+  SMARTLIST_FOREACH(st->commands, const pending_command_t *, cmd,
+                    if (cmd->is_extend) ++n);
+  return n;
+}
+
+/** Thread body: build circuits on the ControlPort until we have built (or
+ * failed to build) enough of them. */
+static void
+control_worker_main(void *arg)
+{
+  control_state_t st;
+  char line[MAX_CONTROL_LINE_LEN];
+  char *extend = NULL;
+  int n_launched = 0, n_unfinished;
+  (void) arg;
+
+  memset(&st, 0, sizeof(st));
+  st.commands = smartlist_new();
+  st.circuits = smartlist_new();
+  if (options.circuit_path)
+    tor_asprintf(&extend, "EXTENDCIRCUIT 0 %s", options.circuit_path);
+  else
+    extend = tor_strdup("EXTENDCIRCUIT 0");
+
+  st.s = loadgen_connect(&options.control_addr, options.control_port);
+  if (!SOCKET_OK(st.s) ||
+      control_authenticate(&st) < 0 ||
+      control_command_ok(&st, "SETEVENTS CIRC") < 0)
+    goto err;
+
+  for (;;) {
+    int n_done;
+    while (n_launched < options.n_circuits &&
+           control_n_in_flight(&st) < options.circuit_concurrency) {
+      if (control_send(&st, extend, 1) < 0)
+        goto err;
+      ++n_launched;
+    }
+
+    tor_mutex_acquire(loadgen_mutex);
+    n_done = n_circuits_built + n_circuits_failed;
+    tor_mutex_release(loadgen_mutex);
+    /* Stop once we have every circuit, and Tor has answered every
+     * CLOSECIRCUIT. */
+    if (n_done == options.n_circuits && !smartlist_len(st.commands))
+      break;
+
+    if (control_read_line(&st, line, sizeof(line)) < 0 ||
+        control_handle_line(&st, line) < 0)
+      goto err;
+  }
+  goto done;
+
+ err:
+  /* Every circuit that we haven't built by now has failed. */
+  tor_mutex_acquire(loadgen_mutex);
+  control_failed = 1;
+  n_unfinished = options.n_circuits - n_circuits_built - n_circuits_failed;
+  n_circuits_failed += n_unfinished;
+  if (st.timed_out) {
+    log_warn(LD_CONTROL, "Timed out waiting for the ControlPort.");
+    n_circuits_timed_out += n_unfinished;
+  }
+  tor_mutex_release(loadgen_mutex);
+ done:
+  if (SOCKET_OK(st.s))
+    tor_close_socket(st.s);
+  SMARTLIST_FOREACH(st.commands, pending_command_t *, cmd, tor_free(cmd));
+  smartlist_free(st.commands);
+  SMARTLIST_FOREACH(st.circuits, pending_circuit_t *, circ, tor_free(circ));
+  smartlist_free(st.circuits);
+  tor_free(extend);
+
+  tor_mutex_acquire(loadgen_mutex);
+  --n_threads_running;
+  tor_cond_signal_all(loadgen_cond);
+  tor_mutex_release(loadgen_mutex);
+}
+
+/** Helper for sorting doubles. */
+static int
+compare_doubles_(const void *a_, const void *b_)
+{
+  const double a = *(const double *)a_, b = *(const double *)b_;
+  return (a > b) - (a < b);
+}
+
+/** Return the <b>q</b>th quantile of the <b>n</b> sorted values in
+ * <b>v</b>. */
+static double
+sorted_quantile(const double *v, int n, double q)
+{
+  int idx = (int)(q * n);
+  if (idx >= n)
+    idx = n - 1;
+  return v[idx];
+}
+
+/** Write a line to <b>out</b> that describes the distribution of the
+ * <b>n</b> values in <b>v</b>, sorting them as a side effect. */
+static void
+report_distribution(FILE *out, const char *what, double *v, int n)
+{
+  if (!n) {
+    fprintf(out, "%s: no samples\n", what);
+    return;
+  }
+  qsort(v, n, sizeof(double), compare_doubles_);
+  fprintf(out, "%s: n=%d min=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+          what, n, v[0], sorted_quantile(v, n, 0.5),
+          sorted_quantile(v, n, 0.9), sorted_quantile(v, n, 0.99), v[n-1]);
+}
+
+/** Write our report to <b>out</b>. */
+static void
+write_report(FILE *out, double wall_msec)
+{
+  double *attach = tor_calloc(options.n_streams + 1, sizeof(double));
+  double *rate = tor_calloc(options.n_streams + 1, sizeof(double));
+  int n_attached = 0, n_failed = 0, n_timed_out = 0, n_rates = 0, i;
+  uint64_t total_bytes = 0;
+
+  for (i = 0; i < options.n_streams; ++i) {
+    const stream_result_t *r = &stream_results[i];
+    if (r->timed_out)
+      ++n_timed_out;
+    if (!r->attached || r->timed_out)
+      ++n_failed;
+    if (!r->attached)
+      continue;
+    attach[n_attached++] = r->attach_msec;
+    total_bytes += r->n_bytes;
+    if (r->n_bytes && r->transfer_msec > 0 && !r->timed_out)
+      rate[n_rates++] = U64_TO_DBL(r->n_bytes) / r->transfer_msec;
+  }
+
+  fprintf(out, "tor-loadgen report\n");
+  fprintf(out, "Wall time: %.3f sec\n", wall_msec / 1000.0);
+  if (options.n_circuits) {
+    fprintf(out, "Circuits: %d requested, %d built, %d failed "
+            "(%d timed out)%s\n",
+            options.n_circuits, n_circuits_built, n_circuits_failed,
+            n_circuits_timed_out,
+            control_failed ? " (ControlPort error)" : "");
+    report_distribution(out, "Circuit build time (msec)",
+                        circuit_build_msec, n_circuits_built);
+  }
+  if (options.n_streams) {
+    fprintf(out, "Streams: %d requested, %d attached, %d failed "
+            "(%d timed out)\n",
+            options.n_streams, n_attached, n_failed, n_timed_out);
+    report_distribution(out, "Stream attach latency (msec)",
+                        attach, n_attached);
+    if (options.http_path) {
+      /* Bytes per msec are KB per sec. */
+      fprintf(out, "Bytes read: "U64_FORMAT" (%.1f KB/sec overall)\n",
+              U64_PRINTF_ARG(total_bytes),
+              wall_msec > 0 ? U64_TO_DBL(total_bytes) / wall_msec : 0.0);
+      report_distribution(out, "Stream throughput (KB/sec)", rate, n_rates);
+    }
+  }
+
+  tor_free(attach);
+  tor_free(rate);
+}
+
+/** Print a usage message and exit. */
+static void
+usage(void)
+{
+  puts("Syntax: tor-loadgen [-v] [-o reportfile] [-T timeout]\n"
+       "         [-s socksaddr:port] [-n streams] [-p parallel] [-i]\n"
+       "         [-t targethost:port] [-r urlpath]\n"
+       "         [-c controladdr:port] [-a cookiefile | -w password]\n"
+       "         [-b circuits] [-B parallel] [-P path] [-k]");
+  exit(1);
+}
+
+/** Parse the number argument <b>arg</b> of the option <b>opt</b>, which
+ * must be between <b>min</b> and <b>max</b>; exit on error. */
+static int
+parse_int_arg(const char *opt, const char *arg, int min, int max)
+{
+  int ok = 0;
+  int n = (int) tor_parse_long(arg, 10, min, max, &ok, NULL);
+  if (!ok) {
+    fprintf(stderr, "%s requires a number between %d and %d\n",
+            opt, min, max);
+    usage();
+  }
+  return n;
+}
+
+/** Parse <b>arg</b> as an address and port; exit on error. */
+static void
+parse_addrport_arg(const char *opt, const char *arg,
+                   tor_addr_t *addr_out, uint16_t *port_out)
+{
+  if (tor_addr_port_parse(LOG_WARN, arg, addr_out, port_out, -1) < 0) {
+    fprintf(stderr, "%s requires an IP address and a port\n", opt);
+    usage();
+  }
+}
+
+/** Entry point to tor-loadgen */
+int
+main(int argc, char **argv)
+{
+  const char *report_file = NULL;
+  int verbose = 0, i, n_threads, failed = 0;
+  log_severity_list_t *severities;
+  monotime_t start, end;
+  FILE *out = stdout;
+
+  init_logging(1);
+  sandbox_disable_getaddrinfo_cache();
+
+  memset(&options, 0, sizeof(options));
+  tor_addr_from_ipv4h(&options.socks_addr, 0x7f000001u);
+  options.socks_port = 9050;
+  options.stream_concurrency = 10;
+  options.circuit_concurrency = 5;
+  options.io_timeout = DEFAULT_IO_TIMEOUT;
+
+  if (argc > 1 && !strcmp(argv[1], "--version")) {
+    printf("Tor version %s.\n", VERSION);
+    return 0;
+  }
+  for (i = 1; i < argc; ++i) {
+    const char *opt = argv[i];
+    const char *arg = (i + 1 < argc) ? argv[i+1] : NULL;
+    if (!strcmp(opt, "-v")) {
+      verbose = 1;
+      continue;
+    } else if (!strcmp(opt, "-i")) {
+      options.isolate_streams = 1;
+      continue;
+    } else if (!strcmp(opt, "-k")) {
+      options.keep_circuits = 1;
+      continue;
+    }
+
+    if (!arg || strlen(opt) != 2 || opt[0] != '-') {
+      fprintf(stderr, "Unrecognized flag '%s', or no argument given\n", opt);
+      usage();
+    }
+    ++i;
+    switch (opt[1]) {
+      case 's':
+        parse_addrport_arg(opt, arg, &options.socks_addr,
+                           &options.socks_port);
+        break;
+      case 'c':
+        parse_addrport_arg(opt, arg, &options.control_addr,
+                           &options.control_port);
+        options.have_control_port = 1;
+        break;
+      case 'a': options.cookie_file = arg; break;
+      case 'w': options.password = arg; break;
+      case 't': {
+        char *host = NULL;
+        if (tor_addr_port_split(LOG_WARN, arg, &host,
+                                &options.target_port) < 0 ||
+            !options.target_port) {
+          tor_free(host);
+          fprintf(stderr, "-t requires a hostname and a port\n");
+          usage();
+        }
+        options.target_host = host;
+        break;
+      }
+      case 'r': options.http_path = arg; break;
+      case 'n':
+        options.n_streams = parse_int_arg(opt, arg, 0, INT_MAX - 1);
+        break;
+      case 'p':
+        options.stream_concurrency = parse_int_arg(opt, arg, 1, 1000);
+        break;
+      case 'b':
+        options.n_circuits = parse_int_arg(opt, arg, 0, INT_MAX - 1);
+        break;
+      case 'B':
+        options.circuit_concurrency = parse_int_arg(opt, arg, 1, 1000);
+        break;
+      case 'P': options.circuit_path = arg; break;
+      case 'T':
+        options.io_timeout = parse_int_arg(opt, arg, 1, 86400);
+        break;
+      case 'o': report_file = arg; break;
+      default:
+        fprintf(stderr, "Unrecognized flag '%s'\n", opt);
+        usage();
+    }
+  }
+
+  if (!options.n_streams && !options.n_circuits) {
+    fprintf(stderr, "Nothing to do: give -n and/or -b\n");
+    usage();
+  }
+  if (options.n_streams && !options.target_host) {
+    fprintf(stderr, "Streams need a target: give -t\n");
+    usage();
+  }
+  if (options.n_circuits && !options.have_control_port) {
+    fprintf(stderr, "Circuits need a ControlPort: give -c\n");
+    usage();
+  }
+
+  severities = tor_malloc_zero(sizeof(log_severity_list_t));
+  set_log_severity_config(verbose ? LOG_DEBUG : LOG_WARN, LOG_ERR,
+                          severities);
+  add_stream_log(severities, "<stderr>", fileno(stderr));
+  tor_free(severities);
+
+  if (network_init() < 0) {
+    log_err(LD_BUG, "Error initializing network; exiting.");
+    return 1;
+  }
+  tor_threads_init();
+  monotime_init();
+
+  loadgen_mutex = tor_mutex_new();
+  loadgen_cond = tor_cond_new();
+  stream_results = tor_calloc(options.n_streams + 1,
+                              sizeof(stream_result_t));
+  circuit_build_msec = tor_calloc(options.n_circuits + 1, sizeof(double));
+
+  monotime_get(&start);
+  n_threads = options.n_streams ?
+    MIN(options.stream_concurrency, options.n_streams) : 0;
+  tor_mutex_acquire(loadgen_mutex);
+  n_threads_running = n_threads + (options.n_circuits ? 1 : 0);
+  tor_mutex_release(loadgen_mutex);
+  /* If we can't start a thread, we still report on the ones that we
+   * started; the streams that nobody opens count as failed. */
+  if (options.n_circuits && spawn_func(control_worker_main, NULL) < 0) {
+    log_err(LD_GENERAL, "Couldn't start the controller thread.");
+    tor_mutex_acquire(loadgen_mutex);
+    --n_threads_running;
+    control_failed = 1;
+    tor_mutex_release(loadgen_mutex);
+  }
+  for (i = 0; i < n_threads; ++i) {
+    if (spawn_func(stream_worker_main, NULL) < 0) {
+      log_err(LD_GENERAL, "Couldn't start a stream thread.");
+      tor_mutex_acquire(loadgen_mutex);
+      n_threads_running -= n_threads - i;
+      tor_mutex_release(loadgen_mutex);
+      failed = 1;
+      break;
+    }
+  }
+
+  tor_mutex_acquire(loadgen_mutex);
+  while (n_threads_running)
+    tor_cond_wait(loadgen_cond, loadgen_mutex, NULL);
+  tor_mutex_release(loadgen_mutex);
+  monotime_get(&end);
+
+  if (report_file) {
+    out = fopen(report_file, "w");
+    if (!out) {
+      log_err(LD_FS, "Couldn't open %s: %s; writing the report to stdout.",
+              report_file, strerror(errno));
+      out = stdout;
+      failed = 1;
+    }
+  }
+  write_report(out, msec_between(&start, &end));
+  if (out != stdout)
+    fclose(out);
+
+  return (control_failed || failed) ? 1 : 0;
+}